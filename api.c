@@ -1,35 +1,95 @@
 #include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <jansson.h>
 #include <orcania.h>
 #include <ulfius.h>
 
+#include "arena.h"
+#include "assets.h"
+#include "attachment.h"
 #include "base64.h"
 #include "database.h"
+#include "events.h"
 #include "http.h"
 #include "logger.h"
 #include "pass.h"
+#include "policy.h"
+#include "pool.h"
+#include "sample.h"
+#include "search.h"
+#include "trace.h"
+
+#define STR1(x) #x
+#define STR(x) STR1(x)
 
 #define DEFAULT_PORT 8080
+#define DEFAULT_DRAIN_TIMEOUT 30
+#define DEFAULT_STATIC_DIR "app"
+#define DEFAULT_ATTACHMENT_DIR "attachments"
 
 #define AUTH_HEADER "X-Hush-Auth"
+#define REQUEST_ID_HEADER "X-Request-Id"
 
 #define LOGIN_PATH "/login"
+#define STATIC_PATH "/app"
 #define HEALTH_PATH  "/healthz"
 #define API_PATH "/api/v1"
 #define USER_PATH "/user"
 #define USERS_PATH "/users"
 #define USER_BY_ID_PATH USER_PATH "/:id"
 #define USER_KEY_PATH "/user/key"
+#define METRICS_PATH "/metrics"
+#define LOG_LEVEL_PATH "/log/level"
 #define PASSWORD_PATH "/password"
 #define PASSWORDS_PATH "/passwords"
 #define PASSWORD_BY_NAME_PATH PASSWORD_PATH "/:name"
+#define PASSWORD_CHECK_PATH PASSWORD_PATH "/check"
+#define GENERATE_PATH "/generate"
+#define PASSWORDS_BATCH_GET_PATH PASSWORDS_PATH ":batchGet"
+#define PASSWORDS_WATCH_PATH PASSWORDS_PATH ":watch"
+#define PASSWORDS_EXPORT_PATH PASSWORDS_PATH ":export"
+#define PASSWORDS_IMPORT_PATH PASSWORDS_PATH ":import"
+#define PASSWORDS_SEARCH_PATH PASSWORDS_PATH "/search"
+#define ATTACHMENT_PATH "/attachment"
+#define ATTACHMENT_BY_NAME_PATH ATTACHMENT_PATH "/:name"
 #define HEALTH_STATUS_SICK    "sick"
 #define HEALTH_STATUS_HEALTHY "healthy"
 
+#define MAX_BATCH_GET_NAMES 256
+#define DEFAULT_IMPORT_BATCH_SIZE 500
+#define MAX_SEARCH_QUERY 256
+#define MAX_SYNC_CHANGES 1000
+#define MAX_CHECK_PASSWORDS 10000
+#define DEFAULT_GENERATE_LENGTH 32
+#define MAX_GENERATE_LENGTH 1024
+#define MAX_GENERATE_COUNT 1000
+#define DEFAULT_SEARCH_LIMIT 20
+#define DEFAULT_SEARCH_MAX_USERS 1024
+#define DEFAULT_SEARCH_INDEX_TTL 30
+#define DEFAULT_LOG_SAMPLE_RULES HEALTH_PATH "=1000"
+#define DEFAULT_LOG_SAMPLE_SLOW_MS 500
+#define DEFAULT_ATTACHMENT_MAX_SIZE (16 * 1024 * 1024)
+
+#define DEFAULT_EVENTS_QUEUE_SIZE 256
+#define WATCH_POLL_INTERVAL_MS 1000
+
+#define DEFAULT_HASH_WORKERS 2
+#define DEFAULT_HASH_QUEUE_SIZE 64
+
+#define DEFAULT_CRYPTO_WORKERS 2
+#define DEFAULT_CRYPTO_QUEUE_SIZE 64
+
+#define REQUEST_ARENA_BLOCK_SIZE 4096
+
 /**
  * time_spent takes the start time of a route handler
  * and calculates how long it ran for. It then returns
@@ -45,11 +105,163 @@
 static struct _u_instance instance;
 static db_t *dbr = NULL;
 
+/**
+ * hash_pool runs the argon2id hashing for logins and new
+ * users so that bursts of them can't starve the request
+ * threads or the database.
+ */
+static pool_t *hash_pool = NULL;
+
+/**
+ * crypto_pool decrypts large vaults in parallel on the
+ * list path.
+ */
+static pool_t *crypto_pool = NULL;
+
+/**
+ * import_batch_size is the number of entries an import
+ * writes per transaction.
+ */
+static size_t import_batch_size = DEFAULT_IMPORT_BATCH_SIZE;
+
+/**
+ * attachment_max_size is the largest attachment that can be
+ * uploaded. Request bodies are buffered whole before they're
+ * handed to a callback so this bounds the memory an upload
+ * takes.
+ */
+static size_t attachment_max_size = DEFAULT_ATTACHMENT_MAX_SIZE;
+
+/**
+ * hash_job is the work handed to the hash pool. When
+ * verify is set the password is checked against hash and
+ * only rehashed if the parameters have changed.
+ */
+struct hash_job {
+    const char *password;
+    const char *hash;
+    bool verify;
+    bool verified;
+    bool rehashed;
+    char new_hash[crypto_pwhash_STRBYTES];
+};
+
+static void
+hash_task(void *arg)
+{
+    struct hash_job *job = (struct hash_job *)arg;
+
+    if (job->verify) {
+        job->verified = password_verify(job->hash, job->password);
+        if (!job->verified || !password_needs_rehash(job->hash)) {
+            return;
+        }
+    }
+
+    job->rehashed = password_hash(job->password, job->new_hash) == 0;
+}
+
+/**
+ * request_state is what a request keeps for its lifetime. It's
+ * attached to the response and freed along with it.
+ */
+struct request_state {
+    arena_t *arena;
+    trace_t *trace;
+};
+
+static void
+free_request_state(void *data)
+{
+    struct request_state *state = (struct request_state *)data;
+
+    trace_free(state->trace);
+    arena_free(state->arena);
+    free(state);
+}
+
+/**
+ * request_state returns the state of the current request,
+ * creating it on first use. Creating it starts the request's
+ * trace and sets the X-Request-Id header.
+ */
+static struct request_state*
+request_state(struct _u_response *response)
+{
+    if (response->shared_data == NULL) {
+        struct request_state *state = malloc(sizeof(struct request_state));
+        state->arena = arena_new(REQUEST_ARENA_BLOCK_SIZE);
+        state->trace = trace_new();
+
+        ulfius_set_response_shared_data(response, state, &free_request_state);
+        u_map_put(response->map_header, REQUEST_ID_HEADER, trace_id(state->trace));
+    }
+
+    return (struct request_state *)response->shared_data;
+}
+
+/**
+ * request_arena returns the arena for the current request.
+ * Everything allocated from it is released in one shot when
+ * the response is cleaned up.
+ */
+static arena_t*
+request_arena(struct _u_response *response)
+{
+    return request_state(response)->arena;
+}
+
+/**
+ * request_trace returns the trace of the current request.
+ * Handlers call it first so the trace covers all of their work.
+ */
+static trace_t*
+request_trace(struct _u_response *response)
+{
+    return request_state(response)->trace;
+}
+
+/**
+ * client_addr formats the request's client address into
+ * memory taken from the request arena.
+ */
+static const char*
+client_addr(const struct _u_request *request, arena_t *arena)
+{
+    char *addr = arena_alloc(arena, INET6_ADDRSTRLEN);
+    const struct sockaddr *sa = request->client_address;
+
+    if (sa == NULL) {
+        return "";
+    }
+
+    if (sa->sa_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)sa)->sin6_addr, addr, INET6_ADDRSTRLEN);
+    } else {
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)sa)->sin_addr, addr, INET6_ADDRSTRLEN);
+    }
+
+    return addr;
+}
+
 void
-log_request(const struct _u_request *request, struct _u_response *response, clock_t start)
+log_request(const struct _u_request *request, struct _u_response *response, trace_t *trace)
 {
-    clock_t diff = clock() - start;
-    int msec = diff * 1000;
+    char name[256];
+    snprintf(name, sizeof(name), "%s %s", request->http_verb, request->url_path);
+    trace_finish(trace, name, response->status);
+
+    if (!s_log_enabled(LOG_INFO)) {
+        return;
+    }
+
+    uint32_t sample_rate = sample_request(request->url_path, response->status, trace_duration_ns(trace));
+    if (sample_rate == 0) {
+        return;
+    }
+
+    char spans[TRACE_MAX_SPANS * 48];
+    trace_format_spans(trace, spans, sizeof(spans));
 
     s_log(LOG_INFO,
         s_log_string("method", request->http_verb), 
@@ -57,8 +269,58 @@ log_request(const struct _u_request *request, struct _u_response *response, cloc
         //s_log_string("host", ipv4),
         s_log_uint32("status", response->status),
         s_log_string("proto", request->http_protocol),
-        s_log_int("duration", msec),
-        s_log_string("client_addr", inet_ntoa(((struct sockaddr_in*)request->client_address)->sin_addr)));
+        s_log_uint64("duration_ns", trace_duration_ns(trace)),
+        s_log_string("request_id", trace_id(trace)),
+        s_log_string("spans", spans),
+        s_log_string("client_addr", client_addr(request, request_arena(response))),
+        s_log_uint32("sample_rate", sample_rate));
+}
+
+/**
+ * set_json_body_response sets the JSON body of the response,
+ * recording the time spent encoding it.
+ */
+static int
+set_json_body_response(struct _u_response *response, const unsigned int status, const json_t *json_body)
+{
+    int span = trace_span_begin("json.encode");
+    int res = ulfius_set_json_body_response(response, status, json_body);
+    trace_span_end(span);
+
+    return res;
+}
+
+/**
+ * auth_user returns the user the request's auth token belongs
+ * to, allocated from the given arena. Returns NULL if the token
+ * is missing or unknown.
+ */
+static user_t*
+auth_user(const struct _u_request *request, arena_t *arena)
+{
+    const char *token = u_map_get(request->map_header, AUTH_HEADER);
+    if (token == NULL) {
+        return NULL;
+    }
+
+    user_t *user = db_user_new(arena);
+    if (TRACED("db.user_get_by_token", db_user_get_by_token(dbr, token, user)) < 1) {
+        return NULL;
+    }
+
+    return user;
+}
+
+/**
+ * auth_admin checks that the request's auth token belongs
+ * to the admin user.
+ */
+static bool
+auth_admin(const struct _u_request *request, arena_t *arena)
+{
+    user_t *user = auth_user(request, arena);
+
+    return user != NULL && strcmp(user->username, "admin") == 0;
 }
 
 // /**
@@ -94,10 +356,10 @@ callback_auth_token(const struct _u_request *request, struct _u_response *respon
 static int
 callback_health(const struct _u_request *request, struct _u_response *response, void *user_data)
 {
-    clock_t start = clock();
+    trace_t *trace = request_trace(response);
     ulfius_set_string_body_response(response, HTTP_STATUS_OK, "OK");
     
-    log_request(request, response, start);
+    log_request(request, response, trace);
     return U_CALLBACK_CONTINUE;
 }
 
@@ -119,17 +381,14 @@ callback_default(const struct _u_request *request, struct _u_response *response,
 static int
 callback_new_user(const struct _u_request *request, struct _u_response *response, void *user_data)
 {
-    clock_t start = clock();
-    
-    const char *auth_token = u_map_get(request->map_header, AUTH_HEADER);
+    trace_t *trace = request_trace(response);
+    arena_t *arena = request_arena(response);
 
-    user_t *user1 = db_user_new();
-    int row_count = db_user_get_by_token(dbr, auth_token, user1);
-    if (strcmp(user1->username, "admin")) {
+    if (!auth_admin(request, arena)) {
         ulfius_set_string_body_response(response, HTTP_STATUS_UNAUTHORIZED, "error authentication");
+        log_request(request, response, trace);
         return U_CALLBACK_UNAUTHORIZED;
     }
-    db_user_free(user1);
 
     json_error_t error;
     json_t *json_new_user_request = ulfius_get_json_body_request(request, &error);
@@ -137,47 +396,56 @@ callback_new_user(const struct _u_request *request, struct _u_response *response
     const char *first_name = json_string_value(json_object_get(json_new_user_request, "first_name"));
     const char *last_name = json_string_value(json_object_get(json_new_user_request, "last_name"));
     const char *password = json_string_value(json_object_get(json_new_user_request, "password"));
-    if (strcmp(error.text, "")) {
+    if (json_new_user_request == NULL || username == NULL || first_name == NULL || last_name == NULL || password == NULL) {
         s_log(LOG_ERROR, s_log_string("msg", error.text));
-        response->status = HTTP_STATUS_BAD_REQUEST;
+        json_decref(json_new_user_request);
         ulfius_set_string_body_response(response, HTTP_STATUS_BAD_REQUEST, "");
+        log_request(request, response, trace);
         return U_CALLBACK_ERROR;
     }
 
-    char *token = generate_password(32);
-
-    if (db_user_add(dbr, username, first_name, last_name, password, token) != 0) {
-        s_log(LOG_ERROR, s_log_string("msg", db_get_error(dbr)));
+    struct hash_job job = {.password = password};
+    if (TRACED("crypto.argon2id", pool_run(hash_pool, hash_task, &job)) != 0) {
+        json_decref(json_new_user_request);
+        ulfius_set_string_body_response(response, HTTP_STATUS_SERVICE_UNAVAILABLE, "too many pending requests");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+    if (!job.rehashed) {
+        json_decref(json_new_user_request);
         ulfius_set_string_body_response(response, HTTP_STATUS_INTERNAL_SERVER_ERROR, "failed to add new user");
+        log_request(request, response, trace);
         return U_CALLBACK_ERROR;
     }
 
-    user_t *user = db_user_new();
-    if (db_user_get_by_username(dbr, username, user) != 1) {
+    char *token = arena_alloc(arena, DB_TOKEN_SIZE + 1);
+    generate_password_into(token, DB_TOKEN_SIZE);
+
+    user_t *user = db_user_new(arena);
+    if (TRACED("db.user_add", db_user_add(dbr, username, first_name, last_name, job.new_hash, token)) != 0 ||
+        TRACED("db.user_get_by_username", db_user_get_by_username(dbr, username, user)) != 1) {
         s_log(LOG_ERROR, s_log_string("msg", db_get_error(dbr)));
-        response->status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        json_decref(json_new_user_request);
         ulfius_set_string_body_response(response, HTTP_STATUS_INTERNAL_SERVER_ERROR, "failed to add new user");
+        log_request(request, response, trace);
         return U_CALLBACK_ERROR;
     }
+    json_decref(json_new_user_request);
     
     unsigned char key[crypto_secretbox_KEYBYTES];
     crypto_secretbox_keygen(key);
-    if (db_key_add(dbr, key, user->id) != 0) {
+    if (TRACED("db.key_add", db_key_add(dbr, key, user->id)) != 0) {
         s_log(LOG_ERROR, s_log_string("msg", db_get_error(dbr)));
-        response->status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
         ulfius_set_string_body_response(response, HTTP_STATUS_INTERNAL_SERVER_ERROR, "failed to add new user");
+        log_request(request, response, trace);
         return U_CALLBACK_ERROR;
     }
 
-    json_t *json_body = json_object();
-    json_body = json_pack("{s:s}", "token", token);
-    ulfius_set_json_body_response(response, HTTP_STATUS_OK, json_body);
-
-    json_decref(json_new_user_request);
+    json_t *json_body = json_pack("{s:s}", "token", token);
+    set_json_body_response(response, HTTP_STATUS_OK, json_body);
     json_decref(json_body);
-    free((char *)token);
     
-    log_request(request, response, start);
+    log_request(request, response, trace);
     return U_CALLBACK_CONTINUE;
 }
 
@@ -187,42 +455,38 @@ callback_new_user(const struct _u_request *request, struct _u_response *response
 static int
 callback_get_users(const struct _u_request *request, struct _u_response *response, void *user_data)
 {
-    clock_t start = clock();
-
-    const char *auth_token = u_map_get(request->map_header, AUTH_HEADER);
+    trace_t *trace = request_trace(response);
+    arena_t *arena = request_arena(response);
 
-    user_t *user1 = db_user_new();
-    int row_count = db_user_get_by_token(dbr, auth_token, user1);
-    if (strcmp(user1->username, "admin")) {
+    if (!auth_admin(request, arena)) {
         ulfius_set_string_body_response(response, HTTP_STATUS_UNAUTHORIZED, "error authentication");
+        log_request(request, response, trace);
         return U_CALLBACK_UNAUTHORIZED;
     }
-    db_user_free(user1);
 
-    user_t **users = db_users_new();
-    uint64_t user_count = db_users_get_all(dbr, users);
+    user_t **users = NULL;
+    uint64_t user_count = TRACED("db.users_get_all", db_users_get_all(dbr, arena, &users));
+    if (user_count == (uint64_t)-1) {
+        s_log(LOG_ERROR, s_log_string("msg", db_get_error(dbr)));
+        ulfius_set_string_body_response(response, HTTP_STATUS_INTERNAL_SERVER_ERROR, "failed to retrieve users");
+        log_request(request, response, trace);
+        return U_CALLBACK_ERROR;
+    }
 
     json_t *json_users = json_array();
-    for (int i = 0; i < user_count; i++) {
-        if (users[i] != NULL) {
-            json_t *ju = json_pack("{s:i, s:s, s:s}",
-                "id", users[i]->id,
-                "first_name", users[i]->first_name,
-                "last_name", users[i]->last_name);
-            json_array_append_new(json_users, ju);
-        }
+    for (uint64_t i = 0; i < user_count; i++) {
+        json_t *ju = json_pack("{s:i, s:s, s:s}",
+            "id", users[i]->id,
+            "first_name", users[i]->first_name,
+            "last_name", users[i]->last_name);
+        json_array_append_new(json_users, ju);
     }
 
-    json_t *json_body = json_object();
-    json_body = json_pack("{s:i, s:O}", "count", user_count, "users", json_users);
-
-    ulfius_set_json_body_response(response, HTTP_STATUS_OK, json_body);
-
-    json_decref(json_users);
+    json_t *json_body = json_pack("{s:i, s:o}", "count", user_count, "users", json_users);
+    set_json_body_response(response, HTTP_STATUS_OK, json_body);
     json_decref(json_body);
-    db_users_free(users, user_count);
 
-    log_request(request, response, start);
+    log_request(request, response, trace);
     return U_CALLBACK_CONTINUE;
 }
 
@@ -232,35 +496,31 @@ callback_get_users(const struct _u_request *request, struct _u_response *respons
 static int
 callback_get_user_key(const struct _u_request *request, struct _u_response *response, void *user_data)
 {
-    clock_t start = clock();
+    trace_t *trace = request_trace(response);
+    arena_t *arena = request_arena(response);
 
-    const char *token = u_map_get(request->map_header, AUTH_HEADER);
-    printf("XXX - token - %s\n", token);
-    user_t *user = db_user_new();
-    int row_count = db_user_get_by_token(dbr, token, user);
-    if (row_count == 0) {
-        // token not found
-        free(user);
+    user_t *user = auth_user(request, arena);
+    if (user == NULL) {
         response->status = HTTP_STATUS_UNAUTHORIZED;
-        log_request(request, response, start);
+        log_request(request, response, trace);
         return U_CALLBACK_UNAUTHORIZED;
     }
     
-    u_key_t *key = db_key_new();
-    if (db_key_get_by_user_id(dbr, user->id, key) != 1) {
-        // key not found error
+    u_key_t *key = db_key_new(arena);
+    if (TRACED("db.key_get_by_user_id", db_key_get_by_user_id(dbr, user->id, key)) != 1) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_NOT_FOUND, ULFIUS_HTTP_NOT_FOUND_BODY);
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
     }
 
-    char *encoded_key = base64_encode((const unsigned char *)key->key, 32);
-    json_t *json_body = json_object();
-    json_body = json_pack("{s:s}", "key", encoded_key);
-
-    ulfius_set_json_body_response(response, HTTP_STATUS_OK, json_body);
+    char *encoded_key = base64_encode((const unsigned char *)key->key, DB_KEY_SIZE);
+    json_t *json_body = json_pack("{s:s}", "key", encoded_key);
+    set_json_body_response(response, HTTP_STATUS_OK, json_body);
 
     json_decref(json_body);
-    db_key_free(key);
+    free(encoded_key);
 
-    log_request(request, response, start);
+    log_request(request, response, trace);
     return U_CALLBACK_CONTINUE;
 }
 
@@ -270,331 +530,1564 @@ callback_get_user_key(const struct _u_request *request, struct _u_response *resp
 static int
 callback_get_user_by_id(const struct _u_request *request, struct _u_response *response, void *user_data)
 {
-    clock_t start = clock();
-
-    const char *auth_token = u_map_get(request->map_header, AUTH_HEADER);
+    trace_t *trace = request_trace(response);
+    arena_t *arena = request_arena(response);
 
-    user_t *user1 = db_user_new();
-    int row_count = db_user_get_by_token(dbr, auth_token, user1);
-    if (strcmp(user1->username, "admin")) {
+    if (!auth_admin(request, arena)) {
         ulfius_set_string_body_response(response, HTTP_STATUS_UNAUTHORIZED, "error authentication");
+        log_request(request, response, trace);
         return U_CALLBACK_UNAUTHORIZED;
     }
-    db_user_free(user1);
 
     const char *idv = u_map_get(request->map_url, "id");
     char *endptr;
     long id = strtol(idv, &endptr, 10);
 
-    user_t *user = db_user_new();
-    uint64_t user_count = db_user_get_by_id(dbr, id, user);
-    if (user_count == 0) {
+    user_t *user = db_user_new(arena);
+    if (TRACED("db.user_get_profile", db_user_get_profile(dbr, id, user)) < 1) {
         ulfius_set_string_body_response(response, HTTP_STATUS_NOT_FOUND, ULFIUS_HTTP_NOT_FOUND_BODY);
-        log_request(request, response, start);
+        log_request(request, response, trace);
         return U_CALLBACK_CONTINUE;
     }
 
-    json_t *json_body = json_object();
-    json_body = json_pack("{s:i, s:s, s:s}",
+    json_t *json_body = json_pack("{s:i, s:s, s:s}",
         "id", user->id,
         "first_name", user->first_name,
         "last_name", user->last_name);
-
-    ulfius_set_json_body_response(response, HTTP_STATUS_OK, json_body);
-
+    set_json_body_response(response, HTTP_STATUS_OK, json_body);
     json_decref(json_body);
-    db_user_free(user);
 
-    log_request(request, response, start);
+    log_request(request, response, trace);
     return U_CALLBACK_CONTINUE;
 }
 
 static int
 callback_get_password(const struct _u_request *request, struct _u_response *response, void *user_data)
 {
-    clock_t start = clock();
+    trace_t *trace = request_trace(response);
+    arena_t *arena = request_arena(response);
 
     const char *p_name = u_map_get(request->map_url, "name");
     const char *token = u_map_get(request->map_header, AUTH_HEADER);
+    if (token == NULL) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_UNAUTHORIZED, "error authentication");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
 
-    password_t *pass = db_password_new();
-    if (db_password_get_by_token(dbr, p_name, token, pass) == 0) {
-        // handle the error here
+    password_t *pass = db_password_new(arena);
+    int row_count = TRACED("db.password_get_by_token", db_password_get_by_token(dbr, p_name, token, pass));
+    if (row_count < 0) {
+        s_log(LOG_ERROR, s_log_string("msg", "unable to read password"), s_log_string("error", db_get_error(dbr)));
+        ulfius_set_string_body_response(response, HTTP_STATUS_INTERNAL_SERVER_ERROR, "failed to retrieve password");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+    if (row_count == 0) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_NOT_FOUND, ULFIUS_HTTP_NOT_FOUND_BODY);
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
     }
 
-    json_t *json_body = json_object();
-    json_body = json_pack("{s:i, s:s, s:s, s:s}",
+    json_t *json_body = json_pack("{s:i, s:s, s:s, s:s}",
         "id", pass->id,
         "name", pass->name,
         "username", pass->username,
         "password", pass->password);
+    set_json_body_response(response, HTTP_STATUS_OK, json_body);
+    json_decref(json_body);
+
+    log_request(request, response, trace);
+    return U_CALLBACK_CONTINUE;
+}
+
+/**
+ * get_password_changes responds with the latest change to each of
+ * the user's passwords after the given sequence number and the
+ * sequence number to ask from next time. When more is set there
+ * are more changes to fetch.
+ */
+static int
+get_password_changes(const struct _u_request *request, struct _u_response *response, trace_t *trace, user_t *user, const char *sincev)
+{
+    char *endptr;
+    uint64_t since = strtoull(sincev, &endptr, 10);
+    if (sincev[0] == '\0' || sincev[0] == '-' || *endptr != '\0') {
+        ulfius_set_string_body_response(response, HTTP_STATUS_BAD_REQUEST, "since must be a sequence number");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    change_t **changes = NULL;
+    int change_count = TRACED("db.changes_get_since", db_changes_get_since(dbr, request_arena(response), user->id, since, MAX_SYNC_CHANGES, &changes));
+    if (change_count < 0) {
+        s_log(LOG_ERROR, s_log_string("msg", "unable to read changes"), s_log_string("error", db_get_error(dbr)));
+        ulfius_set_string_body_response(response, HTTP_STATUS_INTERNAL_SERVER_ERROR, "failed to retrieve changes");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    json_t *json_changes = json_array();
+    for (int i = 0; i < change_count; i++) {
+        const change_t *change = changes[i];
+        json_t *jc = json_pack("{s:I, s:s, s:s}",
+            "seq", (json_int_t)change->seq,
+            "operation", change->operation,
+            "name", change->pass->name);
+        if (strcmp(change->operation, DB_CHANGE_DELETE) != 0) {
+            json_object_set_new(jc, "id", json_integer(change->pass->id));
+            json_object_set_new(jc, "username", json_string(change->pass->username));
+            json_object_set_new(jc, "password", json_string(change->pass->password));
+        }
+        json_array_append_new(json_changes, jc);
+    }
 
-    ulfius_set_json_body_response(response, HTTP_STATUS_OK, json_body);
+    uint64_t seq = change_count > 0 ? changes[change_count-1]->seq : since;
 
+    json_t *json_body = json_pack("{s:i, s:I, s:b, s:o}",
+        "count", change_count,
+        "seq", (json_int_t)seq,
+        "more", change_count == MAX_SYNC_CHANGES,
+        "changes", json_changes);
+    set_json_body_response(response, HTTP_STATUS_OK, json_body);
     json_decref(json_body);
-    db_password_free(pass);
 
-    log_request(request, response, start);
+    log_request(request, response, trace);
     return U_CALLBACK_CONTINUE;
 }
 
+/**
+ * callback_get_passwords returns all of the user's passwords along
+ * with the sequence number of the latest change to them. With
+ * since set only what changed after that sequence number is
+ * returned.
+ */
 static int
 callback_get_passwords(const struct _u_request *request, struct _u_response *response, void *user_data)
 {
-    clock_t start = clock();
+    trace_t *trace = request_trace(response);
+    arena_t *arena = request_arena(response);
 
-    const char *token = u_map_get(request->map_header, AUTH_HEADER);
+    user_t *user = auth_user(request, arena);
+    if (user == NULL) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_UNAUTHORIZED, "error authentication");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
 
-    password_t **passwords = db_passwords_new();
-    int password_count = db_passwords_get_by_token(dbr, token, passwords);
+    const char *since = u_map_get(request->map_url, "since");
+    if (since != NULL) {
+        return get_password_changes(request, response, trace, user, since);
+    }
+
+    // read the sequence number first so a write landing between
+    // the two queries is sent again rather than missed
+    uint64_t seq = 0;
+    if (TRACED("db.changes_last_seq", db_changes_last_seq(dbr, user->id, &seq)) != 0) {
+        s_log(LOG_ERROR, s_log_string("msg", "unable to read changes"), s_log_string("error", db_get_error(dbr)));
+        ulfius_set_string_body_response(response, HTTP_STATUS_INTERNAL_SERVER_ERROR, "failed to retrieve passwords");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    password_t **passwords = NULL;
+    int password_count = TRACED("db.passwords_get_by_token", db_passwords_get_by_token(dbr, arena, u_map_get(request->map_header, AUTH_HEADER), &passwords));
+    if (password_count < 0) {
+        s_log(LOG_ERROR, s_log_string("msg", "unable to read passwords"), s_log_string("error", db_get_error(dbr)));
+        ulfius_set_string_body_response(response, HTTP_STATUS_INTERNAL_SERVER_ERROR, "failed to retrieve passwords");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
     if (password_count == 0) {
         ulfius_set_string_body_response(response, HTTP_STATUS_NOT_FOUND, ULFIUS_HTTP_NOT_FOUND_BODY);
-        log_request(request, response, start);
+        log_request(request, response, trace);
         return U_CALLBACK_CONTINUE;
     }
 
     json_t *json_passwords = json_array();
     for (int i = 0; i < password_count; i++) {
-        if (passwords[i] != NULL) {
-            json_t *jp = json_pack("{s:i, s:s, s:s, s:s}",
-                "id", passwords[i]->id,
-                "name", passwords[i]->name,
-                "username", passwords[i]->username,
-                "password", passwords[i]->password);
-            json_array_append_new(json_passwords, jp);
-        }
+        json_t *jp = json_pack("{s:i, s:s, s:s, s:s}",
+            "id", passwords[i]->id,
+            "name", passwords[i]->name,
+            "username", passwords[i]->username,
+            "password", passwords[i]->password);
+        json_array_append_new(json_passwords, jp);
     }
 
-    json_t *json_body = json_object();
-    json_body = json_pack("{s:i, s:O}", "count", password_count, "passwords", json_passwords);
-    ulfius_set_json_body_response(response, HTTP_STATUS_OK, json_body);
-
+    json_t *json_body = json_pack("{s:i, s:I, s:o}",
+        "count", password_count,
+        "seq", (json_int_t)seq,
+        "passwords", json_passwords);
+    set_json_body_response(response, HTTP_STATUS_OK, json_body);
     json_decref(json_body);
-    db_passwords_free(passwords, password_count);
 
-    log_request(request, response, start);
+    log_request(request, response, trace);
     return U_CALLBACK_CONTINUE;
 }
 
+/**
+ * callback_batch_get_passwords retrieves all of the requested passwords
+ * with one auth check and one query. Names that don't exist for the
+ * user are returned in the missing list.
+ */
 static int
-callback_new_password(const struct _u_request *request, struct _u_response *response, void *user_data)
+callback_batch_get_passwords(const struct _u_request *request, struct _u_response *response, void *user_data)
 {
-    clock_t start = clock();
+    trace_t *trace = request_trace(response);
+    arena_t *arena = request_arena(response);
+
+    user_t *user = auth_user(request, arena);
+    if (user == NULL) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_UNAUTHORIZED, "error authentication");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
 
-    const char *token = u_map_get(request->map_header, AUTH_HEADER);
-    
     json_error_t error;
-    json_t *json_new_user_request = ulfius_get_json_body_request(request, &error);
-    const char *name = json_string_value(json_object_get(json_new_user_request, "name"));
-    const char *username = json_string_value(json_object_get(json_new_user_request, "username"));
-    const char *password = json_string_value(json_object_get(json_new_user_request, "password"));
-    if (strcmp(error.text, "")) {
-        s_log(LOG_ERROR, s_log_string("msg", error.text));
-        ulfius_set_string_body_response(response, HTTP_STATUS_BAD_REQUEST, "");
-        return U_CALLBACK_ERROR;
+    json_t *json_request = ulfius_get_json_body_request(request, &error);
+    json_t *json_names = json_object_get(json_request, "names");
+    size_t name_count = json_array_size(json_names);
+
+    const char **names = arena_calloc(arena, name_count, sizeof(char*));
+    bool valid = json_is_array(json_names) && name_count > 0 && name_count <= MAX_BATCH_GET_NAMES;
+    for (size_t i = 0; valid && i < name_count; i++) {
+        names[i] = json_string_value(json_array_get(json_names, i));
+        valid = names[i] != NULL;
     }
-    
-    user_t *user = db_user_new();
-    int row_count = db_user_get_by_token(dbr, token, user);
-    if (row_count == 0) {
-        // token not found
-        return U_CALLBACK_UNAUTHORIZED;
+
+    if (!valid) {
+        json_decref(json_request);
+        ulfius_set_string_body_response(response, HTTP_STATUS_BAD_REQUEST, "names must be a list of 1 to " STR(MAX_BATCH_GET_NAMES) " strings");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
     }
 
-    if (db_password_add(dbr, name, username, password, "", user->id) != 0) {
-        printf("error: %s\n", db_get_error(dbr));
-        ulfius_set_string_body_response(response, HTTP_STATUS_INTERNAL_SERVER_ERROR, "failed to add new password");
-        return U_CALLBACK_ERROR;
+    password_t **passwords = NULL;
+    int password_count = TRACED("db.passwords_get_by_names", db_passwords_get_by_names(dbr, arena, user->id, names, name_count, &passwords));
+    if (password_count < 0) {
+        s_log(LOG_ERROR, s_log_string("msg", db_get_error(dbr)));
+        json_decref(json_request);
+        ulfius_set_string_body_response(response, HTTP_STATUS_INTERNAL_SERVER_ERROR, "failed to retrieve passwords");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
     }
 
-    ulfius_set_string_body_response(response, HTTP_STATUS_CREATED, "");
+    json_t *json_passwords = json_array();
+    for (int i = 0; i < password_count; i++) {
+        json_array_append_new(json_passwords, json_pack("{s:i, s:s, s:s, s:s}",
+            "id", passwords[i]->id,
+            "name", passwords[i]->name,
+            "username", passwords[i]->username,
+            "password", passwords[i]->password));
+    }
 
-    json_decref(json_new_user_request);
-    db_user_free(user);
+    // names are matched the way the lookup's collation does,
+    // without regard to case
+    json_t *json_missing = json_array();
+    for (size_t i = 0; i < name_count; i++) {
+        bool found = false;
+        for (int j = 0; j < password_count; j++) {
+            if (strcasecmp(names[i], passwords[j]->name) == 0) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            json_array_append_new(json_missing, json_string(names[i]));
+        }
+    }
+
+    json_t *json_body = json_pack("{s:i, s:o, s:o}",
+        "count", password_count,
+        "passwords", json_passwords,
+        "missing", json_missing);
+    set_json_body_response(response, HTTP_STATUS_OK, json_body);
+
+    json_decref(json_body);
+    json_decref(json_request);
 
-    log_request(request, response, start);
+    log_request(request, response, trace);
     return U_CALLBACK_CONTINUE;
 }
 
 static int
-callback_login(const struct _u_request *request, struct _u_response *response, void *user_data)
+callback_new_password(const struct _u_request *request, struct _u_response *response, void *user_data)
 {
-    clock_t start = clock();
+    trace_t *trace = request_trace(response);
+    arena_t *arena = request_arena(response);
+
+    user_t *user = auth_user(request, arena);
+    if (user == NULL) {
+        response->status = HTTP_STATUS_UNAUTHORIZED;
+        log_request(request, response, trace);
+        return U_CALLBACK_UNAUTHORIZED;
+    }
     
     json_error_t error;
-    json_t *json_new_user_request = ulfius_get_json_body_request(request, &error);
-    const char *username = json_string_value(json_object_get(json_new_user_request, "username"));
-    const char *password = json_string_value(json_object_get(json_new_user_request, "password"));
-    if (strcmp(error.text, "") != 0) {
+    json_t *json_new_password_request = ulfius_get_json_body_request(request, &error);
+    const char *name = json_string_value(json_object_get(json_new_password_request, "name"));
+    const char *username = json_string_value(json_object_get(json_new_password_request, "username"));
+    const char *password = json_string_value(json_object_get(json_new_password_request, "password"));
+    if (json_new_password_request == NULL || name == NULL || username == NULL || password == NULL) {
         s_log(LOG_ERROR, s_log_string("msg", error.text));
-        response->status = HTTP_STATUS_BAD_REQUEST;
+        json_decref(json_new_password_request);
         ulfius_set_string_body_response(response, HTTP_STATUS_BAD_REQUEST, "");
-        log_request(request, response, start);
+        log_request(request, response, trace);
         return U_CALLBACK_ERROR;
     }
 
-    user_t *user = db_user_new();
-    if (db_user_get_token(dbr, username, password, user) == 0) {
-        response->status = HTTP_STATUS_UNAUTHORIZED;
-        log_request(request, response, start);
-        return U_CALLBACK_UNAUTHORIZED;
+    if (TRACED("db.password_add", db_password_add(dbr, name, username, password, "", user->id)) != 0) {
+        s_log(LOG_ERROR, s_log_string("msg", db_get_error(dbr)));
+        json_decref(json_new_password_request);
+        ulfius_set_string_body_response(response, HTTP_STATUS_INTERNAL_SERVER_ERROR, "failed to add new password");
+        log_request(request, response, trace);
+        return U_CALLBACK_ERROR;
     }
-    
-    json_t *json_body = json_object();
-    json_body = json_pack("{s:s}", "token", user->token);
+    events_publish(user->id, name, EVENT_OP_CREATE);
+    search_add(user->id, name);
 
-    ulfius_set_json_body_response(response, HTTP_STATUS_OK, json_body);
+    ulfius_set_string_body_response(response, HTTP_STATUS_CREATED, "");
 
-    json_decref(json_new_user_request);
-    json_decref(json_body);
-    db_user_free(user);
+    json_decref(json_new_password_request);
 
-    log_request(request, response, start);
+    log_request(request, response, trace);
     return U_CALLBACK_CONTINUE;
 }
 
-#define STATIC_FILE_CHUNK 256
-
-struct static_file_config {
-    char *files_path;
-    char *url_prefix;
-    struct _u_map *mime_types;
-    struct _u_map *map_header;
-    char *redirect_on_404;
-};
-
 /**
- * get_filename_ext returns the filename extension.
+ * callback_check_passwords scores the strength of a batch of
+ * candidate passwords. Results are in the order given.
  */
-const char*
-get_filename_ext(const char *path)
+static int
+callback_check_passwords(const struct _u_request *request, struct _u_response *response, void *user_data)
 {
-    const char *dot = strrchr(path, '.');
+    trace_t *trace = request_trace(response);
+    arena_t *arena = request_arena(response);
+
+    user_t *user = auth_user(request, arena);
+    if (user == NULL) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_UNAUTHORIZED, "error authentication");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
 
-    if (!dot || dot == path) {
-        return "*";
+    json_error_t error;
+    json_t *json_request = ulfius_get_json_body_request(request, &error);
+    json_t *json_candidates = json_object_get(json_request, "passwords");
+    size_t candidate_count = json_array_size(json_candidates);
+
+    bool valid = json_is_array(json_candidates) && candidate_count > 0 && candidate_count <= MAX_CHECK_PASSWORDS;
+    for (size_t i = 0; valid && i < candidate_count; i++) {
+        valid = json_is_string(json_array_get(json_candidates, i));
+    }
+
+    if (!valid) {
+        json_decref(json_request);
+        ulfius_set_string_body_response(response, HTTP_STATUS_BAD_REQUEST, "passwords must be a list of 1 to " STR(MAX_CHECK_PASSWORDS) " strings");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
     }
 
-    if (strchr(dot, '?') != NULL) {
-        *strchr(dot, '?') = '\0';
+    int span = trace_span_begin("password.strength");
+    json_t *json_results = json_array();
+    for (size_t i = 0; i < candidate_count; i++) {
+        password_strength_t strength;
+        password_strength(json_string_value(json_array_get(json_candidates, i)), &strength);
+
+        json_array_append_new(json_results, json_pack("{s:i, s:f, s:I, s:b, s:b, s:b, s:b, s:b, s:I, s:I}",
+            "score", strength.score,
+            "entropy", strength.entropy,
+            "length", (json_int_t)strength.length,
+            "lower", strength.has_lower,
+            "upper", strength.has_upper,
+            "number", strength.has_number,
+            "special", strength.has_special,
+            "dictionary", strength.in_dictionary,
+            "repeats", (json_int_t)strength.repeats,
+            "sequences", (json_int_t)strength.sequences));
     }
+    trace_span_end(span);
+
+    json_decref(json_request);
+
+    json_t *json_body = json_pack("{s:i, s:i, s:o}",
+        "count", (int)candidate_count,
+        "max_score", PASSWORD_MAX_SCORE,
+        "results", json_results);
+    set_json_body_response(response, HTTP_STATUS_OK, json_body);
+    json_decref(json_body);
 
-    return dot;
+    log_request(request, response, trace);
+    return U_CALLBACK_CONTINUE;
 }
 
 /**
- * callback_static_file_stream callback function to ease sending large files.
+ * parse_size_param reads a positive number from the query
+ * string into value, leaving it alone when the parameter is
+ * missing. Returns -1 if it isn't a number between 1 and max.
  */
-static ssize_t
-callback_static_file_stream(void *cls, uint64_t pos, char *buf, size_t max)
+static int
+parse_size_param(const struct _u_request *request, const char *name, const size_t max, size_t *value)
 {
-    (void)(pos);
-    if (cls != NULL) {
-        return fread(buf, 1, max, (FILE *)cls);
+    const char *param = u_map_get(request->map_url, name);
+    if (param == NULL) {
+        return 0;
     }
 
-    return U_STREAM_END;
+    char *end;
+    unsigned long long v = strtoull(param, &end, 10);
+    if (param[0] == '\0' || param[0] == '-' || *end != '\0' || v == 0 || v > max) {
+        return -1;
+    }
+    *value = v;
+
+    return 0;
 }
 
 /**
- * Cleanup FILE* structure when streaming is complete
+ * callback_generate_passwords returns count freshly generated
+ * passwords. The policy query parameter picks a named password
+ * policy and label picks the one assigned to that label, falling
+ * back to the default policy. Without a loaded policy they're
+ * letters, numbers and symbols of the given length.
  */
-static void
-callback_static_file_stream_free(void * cls)
-{
-    if (cls != NULL) {
-        fclose((FILE *)cls);
-    }
-}
-
-int
-callback_static_file(const struct _u_request *request, struct _u_response *response, void *user_data)
+static int
+callback_generate_passwords(const struct _u_request *request, struct _u_response *response, void *user_data)
 {
-    size_t length;
-    FILE * f;
-    char * file_requested, * file_path, * url_dup_save, * real_path = NULL;
-    const char * content_type;
+    trace_t *trace = request_trace(response);
+    arena_t *arena = request_arena(response);
 
-    /*
-    * Comment this if statement if you don't access static files url from root dir, like /app
-    */
-    if (request->callback_position > 0) {
+    user_t *user = auth_user(request, arena);
+    if (user == NULL) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_UNAUTHORIZED, "error authentication");
+        log_request(request, response, trace);
         return U_CALLBACK_CONTINUE;
-    } else if (user_data != NULL && ((struct static_file_config *)user_data)->files_path != NULL) {
-        file_requested = strdup(request->http_url);
-        url_dup_save = file_requested;
-    
-        while (file_requested[0] == '/') {
-            file_requested++;
-        }
-        file_requested += strlen(((struct static_file_config *)user_data)->url_prefix);
-
-        while (file_requested[0] == '/') {
-            file_requested++;
-        }
+    }
 
-        if (strchr(file_requested, '#') != NULL) {
-            *strchr(file_requested, '#') = '\0';
-        }
+    const char *policy_param = u_map_get(request->map_url, "policy");
+    const char *label = u_map_get(request->map_url, "label");
 
-        if (strchr(file_requested, '?') != NULL) {
-            *strchr(file_requested, '?') = '\0';
+    const policy_t *policy = NULL;
+    if (policy_param != NULL) {
+        policy = policy_get(policy_param);
+        if (policy == NULL) {
+            ulfius_set_string_body_response(response, HTTP_STATUS_NOT_FOUND, "policy not found");
+            log_request(request, response, trace);
+            return U_CALLBACK_CONTINUE;
         }
-    
-    if (file_requested == NULL || strlen(file_requested) == 0 || 0 == strcmp("/", file_requested)) {
-        free(url_dup_save);
-        url_dup_save = file_requested = strdup("index.html");
+    } else if (label != NULL) {
+        policy = policy_for_label(label);
     }
-    
-    file_path = msprintf("%s/%s", ((struct static_file_config *)user_data)->files_path, file_requested);
-    real_path = realpath(file_path, NULL);
-    if (0 == strncmp(((struct static_file_config *)user_data)->files_path, real_path, strlen(((struct static_file_config *)user_data)->files_path))) {
-        if (access(file_path, F_OK) != -1) {
-        f = fopen (file_path, "rb");
-        if (f) {
-            fseek (f, 0, SEEK_END);
-            length = ftell (f);
-            fseek (f, 0, SEEK_SET);
-          
-            content_type = u_map_get_case(((struct static_file_config *)user_data)->mime_types, get_filename_ext(file_requested));
-            if (content_type == NULL) {
-                content_type = u_map_get(((struct static_file_config *)user_data)->mime_types, "*");
-                s_log(LOG_WARN, s_log_string("msg", "Unknown mime type for extension"),
-                    s_log_string("extension", get_filename_ext(file_requested)));
-            }
-            u_map_put(response->map_header, "Content-Type", content_type);
-            u_map_copy_into(response->map_header, ((struct static_file_config *)user_data)->map_header);
-            
-            if (ulfius_set_stream_response(response, 200, callback_static_file_stream, callback_static_file_stream_free, length, STATIC_FILE_CHUNK, f) != U_OK) {
-                s_log(LOG_ERROR, s_log_string("msg", "error ulfius_set_stream_response"));
+    if (policy == NULL) {
+        policy = policy_get(POLICY_DEFAULT);
+    }
+
+    size_t length = 0;
+    size_t count = 1;
+    if (parse_size_param(request, "length", MAX_GENERATE_LENGTH, &length) != 0 ||
+        parse_size_param(request, "count", MAX_GENERATE_COUNT, &count) != 0) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_BAD_REQUEST,
+            "length must be 1 to " STR(MAX_GENERATE_LENGTH) " and count 1 to " STR(MAX_GENERATE_COUNT));
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    if (policy != NULL && length > 0 && !policy_allows_length(policy, length)) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_BAD_REQUEST, "length not allowed by policy");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    size_t stride;
+    size_t *lengths = arena_alloc(arena, count * sizeof(size_t));
+    char *generated;
+
+    int span = trace_span_begin("password.generate");
+    if (policy != NULL) {
+        stride = policy_max_length(policy) + 1;
+        generated = arena_alloc(arena, count * stride);
+        policy_generate(policy, length, generated, lengths, count);
+    } else {
+        if (length == 0) {
+            length = DEFAULT_GENERATE_LENGTH;
+        }
+        stride = length + 1;
+        generated = arena_alloc(arena, count * stride);
+        generate_passwords(generated, length, count);
+        for (size_t i = 0; i < count; i++) {
+            lengths[i] = length;
+        }
+    }
+    trace_span_end(span);
+
+    json_t *json_passwords = json_array();
+    for (size_t i = 0; i < count; i++) {
+        json_array_append_new(json_passwords, json_stringn(generated + i * stride, lengths[i]));
+    }
+    sodium_memzero(generated, count * stride);
+
+    json_t *json_body = json_pack("{s:I, s:s, s:o}",
+        "count", (json_int_t)count,
+        "policy", policy != NULL ? policy_name(policy) : "builtin",
+        "passwords", json_passwords);
+    if (length > 0) {
+        json_object_set_new(json_body, "length", json_integer(length));
+    }
+    u_map_put(response->map_header, "Cache-Control", "no-store");
+    set_json_body_response(response, HTTP_STATUS_OK, json_body);
+    json_decref(json_body);
+
+    log_request(request, response, trace);
+    return U_CALLBACK_CONTINUE;
+}
+
+/**
+ * callback_search_passwords finds the user's passwords whose name
+ * contains q, best matches first. The user's name index is built
+ * on first use and kept up to date as passwords are written.
+ */
+static int
+callback_search_passwords(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+    trace_t *trace = request_trace(response);
+    arena_t *arena = request_arena(response);
+
+    user_t *user = auth_user(request, arena);
+    if (user == NULL) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_UNAUTHORIZED, "error authentication");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    const char *q = u_map_get(request->map_url, "q");
+    if (q == NULL || q[0] == '\0' || strlen(q) > MAX_SEARCH_QUERY) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_BAD_REQUEST, "q must be 1 to " STR(MAX_SEARCH_QUERY) " characters");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    size_t limit = DEFAULT_SEARCH_LIMIT;
+    const char *limitv = u_map_get(request->map_url, "limit");
+    if (limitv != NULL) {
+        limit = strtoul(limitv, NULL, 10);
+        if (limit == 0 || limit > SEARCH_MAX_LIMIT) {
+            ulfius_set_string_body_response(response, HTTP_STATUS_BAD_REQUEST, "limit must be 1 to " STR(SEARCH_MAX_LIMIT));
+            log_request(request, response, trace);
+            return U_CALLBACK_CONTINUE;
+        }
+    }
+
+    if (!search_is_loaded(user->id)) {
+        password_t **passwords = NULL;
+        int password_count = TRACED("db.password_names_get", db_password_names_get(dbr, arena, user->id, &passwords));
+        if (password_count < 0) {
+            s_log(LOG_ERROR, s_log_string("msg", db_get_error(dbr)));
+            ulfius_set_string_body_response(response, HTTP_STATUS_INTERNAL_SERVER_ERROR, "failed to search passwords");
+            log_request(request, response, trace);
+            return U_CALLBACK_CONTINUE;
+        }
+
+        char **names = arena_alloc(arena, sizeof(char*)*(password_count + 1));
+        for (int i = 0; i < password_count; i++) {
+            names[i] = passwords[i]->name;
+        }
+
+        int span = trace_span_begin("search.load");
+        search_load(user->id, names, password_count);
+        trace_span_end(span);
+    }
+
+    search_result_t *results = NULL;
+    int result_count = TRACED("search.query", search_query(user->id, q, limit, arena, &results));
+    if (result_count < 0) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_SERVICE_UNAVAILABLE, "search index is reloading");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    json_t *json_results = json_array();
+    for (int i = 0; i < result_count; i++) {
+        json_array_append_new(json_results, json_pack("{s:s, s:i}",
+            "name", results[i].name,
+            "score", results[i].score));
+    }
+
+    json_t *json_body = json_pack("{s:i, s:o}", "count", result_count, "results", json_results);
+    set_json_body_response(response, HTTP_STATUS_OK, json_body);
+    json_decref(json_body);
+
+    log_request(request, response, trace);
+    return U_CALLBACK_CONTINUE;
+}
+
+#define EXPORT_STREAM_CHUNK (64 * 1024)
+
+/**
+ * export_stream is the state of a running vault export. Rows
+ * are read from the cursor one at a time and turned into a
+ * line that's copied out as MHD asks for more data.
+ */
+struct export_stream {
+    db_cursor_t *cursor;
+    password_t *pass;
+    bool encrypt;
+    unsigned char key[DB_KEY_SIZE];
+    char *line;
+    size_t line_len;
+    size_t line_pos;
+};
+
+/**
+ * seal_line encrypts the given serialized entry with the user's
+ * key and returns the JSON line holding the nonce and ciphertext.
+ */
+static char*
+seal_line(const unsigned char key[DB_KEY_SIZE], const char *plain)
+{
+    size_t plain_len = strlen(plain);
+    size_t cipher_len = plain_len + crypto_secretbox_MACBYTES;
+    unsigned char nonce[crypto_secretbox_NONCEBYTES];
+    unsigned char *cipher = malloc(cipher_len);
+
+    randombytes_buf(nonce, sizeof(nonce));
+    crypto_secretbox_easy(cipher, (const unsigned char *)plain, plain_len, nonce, key);
+
+    char *encoded_nonce = base64_encode(nonce, sizeof(nonce));
+    char *encoded_cipher = base64_encode(cipher, cipher_len);
+
+    json_t *json_line = json_pack("{s:s, s:s}", "nonce", encoded_nonce, "ciphertext", encoded_cipher);
+    char *line = json_dumps(json_line, JSON_COMPACT);
+
+    json_decref(json_line);
+    free(encoded_cipher);
+    free(encoded_nonce);
+    free(cipher);
+
+    return line;
+}
+
+/**
+ * open_line decrypts a line written by seal_line and parses the
+ * entry inside it. Returns NULL if it can't be authenticated.
+ */
+static json_t*
+open_line(const unsigned char key[DB_KEY_SIZE], json_t *json_line)
+{
+    const char *encoded_nonce = json_string_value(json_object_get(json_line, "nonce"));
+    const char *encoded_cipher = json_string_value(json_object_get(json_line, "ciphertext"));
+    if (encoded_nonce == NULL || encoded_cipher == NULL) {
+        return NULL;
+    }
+
+    unsigned char nonce[crypto_secretbox_NONCEBYTES];
+    size_t cipher_len = base64_decoded_size(encoded_cipher);
+    if (base64_decoded_size(encoded_nonce) != sizeof(nonce) || cipher_len < crypto_secretbox_MACBYTES ||
+        !base64_decode(encoded_nonce, nonce, sizeof(nonce))) {
+        return NULL;
+    }
+
+    unsigned char *cipher = malloc(cipher_len);
+    unsigned char *plain = malloc(cipher_len - crypto_secretbox_MACBYTES + 1);
+    json_t *entry = NULL;
+
+    if (base64_decode(encoded_cipher, cipher, cipher_len) &&
+        crypto_secretbox_open_easy(plain, cipher, cipher_len, nonce, key) == 0) {
+        entry = json_loadb((const char *)plain, cipher_len - crypto_secretbox_MACBYTES, 0, NULL);
+    }
+
+    sodium_memzero(plain, cipher_len - crypto_secretbox_MACBYTES);
+    free(plain);
+    free(cipher);
+
+    return entry;
+}
+
+/**
+ * export_next_line replaces the stream's current line with the
+ * next row of the cursor. Returns 1 when a line is ready, 0 at
+ * the end of the vault and -1 on error.
+ */
+static int
+export_next_line(struct export_stream *stream)
+{
+    int res = db_passwords_next(stream->cursor, stream->pass);
+    if (res != 1) {
+        return res;
+    }
+
+    json_t *json_entry = json_pack("{s:s, s:s, s:s}",
+        "name", stream->pass->name,
+        "username", stream->pass->username,
+        "password", stream->pass->password);
+    char *line = json_dumps(json_entry, JSON_COMPACT);
+    json_decref(json_entry);
+
+    if (stream->encrypt) {
+        char *plain = line;
+        line = seal_line(stream->key, plain);
+        sodium_memzero(plain, strlen(plain));
+        free(plain);
+    }
+
+    if (stream->line != NULL) {
+        sodium_memzero(stream->line, stream->line_len);
+        free(stream->line);
+    }
+
+    stream->line_len = strlen(line) + 1;
+    stream->line = realloc(line, stream->line_len + 1);
+    stream->line[stream->line_len-1] = '\n';
+    stream->line[stream->line_len] = '\0';
+    stream->line_pos = 0;
+
+    return 1;
+}
+
+/**
+ * callback_export_passwords_stream fills MHD's buffer with as
+ * many lines as fit, reading rows as it goes.
+ */
+static ssize_t
+callback_export_passwords_stream(void *cls, uint64_t pos, char *buf, size_t max)
+{
+    struct export_stream *stream = (struct export_stream *)cls;
+    size_t written = 0;
+
+    while (written < max) {
+        if (stream->line == NULL || stream->line_pos == stream->line_len) {
+            int res = export_next_line(stream);
+            if (res < 0) {
+                return U_STREAM_ERROR;
             }
+            if (res == 0) {
+                break;
             }
-            } else {
-                if (((struct static_file_config *)user_data)->redirect_on_404 == NULL) {
-                    ulfius_set_string_body_response(response, 404, "File not found");
-                } else {
-                    ulfius_add_header_to_response(response, "Location", ((struct static_file_config *)user_data)->redirect_on_404);
-                    response->status = 302;
+        }
+
+        size_t n = stream->line_len - stream->line_pos;
+        if (n > max - written) {
+            n = max - written;
+        }
+        memcpy(buf + written, stream->line + stream->line_pos, n);
+        stream->line_pos += n;
+        written += n;
+    }
+
+    return written > 0 ? (ssize_t)written : U_STREAM_END;
+}
+
+static void
+callback_export_passwords_stream_free(void *cls)
+{
+    struct export_stream *stream = (struct export_stream *)cls;
+
+    db_cursor_close(stream->cursor);
+    db_password_free(stream->pass);
+    if (stream->line != NULL) {
+        sodium_memzero(stream->line, stream->line_len);
+        free(stream->line);
+    }
+    sodium_memzero(stream->key, sizeof(stream->key));
+    free(stream);
+}
+
+/**
+ * callback_export_passwords streams all of the user's passwords
+ * as newline delimited JSON straight from a database cursor.
+ * With encrypt=true every line is sealed with the user's key.
+ */
+static int
+callback_export_passwords(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+    trace_t *trace = request_trace(response);
+    arena_t *arena = request_arena(response);
+
+    user_t *user = auth_user(request, arena);
+    if (user == NULL) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_UNAUTHORIZED, "error authentication");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    struct export_stream *stream = calloc(1, sizeof(struct export_stream));
+    stream->encrypt = o_strcmp(u_map_get(request->map_url, "encrypt"), "true") == 0;
+
+    if (stream->encrypt) {
+        u_key_t *key = db_key_new(arena);
+        if (TRACED("db.key_get_by_user_id", db_key_get_by_user_id(dbr, user->id, key)) != 1) {
+            free(stream);
+            ulfius_set_string_body_response(response, HTTP_STATUS_CONFLICT, "user has no usable key");
+            log_request(request, response, trace);
+            return U_CALLBACK_CONTINUE;
+        }
+        memcpy(stream->key, key->key, DB_KEY_SIZE);
+        sodium_memzero(key->key, DB_KEY_SIZE);
+    }
+
+    stream->cursor = TRACED("db.passwords_open", db_passwords_open(dbr, user->id));
+    if (stream->cursor == NULL) {
+        callback_export_passwords_stream_free(stream);
+        ulfius_set_string_body_response(response, HTTP_STATUS_INTERNAL_SERVER_ERROR, "failed to export passwords");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+    stream->pass = db_password_new(NULL);
+
+    u_map_put(response->map_header, "Content-Type", "application/x-ndjson");
+    if (ulfius_set_stream_response(response, HTTP_STATUS_OK, callback_export_passwords_stream, callback_export_passwords_stream_free,
+            U_STREAM_SIZE_UNKOWN, EXPORT_STREAM_CHUNK, stream) != U_OK) {
+        s_log(LOG_ERROR, s_log_string("msg", "error ulfius_set_stream_response"));
+        callback_export_passwords_stream_free(stream);
+    }
+
+    log_request(request, response, trace);
+    return U_CALLBACK_CONTINUE;
+}
+
+/**
+ * import_error rolls back the pending batch and reports the line
+ * the import stopped at along with how many entries were
+ * committed before it.
+ */
+static int
+import_error(const struct _u_request *request, struct _u_response *response, trace_t *trace,
+             size_t imported, size_t line, const char *msg)
+{
+    json_t *json_body = json_pack("{s:I, s:I, s:s}",
+        "imported", (json_int_t)(imported - imported % import_batch_size),
+        "line", (json_int_t)line,
+        "error", msg);
+    set_json_body_response(response, HTTP_STATUS_BAD_REQUEST, json_body);
+    json_decref(json_body);
+
+    log_request(request, response, trace);
+    return U_CALLBACK_CONTINUE;
+}
+
+/**
+ * import_entry is an imported entry waiting for its batch to be
+ * committed before it's announced.
+ */
+struct import_entry {
+    char *name;
+    const char *operation;
+};
+
+static void
+import_publish(const long user_id, const struct import_entry *entries, const size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        events_publish(user_id, entries[i].name, entries[i].operation);
+        search_add(user_id, entries[i].name);
+    }
+}
+
+/**
+ * callback_import_passwords reads newline delimited JSON as
+ * written by the export endpoint, one line at a time, and writes
+ * the entries in transactions of IMPORT_BATCH_SIZE rows. Entries
+ * with a name the user already has replace the existing one.
+ */
+static int
+callback_import_passwords(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+    trace_t *trace = request_trace(response);
+    arena_t *arena = request_arena(response);
+
+    user_t *user = auth_user(request, arena);
+    if (user == NULL) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_UNAUTHORIZED, "error authentication");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    db_password_batch_t *batch = db_password_batch_new(dbr, user->id, import_batch_size);
+    if (batch == NULL) {
+        s_log(LOG_ERROR, s_log_string("msg", db_get_error(dbr)));
+        ulfius_set_string_body_response(response, HTTP_STATUS_INTERNAL_SERVER_ERROR, "failed to import passwords");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    u_key_t *key = NULL;
+    const char *body = (const char *)request->binary_body;
+    const char *end = body + request->binary_body_length;
+    size_t imported = 0;
+    size_t line_no = 0;
+    const char *error_msg = NULL;
+
+    // watchers and the search index only hear about entries once
+    // the batch they're in has been committed.
+    struct import_entry *written = arena_alloc(arena, sizeof(struct import_entry)*import_batch_size);
+    size_t pending = 0;
+
+    int span = trace_span_begin("db.password_import");
+    while (error_msg == NULL && body != NULL && body < end) {
+        const char *eol = memchr(body, '\n', end - body);
+        size_t len = (eol != NULL ? eol : end) - body;
+        const char *line = body;
+        body += len + 1;
+        line_no++;
+
+        if (len == 0 || (len == 1 && line[0] == '\r')) {
+            continue;
+        }
+
+        json_error_t error;
+        json_t *json_line = json_loadb(line, len, 0, &error);
+        if (json_line == NULL) {
+            error_msg = arena_strdup(arena, error.text);
+            break;
+        }
+
+        json_t *json_entry = json_line;
+        if (json_object_get(json_line, "ciphertext") != NULL) {
+            if (key == NULL) {
+                key = db_key_new(arena);
+                if (TRACED("db.key_get_by_user_id", db_key_get_by_user_id(dbr, user->id, key)) != 1) {
+                    json_decref(json_line);
+                    error_msg = "user has no usable key";
+                    break;
                 }
             }
-            } else {
-                if (((struct static_file_config *)user_data)->redirect_on_404 == NULL) {
-                    ulfius_set_string_body_response(response, 404, "file not found");
-                } else {
-                    ulfius_add_header_to_response(response, "Location", ((struct static_file_config *)user_data)->redirect_on_404);
-                    response->status = 302;
-                }
+
+            json_entry = open_line((const unsigned char *)key->key, json_line);
+            json_decref(json_line);
+            if (json_entry == NULL) {
+                error_msg = "unable to decrypt entry";
+                break;
             }
+        }
 
-            free(file_path);
-            free(url_dup_save);
-            free(real_path); // realpath uses malloc
+        const char *name = json_string_value(json_object_get(json_entry, "name"));
+        const char *username = json_string_value(json_object_get(json_entry, "username"));
+        const char *password = json_string_value(json_object_get(json_entry, "password"));
+        if (name == NULL || username == NULL || password == NULL) {
+            json_decref(json_entry);
+            error_msg = "name, username and password are required";
+            break;
+        }
+
+        int res = db_password_batch_add(batch, name, username, password);
+        if (res < 0) {
+            s_log(LOG_ERROR, s_log_string("msg", db_get_error(dbr)));
+            json_decref(json_entry);
+            error_msg = "failed to write entry";
+            break;
+        }
+        written[pending].name = arena_strdup(arena, name);
+        written[pending].operation = res == 1 ? EVENT_OP_CREATE : EVENT_OP_UPDATE;
+        pending++;
+        imported++;
+
+        // the batch commits itself once it's full
+        if (pending == import_batch_size) {
+            import_publish(user->id, written, pending);
+            pending = 0;
+        }
+
+        json_decref(json_entry);
+    }
+
+    if (error_msg == NULL && db_password_batch_commit(batch) != 0) {
+        s_log(LOG_ERROR, s_log_string("msg", db_get_error(dbr)));
+        error_msg = "failed to commit entries";
+    }
+    if (error_msg == NULL) {
+        import_publish(user->id, written, pending);
+    }
+    db_password_batch_free(batch);
+    trace_span_end(span);
+
+    if (key != NULL) {
+        sodium_memzero(key->key, DB_KEY_SIZE);
+    }
+
+    if (error_msg != NULL) {
+        return import_error(request, response, trace, imported, line_no, error_msg);
+    }
+
+    json_t *json_body = json_pack("{s:I}", "imported", (json_int_t)imported);
+    set_json_body_response(response, HTTP_STATUS_OK, json_body);
+    json_decref(json_body);
+
+    log_request(request, response, trace);
+    return U_CALLBACK_CONTINUE;
+}
+
+/**
+ * attachment_key_get reads the user's key into key. Returns -1
+ * and sets the response if the user doesn't have one.
+ */
+static int
+attachment_key_get(const user_t *user, arena_t *arena, struct _u_response *response, unsigned char key[DB_KEY_SIZE])
+{
+    u_key_t *u_key = db_key_new(arena);
+    if (TRACED("db.key_get_by_user_id", db_key_get_by_user_id(dbr, user->id, u_key)) != 1) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_CONFLICT, "user has no usable key");
+        return -1;
+    }
+    memcpy(key, u_key->key, DB_KEY_SIZE);
+    sodium_memzero(u_key->key, DB_KEY_SIZE);
+
+    return 0;
+}
+
+/**
+ * callback_put_attachment stores the request body, such as a
+ * certificate or keystore, encrypted under the given name.
+ */
+static int
+callback_put_attachment(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+    trace_t *trace = request_trace(response);
+    arena_t *arena = request_arena(response);
+
+    user_t *user = auth_user(request, arena);
+    if (user == NULL) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_UNAUTHORIZED, "error authentication");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    const char *name = u_map_get(request->map_url, "name");
+    if (!attachment_name_valid(name)) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_BAD_REQUEST,
+            "name must be up to " STR(ATTACHMENT_MAX_NAME) " letters, digits, dots, dashes or underscores");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    if (request->binary_body_length > attachment_max_size) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_REQUEST_ENTITY_TOO_LARGE, "attachment too large");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    unsigned char key[DB_KEY_SIZE];
+    if (attachment_key_get(user, arena, response, key) != 0) {
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    int span = trace_span_begin("attachment.save");
+    int res = attachment_save(user->id, name, key, (const unsigned char *)request->binary_body, request->binary_body_length);
+    trace_span_end(span);
+    sodium_memzero(key, sizeof(key));
+
+    if (res != 0) {
+        s_log(LOG_ERROR, s_log_string("msg", "unable to save attachment"), s_log_string("error", strerror(errno)));
+        ulfius_set_string_body_response(response, HTTP_STATUS_INTERNAL_SERVER_ERROR, "failed to save attachment");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    json_t *json_body = json_pack("{s:s, s:I}",
+        "name", name,
+        "size", (json_int_t)request->binary_body_length);
+    set_json_body_response(response, HTTP_STATUS_OK, json_body);
+    json_decref(json_body);
+
+    log_request(request, response, trace);
+    return U_CALLBACK_CONTINUE;
+}
+
+/**
+ * callback_get_attachment_stream decrypts the next part of the
+ * attachment into MHD's buffer.
+ */
+static ssize_t
+callback_get_attachment_stream(void *cls, uint64_t pos, char *buf, size_t max)
+{
+    ssize_t n = attachment_read((attachment_t *)cls, buf, max);
+    if (n < 0) {
+        s_log(LOG_ERROR, s_log_string("msg", "attachment failed to authenticate"));
+        return U_STREAM_ERROR;
+    }
+    if (n == 0) {
+        return U_STREAM_END;
+    }
+
+    return n;
+}
+
+static void
+callback_get_attachment_stream_free(void *cls)
+{
+    attachment_close((attachment_t *)cls);
+}
 
+/**
+ * callback_get_attachment streams the named attachment back
+ * decrypted, a chunk at a time from the mapped file, so large
+ * ones don't need to fit in memory.
+ */
+static int
+callback_get_attachment(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+    trace_t *trace = request_trace(response);
+    arena_t *arena = request_arena(response);
+
+    user_t *user = auth_user(request, arena);
+    if (user == NULL) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_UNAUTHORIZED, "error authentication");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    const char *name = u_map_get(request->map_url, "name");
+    if (!attachment_name_valid(name)) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_NOT_FOUND, ULFIUS_HTTP_NOT_FOUND_BODY);
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    unsigned char key[DB_KEY_SIZE];
+    if (attachment_key_get(user, arena, response, key) != 0) {
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    attachment_t *attachment = attachment_open(user->id, name, key);
+    sodium_memzero(key, sizeof(key));
+    if (attachment == NULL) {
+        if (errno == ENOENT) {
+            ulfius_set_string_body_response(response, HTTP_STATUS_NOT_FOUND, ULFIUS_HTTP_NOT_FOUND_BODY);
+        } else {
+            s_log(LOG_ERROR, s_log_string("msg", "unable to open attachment"), s_log_string("error", strerror(errno)));
+            ulfius_set_string_body_response(response, HTTP_STATUS_INTERNAL_SERVER_ERROR, "failed to open attachment");
+        }
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    u_map_put(response->map_header, "Content-Type", "application/octet-stream");
+    u_map_put(response->map_header, "Cache-Control", "no-store");
+    if (ulfius_set_stream_response(response, HTTP_STATUS_OK, callback_get_attachment_stream, callback_get_attachment_stream_free,
+            attachment_size(attachment), STREAM_CHUNK_SIZE, attachment) != U_OK) {
+        s_log(LOG_ERROR, s_log_string("msg", "error ulfius_set_stream_response"));
+        attachment_close(attachment);
+    }
+
+    log_request(request, response, trace);
+    return U_CALLBACK_CONTINUE;
+}
+
+/**
+ * callback_delete_attachment removes the named attachment.
+ */
+static int
+callback_delete_attachment(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+    trace_t *trace = request_trace(response);
+    arena_t *arena = request_arena(response);
+
+    user_t *user = auth_user(request, arena);
+    if (user == NULL) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_UNAUTHORIZED, "error authentication");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    const char *name = u_map_get(request->map_url, "name");
+    if (!attachment_name_valid(name) || attachment_delete(user->id, name) != 0) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_NOT_FOUND, ULFIUS_HTTP_NOT_FOUND_BODY);
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    response->status = HTTP_STATUS_NO_CONTENT;
+
+    log_request(request, response, trace);
+    return U_CALLBACK_CONTINUE;
+}
+
+#ifndef U_DISABLE_WEBSOCKET
+/**
+ * websocket_watch_manager pushes the subscriber's change events to
+ * the client until the connection is closed. A client that falls
+ * behind is sent a resync message and should re-fetch its passwords.
+ */
+static void
+websocket_watch_manager(const struct _u_request *request, struct _websocket_manager *websocket_manager, void *user_data)
+{
+    event_subscriber_t *sub = (event_subscriber_t *)user_data;
+    event_t ev;
+
+    while (ulfius_websocket_status(websocket_manager) == U_WEBSOCKET_STATUS_OPEN) {
+        int res = events_next(sub, &ev, WATCH_POLL_INTERVAL_MS);
+        if (res == 0) {
+            continue;
+        }
+
+        json_t *json_event;
+        if (res < 0) {
+            json_event = json_pack("{s:s}", "operation", "resync");
+        } else {
+            json_event = json_pack("{s:I, s:s, s:s}",
+                "version", (json_int_t)ev.version,
+                "name", ev.name,
+                "operation", ev.operation);
+        }
+
+        char *msg = json_dumps(json_event, JSON_COMPACT);
+        if (ulfius_websocket_send_message(websocket_manager, U_WEBSOCKET_OPCODE_TEXT, strlen(msg), msg) != U_OK) {
+            free(msg);
+            json_decref(json_event);
+            break;
+        }
+
+        free(msg);
+        json_decref(json_event);
+    }
+}
+
+/**
+ * websocket_watch_onclose releases the subscriber once the
+ * websocket is gone.
+ */
+static void
+websocket_watch_onclose(const struct _u_request *request, struct _websocket_manager *websocket_manager, void *user_data)
+{
+    events_unsubscribe((event_subscriber_t *)user_data);
+}
+
+/**
+ * callback_watch_passwords upgrades the connection to a websocket
+ * that streams change events for the authenticated user's passwords.
+ */
+static int
+callback_watch_passwords(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+    trace_t *trace = request_trace(response);
+
+    user_t *user = auth_user(request, request_arena(response));
+    if (user == NULL) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_UNAUTHORIZED, "error authentication");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    event_subscriber_t *sub = events_subscribe(user->id);
+    if (sub == NULL) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_INTERNAL_SERVER_ERROR, "failed to subscribe");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    if (ulfius_set_websocket_response(response, NULL, NULL,
+            &websocket_watch_manager, sub,
+            NULL, NULL,
+            &websocket_watch_onclose, sub) != U_OK) {
+        events_unsubscribe(sub);
+        ulfius_set_string_body_response(response, HTTP_STATUS_INTERNAL_SERVER_ERROR, "failed to open websocket");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    log_request(request, response, trace);
+    return U_CALLBACK_CONTINUE;
+}
+#endif
+
+/**
+ * callback_metrics reports the counters of the service's
+ * internal queues. Only available to the admin.
+ */
+static int
+callback_metrics(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+    trace_t *trace = request_trace(response);
+
+    if (!auth_admin(request, request_arena(response))) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_UNAUTHORIZED, "error authentication");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    pool_stats_t hash_stats;
+    pool_get_stats(hash_pool, &hash_stats);
+
+    pool_stats_t crypto_stats;
+    pool_get_stats(crypto_pool, &crypto_stats);
+
+    db_cache_stats_t user_cache_stats;
+    db_user_cache_stats(dbr, &user_cache_stats);
+
+    json_t *json_body = json_pack("{s:{s:I, s:I, s:I, s:I, s:I, s:I}, s:{s:I, s:I, s:I, s:I, s:I, s:I}, s:{s:I}, s:{s:I}, s:{s:I, s:I, s:I}}",
+        "hash_pool",
+            "threads", (json_int_t)hash_stats.threads,
+            "queue_size", (json_int_t)hash_stats.queue_size,
+            "queued", (json_int_t)hash_stats.queued,
+            "active", (json_int_t)hash_stats.active,
+            "completed", (json_int_t)hash_stats.completed,
+            "rejected", (json_int_t)hash_stats.rejected,
+        "crypto_pool",
+            "threads", (json_int_t)crypto_stats.threads,
+            "queue_size", (json_int_t)crypto_stats.queue_size,
+            "queued", (json_int_t)crypto_stats.queued,
+            "active", (json_int_t)crypto_stats.active,
+            "completed", (json_int_t)crypto_stats.completed,
+            "rejected", (json_int_t)crypto_stats.rejected,
+        "events",
+            "dropped", (json_int_t)events_dropped(),
+        "log",
+            "dropped", (json_int_t)s_log_dropped(),
+        "user_cache",
+            "size", (json_int_t)user_cache_stats.size,
+            "hits", (json_int_t)user_cache_stats.hits,
+            "misses", (json_int_t)user_cache_stats.misses);
+    set_json_body_response(response, HTTP_STATUS_OK, json_body);
+    json_decref(json_body);
+
+    log_request(request, response, trace);
+    return U_CALLBACK_CONTINUE;
+}
+
+/**
+ * callback_log_level reports the lowest level the server logs
+ * and, given a level in the body, changes it. Only available
+ * to the admin.
+ */
+static int
+callback_log_level(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+    trace_t *trace = request_trace(response);
+
+    if (!auth_admin(request, request_arena(response))) {
+        ulfius_set_string_body_response(response, HTTP_STATUS_UNAUTHORIZED, "error authentication");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    if (strcmp(request->http_verb, HTTP_METHOD_PUT) == 0) {
+        json_error_t error;
+        json_t *json_request = ulfius_get_json_body_request(request, &error);
+        int level = s_log_level_parse(json_string_value(json_object_get(json_request, "level")));
+        json_decref(json_request);
+
+        if (level < 0) {
+            ulfius_set_string_body_response(response, HTTP_STATUS_BAD_REQUEST, "level must be one of trace, debug, info, warn, error or fatal");
+            log_request(request, response, trace);
             return U_CALLBACK_CONTINUE;
-    } else {
-        s_log(LOG_ERROR, s_log_string("msg", "user_data is NULL or inconsistent"));
+        }
+
+        int previous = s_log_get_level();
+        s_log_set_level(level);
+        s_log(LOG_WARN, s_log_string("msg", "log level changed"),
+            s_log_string("from", s_log_level_name(previous)),
+            s_log_string("to", s_log_level_name(level)));
+    }
+
+    json_t *json_body = json_pack("{s:s, s:s}",
+        "level", s_log_level_name(s_log_get_level()),
+        "min_level", s_log_level_name(S_LOG_MIN_LEVEL));
+    set_json_body_response(response, HTTP_STATUS_OK, json_body);
+    json_decref(json_body);
+
+    log_request(request, response, trace);
+    return U_CALLBACK_CONTINUE;
+}
+
+static int
+callback_login(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+    trace_t *trace = request_trace(response);
+    arena_t *arena = request_arena(response);
+
+    json_error_t error;
+    json_t *json_new_user_request = ulfius_get_json_body_request(request, &error);
+    const char *username = json_string_value(json_object_get(json_new_user_request, "username"));
+    const char *password = json_string_value(json_object_get(json_new_user_request, "password"));
+    if (strcmp(error.text, "") != 0) {
+        s_log(LOG_ERROR, s_log_string("msg", error.text));
+        json_decref(json_new_user_request);
+        ulfius_set_string_body_response(response, HTTP_STATUS_BAD_REQUEST, "");
+        log_request(request, response, trace);
         return U_CALLBACK_ERROR;
     }
+
+    user_t *user = db_user_new(arena);
+    if (username == NULL || password == NULL || TRACED("db.user_get_by_username", db_user_get_by_username(dbr, username, user)) != 1) {
+        json_decref(json_new_user_request);
+        response->status = HTTP_STATUS_UNAUTHORIZED;
+        log_request(request, response, trace);
+        return U_CALLBACK_UNAUTHORIZED;
+    }
+
+    struct hash_job job = {
+        .password = password,
+        .hash = user->password,
+        .verify = true,
+    };
+
+    // accounts created before argon2id still carry a MySQL
+    // PASSWORD() hash. Check those with the database once and
+    // rehash them below.
+    if (strncmp(user->password, crypto_pwhash_argon2id_STRPREFIX, strlen(crypto_pwhash_argon2id_STRPREFIX)) != 0) {
+        job.verify = false;
+        job.verified = TRACED("db.user_get_token", db_user_get_token(dbr, username, password, user)) == 1;
+    }
+
+    if ((job.verify || job.verified) && TRACED("crypto.argon2id", pool_run(hash_pool, hash_task, &job)) != 0) {
+        json_decref(json_new_user_request);
+        ulfius_set_string_body_response(response, HTTP_STATUS_SERVICE_UNAVAILABLE, "too many pending requests");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    if (!job.verified) {
+        json_decref(json_new_user_request);
+        response->status = HTTP_STATUS_UNAUTHORIZED;
+        log_request(request, response, trace);
+        return U_CALLBACK_UNAUTHORIZED;
+    }
+
+    if (job.rehashed && TRACED("db.user_set_password", db_user_set_password(dbr, user->id, job.new_hash)) != 0) {
+        s_log(LOG_WARN, s_log_string("msg", "unable to store rehashed password"), s_log_string("error", db_get_error(dbr)));
+    }
+    
+    json_t *json_body = json_pack("{s:s}", "token", user->token);
+
+    set_json_body_response(response, HTTP_STATUS_OK, json_body);
+
+    json_decref(json_new_user_request);
+    json_decref(json_body);
+
+    log_request(request, response, trace);
+    return U_CALLBACK_CONTINUE;
+}
+
+#define STATIC_STREAM_CHUNK (64 * 1024)
+
+/**
+ * static_stream holds what's needed to stream a large asset
+ * from its already open descriptor.
+ */
+struct static_stream {
+    asset_table_t *table;
+    int fd;
+};
+
+/**
+ * callback_static_file_stream reads the next chunk of a large
+ * asset straight from its descriptor at the given offset.
+ */
+static ssize_t
+callback_static_file_stream(void *cls, uint64_t pos, char *buf, size_t max)
+{
+    struct static_stream *stream = (struct static_stream *)cls;
+
+    ssize_t n = pread(stream->fd, buf, max, (off_t)pos);
+    if (n < 0) {
+        return U_STREAM_ERROR;
+    }
+    if (n == 0) {
+        return U_STREAM_END;
+    }
+
+    return n;
+}
+
+/**
+ * callback_static_file_stream_free gives back the table reference
+ * held for the lifetime of the stream.
+ */
+static void
+callback_static_file_stream_free(void *cls)
+{
+    struct static_stream *stream = (struct static_stream *)cls;
+
+    assets_release(stream->table);
+    free(stream);
+}
+
+/**
+ * accepts_encoding checks the request's Accept-Encoding header
+ * for the given encoding.
+ */
+static bool
+accepts_encoding(const struct _u_request *request, const char *encoding)
+{
+    const char *accept = u_map_get_case(request->map_header, "Accept-Encoding");
+
+    return accept != NULL && strstr(accept, encoding) != NULL;
+}
+
+/**
+ * callback_static_file serves files under app/ from the in-memory
+ * asset table. Precompressed variants are used when the client
+ * accepts them and large files are streamed from an open descriptor.
+ */
+static int
+callback_static_file(const struct _u_request *request, struct _u_response *response, void *user_data)
+{
+    trace_t *trace = request_trace(response);
+
+    char path[PATH_MAX];
+    const char *requested = request->url_path + strlen(STATIC_PATH);
+    while (requested[0] == '/') {
+        requested++;
+    }
+
+    size_t len = strcspn(requested, "?#");
+    if (len == 0) {
+        snprintf(path, sizeof(path), "index.html");
+    } else if (requested[len-1] == '/') {
+        snprintf(path, sizeof(path), "%.*sindex.html", (int)len, requested);
+    } else {
+        snprintf(path, sizeof(path), "%.*s", (int)len, requested);
+    }
+
+    asset_table_t *table = assets_acquire();
+    const asset_t *asset = assets_get(table, path);
+    if (asset == NULL) {
+        assets_release(table);
+        ulfius_set_string_body_response(response, HTTP_STATUS_NOT_FOUND, "file not found");
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    u_map_put(response->map_header, "ETag", asset->etag);
+    u_map_put(response->map_header, "Vary", "Accept-Encoding");
+
+    const char *if_none_match = u_map_get_case(request->map_header, "If-None-Match");
+    if (if_none_match != NULL && strcmp(if_none_match, asset->etag) == 0) {
+        assets_release(table);
+        response->status = HTTP_STATUS_NOT_MODIFIED;
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    u_map_put(response->map_header, "Content-Type", asset->content_type);
+
+    if (asset->data == NULL) {
+        struct static_stream *stream = malloc(sizeof(struct static_stream));
+        stream->table = table;
+        stream->fd = asset->fd;
+
+        if (ulfius_set_stream_response(response, HTTP_STATUS_OK, callback_static_file_stream, callback_static_file_stream_free, asset->size, STATIC_STREAM_CHUNK, stream) != U_OK) {
+            s_log(LOG_ERROR, s_log_string("msg", "error ulfius_set_stream_response"));
+            callback_static_file_stream_free(stream);
+        }
+
+        log_request(request, response, trace);
+        return U_CALLBACK_CONTINUE;
+    }
+
+    if (asset->br != NULL && accepts_encoding(request, "br")) {
+        u_map_put(response->map_header, "Content-Encoding", "br");
+        ulfius_set_binary_body_response(response, HTTP_STATUS_OK, (const char *)asset->br, asset->br_size);
+    } else if (asset->gzip != NULL && accepts_encoding(request, "gzip")) {
+        u_map_put(response->map_header, "Content-Encoding", "gzip");
+        ulfius_set_binary_body_response(response, HTTP_STATUS_OK, (const char *)asset->gzip, asset->gzip_size);
+    } else {
+        ulfius_set_binary_body_response(response, HTTP_STATUS_OK, (const char *)asset->data, asset->size);
+    }
+    assets_release(table);
+
+    log_request(request, response, trace);
+    return U_CALLBACK_CONTINUE;
 }
 
 int
@@ -602,28 +2095,72 @@ api_init(db_t *db)
 {
     dbr = db;
 
-    if (ulfius_init_instance(&instance, DEFAULT_PORT, NULL, NULL) != U_OK) {
+    const char *queue_size = getenv("EVENTS_QUEUE_SIZE");
+    events_init(queue_size != NULL ? strtoul(queue_size, NULL, 10) : DEFAULT_EVENTS_QUEUE_SIZE);
+
+    const char *port = getenv("HTTP_PORT");
+    if (ulfius_init_instance(&instance, port != NULL ? atoi(port) : DEFAULT_PORT, NULL, NULL) != U_OK) {
         fprintf(stderr, "error ulfius_init_instance, abort\n");
         return EXIT_FAILURE;
     }
 
-    struct static_file_config config;
+    const char *hash_workers = getenv("HASH_WORKERS");
+    const char *hash_queue_size = getenv("HASH_QUEUE_SIZE");
+    hash_pool = pool_new(hash_workers != NULL ? strtoul(hash_workers, NULL, 10) : DEFAULT_HASH_WORKERS,
+        hash_queue_size != NULL ? strtoul(hash_queue_size, NULL, 10) : DEFAULT_HASH_QUEUE_SIZE);
+    if (hash_pool == NULL) {
+        fprintf(stderr, "error: unable to start hash pool, HASH_WORKERS must be at least 1\n");
+        ulfius_clean_instance(&instance);
+        return EXIT_FAILURE;
+    }
+
+    const char *crypto_workers = getenv("CRYPTO_WORKERS");
+    const char *crypto_queue_size = getenv("CRYPTO_QUEUE_SIZE");
+    crypto_pool = pool_new(crypto_workers != NULL ? strtoul(crypto_workers, NULL, 10) : DEFAULT_CRYPTO_WORKERS,
+        crypto_queue_size != NULL ? strtoul(crypto_queue_size, NULL, 10) : DEFAULT_CRYPTO_QUEUE_SIZE);
+    if (crypto_pool == NULL) {
+        fprintf(stderr, "error: unable to start crypto pool, CRYPTO_WORKERS must be at least 1\n");
+        pool_free(hash_pool);
+        hash_pool = NULL;
+        ulfius_clean_instance(&instance);
+        return EXIT_FAILURE;
+    }
+    db_set_crypto_pool(dbr, crypto_pool);
+
+    const char *search_max_users = getenv("SEARCH_MAX_USERS");
+    const char *search_index_ttl = getenv("SEARCH_INDEX_TTL");
+    search_init(search_max_users != NULL ? strtoul(search_max_users, NULL, 10) : DEFAULT_SEARCH_MAX_USERS,
+        search_index_ttl != NULL ? strtoul(search_index_ttl, NULL, 10) : DEFAULT_SEARCH_INDEX_TTL);
+
+    const char *batch_size = getenv("IMPORT_BATCH_SIZE");
+    if (batch_size != NULL && strtoul(batch_size, NULL, 10) > 0) {
+        import_batch_size = strtoul(batch_size, NULL, 10);
+    }
+
+    const char *sample_rules = getenv("LOG_SAMPLE_RULES");
+    const char *sample_slow_ms = getenv("LOG_SAMPLE_SLOW_MS");
+    if (sample_init(sample_rules != NULL ? sample_rules : DEFAULT_LOG_SAMPLE_RULES,
+        (sample_slow_ms != NULL ? strtoull(sample_slow_ms, NULL, 10) : DEFAULT_LOG_SAMPLE_SLOW_MS) * 1000000) != 0) {
+        s_log(LOG_WARN, s_log_string("msg", "ignoring invalid log sample rules"));
+    }
 
-    // Add mime types
-    u_map_put(config.mime_types, "*", "application/octet-stream");
-    u_map_put(config.mime_types, ".html", "text/html");
-    u_map_put(config.mime_types, ".css", "text/css");
-    u_map_put(config.mime_types, ".js", "application/javascript");
-    u_map_put(config.mime_types, ".json", "application/json");
-    u_map_put(config.mime_types, ".png", "image/png");
-    u_map_put(config.mime_types, ".gif", "image/gif");
-    u_map_put(config.mime_types, ".jpeg", "image/jpeg");
-    u_map_put(config.mime_types, ".jpg", "image/jpeg");
-    u_map_put(config.mime_types, ".ttf", "font/ttf");
-    u_map_put(config.mime_types, ".woff", "font/woff");
-    u_map_put(config.mime_types, ".ico", "image/x-icon");
+    const char *attachment_dir = getenv("ATTACHMENT_DIR");
+    if (attachment_init(attachment_dir != NULL ? attachment_dir : DEFAULT_ATTACHMENT_DIR) != 0) {
+        s_log(LOG_WARN, s_log_string("msg", "unable to create attachment directory"));
+    }
 
-    // ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_GET, NULL, "*", 0, &callback_static_file, &config);
+    const char *attachment_max = getenv("ATTACHMENT_MAX_SIZE");
+    if (attachment_max != NULL && strtoull(attachment_max, NULL, 10) > 0) {
+        attachment_max_size = strtoull(attachment_max, NULL, 10);
+    }
+
+    const char *static_dir = getenv("STATIC_DIR");
+    if (assets_init(static_dir != NULL ? static_dir : DEFAULT_STATIC_DIR) != 0) {
+        s_log(LOG_WARN, s_log_string("msg", "unable to load static files"));
+    }
+
+    ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_GET, STATIC_PATH, NULL, 0, &callback_static_file, NULL);
+    ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_GET, STATIC_PATH, "*", 0, &callback_static_file, NULL);
 
     ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_GET, HEALTH_PATH, NULL, 0, &callback_health, NULL);
 
@@ -633,28 +2170,94 @@ api_init(db_t *db)
     ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_GET, API_PATH, USER_KEY_PATH, 0, &callback_get_user_key, NULL);
     ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_GET, API_PATH, USERS_PATH, 0, &callback_get_users, NULL);
     ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_GET, API_PATH, USER_BY_ID_PATH, 0, &callback_get_user_by_id, NULL);
+    ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_GET, API_PATH, METRICS_PATH, 0, &callback_metrics, NULL);
+    ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_GET, API_PATH, LOG_LEVEL_PATH, 0, &callback_log_level, NULL);
+    ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_PUT, API_PATH, LOG_LEVEL_PATH, 0, &callback_log_level, NULL);
 
     //ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_POST, API_PATH, PASSWORD_PATH, 0, &callback_auth_token, NULL);
     ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_POST, API_PATH, PASSWORD_PATH, 0, &callback_new_password, NULL);
+    ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_POST, API_PATH, PASSWORD_CHECK_PATH, 0, &callback_check_passwords, NULL);
+    ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_GET, API_PATH, GENERATE_PATH, 0, &callback_generate_passwords, NULL);
     ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_GET, API_PATH, PASSWORD_BY_NAME_PATH, 0, &callback_get_password, NULL);
     ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_GET, API_PATH, PASSWORDS_PATH, 0, &callback_get_passwords, NULL);
+    ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_POST, API_PATH, PASSWORDS_BATCH_GET_PATH, 0, &callback_batch_get_passwords, NULL);
+    ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_GET, API_PATH, PASSWORDS_SEARCH_PATH, 0, &callback_search_passwords, NULL);
+    ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_GET, API_PATH, PASSWORDS_EXPORT_PATH, 0, &callback_export_passwords, NULL);
+    ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_POST, API_PATH, PASSWORDS_IMPORT_PATH, 0, &callback_import_passwords, NULL);
+    ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_PUT, API_PATH, ATTACHMENT_BY_NAME_PATH, 0, &callback_put_attachment, NULL);
+    ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_GET, API_PATH, ATTACHMENT_BY_NAME_PATH, 0, &callback_get_attachment, NULL);
+    ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_DELETE, API_PATH, ATTACHMENT_BY_NAME_PATH, 0, &callback_delete_attachment, NULL);
+#ifndef U_DISABLE_WEBSOCKET
+    ulfius_add_endpoint_by_val(&instance, HTTP_METHOD_GET, API_PATH, PASSWORDS_WATCH_PATH, 0, &callback_watch_passwords, NULL);
+#endif
 
     ulfius_set_default_endpoint(&instance, &callback_default, NULL);
 
     return 0;
 }
 
+/**
+ * api_drain stops accepting new connections and waits for the
+ * in-flight ones to finish, up to the given number of seconds.
+ */
+static void
+api_drain(const int timeout)
+{
+    MHD_socket listen_fd = MHD_quiesce_daemon(instance.mhd_daemon);
+    if (listen_fd >= 0) {
+        close(listen_fd);
+    }
+
+    for (int waited = 0; waited < timeout * 10; waited++) {
+        const union MHD_DaemonInfo *info = MHD_get_daemon_info(instance.mhd_daemon, MHD_DAEMON_INFO_CURRENT_CONNECTIONS);
+        if (info == NULL || info->num_connections == 0) {
+            return;
+        }
+        usleep(100000);
+    }
+
+    s_log(LOG_WARN, s_log_string("msg", "drain timed out, closing remaining connections"));
+}
+
 void
 api_start()
 {
-    if (ulfius_start_framework(&instance) == U_OK) {
-        s_log(LOG_INFO, s_log_string("msg", "initializing database"), s_log_int("port", instance.port));
-
-        getchar();
-    } else {
+    // SO_REUSEPORT lets every worker bind the same port and
+    // have the kernel spread new connections across them.
+    struct MHD_OptionItem mhd_ops[] = {
+        {MHD_OPTION_NOTIFY_COMPLETED, (intptr_t)mhd_request_completed, NULL},
+        {MHD_OPTION_URI_LOG_CALLBACK, (intptr_t)ulfius_uri_logger, NULL},
+        {MHD_OPTION_CONNECTION_TIMEOUT, instance.timeout, NULL},
+        {MHD_OPTION_LISTENING_ADDRESS_REUSE, 1, NULL},
+        {MHD_OPTION_END, 0, NULL},
+    };
+    unsigned int mhd_flags = MHD_USE_THREAD_PER_CONNECTION | MHD_USE_INTERNAL_POLLING_THREAD | MHD_USE_ITC | MHD_USE_ERROR_LOG;
+
+    if (ulfius_start_framework_with_mhd_options(&instance, mhd_flags, mhd_ops) != U_OK) {
         s_log(LOG_ERROR, s_log_string("msg", "error starting server"));
+        ulfius_clean_instance(&instance);
+        return;
     }
 
+    s_log(LOG_INFO, s_log_string("msg", "server started"), s_log_int("port", instance.port), s_log_int("pid", getpid()));
+
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+
+    int sig;
+    sigwait(&stop_signals, &sig);
+
+    s_log(LOG_INFO, s_log_string("msg", "draining connections"), s_log_int("signal", sig));
+
+    const char *drain_timeout = getenv("DRAIN_TIMEOUT");
+    api_drain(drain_timeout != NULL ? atoi(drain_timeout) : DEFAULT_DRAIN_TIMEOUT);
+
     ulfius_stop_framework(&instance);
     ulfius_clean_instance(&instance);
+
+    pool_free(hash_pool);
+    db_set_crypto_pool(dbr, NULL);
+    pool_free(crypto_pool);
 }
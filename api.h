@@ -33,6 +33,12 @@
 int
 api_init(db_t *db);
 
+/**
+ * api_start runs the server until SIGINT or SIGTERM is received
+ * and then drains in-flight requests before returning. Both
+ * signals need to be blocked before api_init is called so only
+ * api_start receives them.
+ */
 void
 api_start();
 
@@ -0,0 +1,208 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_DEFAULT_BLOCK_SIZE 8192
+
+#define ALIGN_UP(x) (((x) + (ARENA_ALIGNMENT - 1)) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+/**
+ * arena_block is a chunk of memory allocations are bumped
+ * out of. Blocks are chained so they can all be freed.
+ */
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    unsigned char data[] __attribute__((aligned(ARENA_ALIGNMENT)));
+};
+
+struct arena {
+    struct arena_block *head;
+    size_t block_size;
+};
+
+static struct arena_block*
+arena_block_new(const size_t size)
+{
+    struct arena_block *block = malloc(sizeof(struct arena_block) + size);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+
+    return block;
+}
+
+arena_t*
+arena_new(const size_t block_size)
+{
+    arena_t *arena = malloc(sizeof(arena_t));
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    arena->block_size = block_size > 0 ? block_size : ARENA_DEFAULT_BLOCK_SIZE;
+    arena->head = arena_block_new(arena->block_size);
+    if (arena->head == NULL) {
+        free(arena);
+        return NULL;
+    }
+
+    return arena;
+}
+
+void
+arena_free(arena_t *arena)
+{
+    if (arena == NULL) {
+        return;
+    }
+
+    struct arena_block *block = arena->head;
+    while (block != NULL) {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+
+    free(arena);
+}
+
+void*
+arena_alloc(arena_t *arena, const size_t size)
+{
+    size_t aligned = ALIGN_UP(size > 0 ? size : 1);
+    struct arena_block *block = arena->head;
+
+    if (block->size - block->used < aligned) {
+        // oversized requests get a block of their own that's
+        // chained behind the current one so it keeps filling.
+        if (aligned > arena->block_size / 4) {
+            struct arena_block *big = arena_block_new(aligned);
+            if (big == NULL) {
+                return NULL;
+            }
+            big->used = aligned;
+            big->next = block->next;
+            block->next = big;
+
+            return big->data;
+        }
+
+        block = arena_block_new(arena->block_size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->next = arena->head;
+        arena->head = block;
+    }
+
+    void *ptr = block->data + block->used;
+    block->used += aligned;
+
+    return ptr;
+}
+
+void*
+arena_calloc(arena_t *arena, const size_t count, const size_t size)
+{
+    if (size != 0 && count > SIZE_MAX / size) {
+        return NULL;
+    }
+
+    void *ptr = arena_alloc(arena, count * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, count * size);
+    }
+
+    return ptr;
+}
+
+char*
+arena_strndup(arena_t *arena, const char *s, const size_t n)
+{
+    size_t len = strnlen(s, n);
+
+    char *dst = arena_alloc(arena, len + 1);
+    if (dst == NULL) {
+        return NULL;
+    }
+    memcpy(dst, s, len);
+    dst[len] = '\0';
+
+    return dst;
+}
+
+char*
+arena_strdup(arena_t *arena, const char *s)
+{
+    return arena_strndup(arena, s, strlen(s));
+}
+
+char*
+arena_vsprintf(arena_t *arena, const char *fmt, va_list ap)
+{
+    va_list ap_copy;
+    va_copy(ap_copy, ap);
+    int len = vsnprintf(NULL, 0, fmt, ap_copy);
+    va_end(ap_copy);
+
+    if (len < 0) {
+        return NULL;
+    }
+
+    char *s = arena_alloc(arena, (size_t)len + 1);
+    if (s != NULL) {
+        vsnprintf(s, (size_t)len + 1, fmt, ap);
+    }
+
+    return s;
+}
+
+char*
+arena_sprintf(arena_t *arena, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    char *s = arena_vsprintf(arena, fmt, ap);
+    va_end(ap);
+
+    return s;
+}
@@ -0,0 +1,87 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+typedef struct arena arena_t;
+
+/**
+ * arena_new creates a bump allocator that hands out memory
+ * from blocks of the given size. Everything allocated from
+ * it is released at once with arena_free.
+ */
+arena_t*
+arena_new(const size_t block_size);
+
+/**
+ * arena_free releases every allocation made from the arena
+ * along with the arena itself.
+ */
+void
+arena_free(arena_t *arena);
+
+/**
+ * arena_alloc returns size bytes of uninitialized memory
+ * aligned for any type.
+ */
+void*
+arena_alloc(arena_t *arena, const size_t size);
+
+/**
+ * arena_calloc returns count * size bytes of zeroed memory.
+ */
+void*
+arena_calloc(arena_t *arena, const size_t count, const size_t size);
+
+/**
+ * arena_strdup copies the given string into the arena.
+ */
+char*
+arena_strdup(arena_t *arena, const char *s);
+
+/**
+ * arena_strndup copies at most n bytes of the given string
+ * into the arena and terminates it.
+ */
+char*
+arena_strndup(arena_t *arena, const char *s, const size_t n);
+
+/**
+ * arena_sprintf formats into a string allocated from the
+ * arena.
+ */
+char*
+arena_sprintf(arena_t *arena, const char *fmt, ...);
+
+char*
+arena_vsprintf(arena_t *arena, const char *fmt, va_list ap);
+
+#endif /* _ARENA_H */
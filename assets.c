@@ -0,0 +1,488 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include <sodium.h>
+
+#include "assets.h"
+#include "logger.h"
+
+#define ASSET_MAX_MEMORY_SIZE (1024 * 1024)
+#define ASSET_RELOAD_DELAY_US 100000
+
+/**
+ * mime_types maps file extensions to the content type
+ * the file is served with.
+ */
+static const struct {
+    const char *ext;
+    const char *type;
+} mime_types[] = {
+    {".html", "text/html"},
+    {".css", "text/css"},
+    {".js", "application/javascript"},
+    {".json", "application/json"},
+    {".png", "image/png"},
+    {".gif", "image/gif"},
+    {".jpeg", "image/jpeg"},
+    {".jpg", "image/jpeg"},
+    {".svg", "image/svg+xml"},
+    {".ttf", "font/ttf"},
+    {".woff", "font/woff"},
+    {".woff2", "font/woff2"},
+    {".ico", "image/x-icon"},
+};
+
+#define DEFAULT_MIME_TYPE "application/octet-stream"
+
+/**
+ * asset_table is an open addressed hash table of assets
+ * keyed by their path. Tables are immutable once built and
+ * are freed when the last reference is released.
+ */
+struct asset_table {
+    asset_t *slots;
+    size_t mask;
+    size_t count;
+    char **dirs;
+    size_t dir_count;
+    int refs;
+};
+
+static char *asset_root = NULL;
+static asset_table_t *current = NULL;
+static pthread_mutex_t current_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * hash_path returns the FNV-1a hash of the given path.
+ */
+static uint64_t
+hash_path(const char *path)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    for (; *path != '\0'; path++) {
+        h ^= (unsigned char)*path;
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+static const char*
+mime_type_for(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    if (dot == NULL) {
+        return DEFAULT_MIME_TYPE;
+    }
+
+    for (size_t i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); i++) {
+        if (strcasecmp(dot, mime_types[i].ext) == 0) {
+            return mime_types[i].type;
+        }
+    }
+
+    return DEFAULT_MIME_TYPE;
+}
+
+/**
+ * read_file reads the whole file into a newly allocated
+ * buffer. Returns NULL if the file can't be read.
+ */
+static unsigned char*
+read_file(const char *path, size_t *size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    unsigned char *data = malloc(st.st_size > 0 ? st.st_size : 1);
+    size_t off = 0;
+    while (off < (size_t)st.st_size) {
+        ssize_t n = read(fd, data + off, st.st_size - off);
+        if (n <= 0) {
+            free(data);
+            close(fd);
+            return NULL;
+        }
+        off += n;
+    }
+    close(fd);
+
+    *size = off;
+    return data;
+}
+
+static bool
+has_suffix(const char *s, const char *suffix)
+{
+    size_t s_len = strlen(s);
+    size_t suffix_len = strlen(suffix);
+
+    return s_len >= suffix_len && strcmp(s + s_len - suffix_len, suffix) == 0;
+}
+
+/**
+ * asset_load fills in the asset for the file at the given path
+ * including its ETag and any precompressed .gz and .br siblings.
+ */
+static int
+asset_load(asset_t *asset, const char *full_path, const char *rel_path, const size_t size)
+{
+    memset(asset, 0, sizeof(asset_t));
+    asset->fd = -1;
+
+    unsigned char hash[8];
+    crypto_generichash_state st;
+    crypto_generichash_init(&st, NULL, 0, sizeof(hash));
+
+    if (size <= ASSET_MAX_MEMORY_SIZE) {
+        asset->data = read_file(full_path, &asset->size);
+        if (asset->data == NULL) {
+            return 1;
+        }
+        crypto_generichash_update(&st, asset->data, asset->size);
+    } else {
+        asset->fd = open(full_path, O_RDONLY);
+        if (asset->fd < 0) {
+            return 1;
+        }
+        asset->size = size;
+
+        unsigned char buf[65536];
+        ssize_t n;
+        off_t off = 0;
+        while ((n = pread(asset->fd, buf, sizeof(buf), off)) > 0) {
+            crypto_generichash_update(&st, buf, n);
+            off += n;
+        }
+    }
+    crypto_generichash_final(&st, hash, sizeof(hash));
+
+    asset->etag[0] = '"';
+    sodium_bin2hex(asset->etag + 1, sizeof(asset->etag) - 2, hash, sizeof(hash));
+    asset->etag[17] = '"';
+    asset->etag[18] = '\0';
+
+    asset->path = strdup(rel_path);
+    asset->content_type = mime_type_for(rel_path);
+
+    char variant[PATH_MAX];
+    snprintf(variant, sizeof(variant), "%s.gz", full_path);
+    asset->gzip = read_file(variant, &asset->gzip_size);
+    snprintf(variant, sizeof(variant), "%s.br", full_path);
+    asset->br = read_file(variant, &asset->br_size);
+
+    return 0;
+}
+
+static void
+asset_free(asset_t *asset)
+{
+    free(asset->path);
+    free(asset->data);
+    free(asset->gzip);
+    free(asset->br);
+    if (asset->fd >= 0) {
+        close(asset->fd);
+    }
+}
+
+static void
+table_insert(asset_table_t *table, const asset_t *asset)
+{
+    size_t i = hash_path(asset->path) & table->mask;
+    while (table->slots[i].path != NULL) {
+        i = (i + 1) & table->mask;
+    }
+
+    table->slots[i] = *asset;
+    table->count++;
+}
+
+/**
+ * table_grow doubles the table when it's over half full.
+ */
+static void
+table_grow(asset_table_t *table)
+{
+    if ((table->count + 1) * 2 <= table->mask + 1) {
+        return;
+    }
+
+    asset_t *old = table->slots;
+    size_t old_size = table->mask + 1;
+
+    table->slots = calloc(old_size * 2, sizeof(asset_t));
+    table->mask = (old_size * 2) - 1;
+    table->count = 0;
+
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i].path != NULL) {
+            table_insert(table, &old[i]);
+        }
+    }
+    free(old);
+}
+
+/**
+ * table_walk adds every file under dir to the table. Precompressed
+ * variants are picked up by their source file instead of being
+ * served on their own.
+ */
+static void
+table_walk(asset_table_t *table, const char *dir, const char *rel_dir)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return;
+    }
+
+    table->dirs = realloc(table->dirs, sizeof(char*) * (table->dir_count + 1));
+    table->dirs[table->dir_count++] = strdup(dir);
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+
+        char full_path[PATH_MAX];
+        char rel_path[PATH_MAX];
+        snprintf(full_path, sizeof(full_path), "%s/%s", dir, entry->d_name);
+        if (rel_dir[0] == '\0') {
+            snprintf(rel_path, sizeof(rel_path), "%s", entry->d_name);
+        } else {
+            snprintf(rel_path, sizeof(rel_path), "%s/%s", rel_dir, entry->d_name);
+        }
+
+        struct stat st;
+        if (stat(full_path, &st) != 0) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            table_walk(table, full_path, rel_path);
+            continue;
+        }
+
+        if (!S_ISREG(st.st_mode) || has_suffix(rel_path, ".gz") || has_suffix(rel_path, ".br")) {
+            continue;
+        }
+
+        asset_t asset;
+        if (asset_load(&asset, full_path, rel_path, st.st_size) != 0) {
+            s_log(LOG_WARN, s_log_string("msg", "unable to load static file"), s_log_string("path", full_path));
+            continue;
+        }
+
+        table_grow(table);
+        table_insert(table, &asset);
+    }
+
+    closedir(d);
+}
+
+static asset_table_t*
+table_build(const char *root)
+{
+    asset_table_t *table = calloc(1, sizeof(asset_table_t));
+    table->slots = calloc(16, sizeof(asset_t));
+    table->mask = 15;
+    table->refs = 1;
+
+    table_walk(table, root, "");
+
+    return table;
+}
+
+static void
+table_free(asset_table_t *table)
+{
+    for (size_t i = 0; i <= table->mask; i++) {
+        if (table->slots[i].path != NULL) {
+            asset_free(&table->slots[i]);
+        }
+    }
+
+    for (size_t i = 0; i < table->dir_count; i++) {
+        free(table->dirs[i]);
+    }
+
+    free(table->dirs);
+    free(table->slots);
+    free(table);
+}
+
+/**
+ * assets_swap makes the given table current and drops the
+ * reference held on the previous one.
+ */
+static void
+assets_swap(asset_table_t *table)
+{
+    pthread_mutex_lock(&current_lock);
+    asset_table_t *old = current;
+    current = table;
+    pthread_mutex_unlock(&current_lock);
+
+    if (old != NULL) {
+        assets_release(old);
+    }
+}
+
+#ifdef __linux__
+/**
+ * assets_watch rebuilds the asset table whenever a file under
+ * one of the table's directories is changed.
+ */
+static void*
+assets_watch(void *arg)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        int fd = inotify_init1(IN_CLOEXEC);
+        if (fd < 0) {
+            s_log(LOG_ERROR, s_log_string("msg", "unable to watch static files"));
+            return NULL;
+        }
+
+        asset_table_t *table = assets_acquire();
+        for (size_t i = 0; i < table->dir_count; i++) {
+            inotify_add_watch(fd, table->dirs[i], IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+        }
+        assets_release(table);
+
+        if (read(fd, buf, sizeof(buf)) <= 0) {
+            close(fd);
+            continue;
+        }
+
+        // editors and deploys tend to touch several files at once
+        // so give them a moment before rebuilding.
+        usleep(ASSET_RELOAD_DELAY_US);
+        close(fd);
+
+        assets_swap(table_build(asset_root));
+        s_log(LOG_INFO, s_log_string("msg", "reloaded static files"));
+    }
+
+    return NULL;
+}
+#endif
+
+int
+assets_init(const char *root)
+{
+    asset_root = realpath(root, NULL);
+    if (asset_root == NULL) {
+        return 1;
+    }
+
+    assets_swap(table_build(asset_root));
+
+#ifdef __linux__
+    pthread_t watcher;
+    if (pthread_create(&watcher, NULL, assets_watch, NULL) != 0) {
+        return 1;
+    }
+    pthread_detach(watcher);
+#endif
+
+    return 0;
+}
+
+asset_table_t*
+assets_acquire()
+{
+    pthread_mutex_lock(&current_lock);
+    asset_table_t *table = current;
+    if (table != NULL) {
+        table->refs++;
+    }
+    pthread_mutex_unlock(&current_lock);
+
+    return table;
+}
+
+void
+assets_release(asset_table_t *table)
+{
+    if (table == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&current_lock);
+    int refs = --table->refs;
+    pthread_mutex_unlock(&current_lock);
+
+    if (refs == 0) {
+        table_free(table);
+    }
+}
+
+const asset_t*
+assets_get(const asset_table_t *table, const char *path)
+{
+    if (table == NULL) {
+        return NULL;
+    }
+
+    size_t i = hash_path(path) & table->mask;
+    while (table->slots[i].path != NULL) {
+        if (strcmp(table->slots[i].path, path) == 0) {
+            return &table->slots[i];
+        }
+        i = (i + 1) & table->mask;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,82 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _ASSETS_H
+#define _ASSETS_H
+
+#include <stddef.h>
+
+/**
+ * asset_t is a single static file held by the asset table. Files
+ * up to ASSET_MAX_MEMORY_SIZE are kept in memory, larger ones keep
+ * an open descriptor so they can be streamed without reopening.
+ */
+typedef struct {
+    char *path;
+    const char *content_type;
+    char etag[20];
+    size_t size;
+    unsigned char *data;
+    unsigned char *gzip;
+    size_t gzip_size;
+    unsigned char *br;
+    size_t br_size;
+    int fd;
+} asset_t;
+
+typedef struct asset_table asset_table_t;
+
+/**
+ * assets_init loads every file under the given directory into
+ * the asset table and, on Linux, starts watching the directory
+ * so the table is rebuilt when files change.
+ */
+int
+assets_init(const char *root);
+
+/**
+ * assets_acquire returns a reference to the current asset table.
+ * The reference must be given back with assets_release once the
+ * caller is done with any asset it looked up.
+ */
+asset_table_t*
+assets_acquire();
+
+/**
+ * assets_release drops a reference taken by assets_acquire.
+ */
+void
+assets_release(asset_table_t *table);
+
+/**
+ * assets_get looks up the asset for the given path relative to
+ * the asset root. Returns NULL if there's no such asset.
+ */
+const asset_t*
+assets_get(const asset_table_t *table, const char *path);
+
+#endif /* _ASSETS_H */
@@ -0,0 +1,274 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sodium.h>
+
+#include "attachment.h"
+#include "stream.h"
+
+/**
+ * Attachments are encrypted with a key derived from the user's
+ * key rather than the key itself, so it's never used with two
+ * different ciphers.
+ */
+#define ATTACHMENT_KDF_CONTEXT "hushfile"
+#define ATTACHMENT_KDF_ID 1
+
+struct attachment {
+    void *map;
+    size_t map_size;
+    size_t size;
+    stream_pull_t pull;
+    unsigned char plain[STREAM_CHUNK_SIZE];
+    size_t plain_len;
+    size_t plain_pos;
+};
+
+static char attachment_dir[PATH_MAX];
+
+int
+attachment_init(const char *dir)
+{
+    if (strlen(dir) >= sizeof(attachment_dir) - ATTACHMENT_MAX_NAME - 32) {
+        return -1;
+    }
+    strcpy(attachment_dir, dir);
+
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    return 0;
+}
+
+bool
+attachment_name_valid(const char *name)
+{
+    if (name == NULL || name[0] == '\0' || name[0] == '.') {
+        return false;
+    }
+
+    size_t len = 0;
+    for (const char *c = name; *c != '\0'; c++, len++) {
+        switch (*c) {
+            case 'a' ... 'z':
+            case 'A' ... 'Z':
+            case '0' ... '9':
+            case '.':
+            case '-':
+            case '_':
+                break;
+            default:
+                return false;
+        }
+    }
+
+    return len <= ATTACHMENT_MAX_NAME;
+}
+
+/**
+ * attachment_key derives the attachment key from the user's.
+ */
+static void
+attachment_key(const unsigned char *user_key, unsigned char key[STREAM_KEY_BYTES])
+{
+    crypto_kdf_derive_from_key(key, STREAM_KEY_BYTES, ATTACHMENT_KDF_ID, ATTACHMENT_KDF_CONTEXT, user_key);
+}
+
+int
+attachment_save(const long user_id, const char *name, const unsigned char *user_key, const unsigned char *data, const size_t len)
+{
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/%ld", attachment_dir, user_id);
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    // written next to the attachment and renamed over it so
+    // downloads in progress keep reading the old one. names
+    // can't start with a dot so the temporary one can't clash.
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/.%s.XXXXXX", dir, name);
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        return -1;
+    }
+
+    unsigned char key[STREAM_KEY_BYTES];
+    attachment_key(user_key, key);
+    int res = stream_encrypt_buf(data, len, fd, key);
+    sodium_memzero(key, sizeof(key));
+
+    if (res == 0) {
+        res = fsync(fd);
+    }
+    if (close(fd) != 0) {
+        res = -1;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (res == 0 && rename(tmp_path, path) == 0) {
+        return 0;
+    }
+    unlink(tmp_path);
+
+    return -1;
+}
+
+attachment_t*
+attachment_open(const long user_id, const char *name, const unsigned char *user_key)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%ld/%s", attachment_dir, user_id, name);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || stream_decrypted_size(st.st_size) < 0) {
+        close(fd);
+        errno = EBADMSG;
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    attachment_t *attachment = malloc(sizeof(attachment_t));
+    if (attachment == NULL) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    attachment->map = map;
+    attachment->map_size = st.st_size;
+    attachment->size = stream_decrypted_size(st.st_size);
+
+    unsigned char key[STREAM_KEY_BYTES];
+    attachment_key(user_key, key);
+    int res = stream_pull_init(&attachment->pull, map, st.st_size, key);
+    sodium_memzero(key, sizeof(key));
+
+    // the header alone doesn't say if the key is right, so the
+    // first chunk is decrypted now while there's still time to
+    // answer with an error rather than a cut off download.
+    ssize_t n = res == 0 ? stream_pull_next(&attachment->pull, attachment->plain) : -1;
+    if (n < 0) {
+        munmap(map, st.st_size);
+        sodium_memzero(attachment, sizeof(attachment_t));
+        free(attachment);
+        errno = EBADMSG;
+        return NULL;
+    }
+    attachment->plain_len = n;
+    attachment->plain_pos = 0;
+
+    return attachment;
+}
+
+size_t
+attachment_size(const attachment_t *attachment)
+{
+    return attachment->size;
+}
+
+ssize_t
+attachment_read(attachment_t *attachment, char *buf, const size_t max)
+{
+    size_t written = 0;
+    while (written < max) {
+        if (attachment->plain_pos < attachment->plain_len) {
+            size_t n = attachment->plain_len - attachment->plain_pos;
+            if (n > max - written) {
+                n = max - written;
+            }
+            memcpy(buf + written, attachment->plain + attachment->plain_pos, n);
+            attachment->plain_pos += n;
+            written += n;
+            continue;
+        }
+
+        // whole chunks are decrypted straight into the caller's
+        // buffer, only the tail that doesn't fit is kept back.
+        const bool direct = max - written >= STREAM_CHUNK_SIZE;
+        unsigned char *out = direct ? (unsigned char *)buf + written : attachment->plain;
+        ssize_t n = stream_pull_next(&attachment->pull, out);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        if (direct) {
+            written += n;
+        } else {
+            attachment->plain_len = n;
+            attachment->plain_pos = 0;
+        }
+    }
+
+    return written;
+}
+
+void
+attachment_close(attachment_t *attachment)
+{
+    if (attachment == NULL) {
+        return;
+    }
+
+    munmap(attachment->map, attachment->map_size);
+    sodium_memzero(attachment, sizeof(attachment_t));
+    free(attachment);
+}
+
+int
+attachment_delete(const long user_id, const char *name)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%ld/%s", attachment_dir, user_id, name);
+
+    return unlink(path);
+}
@@ -0,0 +1,106 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _ATTACHMENT_H
+#define _ATTACHMENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "stream.h"
+
+#define ATTACHMENT_MAX_NAME 128
+
+/**
+ * attachment_t is an open attachment being decrypted.
+ */
+typedef struct attachment attachment_t;
+
+/**
+ * attachment_init sets the directory attachments are kept in,
+ * creating it if needed. Each user's attachments go in a
+ * directory named after their id. Returns -1 if it can't be
+ * created.
+ */
+int
+attachment_init(const char *dir);
+
+/**
+ * attachment_name_valid checks that the name can be used as a
+ * file name: 1 to ATTACHMENT_MAX_NAME letters, digits, dots,
+ * dashes and underscores, not starting with a dot.
+ */
+bool
+attachment_name_valid(const char *name);
+
+/**
+ * attachment_save encrypts len bytes of data with a key derived
+ * from the user's key and stores it under the given name,
+ * replacing any attachment of the same name. Returns 0 on
+ * success and -1 on error.
+ */
+int
+attachment_save(const long user_id, const char *name, const unsigned char *user_key, const unsigned char *data, const size_t len);
+
+/**
+ * attachment_open maps the named attachment for decrypting.
+ * Returns NULL with errno set to ENOENT if there's no such
+ * attachment or EBADMSG if it isn't one this key opens.
+ */
+attachment_t*
+attachment_open(const long user_id, const char *name, const unsigned char *user_key);
+
+/**
+ * attachment_size returns the size of the decrypted attachment.
+ */
+size_t
+attachment_size(const attachment_t *attachment);
+
+/**
+ * attachment_read decrypts up to max bytes of the attachment
+ * into buf. Returns the number of bytes read, 0 at the end and
+ * -1 if a chunk fails to authenticate.
+ */
+ssize_t
+attachment_read(attachment_t *attachment, char *buf, const size_t max);
+
+/**
+ * attachment_close unmaps the attachment and wipes what was
+ * decrypted.
+ */
+void
+attachment_close(attachment_t *attachment);
+
+/**
+ * attachment_delete removes the named attachment. Returns -1
+ * with errno set to ENOENT if there's no such attachment.
+ */
+int
+attachment_delete(const long user_id, const char *name);
+
+#endif /** end _ATTACHMENT_H */
@@ -88,6 +88,9 @@ base64_encode(const unsigned char *in, size_t len)
 
 	size_t elen = base64_encoded_size(len);
 	char *out = malloc(elen+1);
+	if (out == NULL) {
+        return NULL;
+    }
 	out[elen] = '\0';
 
     size_t i, j;
@@ -9,3 +9,29 @@ export ADMIN_USERNAME=admin
 export ADMIN_FIRST_NAME=admin
 export ADMIN_LAST_NAME=admin
 export ADMIN_PASSWORD=one4all
+export HTTP_WORKERS=4
+export HASH_WORKERS=2
+export HASH_QUEUE_SIZE=64
+export USER_CACHE_SIZE=1024
+export DB_POOL_SIZE=8
+export IMPORT_BATCH_SIZE=500
+export TRACE_EXPORT_FILE=
+export CRYPTO_WORKERS=2
+export CRYPTO_QUEUE_SIZE=64
+export SEARCH_MAX_USERS=1024
+export SEARCH_INDEX_TTL=30
+export LOG_BUFFER_SIZE=1024
+export LOG_FULL_POLICY=drop
+export LOG_LEVEL=info
+export LOG_SAMPLE_RULES=/healthz=1000
+export LOG_SAMPLE_SLOW_MS=500
+export LOG_FILE=
+export LOG_FILE_MAX_BYTES=104857600
+export LOG_FILE_ROTATE_SECS=86400
+export LOG_FILE_FSYNC_SECS=1
+export LOG_FORMAT=json
+export LOG_CLOCK=realtime
+export DICT_INDEX=words.idx
+export PASSWORD_POLICIES=
+export ATTACHMENT_DIR=attachments
+export ATTACHMENT_MAX_SIZE=16777216
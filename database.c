@@ -1,11 +1,20 @@
+#define _GNU_SOURCE
+
 #include <stdbool.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <mysql/errmsg.h>
+
+#include "arena.h"
 #include "database.h"
 #include "pass.h"
+#include "pool.h"
+#include "secret.h"
 
 #define CREATE_TABLE_USERS_QUERY "CREATE TABLE IF NOT EXISTS users (" \
     "id int NOT NULL AUTO_INCREMENT," \
@@ -31,7 +40,7 @@
 
 #define CREATE_TABLE_KEYS_QUERY "create table if not exists `keys` (" \
     "id int NOT NULL AUTO_INCREMENT," \
-    "`key` text NOT NULL," \
+    "`key` varbinary(64) NOT NULL," \
     "user_id int NOT NULL," \
     "PRIMARY KEY (id)," \
     "FOREIGN KEY (user_id) REFERENCES users(id)" \
@@ -53,702 +62,1701 @@
     "FOREIGN KEY (password_id) REFERENCES passwords(id)" \
 ");"
 
+#define CREATE_TABLE_CHANGES_QUERY "CREATE TABLE IF NOT EXISTS changes (" \
+    "seq bigint NOT NULL AUTO_INCREMENT," \
+    "user_id int NOT NULL," \
+    "name varchar(255) NOT NULL," \
+    "operation varchar(16) NOT NULL," \
+    "PRIMARY KEY (seq)," \
+    "INDEX user_id_seq_idx (user_id, seq)," \
+    "INDEX user_id_name_idx (user_id, name)" \
+");"
+
+// passwords written before the change log existed get a create
+// entry so a sync from 0 sees them.
+#define BACKFILL_CHANGES_QUERY "INSERT INTO changes (user_id, name, operation) " \
+    "SELECT p.user_id, p.name, '" DB_CHANGE_CREATE "' FROM passwords AS p " \
+    "WHERE NOT EXISTS (SELECT 1 FROM changes AS c WHERE c.user_id = p.user_id AND c.name = p.name) ORDER BY p.id"
+
+// keys used to be stored in a text column. the column goes
+// through blob so the bytes come across unchanged, then keys that
+// aren't DB_KEY_SIZE bytes are stretched to that size with SHA-256
+// before the column is narrowed to binary.
+#define SELECT_KEY_COLUMN_TYPE_QUERY "SELECT DATA_TYPE FROM information_schema.COLUMNS " \
+    "WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME = 'keys' AND COLUMN_NAME = 'key'"
+#define ALTER_KEY_COLUMN_BLOB_QUERY "ALTER TABLE `keys` MODIFY `key` blob NOT NULL"
+#define REENCODE_KEYS_QUERY "UPDATE `keys` SET `key` = UNHEX(SHA2(`key`, 256)) WHERE LENGTH(`key`) <> 32"
+#define ALTER_KEY_COLUMN_BINARY_QUERY "ALTER TABLE `keys` MODIFY `key` varbinary(64) NOT NULL"
+
 #define INSERT_PASSWORD_QUERY "INSERT INTO passwords (name, username, password, user_id) VALUES (?, ?, ?, ?)"
-#define INSERT_USER_QUERY "INSERT INTO users (username, first_name, last_name, password, token) VALUES (?, ?, ?, PASSWORD(?), ?)"
+#define INSERT_USER_QUERY "INSERT INTO users (username, first_name, last_name, password, token) VALUES (?, ?, ?, ?, ?)"
+#define UPDATE_USER_PASSWORD_QUERY "UPDATE users SET password = ? WHERE id = ?"
 #define INSERT_USER_KEY_QUERY "INSERT INTO `keys` (`key`, user_id) VALUES (?, ?)"
 #define SELECT_ALL_USERS_QUERY "SELECT * FROM users"
 #define SELECT_USER_BY_NAME_QUERY "SELECT * FROM users WHERE username = '%s'"
 #define SELECT_USER_BY_TOKEN_QUERY "SELECT * FROM users WHERE token = '%s'"
-#define SELECT_USER_BY_ID_QUERY "SELECT * FROM users WHERE id = %lu"
+#define SELECT_USER_BY_ID_QUERY "SELECT * FROM users WHERE id = %ld"
+#define SELECT_USER_PROFILE_BY_ID_QUERY "SELECT id, username, first_name, last_name FROM users WHERE id = %ld"
 #define SELECT_USER_IS_ADMIN "SELECT id FROM users WHERE token = '%s'"
-#define SELECT_PASSWORD_BY_NAME_QUERY "SELECT * FROM passwords WHERE name = '%s' AND user_id = %lu"
+#define SELECT_PASSWORD_BY_NAME_QUERY "SELECT * FROM passwords WHERE name = '%s' AND user_id = %ld"
 #define SELECT_PASSWORD_BY_TOKEN_QUERY "SELECT * FROM passwords WHERE name = '%s' AND user_id = (SELECT id FROM users WHERE token = '%s')"
-#define SELECT_PASSWORDS_BY_TOKEN_QUERY "SELECT p.id, p.name, p.username, p.password FROM passwords AS p JOIN users AS u ON p.user_id = u.id WHERE u.token = '%s'"
+#define SELECT_PASSWORDS_BY_TOKEN_QUERY "SELECT p.id, p.name, p.username, p.password, p.user_id FROM passwords AS p JOIN users AS u ON p.user_id = u.id WHERE u.token = '%s'"
+#define SELECT_PASSWORDS_BY_NAMES_QUERY "SELECT id, name, username, password FROM passwords WHERE user_id = ? AND name IN (%s)"
 #define SELECT_TOKEN_BY_USERNAME_QUERY "SELECT token FROM users WHERE username = '%s' AND password = PASSWORD('%s')"
-#define SELECT_KEY_BY_USER_ID_QUERY "SELECT CONVERT(`key` USING utf8) FROM `keys` WHERE user_id = %lu"
+#define SELECT_KEY_BY_USER_ID_QUERY "SELECT `key` FROM `keys` WHERE user_id = %ld ORDER BY id"
+#define LOCK_USER_BY_ID_QUERY "SELECT id FROM users WHERE id = %ld FOR UPDATE"
+#define INSERT_CHANGE_QUERY "INSERT INTO changes (user_id, name, operation) VALUES (?, ?, ?)"
+#define SELECT_LAST_CHANGE_SEQ_QUERY "SELECT COALESCE(MAX(seq), 0) FROM changes WHERE user_id = %ld"
+#define SELECT_CHANGES_SINCE_QUERY "SELECT c.seq, c.name, c.operation, p.id, p.username, p.password FROM changes AS c " \
+    "JOIN (SELECT MAX(seq) AS seq FROM changes WHERE user_id = %ld AND seq > %" PRIu64 " GROUP BY name) AS latest ON latest.seq = c.seq " \
+    "LEFT JOIN passwords AS p ON p.user_id = c.user_id AND p.name = c.name ORDER BY c.seq LIMIT %d"
+#define SELECT_PASSWORD_NAMES_BY_USER_ID_QUERY "SELECT id, name FROM passwords WHERE user_id = %ld"
+#define SELECT_PASSWORDS_BY_USER_ID_QUERY "SELECT id, name, username, password FROM passwords WHERE user_id = %ld ORDER BY id"
+#define IMPORT_PASSWORD_QUERY "INSERT INTO passwords (name, username, password, user_id) VALUES (?, ?, ?, ?) " \
+    "ON DUPLICATE KEY UPDATE username = VALUES(username), password = VALUES(password)"
+
+#define DEFAULT_USER_CACHE_SIZE 1024
+#define DEFAULT_DB_POOL_SIZE 8
+
+/**
+ * user_profile is a cached copy of the public part of a
+ * user. An id of 0 marks an empty slot.
+ */
+struct user_profile {
+    long id;
+    char *username;
+    char *first_name;
+    char *last_name;
+};
 
+/**
+ * user_cache is a direct mapped cache of user profiles keyed
+ * by id. Ids are sequential so neighbouring users don't evict
+ * each other until the cache wraps around.
+ */
+struct user_cache {
+    pthread_mutex_t lock;
+    struct user_profile *slots;
+    size_t size;
+    uint64_t hits;
+    uint64_t misses;
+};
 
-MYSQL_ROW row;
+/**
+ * db_pool hands out connections to one thread at a time since
+ * a MYSQL handle can't be shared. Connections are opened as
+ * they're needed, up to max, and kept for reuse once released.
+ */
+struct db_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    MYSQL **idle;
+    size_t idle_count;
+    size_t open;
+    size_t max;
+};
 
 struct db {
+    struct db_pool pool;
+    struct user_cache user_cache;
+    pool_t *crypto_pool;
+    char *server;
+    char *user;
+    char *password;
+    char *database;
+};
+
+/**
+ * db_cursor streams rows over its own connection so the
+ * pool isn't held up while the rows are consumed.
+ */
+struct db_cursor {
+    MYSQL *conn;
+    MYSQL_RES *res;
+    bool has_key;
+    unsigned char key[DB_KEY_SIZE];
+};
+
+/**
+ * db_password_batch writes passwords with a single prepared
+ * statement, committing every batch_size rows. It holds a pooled
+ * connection until it's freed so no other statements end up in
+ * its transactions.
+ */
+struct db_password_batch {
+    db_t *db;
     MYSQL *conn;
+    MYSQL_STMT *stmt;
+    MYSQL_STMT *change_stmt;
+    long user_id;
+    unsigned char key[DB_KEY_SIZE];
+    size_t batch_size;
+    size_t pending;
 };
 
 db_t*
 db_new()
 {
-    return (struct db *)malloc(sizeof(struct db));
+    struct db *db = calloc(1, sizeof(struct db));
+    pthread_mutex_init(&db->user_cache.lock, NULL);
+    pthread_mutex_init(&db->pool.lock, NULL);
+    pthread_cond_init(&db->pool.cond, NULL);
+
+    return db;
 }
 
-int
-db_init(db_t *db, const char *server, const char *user, const char *password, const char *database)
+/**
+ * db_error holds the last error seen by the calling thread since
+ * its connection is back in the pool by the time it's asked for.
+ */
+static __thread char db_error[MYSQL_ERRMSG_SIZE];
+
+static void
+db_error_save(MYSQL *conn)
 {
-    db->conn = mysql_init(NULL);
+    snprintf(db_error, sizeof(db_error), "%s", mysql_error(conn));
+}
 
-    if (!mysql_real_connect(db->conn, server, user, password, database, 0, NULL, 0)) {
-        return 1;
-    }
+static void
+db_stmt_error_save(MYSQL_STMT *stmt)
+{
+    snprintf(db_error, sizeof(db_error), "%s", mysql_stmt_error(stmt));
+}
 
-    if (mysql_query(db->conn, CREATE_TABLE_USERS_QUERY)) {
-        return 2;
+/**
+ * db_connect opens a new connection to the database with the
+ * settings given to db_init. Returns NULL on error.
+ */
+static MYSQL*
+db_connect(db_t *db)
+{
+    MYSQL *conn = mysql_init(NULL);
+    if (conn == NULL) {
+        return NULL;
     }
 
-    if (mysql_query(db->conn, CREATE_TABLE_PASSWORDS_QUERY)) {
-        return 3;
+    if (!mysql_real_connect(conn, db->server, db->user, db->password, db->database, 0, NULL, 0)) {
+        db_error_save(conn);
+        mysql_close(conn);
+        return NULL;
     }
 
-    if (mysql_query(db->conn, CREATE_TABLE_KEYS_QUERY)) {
-        return 4;
-    }
+    return conn;
+}
 
-    if (mysql_query(db->conn, CREATE_TABLE_LABELS_QUERY)) {
-        return 5;
+/**
+ * db_conn_acquire takes an idle connection from the pool or
+ * opens a new one, waiting for one to be released when max are
+ * already open. Returns NULL if a connection can't be opened.
+ */
+static MYSQL*
+db_conn_acquire(db_t *db)
+{
+    struct db_pool *pool = &db->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->idle_count == 0 && pool->open >= pool->max) {
+        pthread_cond_wait(&pool->cond, &pool->lock);
     }
 
-    if (mysql_query(db->conn, CREATE_TABLE_PASSWORD_LABELS_QUERY)) {
-        return 6;
+    if (pool->idle_count > 0) {
+        MYSQL *conn = pool->idle[--pool->idle_count];
+        pthread_mutex_unlock(&pool->lock);
+        return conn;
     }
 
-    const char *token = generate_password(32);
-    db_user_add(db, getenv("ADMIN_USERNAME"), getenv("ADMIN_FIRST_NAME"), getenv("ADMIN_LAST_NAME"), getenv("ADMIN_PASSWORD"), token);
-    free((char *)token);
+    pool->open++;
+    pthread_mutex_unlock(&pool->lock);
 
-    return 0;
+    MYSQL *conn = db_connect(db);
+    if (conn == NULL) {
+        pthread_mutex_lock(&pool->lock);
+        pool->open--;
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return conn;
 }
 
-void
-db_cleanup(db_t *db)
+/**
+ * db_conn_release returns the connection to the pool, saving
+ * its last error first. Connections the server dropped are
+ * closed so the next acquire opens a fresh one.
+ */
+static void
+db_conn_release(db_t *db, MYSQL *conn)
 {
-    if (db == NULL) {
-        return;
+    struct db_pool *pool = &db->pool;
+
+    unsigned int err = mysql_errno(conn);
+    if (err != 0) {
+        db_error_save(conn);
     }
 
-    if (db->conn != NULL) {
-        mysql_close(db->conn);
+    pthread_mutex_lock(&pool->lock);
+    if (err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST) {
+        mysql_close(conn);
+        pool->open--;
+    } else {
+        pool->idle[pool->idle_count++] = conn;
     }
-    
-    free(db);
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
 }
 
-const char*
-db_get_error(db_t *db)
+/**
+ * db_select runs the query on a pooled connection and buffers
+ * the whole result so the connection can go straight back.
+ * Returns NULL on error.
+ */
+static MYSQL_RES*
+db_select(db_t *db, const char *query)
 {
-    return mysql_error(db->conn);
-}
+    MYSQL *conn = db_conn_acquire(db);
+    if (conn == NULL) {
+        return NULL;
+    }
 
-user_t*
-db_user_new()
-{
-    user_t *user = malloc(sizeof(user_t));
-    user->id = 0;
-    user->first_name = calloc(0, sizeof(char));
-    user->last_name = calloc(0, sizeof(char));
-    user->password = calloc(0, sizeof(char));
-    user->token = calloc(0, sizeof(char));
+    MYSQL_RES *res = NULL;
+    if (mysql_query(conn, query) == 0) {
+        res = mysql_store_result(conn);
+    }
+    db_conn_release(db, conn);
 
-    return user;
+    return res;
 }
 
-user_t**
-db_users_new()
+/**
+ * user_cache_init sizes the profile cache. A size of 0
+ * disables it.
+ */
+static void
+user_cache_init(struct user_cache *cache, const size_t size)
 {
-    user_t **users = malloc(sizeof(user_t)*2);
-
-    for (int i = 0; i < 2; i++) {
-        users[i] = db_user_new();
+    cache->size = size;
+    if (size > 0) {
+        cache->slots = calloc(size, sizeof(struct user_profile));
     }
-
-    return users;
 }
 
-password_t*
-db_password_new()
+static void
+user_profile_clear(struct user_profile *profile)
 {
-    password_t *pass = malloc(sizeof(user_t));
-    pass->id = 0;
-    pass->name = calloc(0, sizeof(char));
-    pass->username = calloc(0, sizeof(char));
-    pass->password = calloc(0, sizeof(char));
-    pass->user_id = 0;
-
-    return pass;
+    free(profile->username);
+    free(profile->first_name);
+    free(profile->last_name);
+    memset(profile, 0, sizeof(struct user_profile));
 }
 
-password_t**
-db_passwords_new()
+/**
+ * user_cache_invalidate drops the cached profile for the
+ * given id, if there is one.
+ */
+static void
+user_cache_invalidate(struct user_cache *cache, const long id)
 {
-    password_t **passwords = malloc(sizeof(password_t)*2);
+    if (cache->slots == NULL || id <= 0) {
+        return;
+    }
 
-    for (int i = 0; i < 2; i++) {
-        passwords[i] = db_password_new();
+    pthread_mutex_lock(&cache->lock);
+    struct user_profile *profile = &cache->slots[id % cache->size];
+    if (profile->id == id) {
+        user_profile_clear(profile);
     }
+    pthread_mutex_unlock(&cache->lock);
+}
 
-    return passwords;
+static void
+user_cache_free(struct user_cache *cache)
+{
+    for (size_t i = 0; cache->slots != NULL && i < cache->size; i++) {
+        user_profile_clear(&cache->slots[i]);
+    }
+    free(cache->slots);
+    pthread_mutex_destroy(&cache->lock);
 }
 
-int
-db_password_add(db_t *db, const char *name, const char *username, const char *password, const char *labels, const long user_id)
+/**
+ * db_migrate_keys moves keys written to the old text column over
+ * to the binary one. It does nothing once the column is binary
+ * so it's safe to run on every start.
+ */
+static int
+db_migrate_keys(MYSQL *conn)
 {
-    MYSQL_STMT *insert_password_stmt = mysql_stmt_init(db->conn);
+    if (mysql_query(conn, SELECT_KEY_COLUMN_TYPE_QUERY)) {
+        return -1;
+    }
 
-    int result = mysql_stmt_prepare(insert_password_stmt, INSERT_PASSWORD_QUERY, strlen(INSERT_PASSWORD_QUERY));  
-    if (result != 0) {
-        return result;
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (res == NULL) {
+        return -1;
     }
 
-    MYSQL_BIND bind[4];
+    MYSQL_ROW row = mysql_fetch_row(res);
+    bool migrated = row == NULL || (row[0] != NULL && strcasecmp(row[0], "varbinary") == 0);
+    mysql_free_result(res);
+    if (migrated) {
+        return 0;
+    }
 
-    unsigned int array_size = 1; 
-    unsigned long name_len = strlen(name);
-    unsigned long username_len = strlen(username);
-    unsigned long password_len = strlen(password);
+    if (mysql_query(conn, ALTER_KEY_COLUMN_BLOB_QUERY) ||
+        mysql_query(conn, REENCODE_KEYS_QUERY) ||
+        mysql_query(conn, ALTER_KEY_COLUMN_BINARY_QUERY)) {
+        return -1;
+    }
 
-    memset(bind, 0, sizeof(bind)); 
+    return 0;
+}
 
-    bind[0].buffer_type = MYSQL_TYPE_STRING; 
-    bind[0].buffer = (char *)name;
-    bind[0].buffer_length = strlen(name); 
-    bind[0].length = &name_len;
+/**
+ * db_migrate creates any tables that don't exist yet and brings
+ * the data in the existing ones up to date.
+ */
+static int
+db_migrate(MYSQL *conn)
+{
+    if (mysql_query(conn, CREATE_TABLE_USERS_QUERY)) {
+        return 2;
+    }
 
-    bind[1].buffer_type = MYSQL_TYPE_STRING; 
-    bind[1].buffer = (char *)username;
-    bind[1].buffer_length = strlen(username); 
-    bind[1].length = &username_len;
+    if (mysql_query(conn, CREATE_TABLE_PASSWORDS_QUERY)) {
+        return 3;
+    }
 
-    bind[2].buffer_type = MYSQL_TYPE_STRING; 
-    bind[2].buffer = (char *)password;
-    bind[2].buffer_length = strlen(password); 
-    bind[2].length = &password_len;
+    if (mysql_query(conn, CREATE_TABLE_KEYS_QUERY)) {
+        return 4;
+    }
 
-    bind[3].buffer_type = MYSQL_TYPE_LONG; 
-    bind[3].buffer = (long*)&user_id; 
-    bind[3].is_null = 0;
-    bind[3].length = 0;
+    if (mysql_query(conn, CREATE_TABLE_LABELS_QUERY)) {
+        return 5;
+    }
 
-    if (mysql_stmt_bind_param(insert_password_stmt, bind)) {
-        return result;
+    if (mysql_query(conn, CREATE_TABLE_PASSWORD_LABELS_QUERY)) {
+        return 6;
     }
 
-    MYSQL_RES *res;
-    result = mysql_stmt_execute(insert_password_stmt); 
-    if (result != 0) {
-        return result;
+    if (mysql_query(conn, CREATE_TABLE_CHANGES_QUERY)) {
+        return 8;
     }
 
-    mysql_free_result(res);
+    if (mysql_query(conn, BACKFILL_CHANGES_QUERY)) {
+        return 9;
+    }
 
-    return 0;
-}
+    if (db_migrate_keys(conn) != 0) {
+        return 10;
+    }
 
-int
-db_label_add(db_t *db, char *label, long pass_id)
-{
     return 0;
 }
 
 int
-db_user_add(db_t *db, const char *username, const char *first_name, const char *last_name, const char *password, const char *token)
+db_init(db_t *db, const char *server, const char *user, const char *password, const char *database)
 {
-    MYSQL_STMT *insert_user_stmt = mysql_stmt_init(db->conn);
-
-    int result = mysql_stmt_prepare(insert_user_stmt, INSERT_USER_QUERY, strlen(INSERT_USER_QUERY));  
-    if (result != 0) {
-        return result;
+    const char *cache_size = getenv("USER_CACHE_SIZE");
+    user_cache_init(&db->user_cache, cache_size != NULL ? strtoul(cache_size, NULL, 10) : DEFAULT_USER_CACHE_SIZE);
+
+    db->server = server != NULL ? strdup(server) : NULL;
+    db->user = user != NULL ? strdup(user) : NULL;
+    db->password = password != NULL ? strdup(password) : NULL;
+    db->database = database != NULL ? strdup(database) : NULL;
+
+    const char *pool_size = getenv("DB_POOL_SIZE");
+    db->pool.max = pool_size != NULL ? strtoul(pool_size, NULL, 10) : DEFAULT_DB_POOL_SIZE;
+    if (db->pool.max < 1) {
+        db->pool.max = 1;
     }
-    
-    MYSQL_BIND bind[5];
-    memset(bind, 0, sizeof(bind));
-
-    unsigned int array_size = 1; 
-    unsigned long username_len = strlen(username);
-    unsigned long first_name_len = strlen(first_name);
-    unsigned long last_name_len = strlen(last_name);
-    unsigned long password_len = strlen(password);
-    unsigned long token_len = strlen(token);
-
-    bind[0].buffer_type = MYSQL_TYPE_STRING; 
-    bind[0].buffer = (char *)username;
-    bind[0].buffer_length = strlen(username); 
-    bind[0].length = &username_len;
+    db->pool.idle = calloc(db->pool.max, sizeof(MYSQL*));
 
-    bind[1].buffer_type = MYSQL_TYPE_STRING; 
-    bind[1].buffer = (char *)first_name;
-    bind[1].buffer_length = strlen(first_name); 
-    bind[1].length = &first_name_len;
-
-    bind[2].buffer_type = MYSQL_TYPE_STRING; 
-    bind[2].buffer = (char *)last_name;
-    bind[2].buffer_length = strlen(last_name); 
-    bind[2].length = &last_name_len;
-
-    bind[3].buffer_type = MYSQL_TYPE_STRING; 
-    bind[3].buffer = (char *)password;
-    bind[3].buffer_length = strlen(password); 
-    bind[3].length = &password_len;
-
-    bind[4].buffer_type = MYSQL_TYPE_STRING; 
-    bind[4].buffer = (char *)token;
-    bind[4].buffer_length = strlen(token); 
-    bind[4].length = &token_len;
-    
-    if (mysql_stmt_bind_param(insert_user_stmt, bind)) {
-        return result;
-    }
-    
-    result = mysql_stmt_execute(insert_user_stmt); 
-    if (result != 0) {
-        return result;
+    // check the settings work now rather than on the first
+    // request. the connection stays in the pool for reuse.
+    MYSQL *conn = db_conn_acquire(db);
+    if (conn == NULL) {
+        return 1;
     }
+    db_conn_release(db, conn);
 
     return 0;
 }
 
-uint64_t
-db_users_get_all(db_t *db, user_t **users)
+int
+db_bootstrap(db_t *db)
 {
-    if (mysql_query(db->conn, SELECT_ALL_USERS_QUERY)) {
-        return -1;
+    MYSQL *conn = db_conn_acquire(db);
+    if (conn == NULL) {
+        return 1;
     }
 
-    MYSQL_RES *res = mysql_store_result(db->conn);
-    uint64_t row_count = mysql_num_rows(res);
-    if (row_count == 0) {
-        goto CLEANUP;
+    int ret = db_migrate(conn);
+    db_conn_release(db, conn);
+    if (ret != 0) {
+        return ret;
     }
 
-    if (row_count > 2) {
-        users = realloc(users, sizeof(user_t)*row_count);
+    char hash[crypto_pwhash_STRBYTES];
+    if (password_hash(getenv("ADMIN_PASSWORD"), hash) != 0) {
+        return 7;
     }
-    
-    uint64_t i = 0;
-    char *endptr;
-
-    while ((row = mysql_fetch_row(res)) != NULL) {
-        user_t *user = malloc(sizeof(user_t));
-
-        user->id = strtol(row[0], &endptr, 10);
-        user->username = realloc(user->username, strlen(row[1]));
-        strcpy(user->username, row[1]);
-
-        user->first_name = realloc(user->first_name, strlen(row[2]));
-        strcpy(user->first_name, row[2]);
-
-        user->last_name = realloc(user->last_name, strlen(row[3]));
-        strcpy(user->last_name, row[3]);
 
-        user->password = realloc(user->password, strlen(row[4]));
-        strcpy(user->password, row[4]);
+    char token[DB_TOKEN_SIZE + 1];
+    generate_password_into(token, DB_TOKEN_SIZE);
+    db_user_add(db, getenv("ADMIN_USERNAME"), getenv("ADMIN_FIRST_NAME"), getenv("ADMIN_LAST_NAME"), hash, token);
 
-        user->token = realloc(user->token, strlen(row[4]));
-        strcpy(user->password, row[4]);
+    return 0;
+}
 
-        users[i] = user;
-        i++;
+void
+db_cleanup(db_t *db)
+{
+    if (db == NULL) {
+        return;
     }
 
-CLEANUP:
-    mysql_free_result(res);
+    for (size_t i = 0; i < db->pool.idle_count; i++) {
+        mysql_close(db->pool.idle[i]);
+    }
+    free(db->pool.idle);
+    pthread_cond_destroy(&db->pool.cond);
+    pthread_mutex_destroy(&db->pool.lock);
+
+    user_cache_free(&db->user_cache);
+    free(db->server);
+    free(db->user);
+    free(db->password);
+    free(db->database);
+    free(db);
+}
 
-    return row_count;
+const char*
+db_get_error(db_t *db)
+{
+    return db_error;
 }
 
-int
-db_user_get_by_username(db_t *db, const char *username, user_t *user)
+/**
+ * db_alloc allocates from the arena when one is given and
+ * from the heap otherwise.
+ */
+static void*
+db_alloc(arena_t *arena, const size_t size)
 {
-    char *query = malloc(strlen(SELECT_USER_BY_NAME_QUERY)+strlen(username));
-    sprintf(query, SELECT_USER_BY_NAME_QUERY, username);
+    return arena != NULL ? arena_alloc(arena, size) : malloc(size);
+}
 
-    if (mysql_query(db->conn, query)) {
-        return -1;
+/**
+ * db_set_string copies value into the given field. Heap
+ * allocated fields have their previous value freed.
+ */
+static void
+db_set_string(arena_t *arena, char **field, const char *value)
+{
+    if (value == NULL) {
+        value = "";
     }
 
-    MYSQL_RES *res = mysql_store_result(db->conn);
-    uint64_t row_count = mysql_num_rows(res);
-    if (row_count == 0) {
-        goto CLEANUP;
+    if (arena != NULL) {
+        *field = arena_strdup(arena, value);
+        return;
     }
 
-    char *endptr;
-
-    while ((row = mysql_fetch_row(res)) != NULL) {
-        user->id = strtol(row[0], &endptr, 10);
-        user->username = realloc(user->username, strlen(row[1]));
-        strcpy(user->username, row[1]);
-
-        user->first_name = realloc(user->first_name, strlen(row[2]));
-        strcpy(user->first_name, row[2]);
-
-        user->last_name = realloc(user->last_name, strlen(row[3]));
-        strcpy(user->last_name, row[3]);
-
-        user->password = realloc(user->password, strlen(row[4]));
-        strcpy(user->password, row[4]);
+    free(*field);
+    *field = strdup(value);
+}
 
-        user->token = realloc(user->token, strlen(row[5]));
-        strcpy(user->token, row[5]);
+/**
+ * db_query formats a query string allocated from the arena
+ * when one is given. Free it with db_query_free.
+ */
+static char*
+db_query(arena_t *arena, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+
+    char *query;
+    if (arena != NULL) {
+        query = arena_vsprintf(arena, fmt, ap);
+    } else if (vasprintf(&query, fmt, ap) < 0) {
+        query = NULL;
     }
 
-CLEANUP:
-    free(query);
-    mysql_free_result(res);
+    va_end(ap);
 
-    return row_count;
+    return query;
 }
 
-int
-db_user_get_by_id(db_t *db, const long id, user_t *user)
+static void
+db_query_free(arena_t *arena, char *query)
 {
-    char sid[10 + sizeof(char)];
-    sprintf(sid, "%ld", id);
+    if (arena == NULL) {
+        free(query);
+    }
+}
 
-    char *query = malloc(strlen(SELECT_USER_BY_ID_QUERY)+strlen(sid));
-    sprintf(query, SELECT_USER_BY_ID_QUERY, id);
+/**
+ * db_user_from_row fills in the user from a row of
+ * SELECT * FROM users.
+ */
+static void
+db_user_from_row(user_t *user, MYSQL_ROW row)
+{
+    user->id = strtol(row[0], NULL, 10);
+    db_set_string(user->arena, &user->username, row[1]);
+    db_set_string(user->arena, &user->first_name, row[2]);
+    db_set_string(user->arena, &user->last_name, row[3]);
+    db_set_string(user->arena, &user->password, row[4]);
+    db_set_string(user->arena, &user->token, row[5]);
+}
 
-    if (mysql_query(db->conn, query)) {
+/**
+ * db_fetch_key reads the user's secretbox key over the given
+ * connection. Returns 1 when a usable key was found, 0 when
+ * there isn't one and -1 on error.
+ */
+static int
+db_fetch_key(MYSQL *conn, const long user_id, unsigned char key[DB_KEY_SIZE])
+{
+    char *query = db_query(NULL, SELECT_KEY_BY_USER_ID_QUERY, user_id);
+    int result = mysql_query(conn, query);
+    db_query_free(NULL, query);
+    if (result != 0) {
         return -1;
     }
 
-    MYSQL_RES *res = mysql_store_result(db->conn);
-    uint64_t row_count = mysql_num_rows(res);
-    if (row_count == 0) {
-        goto CLEANUP;
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (res == NULL) {
+        return -1;
     }
 
-    char *endptr;
-
+    // the newest key of the right size wins. shorter rows are
+    // skipped rather than failing the lookup.
+    int found = 0;
+    MYSQL_ROW row;
     while ((row = mysql_fetch_row(res)) != NULL) {
-        user->id = strtol(row[0], &endptr, 10);
-        user->username = malloc(strlen(row[1]));
-        strcpy(user->username, row[1]);
-
-        user->first_name = malloc(strlen(row[2]));
-        strcpy(user->first_name, row[2]);
-
-        user->last_name = malloc(strlen(row[3]));
-        strcpy(user->last_name, row[3]);
-
-        user->password = malloc(strlen(row[4]));
-        strcpy(user->password, row[4]);
-
-        user->token = malloc(strlen(row[5]));
-        strcpy(user->token, row[5]);
+        unsigned long *lengths = mysql_fetch_lengths(res);
+        if (lengths[0] < DB_KEY_SIZE) {
+            continue;
+        }
+        memcpy(key, row[0], DB_KEY_SIZE);
+        found = 1;
     }
 
-CLEANUP:
-    free(query);
     mysql_free_result(res);
 
-    return row_count;
+    return found;
 }
 
-int
-db_user_get_by_token(db_t *db, const char *token, user_t *user)
+/**
+ * db_key_insert stores the user's key over the given connection.
+ */
+static int
+db_key_insert(MYSQL *conn, const unsigned char key[DB_KEY_SIZE], const long user_id)
 {
-    char *query = malloc(strlen(SELECT_USER_BY_TOKEN_QUERY)+strlen(token));
-    sprintf(query, SELECT_USER_BY_TOKEN_QUERY, token);
+    MYSQL_STMT *insert_user_key_stmt = mysql_stmt_init(conn);
 
-    if (mysql_query(db->conn, query)) {
-        return -1;
+    int result = mysql_stmt_prepare(insert_user_key_stmt, INSERT_USER_KEY_QUERY, strlen(INSERT_USER_KEY_QUERY));  
+    if (result != 0) {
+        mysql_stmt_close(insert_user_key_stmt);
+        return result;
     }
+    
+    MYSQL_BIND bind[2];
+    memset(bind, 0, sizeof(bind));
 
-    MYSQL_RES *res = mysql_store_result(db->conn);
-    uint64_t row_count = mysql_num_rows(res);
-    if (row_count == 0) {
-        goto CLEANUP;
-    }
+    unsigned int array_size = 1; 
+    unsigned long key_len = DB_KEY_SIZE;
 
-    char *endptr;
+    bind[0].buffer_type = MYSQL_TYPE_BLOB; 
+    bind[0].buffer = (char *)key;
+    bind[0].buffer_length = DB_KEY_SIZE; 
+    bind[0].length = &key_len;
+
+    bind[1].buffer_type = MYSQL_TYPE_LONG; 
+    bind[1].buffer = (long*)&user_id; 
+    bind[1].is_null = 0;
+    bind[1].length = 0;
+    
+    result = 1;
+    if (mysql_stmt_bind_param(insert_user_key_stmt, bind) == 0) {
+        result = mysql_stmt_execute(insert_user_key_stmt);
+    }
+    if (result != 0) {
+        db_stmt_error_save(insert_user_key_stmt);
+    }
+    mysql_stmt_close(insert_user_key_stmt);
+
+    return result;
+}
+
+/**
+ * db_user_key reads the user's key for sealing new secrets,
+ * creating it if the user doesn't have one yet. Creation locks
+ * the user's row so concurrent first writes agree on one key.
+ * Existing keys are never replaced or removed.
+ */
+static int
+db_user_key(db_t *db, const long user_id, unsigned char key[DB_KEY_SIZE])
+{
+    MYSQL *conn = db_conn_acquire(db);
+    if (conn == NULL) {
+        return -1;
+    }
+
+    int res = db_fetch_key(conn, user_id, key);
+    if (res != 0) {
+        db_conn_release(db, conn);
+        return res == 1 ? 0 : -1;
+    }
+
+    if (mysql_query(conn, "START TRANSACTION")) {
+        db_conn_release(db, conn);
+        return -1;
+    }
+
+    // whoever gets the lock first creates the key. the others
+    // find it once they get the lock in turn.
+    char *query = db_query(NULL, LOCK_USER_BY_ID_QUERY, user_id);
+    res = mysql_query(conn, query);
+    db_query_free(NULL, query);
+    if (res == 0) {
+        MYSQL_RES *lock = mysql_store_result(conn);
+        res = lock != NULL ? 0 : -1;
+        if (lock != NULL) {
+            mysql_free_result(lock);
+        }
+    }
+
+    if (res == 0) {
+        res = db_fetch_key(conn, user_id, key);
+        if (res == 0) {
+            crypto_secretbox_keygen(key);
+            res = db_key_insert(conn, key, user_id);
+        } else if (res == 1) {
+            res = 0;
+        }
+    }
+
+    if (res == 0 && mysql_commit(conn) != 0) {
+        res = -1;
+    }
+    if (res != 0) {
+        if (mysql_errno(conn) != 0) {
+            db_error_save(conn);
+        }
+        mysql_rollback(conn);
+        sodium_memzero(key, DB_KEY_SIZE);
+    }
+    db_conn_release(db, conn);
+
+    return res == 0 ? 0 : -1;
+}
+
+/**
+ * db_passwords_open_all opens the sealed passwords of a single
+ * user in one go, reading the key once.
+ */
+static int
+db_passwords_open_all(db_t *db, const long user_id, password_t **passwords, const uint64_t count)
+{
+    bool sealed = false;
+    for (uint64_t i = 0; i < count && !sealed; i++) {
+        sealed = secret_is_sealed(passwords[i]->password);
+    }
+    if (!sealed) {
+        return 0;
+    }
+
+    MYSQL *conn = db_conn_acquire(db);
+    if (conn == NULL) {
+        return -1;
+    }
+
+    unsigned char key[DB_KEY_SIZE];
+    int has_key = db_fetch_key(conn, user_id, key);
+    db_conn_release(db, conn);
+    if (has_key != 1) {
+        return -1;
+    }
+
+    char **values = malloc(sizeof(char*)*count);
+    for (uint64_t i = 0; i < count; i++) {
+        values[i] = passwords[i]->password;
+    }
+
+    size_t failed = secret_open_all(key, values, count, db->crypto_pool);
 
+    sodium_memzero(key, sizeof(key));
+    free(values);
+
+    return failed == 0 ? 0 : -1;
+}
+
+void
+db_set_crypto_pool(db_t *db, pool_t *pool)
+{
+    db->crypto_pool = pool;
+}
+
+static MYSQL_STMT*
+db_change_stmt_new(MYSQL *conn)
+{
+    MYSQL_STMT *stmt = mysql_stmt_init(conn);
+    if (mysql_stmt_prepare(stmt, INSERT_CHANGE_QUERY, strlen(INSERT_CHANGE_QUERY)) != 0) {
+        mysql_stmt_close(stmt);
+        return NULL;
+    }
+
+    return stmt;
+}
+
+/**
+ * db_change_add records a write to one of the user's passwords
+ * in the change log with a prepared INSERT_CHANGE_QUERY.
+ */
+static int
+db_change_add(MYSQL_STMT *stmt, const long user_id, const char *name, const char *operation)
+{
+    MYSQL_BIND bind[3];
+    memset(bind, 0, sizeof(bind));
+
+    long long id = user_id;
+    unsigned long name_len = strlen(name);
+    unsigned long operation_len = strlen(operation);
+
+    bind[0].buffer_type = MYSQL_TYPE_LONGLONG;
+    bind[0].buffer = &id;
+
+    bind[1].buffer_type = MYSQL_TYPE_STRING;
+    bind[1].buffer = (char *)name;
+    bind[1].buffer_length = name_len;
+    bind[1].length = &name_len;
+
+    bind[2].buffer_type = MYSQL_TYPE_STRING;
+    bind[2].buffer = (char *)operation;
+    bind[2].buffer_length = operation_len;
+    bind[2].length = &operation_len;
+
+    if (mysql_stmt_bind_param(stmt, bind)) {
+        return 1;
+    }
+
+    return mysql_stmt_execute(stmt);
+}
+
+user_t*
+db_user_new(arena_t *arena)
+{
+    user_t *user = db_alloc(arena, sizeof(user_t));
+    user->id = 0;
+    user->arena = arena;
+    user->username = NULL;
+    user->first_name = NULL;
+    user->last_name = NULL;
+    user->password = NULL;
+    user->token = NULL;
+
+    db_set_string(arena, &user->username, "");
+    db_set_string(arena, &user->first_name, "");
+    db_set_string(arena, &user->last_name, "");
+    db_set_string(arena, &user->password, "");
+    db_set_string(arena, &user->token, "");
+
+    return user;
+}
+
+password_t*
+db_password_new(arena_t *arena)
+{
+    password_t *pass = db_alloc(arena, sizeof(password_t));
+    pass->id = 0;
+    pass->arena = arena;
+    pass->name = NULL;
+    pass->username = NULL;
+    pass->password = NULL;
+    pass->user_id = 0;
+
+    db_set_string(arena, &pass->name, "");
+    db_set_string(arena, &pass->username, "");
+    db_set_string(arena, &pass->password, "");
+
+    return pass;
+}
+
+int
+db_password_add(db_t *db, const char *name, const char *username, const char *password, const char *labels, const long user_id)
+{
+    unsigned char key[DB_KEY_SIZE];
+    if (db_user_key(db, user_id, key) != 0) {
+        return -1;
+    }
+
+    // the password and its change log entry are written together
+    // so a sync never sees one without the other. the pooled
+    // connection is held throughout so nothing else joins it.
+    MYSQL *conn = db_conn_acquire(db);
+    if (conn == NULL) {
+        sodium_memzero(key, sizeof(key));
+        return -1;
+    }
+
+    MYSQL_STMT *insert_password_stmt = mysql_stmt_init(conn);
+
+    int result = mysql_stmt_prepare(insert_password_stmt, INSERT_PASSWORD_QUERY, strlen(INSERT_PASSWORD_QUERY));  
+    if (result != 0) {
+        sodium_memzero(key, sizeof(key));
+        db_error_save(conn);
+        mysql_stmt_close(insert_password_stmt);
+        db_conn_release(db, conn);
+        return result;
+    }
+
+    char *sealed = secret_seal(key, password);
+    sodium_memzero(key, sizeof(key));
+    if (sealed == NULL) {
+        snprintf(db_error, sizeof(db_error), "unable to seal password");
+        mysql_stmt_close(insert_password_stmt);
+        db_conn_release(db, conn);
+        return 1;
+    }
+
+    MYSQL_BIND bind[4];
+
+    unsigned int array_size = 1; 
+    unsigned long name_len = strlen(name);
+    unsigned long username_len = strlen(username);
+    unsigned long password_len = strlen(sealed);
+
+    memset(bind, 0, sizeof(bind)); 
+
+    bind[0].buffer_type = MYSQL_TYPE_STRING; 
+    bind[0].buffer = (char *)name;
+    bind[0].buffer_length = strlen(name); 
+    bind[0].length = &name_len;
+
+    bind[1].buffer_type = MYSQL_TYPE_STRING; 
+    bind[1].buffer = (char *)username;
+    bind[1].buffer_length = strlen(username); 
+    bind[1].length = &username_len;
+
+    bind[2].buffer_type = MYSQL_TYPE_STRING; 
+    bind[2].buffer = sealed;
+    bind[2].buffer_length = password_len; 
+    bind[2].length = &password_len;
+
+    bind[3].buffer_type = MYSQL_TYPE_LONG; 
+    bind[3].buffer = (long*)&user_id; 
+    bind[3].is_null = 0;
+    bind[3].length = 0;
+
+    MYSQL_STMT *change_stmt = NULL;
+    result = 1;
+    if (mysql_stmt_bind_param(insert_password_stmt, bind) == 0 &&
+        (change_stmt = db_change_stmt_new(conn)) != NULL &&
+        mysql_query(conn, "START TRANSACTION") == 0) {
+        result = mysql_stmt_execute(insert_password_stmt); 
+        if (result != 0) {
+            db_stmt_error_save(insert_password_stmt);
+        } else if ((result = db_change_add(change_stmt, user_id, name, DB_CHANGE_CREATE)) != 0) {
+            db_stmt_error_save(change_stmt);
+        } else if (mysql_commit(conn)) {
+            db_error_save(conn);
+            result = 1;
+        }
+        if (result != 0) {
+            mysql_rollback(conn);
+        }
+    } else {
+        db_error_save(conn);
+    }
+
+    free(sealed);
+    if (change_stmt != NULL) {
+        mysql_stmt_close(change_stmt);
+    }
+    mysql_stmt_close(insert_password_stmt);
+    db_conn_release(db, conn);
+
+    return result;
+}
+
+int
+db_label_add(db_t *db, char *label, long pass_id)
+{
+    return 0;
+}
+
+int
+db_user_add(db_t *db, const char *username, const char *first_name, const char *last_name, const char *password, const char *token)
+{
+    MYSQL *conn = db_conn_acquire(db);
+    if (conn == NULL) {
+        return 1;
+    }
+
+    MYSQL_STMT *insert_user_stmt = mysql_stmt_init(conn);
+
+    int result = mysql_stmt_prepare(insert_user_stmt, INSERT_USER_QUERY, strlen(INSERT_USER_QUERY));  
+    if (result != 0) {
+        mysql_stmt_close(insert_user_stmt);
+        db_conn_release(db, conn);
+        return result;
+    }
+    
+    MYSQL_BIND bind[5];
+    memset(bind, 0, sizeof(bind));
+
+    unsigned int array_size = 1; 
+    unsigned long username_len = strlen(username);
+    unsigned long first_name_len = strlen(first_name);
+    unsigned long last_name_len = strlen(last_name);
+    unsigned long password_len = strlen(password);
+    unsigned long token_len = strlen(token);
+
+    bind[0].buffer_type = MYSQL_TYPE_STRING; 
+    bind[0].buffer = (char *)username;
+    bind[0].buffer_length = strlen(username); 
+    bind[0].length = &username_len;
+
+    bind[1].buffer_type = MYSQL_TYPE_STRING; 
+    bind[1].buffer = (char *)first_name;
+    bind[1].buffer_length = strlen(first_name); 
+    bind[1].length = &first_name_len;
+
+    bind[2].buffer_type = MYSQL_TYPE_STRING; 
+    bind[2].buffer = (char *)last_name;
+    bind[2].buffer_length = strlen(last_name); 
+    bind[2].length = &last_name_len;
+
+    bind[3].buffer_type = MYSQL_TYPE_STRING; 
+    bind[3].buffer = (char *)password;
+    bind[3].buffer_length = strlen(password); 
+    bind[3].length = &password_len;
+
+    bind[4].buffer_type = MYSQL_TYPE_STRING; 
+    bind[4].buffer = (char *)token;
+    bind[4].buffer_length = strlen(token); 
+    bind[4].length = &token_len;
+    
+    result = 1;
+    if (mysql_stmt_bind_param(insert_user_stmt, bind) == 0) {
+        result = mysql_stmt_execute(insert_user_stmt);
+    }
+    if (result != 0) {
+        db_stmt_error_save(insert_user_stmt);
+    } else {
+        user_cache_invalidate(&db->user_cache, mysql_stmt_insert_id(insert_user_stmt));
+    }
+
+    mysql_stmt_close(insert_user_stmt);
+    db_conn_release(db, conn);
+
+    return result;
+}
+
+int
+db_user_set_password(db_t *db, const long id, const char *password)
+{
+    MYSQL *conn = db_conn_acquire(db);
+    if (conn == NULL) {
+        return 1;
+    }
+
+    MYSQL_STMT *update_password_stmt = mysql_stmt_init(conn);
+
+    int result = mysql_stmt_prepare(update_password_stmt, UPDATE_USER_PASSWORD_QUERY, strlen(UPDATE_USER_PASSWORD_QUERY));
+    if (result != 0) {
+        mysql_stmt_close(update_password_stmt);
+        db_conn_release(db, conn);
+        return result;
+    }
+
+    MYSQL_BIND bind[2];
+    memset(bind, 0, sizeof(bind));
+
+    unsigned long password_len = strlen(password);
+
+    bind[0].buffer_type = MYSQL_TYPE_STRING;
+    bind[0].buffer = (char *)password;
+    bind[0].buffer_length = password_len;
+    bind[0].length = &password_len;
+
+    bind[1].buffer_type = MYSQL_TYPE_LONGLONG;
+    bind[1].buffer = (long*)&id;
+
+    if (mysql_stmt_bind_param(update_password_stmt, bind)) {
+        mysql_stmt_close(update_password_stmt);
+        db_conn_release(db, conn);
+        return 1;
+    }
+
+    result = mysql_stmt_execute(update_password_stmt);
+    if (result != 0) {
+        db_stmt_error_save(update_password_stmt);
+    }
+    mysql_stmt_close(update_password_stmt);
+    db_conn_release(db, conn);
+
+    user_cache_invalidate(&db->user_cache, id);
+
+    return result;
+}
+
+uint64_t
+db_users_get_all(db_t *db, arena_t *arena, user_t ***users)
+{
+    *users = NULL;
+
+    MYSQL_RES *res = db_select(db, SELECT_ALL_USERS_QUERY);
+    if (res == NULL) {
+        return -1;
+    }
+
+    uint64_t row_count = mysql_num_rows(res);
+    if (row_count == 0) {
+        goto CLEANUP;
+    }
+
+    *users = db_alloc(arena, sizeof(user_t*)*row_count);
+
+    uint64_t i = 0;
+    MYSQL_ROW row;
+
+    while ((row = mysql_fetch_row(res)) != NULL) {
+        user_t *user = db_user_new(arena);
+        db_user_from_row(user, row);
+
+        (*users)[i] = user;
+        i++;
+    }
+
+CLEANUP:
+    mysql_free_result(res);
+
+    return row_count;
+}
+
+int
+db_user_get_by_username(db_t *db, const char *username, user_t *user)
+{
+    char *query = db_query(user->arena, SELECT_USER_BY_NAME_QUERY, username);
+
+    MYSQL_RES *res = db_select(db, query);
+    if (res == NULL) {
+        db_query_free(user->arena, query);
+        return -1;
+    }
+
+    uint64_t row_count = mysql_num_rows(res);
+
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(res)) != NULL) {
+        db_user_from_row(user, row);
+    }
+
+    db_query_free(user->arena, query);
+    mysql_free_result(res);
+
+    return row_count;
+}
+
+int
+db_user_get_by_id(db_t *db, const long id, user_t *user)
+{
+    char *query = db_query(user->arena, SELECT_USER_BY_ID_QUERY, id);
+
+    MYSQL_RES *res = db_select(db, query);
+    if (res == NULL) {
+        db_query_free(user->arena, query);
+        return -1;
+    }
+
+    uint64_t row_count = mysql_num_rows(res);
+
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(res)) != NULL) {
+        db_user_from_row(user, row);
+    }
+
+    db_query_free(user->arena, query);
+    mysql_free_result(res);
+
+    return row_count;
+}
+
+int
+db_user_get_profile(db_t *db, const long id, user_t *user)
+{
+    struct user_cache *cache = &db->user_cache;
+
+    if (cache->slots != NULL && id > 0) {
+        pthread_mutex_lock(&cache->lock);
+        struct user_profile *profile = &cache->slots[id % cache->size];
+        if (profile->id == id) {
+            user->id = profile->id;
+            db_set_string(user->arena, &user->username, profile->username);
+            db_set_string(user->arena, &user->first_name, profile->first_name);
+            db_set_string(user->arena, &user->last_name, profile->last_name);
+            cache->hits++;
+            pthread_mutex_unlock(&cache->lock);
+            return 1;
+        }
+        cache->misses++;
+        pthread_mutex_unlock(&cache->lock);
+    }
+
+    char *query = db_query(user->arena, SELECT_USER_PROFILE_BY_ID_QUERY, id);
+
+    MYSQL_RES *res = db_select(db, query);
+    if (res == NULL) {
+        db_query_free(user->arena, query);
+        return -1;
+    }
+
+    uint64_t row_count = mysql_num_rows(res);
+
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(res)) != NULL) {
+        user->id = strtol(row[0], NULL, 10);
+        db_set_string(user->arena, &user->username, row[1]);
+        db_set_string(user->arena, &user->first_name, row[2]);
+        db_set_string(user->arena, &user->last_name, row[3]);
+    }
+
+    db_query_free(user->arena, query);
+    mysql_free_result(res);
+
+    if (row_count == 1 && cache->slots != NULL) {
+        pthread_mutex_lock(&cache->lock);
+        struct user_profile *profile = &cache->slots[id % cache->size];
+        user_profile_clear(profile);
+        profile->id = user->id;
+        profile->username = strdup(user->username);
+        profile->first_name = strdup(user->first_name);
+        profile->last_name = strdup(user->last_name);
+        pthread_mutex_unlock(&cache->lock);
+    }
+
+    return row_count;
+}
+
+void
+db_user_cache_stats(db_t *db, db_cache_stats_t *stats)
+{
+    struct user_cache *cache = &db->user_cache;
+
+    pthread_mutex_lock(&cache->lock);
+    stats->size = cache->size;
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+int
+db_user_get_by_token(db_t *db, const char *token, user_t *user)
+{
+    char *query = db_query(user->arena, SELECT_USER_BY_TOKEN_QUERY, token);
+
+    MYSQL_RES *res = db_select(db, query);
+    if (res == NULL) {
+        db_query_free(user->arena, query);
+        return -1;
+    }
+
+    uint64_t row_count = mysql_num_rows(res);
+
+    MYSQL_ROW row;
     while ((row = mysql_fetch_row(res)) != NULL) {
-        user->id = strtol(row[0], &endptr, 10);
+        db_user_from_row(user, row);
+    }
+
+    db_query_free(user->arena, query);
+    mysql_free_result(res);
+
+    return row_count;
+}
+
+int
+db_user_get_token(db_t *db, const char *username, const char *password, user_t *user)
+{
+    char *query = db_query(user->arena, SELECT_TOKEN_BY_USERNAME_QUERY, username, password);
+
+    MYSQL_RES *res = db_select(db, query);
+    if (res == NULL) {
+        db_query_free(user->arena, query);
+        return 0;
+    }
 
-        user->username = realloc(user->token, strlen(row[1]));
-        strcpy(user->username, row[1]);
+    uint64_t row_count = mysql_num_rows(res);
+
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(res)) != NULL) {
+        db_set_string(user->arena, &user->token, row[0]);
+    }
+
+    db_query_free(user->arena, query);
+    mysql_free_result(res);
+
+    return row_count;
+}
+
+void
+db_user_free(user_t *user)
+{
+    if (user == NULL || user->arena != NULL) {
+        return;
+    }
+
+    free(user->username);
+    free(user->first_name);
+    free(user->last_name);
+    free(user->password);
+    free(user->token);
+    free(user);
+}
+
+void
+db_users_free(user_t **users, const uint64_t size)
+{
+    if (users == NULL || (size > 0 && users[0]->arena != NULL)) {
+        return;
+    }
+
+    for (uint64_t i = 0; i < size; i++) {
+        db_user_free(users[i]);
+    }
+
+    free(users);
+}
+
+int
+db_password_get_by_name(db_t *db, const char *name, const long user_id, password_t *pass)
+{
+    char *query = db_query(pass->arena, SELECT_PASSWORD_BY_NAME_QUERY, name, user_id);
+
+    MYSQL_RES *res = db_select(db, query);
+    if (res == NULL) {
+        db_query_free(pass->arena, query);
+        return -1;
+    }
+
+    uint64_t row_count = mysql_num_rows(res);
+
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(res)) != NULL) {
+        pass->id = strtol(row[0], NULL, 10);
+        db_set_string(pass->arena, &pass->name, row[1]);
+        db_set_string(pass->arena, &pass->username, row[2]);
+        db_set_string(pass->arena, &pass->password, row[3]);
+        pass->user_id = strtol(row[4], NULL, 10);
+    }
+
+    db_query_free(pass->arena, query);
+    mysql_free_result(res);
+
+    if (row_count > 0 && db_passwords_open_all(db, pass->user_id, &pass, 1) != 0) {
+        return -1;
+    }
+
+    return row_count;
+}
 
-        user->first_name = realloc(user->token, strlen(row[2]));
-        strcpy(user->first_name, row[2]);
+int
+db_password_get_by_token(db_t *db, const char *name, const char *token, password_t *pass)
+{
+    char *query = db_query(pass->arena, SELECT_PASSWORD_BY_TOKEN_QUERY, name, token);
 
-        user->last_name = realloc(user->token, strlen(row[3]));
-        strcpy(user->last_name, row[3]);
+    MYSQL_RES *res = db_select(db, query);
+    if (res == NULL) {
+        db_query_free(pass->arena, query);
+        return -1;
+    }
 
-        user->password = realloc(user->token, strlen(row[4]));
-        strcpy(user->password, row[4]);
+    uint64_t row_count = mysql_num_rows(res);
 
-        user->token = realloc(user->token,strlen(row[5]));
-        strcpy(user->token, row[5]);
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(res)) != NULL) {
+        pass->id = strtol(row[0], NULL, 10);
+        db_set_string(pass->arena, &pass->name, row[1]);
+        db_set_string(pass->arena, &pass->username, row[2]);
+        db_set_string(pass->arena, &pass->password, row[3]);
+        pass->user_id = strtol(row[4], NULL, 10);
     }
 
-CLEANUP:
-    free(query);
+    db_query_free(pass->arena, query);
     mysql_free_result(res);
 
+    if (row_count > 0 && db_passwords_open_all(db, pass->user_id, &pass, 1) != 0) {
+        return -1;
+    }
+
     return row_count;
 }
 
 int
-db_user_get_token(db_t *db, const char *username, const char *password, user_t *user)
+db_passwords_get_by_token(db_t *db, arena_t *arena, const char *token, password_t ***passwords)
 {
-    char *query = malloc(strlen(SELECT_TOKEN_BY_USERNAME_QUERY)+strlen(username)+strlen(password));
-    sprintf(query, SELECT_TOKEN_BY_USERNAME_QUERY, username, password);
+    *passwords = NULL;
 
-    if (mysql_query(db->conn, query)) {
-        return 0;
+    char *query = db_query(arena, SELECT_PASSWORDS_BY_TOKEN_QUERY, token);
+
+    MYSQL_RES *res = db_select(db, query);
+    if (res == NULL) {
+        db_query_free(arena, query);
+        return -1;
     }
-    
-    MYSQL_RES *res = mysql_store_result(db->conn);
-    uint64_t row_count = mysql_num_rows(res);
 
+    uint64_t row_count = mysql_num_rows(res);
     if (row_count == 0) {
-        return row_count;
+        goto CLEANUP;
     }
 
+    *passwords = db_alloc(arena, sizeof(password_t*)*row_count);
+    
+    uint64_t i = 0;
+    MYSQL_ROW row;
+
     while ((row = mysql_fetch_row(res)) != NULL) {
-        user->token = realloc(user->token, strlen(row[0]));
-        strcpy(user->token, row[0]);
+        password_t *pass = db_password_new(arena);
+
+        pass->id = strtol(row[0], NULL, 10);
+        db_set_string(arena, &pass->name, row[1]);
+        db_set_string(arena, &pass->username, row[2]);
+        db_set_string(arena, &pass->password, row[3]);
+        pass->user_id = strtol(row[4], NULL, 10);
+
+        (*passwords)[i] = pass;
+        i++;
     }
 
-    free(query);
+CLEANUP:
+    db_query_free(arena, query);
     mysql_free_result(res);
 
+    if (row_count > 0 && db_passwords_open_all(db, (*passwords)[0]->user_id, *passwords, row_count) != 0) {
+        return -1;
+    }
+
     return row_count;
 }
 
-// db_user_free frees the memory allocated for the 
-// get user call.
-void
-db_user_free(user_t *user)
+int
+db_changes_last_seq(db_t *db, const long user_id, uint64_t *seq)
 {
-    if (user == NULL) {
-        return;
+    char *query = db_query(NULL, SELECT_LAST_CHANGE_SEQ_QUERY, user_id);
+    MYSQL_RES *res = db_select(db, query);
+    db_query_free(NULL, query);
+    if (res == NULL) {
+        return -1;
     }
 
-    if (user->username != NULL) {
-        free(user->username);
+    MYSQL_ROW row = mysql_fetch_row(res);
+    *seq = row != NULL && row[0] != NULL ? strtoull(row[0], NULL, 10) : 0;
+    mysql_free_result(res);
+
+    return 0;
+}
+
+int
+db_changes_get_since(db_t *db, arena_t *arena, const long user_id, const uint64_t since, const int limit, change_t ***changes)
+{
+    *changes = NULL;
+
+    char *query = db_query(arena, SELECT_CHANGES_SINCE_QUERY, user_id, since, limit);
+
+    MYSQL_RES *res = db_select(db, query);
+    if (res == NULL) {
+        db_query_free(arena, query);
+        return -1;
     }
 
-    if (user->first_name != NULL) {
-        free(user->first_name);
+    uint64_t row_count = mysql_num_rows(res);
+    if (row_count == 0) {
+        goto CLEANUP;
     }
 
-    if (user->last_name != NULL) {
-        free(user->last_name);
+    *changes = db_alloc(arena, sizeof(change_t*)*row_count);
+    password_t **passwords = db_alloc(arena, sizeof(password_t*)*row_count);
+
+    uint64_t i = 0;
+    MYSQL_ROW row;
+
+    while ((row = mysql_fetch_row(res)) != NULL) {
+        change_t *change = db_alloc(arena, sizeof(change_t));
+        change->arena = arena;
+        change->seq = strtoull(row[0], NULL, 10);
+        change->operation = NULL;
+        change->pass = db_password_new(arena);
+        change->pass->user_id = user_id;
+        db_set_string(arena, &change->pass->name, row[1]);
+
+        // a row that's gone is a tombstone whatever was last
+        // logged for it
+        if (row[3] == NULL) {
+            db_set_string(arena, &change->operation, DB_CHANGE_DELETE);
+        } else {
+            db_set_string(arena, &change->operation, row[2]);
+            change->pass->id = strtol(row[3], NULL, 10);
+            db_set_string(arena, &change->pass->username, row[4]);
+            db_set_string(arena, &change->pass->password, row[5]);
+        }
+
+        passwords[i] = change->pass;
+        (*changes)[i] = change;
+        i++;
     }
 
-    if (user->password != NULL) {
-        free(user->password);
+    if (db_passwords_open_all(db, user_id, passwords, row_count) != 0) {
+        row_count = -1;
     }
-    
-    if (user->token != NULL) {
-        free(user->token);
+    if (arena == NULL) {
+        free(passwords);
     }
 
-    free(user);
+CLEANUP:
+    db_query_free(arena, query);
+    mysql_free_result(res);
+
+    return row_count;
 }
 
-// db_users_free frees the memory allocated for the 
-// get users call.
 void
-db_users_free(user_t **user, const uint64_t size)
+db_changes_free(change_t **changes, const uint64_t size)
 {
-    if (user == NULL) {
+    if (changes == NULL || (size > 0 && changes[0]->arena != NULL)) {
         return;
     }
 
     for (uint64_t i = 0; i < size; i++) {
-        if (user[i]->username != NULL) {
-            free(user[i]->username);
-        }
-
-        if (user[i]->first_name != NULL) {
-            free(user[i]->first_name);
-        }
-
-        if (user[i]->last_name != NULL) {
-            free(user[i]->last_name);
-        }
-
-        if (user[i]->password != NULL) {
-            free(user[i]->password);
-        }
-
-        free(user[i]);
+        db_password_free(changes[i]->pass);
+        free(changes[i]->operation);
+        free(changes[i]);
     }
+
+    free(changes);
 }
 
 int
-db_password_get_by_name(db_t *db, const char *name, const long user_id, password_t *pass)
+db_password_names_get(db_t *db, arena_t *arena, const long user_id, password_t ***passwords)
 {
-    char *query = malloc(strlen(SELECT_PASSWORD_BY_NAME_QUERY)+strlen(name));
-    sprintf(query, SELECT_PASSWORD_BY_NAME_QUERY, name, user_id);
+    *passwords = NULL;
 
-    if (mysql_query(db->conn, query)) {
-        return 1;
+    char *query = db_query(arena, SELECT_PASSWORD_NAMES_BY_USER_ID_QUERY, user_id);
+
+    MYSQL_RES *res = db_select(db, query);
+    if (res == NULL) {
+        db_query_free(arena, query);
+        return -1;
     }
 
-    MYSQL_RES *res = mysql_store_result(db->conn);
     uint64_t row_count = mysql_num_rows(res);
-    if (row_count == 0) {
-        goto CLEANUP;
+    if (row_count > 0) {
+        *passwords = db_alloc(arena, sizeof(password_t*)*row_count);
     }
 
-    char *endptr;
+    uint64_t i = 0;
+    MYSQL_ROW row;
 
     while ((row = mysql_fetch_row(res)) != NULL) {
-        pass->id = strtol(row[0], &endptr, 10);
-
-        pass->name = malloc(strlen(row[1]));
-        strcpy(pass->name, row[1]);
+        password_t *pass = db_password_new(arena);
 
-        pass->username = malloc(strlen(row[1]));
-        strcpy(pass->username, row[1]);
+        pass->id = strtol(row[0], NULL, 10);
+        db_set_string(arena, &pass->name, row[1]);
+        pass->user_id = user_id;
 
-        pass->password = malloc(strlen(row[2]));
-        strcpy(pass->password, row[2]);
-
-        pass->user_id = strtol(row[3], &endptr, 10);
+        (*passwords)[i] = pass;
+        i++;
     }
 
-CLEANUP:
-    free(query);
+    db_query_free(arena, query);
     mysql_free_result(res);
 
-    return 0;
+    return row_count;
 }
 
 int
-db_password_get_by_token(db_t *db, const char *name, const char *token, password_t *pass)
+db_passwords_get_by_names(db_t *db, arena_t *arena, const long user_id, const char **names, const size_t count, password_t ***passwords)
 {
-    char *query = malloc(strlen(SELECT_PASSWORD_BY_TOKEN_QUERY)+strlen(name)+strlen(token));
-    sprintf(query, SELECT_PASSWORD_BY_TOKEN_QUERY, name, token);
+    *passwords = NULL;
+    if (count == 0) {
+        return 0;
+    }
 
-    if (mysql_query(db->conn, query)) {
-        return 1;
+    // build the "?, ?, ..." placeholder list for the IN clause
+    char *placeholders = malloc((count * 3) + 1);
+    char *p = placeholders;
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0) {
+            *p++ = ',';
+            *p++ = ' ';
+        }
+        *p++ = '?';
     }
+    *p = '\0';
 
-    MYSQL_RES *res = mysql_store_result(db->conn);
-    uint64_t row_count = mysql_num_rows(res);
+    char *query = malloc(strlen(SELECT_PASSWORDS_BY_NAMES_QUERY)+strlen(placeholders)+1);
+    sprintf(query, SELECT_PASSWORDS_BY_NAMES_QUERY, placeholders);
+    free(placeholders);
 
-    char *endptr;
+    int ret = -1;
+    MYSQL_BIND *bind = NULL;
+    unsigned long *name_lens = NULL;
+    MYSQL_RES *meta = NULL;
+    char *columns[3] = {0};
 
-    while ((row = mysql_fetch_row(res)) != NULL) {
-        pass->id = strtol(row[0], &endptr, 10);
+    MYSQL *conn = db_conn_acquire(db);
+    if (conn == NULL) {
+        free(query);
+        return -1;
+    }
+
+    MYSQL_STMT *stmt = mysql_stmt_init(conn);
+    if (mysql_stmt_prepare(stmt, query, strlen(query)) != 0) {
+        goto CLEANUP;
+    }
 
-        pass->name = malloc(strlen(row[1]));
-        strcpy(pass->name, row[1]);
+    bind = calloc(count + 1, sizeof(MYSQL_BIND));
+    name_lens = calloc(count, sizeof(unsigned long));
 
-        pass->username = malloc(strlen(row[2]));
-        strcpy(pass->username, row[2]);
+    bind[0].buffer_type = MYSQL_TYPE_LONGLONG;
+    bind[0].buffer = (long*)&user_id;
 
-        pass->password = malloc(strlen(row[3]));
-        strcpy(pass->password, row[3]);
+    for (size_t i = 0; i < count; i++) {
+        name_lens[i] = strlen(names[i]);
+        bind[i+1].buffer_type = MYSQL_TYPE_STRING;
+        bind[i+1].buffer = (char *)names[i];
+        bind[i+1].buffer_length = name_lens[i];
+        bind[i+1].length = &name_lens[i];
     }
 
-    free(query);
-    mysql_free_result(res);
-
-    return 0;
-}
+    if (mysql_stmt_bind_param(stmt, bind)) {
+        goto CLEANUP;
+    }
 
-int
-db_passwords_get_by_token(db_t *db, const char *token, password_t **passwords)
-{
-    char *query = malloc(strlen(SELECT_PASSWORDS_BY_TOKEN_QUERY)+strlen(token)+1);
-    sprintf(query, SELECT_PASSWORDS_BY_TOKEN_QUERY, token);
+    // have the client compute max column lengths so the
+    // result buffers can be sized once for every row
+    bool update_max_length = true;
+    mysql_stmt_attr_set(stmt, STMT_ATTR_UPDATE_MAX_LENGTH, &update_max_length);
 
-    if (mysql_query(db->conn, query)) {
-        return 1;
+    if (mysql_stmt_execute(stmt) != 0 || mysql_stmt_store_result(stmt) != 0) {
+        goto CLEANUP;
     }
 
-    MYSQL_RES *res = mysql_store_result(db->conn);
-    uint64_t row_count = mysql_num_rows(res);
-    if (row_count == 0) {
+    meta = mysql_stmt_result_metadata(stmt);
+    if (meta == NULL) {
         goto CLEANUP;
     }
 
-    if (row_count > 2) {
-        passwords = realloc(passwords, sizeof(password_t*)*row_count);
+    long long id = 0;
+    unsigned long lengths[3];
+    MYSQL_BIND result[4];
+    memset(result, 0, sizeof(result));
+
+    result[0].buffer_type = MYSQL_TYPE_LONGLONG;
+    result[0].buffer = &id;
+
+    for (int i = 0; i < 3; i++) {
+        unsigned long max_length = mysql_fetch_field_direct(meta, i+1)->max_length;
+        columns[i] = malloc(max_length+1);
+        result[i+1].buffer_type = MYSQL_TYPE_STRING;
+        result[i+1].buffer = columns[i];
+        result[i+1].buffer_length = max_length+1;
+        result[i+1].length = &lengths[i];
     }
-    
-    uint64_t i = 0;
-    char *endptr;
 
-    while ((row = mysql_fetch_row(res)) != NULL) {
-        password_t *pass = db_password_new();
+    if (mysql_stmt_bind_result(stmt, result)) {
+        goto CLEANUP;
+    }
 
-        pass->id = strtol(row[0], &endptr, 10);
+    uint64_t row_count = mysql_stmt_num_rows(stmt);
+    if (row_count > 0) {
+        *passwords = db_alloc(arena, sizeof(password_t*)*row_count);
+    }
+
+    uint64_t i = 0;
+    while (i < row_count && mysql_stmt_fetch(stmt) == 0) {
+        password_t *pass = db_password_new(arena);
 
-        pass->name = realloc(pass->name, strlen(row[1])+1);
-        strcpy(pass->name, row[1]);
+        // the bound buffers aren't terminated so do it here
+        // before copying them out.
+        columns[0][lengths[0]] = '\0';
+        columns[1][lengths[1]] = '\0';
+        columns[2][lengths[2]] = '\0';
 
-        pass->username = realloc(pass->username, strlen(row[2])+1);
-        strcpy(pass->username, row[2]);
+        pass->id = id;
+        db_set_string(arena, &pass->name, columns[0]);
+        db_set_string(arena, &pass->username, columns[1]);
+        db_set_string(arena, &pass->password, columns[2]);
 
-        pass->password = realloc(pass->password, strlen(row[3])+1);
-        strcpy(pass->password, row[3]);
+        pass->user_id = user_id;
 
-        passwords[i] = pass;
+        (*passwords)[i] = pass;
         i++;
     }
 
+    ret = (int)i;
+
 CLEANUP:
+    for (int i = 0; i < 3; i++) {
+        free(columns[i]);
+    }
+    if (meta != NULL) {
+        mysql_free_result(meta);
+    }
+    if (ret < 0) {
+        db_stmt_error_save(stmt);
+    }
+    mysql_stmt_close(stmt);
+    db_conn_release(db, conn);
+    free(bind);
+    free(name_lens);
     free(query);
-    mysql_free_result(res);
 
-    return row_count;
+    // opened once the connection is back so it can be reused
+    if (ret > 0 && db_passwords_open_all(db, user_id, *passwords, ret) != 0) {
+        ret = -1;
+    }
+
+    return ret;
 }
 
 void
 db_password_free(password_t *pass)
 {
-    if (pass == NULL) {
+    if (pass == NULL || pass->arena != NULL) {
         return;
     }
 
-    if (pass->name != NULL) {
-        free(pass->name);
-    }
-
-    if (pass->username != NULL) {
-        free(pass->username);
-    }
-
-    if (pass->password != NULL) {
-        free(pass->password);
-    }
+    free(pass->name);
+    free(pass->username);
+    free(pass->password);
+    free(pass);
 }
 
-// db_passwords_free frees the memory allocated for the 
-// get passwords call.
 void
 db_passwords_free(password_t **passwords, const uint64_t size)
 {
-    if (passwords == NULL) {
+    if (passwords == NULL || (size > 0 && passwords[0]->arena != NULL)) {
         return;
     }
 
     for (uint64_t i = 0; i < size; i++) {
-        if (passwords[i]->name != NULL) {
-            free(passwords[i]->name);
-        }
-
-        if (passwords[i]->username != NULL) {
-            free(passwords[i]->username);
-        }
-
-        if (passwords[i]->password != NULL) {
-            free(passwords[i]->password);
-        }
-
-        free(passwords[i]);
+        db_password_free(passwords[i]);
     }
+
+    free(passwords);
 }
 
 u_key_t*
-db_key_new()
+db_key_new(arena_t *arena)
 {
-    u_key_t *key = malloc(sizeof(u_key_t));
+    u_key_t *key = db_alloc(arena, sizeof(u_key_t));
     key->id = 0;
-    key->key = calloc(0, sizeof(char));
+    key->arena = arena;
+    key->key = db_alloc(arena, DB_KEY_SIZE);
+    memset(key->key, 0, DB_KEY_SIZE);
 
     return key;
 }
@@ -756,82 +1764,263 @@ db_key_new()
 void
 db_key_free(u_key_t *key)
 {
-    if (key == NULL) {
+    if (key == NULL || key->arena != NULL) {
         return;
     }
 
-    if (key->key != NULL) {
-        free(key->key);
+    sodium_memzero(key->key, DB_KEY_SIZE);
+    free(key->key);
+    free(key);
+}
+
+int
+db_key_add(db_t *db, const unsigned char key[DB_KEY_SIZE], const long user_id)
+{
+    MYSQL *conn = db_conn_acquire(db);
+    if (conn == NULL) {
+        return 1;
     }
 
-    free(key);
+    int result = db_key_insert(conn, key, user_id);
+    db_conn_release(db, conn);
+
+    return result;
 }
 
 int
-db_key_add(db_t *db, const unsigned char key[32], const long user_id)
+db_key_get_by_user_id(db_t *db, const long user_id, u_key_t *key)
 {
-    MYSQL_STMT *insert_user_key_stmt = mysql_stmt_init(db->conn);
+    MYSQL *conn = db_conn_acquire(db);
+    if (conn == NULL) {
+        return -1;
+    }
 
-    int result = mysql_stmt_prepare(insert_user_key_stmt, INSERT_USER_KEY_QUERY, strlen(INSERT_USER_KEY_QUERY));  
+    int result = db_fetch_key(conn, user_id, (unsigned char *)key->key);
+    db_conn_release(db, conn);
+
+    return result;
+}
+
+db_cursor_t*
+db_passwords_open(db_t *db, const long user_id)
+{
+    db_cursor_t *cursor = calloc(1, sizeof(db_cursor_t));
+
+    cursor->conn = mysql_init(NULL);
+    if (!mysql_real_connect(cursor->conn, db->server, db->user, db->password, db->database, 0, NULL, 0)) {
+        db_cursor_close(cursor);
+        return NULL;
+    }
+
+    // the key has to be read before the rows start streaming
+    // since the connection is busy until they've all been read
+    int has_key = db_fetch_key(cursor->conn, user_id, cursor->key);
+    if (has_key < 0) {
+        db_cursor_close(cursor);
+        return NULL;
+    }
+    cursor->has_key = has_key == 1;
+
+    char *query = db_query(NULL, SELECT_PASSWORDS_BY_USER_ID_QUERY, user_id);
+    int result = mysql_query(cursor->conn, query);
+    db_query_free(NULL, query);
     if (result != 0) {
-        return result;
+        db_cursor_close(cursor);
+        return NULL;
     }
-    
-    MYSQL_BIND bind[2];
-    memset(bind, 0, sizeof(bind));
 
-    unsigned int array_size = 1; 
-    unsigned long key_len = strlen(key);
+    cursor->res = mysql_use_result(cursor->conn);
+    if (cursor->res == NULL) {
+        db_cursor_close(cursor);
+        return NULL;
+    }
 
-    bind[0].buffer_type = MYSQL_TYPE_STRING; 
-    bind[0].buffer = (char *)key;
-    bind[0].buffer_length = strlen(key); 
-    bind[0].length = &key_len;
+    return cursor;
+}
 
-    bind[1].buffer_type = MYSQL_TYPE_LONG; 
-    bind[1].buffer = (long*)&user_id; 
-    bind[1].is_null = 0;
-    bind[1].length = 0;
-    
-    if (mysql_stmt_bind_param(insert_user_key_stmt, bind)) {
-        return result;
+int
+db_passwords_next(db_cursor_t *cursor, password_t *pass)
+{
+    MYSQL_ROW row = mysql_fetch_row(cursor->res);
+    if (row == NULL) {
+        return mysql_errno(cursor->conn) != 0 ? -1 : 0;
     }
-    
-    result = mysql_stmt_execute(insert_user_key_stmt); 
-    if (result != 0) {
-        return result;
+
+    pass->id = strtol(row[0], NULL, 10);
+    db_set_string(pass->arena, &pass->name, row[1]);
+    db_set_string(pass->arena, &pass->username, row[2]);
+    db_set_string(pass->arena, &pass->password, row[3]);
+
+    if (secret_is_sealed(pass->password) && (!cursor->has_key || secret_open(cursor->key, pass->password) != 0)) {
+        return -1;
     }
 
-    return 0;
+    return 1;
+}
+
+void
+db_cursor_close(db_cursor_t *cursor)
+{
+    if (cursor == NULL) {
+        return;
+    }
+
+    if (cursor->res != NULL) {
+        mysql_free_result(cursor->res);
+    }
+    mysql_close(cursor->conn);
+    sodium_memzero(cursor->key, sizeof(cursor->key));
+    free(cursor);
+}
+
+db_password_batch_t*
+db_password_batch_new(db_t *db, const long user_id, const size_t batch_size)
+{
+    unsigned char key[DB_KEY_SIZE];
+    if (db_user_key(db, user_id, key) != 0) {
+        return NULL;
+    }
+
+    MYSQL *conn = db_conn_acquire(db);
+    if (conn == NULL) {
+        sodium_memzero(key, sizeof(key));
+        return NULL;
+    }
+
+    MYSQL_STMT *stmt = mysql_stmt_init(conn);
+    if (mysql_stmt_prepare(stmt, IMPORT_PASSWORD_QUERY, strlen(IMPORT_PASSWORD_QUERY)) != 0) {
+        sodium_memzero(key, sizeof(key));
+        db_error_save(conn);
+        mysql_stmt_close(stmt);
+        db_conn_release(db, conn);
+        return NULL;
+    }
+
+    MYSQL_STMT *change_stmt = db_change_stmt_new(conn);
+    if (change_stmt == NULL) {
+        sodium_memzero(key, sizeof(key));
+        db_error_save(conn);
+        mysql_stmt_close(stmt);
+        db_conn_release(db, conn);
+        return NULL;
+    }
+
+    db_password_batch_t *batch = malloc(sizeof(db_password_batch_t));
+    memcpy(batch->key, key, sizeof(key));
+    sodium_memzero(key, sizeof(key));
+    batch->db = db;
+    batch->conn = conn;
+    batch->stmt = stmt;
+    batch->change_stmt = change_stmt;
+    batch->user_id = user_id;
+    batch->batch_size = batch_size > 0 ? batch_size : 1;
+    batch->pending = 0;
+
+    return batch;
 }
 
 int
-db_key_get_by_user_id(db_t *db, const long user_id, u_key_t *key)
+db_password_batch_add(db_password_batch_t *batch, const char *name, const char *username, const char *password)
 {
-    char sid[10 + sizeof(char)];
-    sprintf(sid, "%ld", user_id);
+    if (batch->pending == 0 && mysql_query(batch->conn, "START TRANSACTION")) {
+        db_error_save(batch->conn);
+        return -1;
+    }
 
-    char *query = malloc(strlen(SELECT_KEY_BY_USER_ID_QUERY)+strlen(sid));
-    sprintf(query, SELECT_KEY_BY_USER_ID_QUERY, user_id);
+    MYSQL_BIND bind[4];
+    memset(bind, 0, sizeof(bind));
 
-    if (mysql_query(db->conn, query)) {
+    char *sealed = secret_seal(batch->key, password);
+    if (sealed == NULL) {
+        snprintf(db_error, sizeof(db_error), "unable to seal password");
+        db_password_batch_rollback(batch);
         return -1;
     }
 
-    MYSQL_RES *res = mysql_store_result(db->conn);
-    uint64_t row_count = mysql_num_rows(res);
-    if (row_count == 0) {
-        goto CLEANUP;
+    unsigned long name_len = strlen(name);
+    unsigned long username_len = strlen(username);
+    unsigned long password_len = strlen(sealed);
+
+    bind[0].buffer_type = MYSQL_TYPE_STRING;
+    bind[0].buffer = (char *)name;
+    bind[0].buffer_length = name_len;
+    bind[0].length = &name_len;
+
+    bind[1].buffer_type = MYSQL_TYPE_STRING;
+    bind[1].buffer = (char *)username;
+    bind[1].buffer_length = username_len;
+    bind[1].length = &username_len;
+
+    bind[2].buffer_type = MYSQL_TYPE_STRING;
+    bind[2].buffer = sealed;
+    bind[2].buffer_length = password_len;
+    bind[2].length = &password_len;
+
+    bind[3].buffer_type = MYSQL_TYPE_LONGLONG;
+    bind[3].buffer = &batch->user_id;
+
+    int failed = mysql_stmt_bind_param(batch->stmt, bind) || mysql_stmt_execute(batch->stmt) != 0;
+    free(sealed);
+    if (failed) {
+        db_stmt_error_save(batch->stmt);
+        db_password_batch_rollback(batch);
+        return -1;
     }
 
-    while ((row = mysql_fetch_row(res)) != NULL) {
-        key->key = realloc(key->key, strlen(row[0]));
-        strcpy(key->key, row[0]);
+    // ON DUPLICATE KEY UPDATE reports 1 for an insert and 2
+    // for an update
+    int affected = (int)mysql_stmt_affected_rows(batch->stmt);
+    if (db_change_add(batch->change_stmt, batch->user_id, name, affected == 1 ? DB_CHANGE_CREATE : DB_CHANGE_UPDATE) != 0) {
+        db_stmt_error_save(batch->change_stmt);
+        db_password_batch_rollback(batch);
+        return -1;
     }
 
-CLEANUP:
-    free(query);
-    mysql_free_result(res);
+    batch->pending++;
+    if (batch->pending == batch->batch_size && db_password_batch_commit(batch) != 0) {
+        return -1;
+    }
 
-    return row_count;
+    return affected;
+}
+
+int
+db_password_batch_commit(db_password_batch_t *batch)
+{
+    if (batch->pending == 0) {
+        return 0;
+    }
+
+    batch->pending = 0;
+    if (mysql_commit(batch->conn)) {
+        db_error_save(batch->conn);
+        db_password_batch_rollback(batch);
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+db_password_batch_rollback(db_password_batch_t *batch)
+{
+    mysql_rollback(batch->conn);
+    batch->pending = 0;
+}
+
+void
+db_password_batch_free(db_password_batch_t *batch)
+{
+    if (batch == NULL) {
+        return;
+    }
+
+    if (batch->pending > 0) {
+        db_password_batch_rollback(batch);
+    }
+    mysql_stmt_close(batch->change_stmt);
+    mysql_stmt_close(batch->stmt);
+    db_conn_release(batch->db, batch->conn);
+    sodium_memzero(batch->key, sizeof(batch->key));
+    free(batch);
 }
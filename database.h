@@ -29,14 +29,37 @@
 #define _DATABASE_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include <mysql/mysql.h>
 
+#include "arena.h"
+#include "pool.h"
+
+
+#define DB_KEY_SIZE 32
+
+/**
+ * DB_TOKEN_SIZE is the length of a user's auth token.
+ */
+#define DB_TOKEN_SIZE 32
+
+#define DB_CHANGE_CREATE "create"
+#define DB_CHANGE_UPDATE "update"
+#define DB_CHANGE_DELETE "delete"
 
 typedef struct db db_t;
+typedef struct db_cursor db_cursor_t;
+typedef struct db_password_batch db_password_batch_t;
 
+/**
+ * Records are allocated from the arena they were created
+ * with. When the arena is NULL they're heap allocated and
+ * need to be freed with the matching free function.
+ */
 typedef struct {
     long id;
+    arena_t *arena;
     char *username;
     char *first_name;
     char *last_name;
@@ -46,55 +69,130 @@ typedef struct {
 
 typedef struct {
     long id;
+    arena_t *arena;
     char *name;
     char *username;
     char *password;
     long user_id;
 } password_t;
 
+/**
+ * key holds the user's DB_KEY_SIZE byte secretbox key. It's
+ * binary and not NUL terminated.
+ */
 typedef struct {
     long id;
+    arena_t *arena;
     char *key;
 } u_key_t;
 
+/**
+ * change_t is an entry of a user's change log. For deletes
+ * only the name of the password is set.
+ */
+typedef struct {
+    uint64_t seq;
+    arena_t *arena;
+    char *operation;
+    password_t *pass;
+} change_t;
+
+typedef struct {
+    uint64_t size;
+    uint64_t hits;
+    uint64_t misses;
+} db_cache_stats_t;
+
 db_t*
 db_new();
 
+/**
+ * db_init sets up the connection pool and the user cache. Every
+ * process serving requests calls it. Returns 0 on success.
+ */
 int
 db_init(db_t *db, const char *server, const char *user, const char *password, const char *database);
 
+/**
+ * db_bootstrap creates and migrates the tables and adds the
+ * admin user. It's run once, before any workers are started, on
+ * a db set up with db_init. Returns 0 on success.
+ */
+int
+db_bootstrap(db_t *db);
+
 const char*
 db_get_error(db_t *db);
 
+/**
+ * db_set_crypto_pool sets the pool large vaults are decrypted
+ * on. Without one everything is decrypted on the calling thread.
+ */
+void
+db_set_crypto_pool(db_t *db, pool_t *pool);
+
 void
 db_cleanup(db_t *db);
 
 user_t*
-db_user_new();
-
-user_t**
-db_users_new();
+db_user_new(arena_t *arena);
 
+/**
+ * db_user_add adds a new user. The password is expected to
+ * already be hashed with password_hash.
+ */
 int
 db_user_add(db_t *db, const char *username, const char *first_name, const char *last_name, const char *password, const char *token);
 
+/**
+ * db_user_set_password replaces the stored password hash
+ * for the given user.
+ */
+int
+db_user_set_password(db_t *db, const long id, const char *password);
+
 int
 db_user_get_by_username(db_t *db, const char *username, user_t *user);
 
 int
 db_user_get_by_id(db_t *db, const long id, user_t *user);
 
+/**
+ * db_user_get_profile fills in the id and names of the given
+ * user, leaving the password and token alone. Profiles are
+ * served from a bounded read-through cache that's invalidated
+ * whenever a user is written.
+ */
+int
+db_user_get_profile(db_t *db, const long id, user_t *user);
+
+/**
+ * db_user_cache_stats reports the profile cache's size and
+ * hit and miss counters.
+ */
+void
+db_user_cache_stats(db_t *db, db_cache_stats_t *stats);
+
 int
 db_user_get_by_token(db_t *db, const char *token, user_t *user);
 
+/**
+ * db_user_get_token looks up the user's token by checking the
+ * password with MySQL's PASSWORD() function. It's only used for
+ * accounts created before passwords were hashed with argon2id.
+ */
 int
 db_user_get_token(db_t *db, const char *username, const char *password, user_t *user);
 
 void
 db_user_free(user_t *user);
 
+/**
+ * db_users_get_all retrieves all users into an array allocated
+ * from the given arena. Returns the number of users.
+ */
 uint64_t
-db_users_get_all(db_t *db, user_t **users);
+db_users_get_all(db_t *db, arena_t *arena, user_t ***users);
 
 int
 db_user_login(db_t *db, const char *username, const char *password);
@@ -103,11 +201,13 @@ void
 db_users_free(user_t **user, const uint64_t size);
 
 password_t*
-db_password_new();
-
-password_t**
-db_passwords_new();
+db_password_new(arena_t *arena);
 
+/**
+ * db_password_add stores a new password sealed with the user's
+ * key. The read functions open sealed passwords before they're
+ * returned.
+ */
 int
 db_password_add(db_t *db, const char *name, const char *username, const char *password, const char *labels, const long user_id);
 
@@ -117,8 +217,52 @@ db_password_get_by_name(db_t *db, const char *name, const long user_id, password
 int
 db_password_get_by_token(db_t *db, const char *name, const char *token, password_t *pass);
 
+/**
+ * db_passwords_get_by_token retrieves all passwords of the user
+ * with the given token into an array allocated from the given
+ * arena. Returns the number of passwords or -1 on error.
+ */
+int
+db_passwords_get_by_token(db_t *db, arena_t *arena, const char *token, password_t ***passwords);
+
+/**
+ * db_changes_last_seq reads the sequence number of the user's
+ * latest change, 0 if there's none. Returns -1 on error.
+ */
+int
+db_changes_last_seq(db_t *db, const long user_id, uint64_t *seq);
+
+/**
+ * db_changes_get_since retrieves the latest change to each of
+ * the user's passwords made after since, oldest first and at
+ * most limit of them, along with the password's current value.
+ * The array is allocated from the given arena. Returns the
+ * number of changes or -1 on error.
+ */
+int
+db_changes_get_since(db_t *db, arena_t *arena, const long user_id, const uint64_t since, const int limit, change_t ***changes);
+
+void
+db_changes_free(change_t **changes, const uint64_t size);
+
+/**
+ * db_password_names_get retrieves the id and name of all of the
+ * user's passwords, leaving the rest of each record empty. The
+ * array is allocated from the given arena. Returns the number
+ * of passwords or -1 on error.
+ */
+int
+db_password_names_get(db_t *db, arena_t *arena, const long user_id, password_t ***passwords);
+
+/**
+ * db_passwords_get_by_names retrieves all of the given user's passwords
+ * whose name is in the given list with a single prepared query. The
+ * returned array is allocated from the given arena. Returns the number
+ * of rows found or -1 on error.
+ */
 int
-db_passwords_get_by_token(db_t *db, const char *token, password_t **passwords);
+db_passwords_get_by_names(db_t *db, arena_t *arena, const long user_id, const char **names, const size_t count, password_t ***passwords);
+
 /**
  * db_pass_free frees the memory used by the given argument
 */
@@ -129,15 +273,68 @@ void
 db_passwords_free(password_t **passwords, const uint64_t size);
 
 u_key_t*
-db_key_new();
+db_key_new(arena_t *arena);
 
 void
 db_key_free(u_key_t *key);
 
 int
-db_key_add(db_t *db, const unsigned char key[32], const long user_id);
+db_key_add(db_t *db, const unsigned char key[DB_KEY_SIZE], const long user_id);
 
 int
 db_key_get_by_user_id(db_t *db, const long user_id, u_key_t *key);
 
+/**
+ * db_passwords_open opens a cursor over all of the given user's
+ * passwords. Rows are streamed from the server over a dedicated
+ * connection rather than buffered. Returns NULL on error.
+ */
+db_cursor_t*
+db_passwords_open(db_t *db, const long user_id);
+
+/**
+ * db_passwords_next reads the next row of the cursor into the
+ * given password. Returns 1 when a row was read, 0 at the end
+ * and -1 on error.
+ */
+int
+db_passwords_next(db_cursor_t *cursor, password_t *pass);
+
+void
+db_cursor_close(db_cursor_t *cursor);
+
+/**
+ * db_password_batch_new prepares a batch writer for the given
+ * user's passwords. Existing passwords with the same name are
+ * overwritten. Returns NULL on error.
+ */
+db_password_batch_t*
+db_password_batch_new(db_t *db, const long user_id, const size_t batch_size);
+
+/**
+ * db_password_batch_add writes a password as part of the current
+ * transaction, committing it once batch_size rows are pending.
+ * Returns 1 when the password was created, 2 when it replaced an
+ * existing one and -1 on error, in which case the pending rows
+ * are rolled back.
+ */
+int
+db_password_batch_add(db_password_batch_t *batch, const char *name, const char *username, const char *password);
+
+/**
+ * db_password_batch_commit commits any pending rows.
+ */
+int
+db_password_batch_commit(db_password_batch_t *batch);
+
+void
+db_password_batch_rollback(db_password_batch_t *batch);
+
+/**
+ * db_password_batch_free rolls back anything that wasn't
+ * committed and frees the batch.
+ */
+void
+db_password_batch_free(db_password_batch_t *batch);
+
 #endif /* _DATABASE_H */
@@ -0,0 +1,473 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dict.h"
+
+#define DICT_MAGIC "HUSHDICT"
+#define DICT_VERSION 1
+#define DICT_BLOOM_HASHES 7
+#define DICT_BLOOM_BITS_PER_WORD 10
+
+/**
+ * DICT_LEET_MAX_AMBIGUOUS caps how many characters with more
+ * than one leetspeak reading are tried both ways.
+ */
+#define DICT_LEET_MAX_AMBIGUOUS 4
+
+/**
+ * dict_header starts the index file. It's followed by the
+ * bloom filter and then the words. Words are grouped by length
+ * and sorted within each group, so a group is a table of fixed
+ * size records that can be binary searched without offsets.
+ */
+struct dict_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t max_word;
+    uint64_t word_count;
+    uint64_t bloom_bits;
+    uint64_t bloom_offset;
+    uint64_t words_offset;
+    uint64_t size;
+    struct {
+        uint64_t offset;
+        uint64_t count;
+    } buckets[DICT_MAX_WORD+1];
+};
+
+struct dict {
+    void *map;
+    size_t size;
+    const struct dict_header *header;
+    const uint64_t *bloom;
+    const char *words;
+};
+
+/**
+ * dict_hash is 64 bit FNV-1a.
+ */
+static uint64_t
+dict_hash(const char *word, const size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)word[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+/**
+ * dict_bloom_bit returns the i'th bloom filter bit of the word
+ * with the given hash, using double hashing.
+ */
+static inline uint64_t
+dict_bloom_bit(const uint64_t h, const int i, const uint64_t bits)
+{
+    const uint64_t h2 = ((h >> 33) ^ (h * 0xff51afd7ed558ccdULL)) | 1;
+    return (h + i * h2) & (bits - 1);
+}
+
+/**
+ * dict_fold lowercases len bytes of src into dst.
+ */
+static void
+dict_fold(char *dst, const char *src, const size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        dst[i] = (char)tolower((unsigned char)src[i]);
+    }
+}
+
+/**
+ * word_ref is a word being indexed.
+ */
+struct word_ref {
+    const char *word;
+    size_t len;
+};
+
+static int
+word_ref_cmp(const void *a, const void *b)
+{
+    const struct word_ref *x = a;
+    const struct word_ref *y = b;
+
+    if (x->len != y->len) {
+        return x->len < y->len ? -1 : 1;
+    }
+
+    return memcmp(x->word, y->word, x->len);
+}
+
+long
+dict_build(const char *words_path, const char *index_path)
+{
+    FILE *in = fopen(words_path, "rb");
+    if (in == NULL) {
+        return -1;
+    }
+
+    // the word list is read whole and folded in place so the
+    // index entries can point straight into it.
+    char *text = NULL;
+    size_t text_len = 0;
+    size_t text_cap = 0;
+    for (;;) {
+        if (text_len == text_cap) {
+            text_cap = text_cap > 0 ? text_cap * 2 : 1 << 20;
+            text = realloc(text, text_cap);
+        }
+        size_t n = fread(text + text_len, 1, text_cap - text_len, in);
+        if (n == 0) {
+            break;
+        }
+        text_len += n;
+    }
+    fclose(in);
+
+    size_t cap = 1024;
+    size_t count = 0;
+    struct word_ref *refs = malloc(cap * sizeof(struct word_ref));
+
+    for (size_t start = 0; start < text_len; ) {
+        size_t len = 0;
+        while (start + len < text_len && text[start+len] != '\n' && text[start+len] != '\r') {
+            len++;
+        }
+
+        if (len > 0 && len <= DICT_MAX_WORD) {
+            if (count == cap) {
+                cap *= 2;
+                refs = realloc(refs, cap * sizeof(struct word_ref));
+            }
+            dict_fold(text + start, text + start, len);
+            refs[count].word = text + start;
+            refs[count].len = len;
+            count++;
+        }
+
+        start += len + 1;
+    }
+
+    qsort(refs, count, sizeof(struct word_ref), word_ref_cmp);
+
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unique > 0 && word_ref_cmp(&refs[unique-1], &refs[i]) == 0) {
+            continue;
+        }
+        refs[unique++] = refs[i];
+    }
+
+    struct dict_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DICT_MAGIC, sizeof(header.magic));
+    header.version = DICT_VERSION;
+    header.max_word = DICT_MAX_WORD;
+    header.word_count = unique;
+
+    header.bloom_bits = 64;
+    while (header.bloom_bits < unique * DICT_BLOOM_BITS_PER_WORD) {
+        header.bloom_bits <<= 1;
+    }
+    uint64_t *bloom = calloc(header.bloom_bits / 64, sizeof(uint64_t));
+
+    uint64_t words_size = 0;
+    for (size_t i = 0; i < unique; i++) {
+        if (header.buckets[refs[i].len].count == 0) {
+            header.buckets[refs[i].len].offset = words_size;
+        }
+        header.buckets[refs[i].len].count++;
+        words_size += refs[i].len;
+
+        const uint64_t h = dict_hash(refs[i].word, refs[i].len);
+        for (int k = 0; k < DICT_BLOOM_HASHES; k++) {
+            const uint64_t bit = dict_bloom_bit(h, k, header.bloom_bits);
+            bloom[bit / 64] |= 1ULL << (bit % 64);
+        }
+    }
+
+    header.bloom_offset = sizeof(header);
+    header.words_offset = header.bloom_offset + header.bloom_bits / 8;
+    header.size = header.words_offset + words_size;
+
+    // write next to the index and rename over it so a running
+    // server keeps its mapping of the old one intact.
+    size_t tmp_len = strlen(index_path) + 5;
+    char *tmp_path = malloc(tmp_len);
+    snprintf(tmp_path, tmp_len, "%s.tmp", index_path);
+
+    long res = -1;
+    FILE *out = fopen(tmp_path, "wb");
+    if (out != NULL) {
+        bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+            fwrite(bloom, 1, header.bloom_bits / 8, out) == header.bloom_bits / 8;
+        for (size_t i = 0; ok && i < unique; i++) {
+            ok = fwrite(refs[i].word, 1, refs[i].len, out) == refs[i].len;
+        }
+        ok = fclose(out) == 0 && ok;
+
+        if (ok && rename(tmp_path, index_path) == 0) {
+            res = unique;
+        } else {
+            unlink(tmp_path);
+        }
+    }
+
+    free(tmp_path);
+    free(bloom);
+    free(refs);
+    free(text);
+
+    return res;
+}
+
+dict_t*
+dict_open(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct dict_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const struct dict_header *header = map;
+    bool valid = memcmp(header->magic, DICT_MAGIC, sizeof(header->magic)) == 0 &&
+        header->version == DICT_VERSION &&
+        header->max_word == DICT_MAX_WORD &&
+        header->size == (uint64_t)st.st_size &&
+        header->bloom_bits >= 64 && (header->bloom_bits & (header->bloom_bits - 1)) == 0 &&
+        header->bloom_offset == sizeof(struct dict_header) &&
+        header->words_offset == header->bloom_offset + header->bloom_bits / 8 &&
+        header->words_offset <= header->size;
+    for (size_t len = 1; valid && len <= DICT_MAX_WORD; len++) {
+        valid = header->buckets[len].offset + header->buckets[len].count * len <= header->size - header->words_offset;
+    }
+
+    if (!valid) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    dict_t *dict = malloc(sizeof(dict_t));
+    dict->map = map;
+    dict->size = st.st_size;
+    dict->header = header;
+    dict->bloom = (const uint64_t *)((const char *)map + header->bloom_offset);
+    dict->words = (const char *)map + header->words_offset;
+
+    return dict;
+}
+
+void
+dict_close(dict_t *dict)
+{
+    if (dict == NULL) {
+        return;
+    }
+
+    munmap(dict->map, dict->size);
+    free(dict);
+}
+
+size_t
+dict_size(const dict_t *dict)
+{
+    return dict->header->word_count;
+}
+
+const char*
+dict_words(const dict_t *dict, const size_t len, size_t *count)
+{
+    *count = 0;
+    if (dict == NULL || len == 0 || len > DICT_MAX_WORD || dict->header->buckets[len].count == 0) {
+        return NULL;
+    }
+
+    *count = dict->header->buckets[len].count;
+
+    return dict->words + dict->header->buckets[len].offset;
+}
+
+/**
+ * dict_lookup checks for a word that's already folded.
+ */
+static bool
+dict_lookup(const dict_t *dict, const char *word, const size_t len)
+{
+    const uint64_t h = dict_hash(word, len);
+    for (int k = 0; k < DICT_BLOOM_HASHES; k++) {
+        const uint64_t bit = dict_bloom_bit(h, k, dict->header->bloom_bits);
+        if ((dict->bloom[bit / 64] & (1ULL << (bit % 64))) == 0) {
+            return false;
+        }
+    }
+
+    const char *bucket = dict->words + dict->header->buckets[len].offset;
+    size_t lo = 0;
+    size_t hi = dict->header->buckets[len].count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(bucket + mid * len, word, len);
+        if (cmp == 0) {
+            return true;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * leet_letter returns the letter a leetspeak character most
+ * often stands for or 0 if it isn't one.
+ */
+static char
+leet_letter(const char c)
+{
+    switch (c) {
+        case '0': return 'o';
+        case '1': return 'i';
+        case '!': return 'i';
+        case '|': return 'i';
+        case '3': return 'e';
+        case '4': return 'a';
+        case '@': return 'a';
+        case '5': return 's';
+        case '$': return 's';
+        case '6': return 'g';
+        case '9': return 'g';
+        case '7': return 't';
+        case '+': return 't';
+        case '8': return 'b';
+        default: return 0;
+    }
+}
+
+/**
+ * leet_alternate returns the other letter a leetspeak character
+ * can stand for or 0 if there's only one.
+ */
+static char
+leet_alternate(const char c)
+{
+    switch (c) {
+        case '1':
+        case '|':
+            return 'l';
+        default:
+            return 0;
+    }
+}
+
+bool
+dict_contains(const dict_t *dict, const char *word, const unsigned int flags)
+{
+    if (dict == NULL || word == NULL) {
+        return false;
+    }
+
+    const size_t len = strlen(word);
+    if (len == 0 || len > DICT_MAX_WORD) {
+        return false;
+    }
+
+    char folded[DICT_MAX_WORD];
+    dict_fold(folded, word, len);
+    if (dict_lookup(dict, folded, len)) {
+        return true;
+    }
+
+    if (!(flags & DICT_LEET)) {
+        return false;
+    }
+
+    size_t ambiguous[DICT_LEET_MAX_AMBIGUOUS];
+    int ambiguous_count = 0;
+    bool substituted = false;
+    for (size_t i = 0; i < len; i++) {
+        char letter = leet_letter(folded[i]);
+        if (letter == 0) {
+            continue;
+        }
+        if (leet_alternate(folded[i]) != 0 && ambiguous_count < DICT_LEET_MAX_AMBIGUOUS) {
+            ambiguous[ambiguous_count++] = i;
+        }
+        folded[i] = letter;
+        substituted = true;
+    }
+
+    if (!substituted) {
+        return false;
+    }
+
+    // try every reading of the ambiguous characters, each
+    // bit of the mask picking the alternate for one of them.
+    char original[DICT_LEET_MAX_AMBIGUOUS];
+    for (int i = 0; i < ambiguous_count; i++) {
+        original[i] = word[ambiguous[i]];
+    }
+
+    for (unsigned int mask = 0; mask < (1u << ambiguous_count); mask++) {
+        for (int i = 0; i < ambiguous_count; i++) {
+            folded[ambiguous[i]] = (mask & (1u << i)) ? leet_alternate(original[i]) : leet_letter(original[i]);
+        }
+        if (dict_lookup(dict, folded, len)) {
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,94 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _DICT_H
+#define _DICT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * DICT_MAX_WORD is the longest word kept in an index. Longer
+ * words are left out when building it.
+ */
+#define DICT_MAX_WORD 64
+
+/**
+ * DICT_LEET makes lookups also try the word with leetspeak
+ * substitutions undone, so "p4ssw0rd" finds "password".
+ */
+#define DICT_LEET 0x1
+
+/**
+ * dict_t is a word list index mapped into memory. Lookups
+ * ignore ASCII case.
+ */
+typedef struct dict dict_t;
+
+/**
+ * dict_build builds the index of the word list at words_path,
+ * one word per line, and writes it to index_path. Returns the
+ * number of words indexed or -1 on error.
+ */
+long
+dict_build(const char *words_path, const char *index_path);
+
+/**
+ * dict_open maps the index at the given path. Returns NULL if
+ * it can't be read or isn't an index.
+ */
+dict_t*
+dict_open(const char *path);
+
+/**
+ * dict_close unmaps the index.
+ */
+void
+dict_close(dict_t *dict);
+
+/**
+ * dict_size returns the number of words in the index.
+ */
+size_t
+dict_size(const dict_t *dict);
+
+/**
+ * dict_words returns the words of the given length as a block
+ * of count * len bytes, folded and sorted with nothing between
+ * them, or NULL if there are none.
+ */
+const char*
+dict_words(const dict_t *dict, const size_t len, size_t *count);
+
+/**
+ * dict_contains checks if the word is in the index. Flags are
+ * a combination of the DICT_ options.
+ */
+bool
+dict_contains(const dict_t *dict, const char *word, const unsigned int flags);
+
+#endif /** end _DICT_H */
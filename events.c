@@ -0,0 +1,197 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "events.h"
+
+#define DEFAULT_QUEUE_SIZE 256
+
+/**
+ * event_subscriber holds a bounded ring of events for a
+ * single connected client.
+ */
+struct event_subscriber {
+    long user_id;
+    event_t *queue;
+    size_t head;
+    size_t count;
+    bool overflowed;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct event_subscriber *next;
+};
+
+static size_t subscriber_queue_size = DEFAULT_QUEUE_SIZE;
+static struct event_subscriber *subscribers = NULL;
+static pthread_rwlock_t subscribers_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static uint64_t event_version = 0;
+static uint64_t event_drops = 0;
+
+int
+events_init(const size_t queue_size)
+{
+    if (queue_size > 0) {
+        subscriber_queue_size = queue_size;
+    }
+
+    return 0;
+}
+
+event_subscriber_t*
+events_subscribe(const long user_id)
+{
+    struct event_subscriber *sub = calloc(1, sizeof(struct event_subscriber));
+    if (sub == NULL) {
+        return NULL;
+    }
+
+    sub->queue = calloc(subscriber_queue_size, sizeof(event_t));
+    if (sub->queue == NULL) {
+        free(sub);
+        return NULL;
+    }
+
+    sub->user_id = user_id;
+    pthread_mutex_init(&sub->lock, NULL);
+    pthread_cond_init(&sub->ready, NULL);
+
+    pthread_rwlock_wrlock(&subscribers_lock);
+    sub->next = subscribers;
+    subscribers = sub;
+    pthread_rwlock_unlock(&subscribers_lock);
+
+    return sub;
+}
+
+void
+events_unsubscribe(event_subscriber_t *sub)
+{
+    if (sub == NULL) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&subscribers_lock);
+    for (struct event_subscriber **s = &subscribers; *s != NULL; s = &(*s)->next) {
+        if (*s == sub) {
+            *s = sub->next;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&subscribers_lock);
+
+    pthread_mutex_destroy(&sub->lock);
+    pthread_cond_destroy(&sub->ready);
+    free(sub->queue);
+    free(sub);
+}
+
+uint64_t
+events_publish(const long user_id, const char *name, const char *operation)
+{
+    event_t ev = {
+        .version = __atomic_add_fetch(&event_version, 1, __ATOMIC_RELAXED),
+        .user_id = user_id,
+        .operation = operation,
+    };
+    strncpy(ev.name, name, EVENT_NAME_SIZE-1);
+
+    pthread_rwlock_rdlock(&subscribers_lock);
+    for (struct event_subscriber *sub = subscribers; sub != NULL; sub = sub->next) {
+        if (sub->user_id != user_id) {
+            continue;
+        }
+
+        pthread_mutex_lock(&sub->lock);
+        if (sub->count == subscriber_queue_size) {
+            // a slow client never holds up the writer. It's told
+            // to resync instead the next time it reads.
+            sub->overflowed = true;
+            __atomic_add_fetch(&event_drops, 1, __ATOMIC_RELAXED);
+        } else {
+            sub->queue[(sub->head + sub->count) % subscriber_queue_size] = ev;
+            sub->count++;
+            pthread_cond_signal(&sub->ready);
+        }
+        pthread_mutex_unlock(&sub->lock);
+    }
+    pthread_rwlock_unlock(&subscribers_lock);
+
+    return ev.version;
+}
+
+int
+events_next(event_subscriber_t *sub, event_t *ev, const int timeout_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    int ret = 0;
+
+    pthread_mutex_lock(&sub->lock);
+    while (sub->count == 0 && !sub->overflowed) {
+        if (pthread_cond_timedwait(&sub->ready, &sub->lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    if (sub->overflowed) {
+        // whatever is queued is incomplete so throw it away
+        // and let the client re-fetch its passwords.
+        sub->overflowed = false;
+        sub->head = 0;
+        sub->count = 0;
+        ret = -1;
+    } else if (sub->count > 0) {
+        *ev = sub->queue[sub->head];
+        sub->head = (sub->head + 1) % subscriber_queue_size;
+        sub->count--;
+        ret = 1;
+    }
+    pthread_mutex_unlock(&sub->lock);
+
+    return ret;
+}
+
+uint64_t
+events_dropped()
+{
+    return __atomic_load_n(&event_drops, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,101 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _EVENTS_H
+#define _EVENTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EVENT_OP_CREATE "create"
+#define EVENT_OP_UPDATE "update"
+#define EVENT_OP_DELETE "delete"
+
+#define EVENT_NAME_SIZE 256
+
+/**
+ * event_t describes a single committed change to one
+ * of a user's passwords.
+ */
+typedef struct {
+    uint64_t version;
+    long user_id;
+    char name[EVENT_NAME_SIZE];
+    const char *operation;
+} event_t;
+
+typedef struct event_subscriber event_subscriber_t;
+
+/**
+ * events_init sets up the in-process change bus. Each
+ * subscriber gets a queue that holds at most queue_size
+ * events.
+ */
+int
+events_init(const size_t queue_size);
+
+/**
+ * events_subscribe registers a new subscriber for the
+ * changes made to the given user's passwords. The
+ * returned subscriber needs to be released with
+ * events_unsubscribe.
+ */
+event_subscriber_t*
+events_subscribe(const long user_id);
+
+/**
+ * events_unsubscribe removes the subscriber from the bus
+ * and frees the memory used by it.
+ */
+void
+events_unsubscribe(event_subscriber_t *sub);
+
+/**
+ * events_publish fans the given change out to every
+ * subscriber of the user. It never blocks on a slow
+ * subscriber. Returns the version assigned to the event.
+ */
+uint64_t
+events_publish(const long user_id, const char *name, const char *operation);
+
+/**
+ * events_next waits up to timeout_ms milliseconds for the
+ * next event. Returns 1 if an event was copied into ev,
+ * 0 on timeout and -1 if the subscriber's queue overflowed
+ * and events were lost since the last call.
+ */
+int
+events_next(event_subscriber_t *sub, event_t *ev, const int timeout_ms);
+
+/**
+ * events_dropped returns the number of events dropped
+ * because a subscriber's queue was full.
+ */
+uint64_t
+events_dropped();
+
+#endif /* _EVENTS_H */
@@ -0,0 +1,208 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * hush-logbench times logging a typical request entry in each
+ * combination of sync or async and JSON or binary. Caller time
+ * is what the logging threads spend in s_log, total includes
+ * draining the async buffer.
+ *
+ * Built with S_LOG_BENCH_JANSSON it also times the logger this
+ * one replaced, which built each entry as a jansson object and
+ * wrote it with json_dumpf, and compares every case against it.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifdef S_LOG_BENCH_JANSSON
+#include <jansson.h>
+#endif
+
+#include "logger.h"
+
+#define DEFAULT_BENCH_ENTRIES 1000000
+#define DEFAULT_BENCH_THREADS 4
+#define DEFAULT_BENCH_BUFFER_SIZE 1024
+
+#define BENCH_PATH "/api/v1/password/example"
+#define BENCH_REQUEST_ID "7f3c2a9e1b5d4c6f"
+
+static size_t entries_per_thread;
+
+/**
+ * baseline_ns is the total time per entry of the jansson
+ * baseline, or 0 when it wasn't run.
+ */
+static double baseline_ns;
+
+static FILE *bench_out;
+
+static double
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void*
+bench_thread(void *arg)
+{
+    (void)arg;
+
+    for (size_t i = 0; i < entries_per_thread; i++) {
+        s_log(LOG_INFO, s_log_string("msg", "request"), s_log_string("method", "GET"),
+            s_log_string("path", BENCH_PATH), s_log_int("status", 200),
+            s_log_uint64("duration_ns", 123456 + i), s_log_string("request_id", BENCH_REQUEST_ID));
+    }
+
+    return NULL;
+}
+
+#ifdef S_LOG_BENCH_JANSSON
+/**
+ * baseline_thread logs the same entries the way the jansson
+ * logger did: an object per entry dumped straight to the file.
+ */
+static void*
+baseline_thread(void *arg)
+{
+    (void)arg;
+
+    for (size_t i = 0; i < entries_per_thread; i++) {
+        json_t *root = json_object();
+        json_object_set_new(root, "level", json_string("info"));
+        json_object_set_new(root, "timestamp", json_integer((json_int_t)time(NULL)));
+        json_object_set_new(root, "msg", json_string("request"));
+        json_object_set_new(root, "method", json_string("GET"));
+        json_object_set_new(root, "path", json_string(BENCH_PATH));
+        json_object_set_new(root, "status", json_integer(200));
+        json_object_set_new(root, "duration_ns", json_integer(123456 + i));
+        json_object_set_new(root, "request_id", json_string(BENCH_REQUEST_ID));
+
+        json_dumpf(root, bench_out, JSON_INDENT(0));
+        fprintf(bench_out, "\n");
+
+        json_decref(root);
+    }
+
+    return NULL;
+}
+#endif
+
+/**
+ * bench_run logs from the given number of threads to the bench
+ * output with fn and reports the time taken.
+ */
+static int
+bench_run(const char *name, void *(*fn)(void *), const int format, const bool async, const size_t threads)
+{
+    s_log_init(bench_out, format);
+    if (async && s_log_async_start(DEFAULT_BENCH_BUFFER_SIZE, S_LOG_FULL_BLOCK) != 0) {
+        fprintf(stderr, "unable to start async logging\n");
+        return -1;
+    }
+
+    pthread_t *workers = calloc(threads, sizeof(pthread_t));
+    if (workers == NULL) {
+        return -1;
+    }
+
+    double start = now_ns();
+    for (size_t i = 0; i < threads; i++) {
+        pthread_create(&workers[i], NULL, fn, NULL);
+    }
+    for (size_t i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    double logged = now_ns();
+
+    if (async) {
+        s_log_shutdown();
+    } else {
+        fflush(bench_out);
+    }
+    double done = now_ns();
+
+    free(workers);
+
+    size_t total = entries_per_thread * threads;
+    double total_ns = (done - start) / total;
+    fprintf(stderr, "%-16s %10zu entries  caller %8.1f ns/entry  total %8.1f ns/entry %12.0f entries/s",
+        name, total, (logged - start) / total, total_ns, total / ((done - start) / 1e9));
+    if (baseline_ns > 0) {
+        fprintf(stderr, "  jansson %8.1f ns/entry (%.2fx)", baseline_ns, baseline_ns / total_ns);
+    }
+    fprintf(stderr, "\n");
+
+    if (fn != bench_thread) {
+        baseline_ns = total_ns;
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t entries = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_BENCH_ENTRIES;
+    size_t threads = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_BENCH_THREADS;
+    if (entries == 0 || threads == 0) {
+        fprintf(stderr, "usage: %s [entries] [threads]\n", argv[0]);
+        return 1;
+    }
+    entries_per_thread = entries / threads > 0 ? entries / threads : 1;
+
+    bench_out = fopen("/dev/null", "w");
+    if (bench_out == NULL) {
+        perror("unable to open /dev/null");
+        return 1;
+    }
+
+    int ret = 0;
+#ifdef S_LOG_BENCH_JANSSON
+    if (bench_run("jansson json", baseline_thread, S_LOG_FORMAT_JSON, false, threads) != 0) {
+        ret = 1;
+    }
+#endif
+    if (ret != 0 ||
+        bench_run("sync json", bench_thread, S_LOG_FORMAT_JSON, false, threads) != 0 ||
+        bench_run("sync binary", bench_thread, S_LOG_FORMAT_BINARY, false, threads) != 0 ||
+        bench_run("async json", bench_thread, S_LOG_FORMAT_JSON, true, threads) != 0 ||
+        bench_run("async binary", bench_thread, S_LOG_FORMAT_BINARY, true, threads) != 0) {
+        ret = 1;
+    }
+
+    fclose(bench_out);
+
+    return ret;
+}
@@ -0,0 +1,351 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * hush-logcat decodes binary hush logs back into the JSON lines
+ * hush writes by default. It reads the files given or stdin.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+
+/**
+ * LOGCAT_MAX_KEYS is the most keys a header can declare.
+ */
+#define LOGCAT_MAX_KEYS 256
+
+/**
+ * reader walks a binary log read from a single file.
+ */
+struct reader {
+    const char *name;
+    FILE *in;
+    long offset;
+};
+
+/**
+ * dict holds the keys of the last header read.
+ */
+static struct {
+    int version;
+    char **keys;
+    size_t count;
+} dict;
+
+static int
+read_byte(struct reader *r)
+{
+    int c = fgetc(r->in);
+    if (c != EOF) {
+        r->offset++;
+    }
+    return c;
+}
+
+static int
+read_varint(struct reader *r, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = read_byte(r);
+        if (c == EOF) {
+            return -1;
+        }
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if ((c & 0x80) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * read_bytes reads a length and that many bytes into a NUL
+ * terminated string the caller frees.
+ */
+static char*
+read_bytes(struct reader *r)
+{
+    uint64_t len;
+    if (read_varint(r, &len) != 0 || len > (1 << 24)) {
+        return NULL;
+    }
+
+    char *s = malloc(len + 1);
+    if (s == NULL || fread(s, 1, len, r->in) != len) {
+        free(s);
+        return NULL;
+    }
+    r->offset += len;
+    s[len] = '\0';
+
+    return s;
+}
+
+static void
+write_string(const char *s)
+{
+    putchar('"');
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        switch (c) {
+            case '"':  fputs("\\\"", stdout); break;
+            case '\\': fputs("\\\\", stdout); break;
+            case '\n': fputs("\\n", stdout); break;
+            case '\r': fputs("\\r", stdout); break;
+            case '\t': fputs("\\t", stdout); break;
+            default:
+                if (c < 0x20) {
+                    printf("\\u%04x", c);
+                } else {
+                    putchar(c);
+                }
+        }
+    }
+    putchar('"');
+}
+
+/**
+ * write_double writes d the way the logger does.
+ */
+static void
+write_double(const double d)
+{
+    if (!isfinite(d)) {
+        fputs("null", stdout);
+        return;
+    }
+
+    char tmp[32];
+    snprintf(tmp, sizeof(tmp), "%.17g", d);
+    fputs(tmp, stdout);
+    if (strpbrk(tmp, ".eE") == NULL) {
+        fputs(".0", stdout);
+    }
+}
+
+static int
+read_header(struct reader *r)
+{
+    char magic[sizeof(S_LOG_BINARY_MAGIC)-1];
+    if (fread(magic, 1, sizeof(magic), r->in) != sizeof(magic) ||
+        memcmp(magic, S_LOG_BINARY_MAGIC, sizeof(magic)) != 0) {
+        return -1;
+    }
+    r->offset += sizeof(magic);
+
+    // version 1 only differs in having second timestamps
+    int version = read_byte(r);
+    if (version != 1 && version != S_LOG_BINARY_VERSION) {
+        return -1;
+    }
+    dict.version = version;
+
+    // the logger writes the count as a single byte so anything
+    // past this is a corrupt header, not a big dictionary.
+    uint64_t count;
+    if (read_varint(r, &count) != 0 || count > LOGCAT_MAX_KEYS) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < dict.count; i++) {
+        free(dict.keys[i]);
+    }
+    free(dict.keys);
+    dict.count = 0;
+
+    dict.keys = calloc(count > 0 ? count : 1, sizeof(char*));
+    if (dict.keys == NULL) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        dict.keys[i] = read_bytes(r);
+        if (dict.keys[i] == NULL) {
+            return -1;
+        }
+        dict.count++;
+    }
+
+    return 0;
+}
+
+static int
+read_entry(struct reader *r)
+{
+    uint64_t len;
+    if (read_varint(r, &len) != 0) {
+        return -1;
+    }
+    const long end = r->offset + len;
+
+    int level = read_byte(r);
+    uint64_t timestamp;
+    if (level == EOF || read_varint(r, &timestamp) != 0) {
+        return -1;
+    }
+
+    if (dict.version == 1) {
+        printf("{\"level\":\"%s\",\"timestamp\":%llu", s_log_level_name(level), (unsigned long long)timestamp);
+    } else {
+        char ts[S_LOG_TIMESTAMP_SIZE];
+        s_log_format_timestamp(timestamp, ts);
+        printf("{\"level\":\"%s\",\"timestamp\":\"%s\"", s_log_level_name(level), ts);
+    }
+
+    while (r->offset < end) {
+        uint64_t id;
+        if (read_varint(r, &id) != 0) {
+            return -1;
+        }
+
+        putchar(',');
+        if (id == 0) {
+            char *key = read_bytes(r);
+            if (key == NULL) {
+                return -1;
+            }
+            write_string(key);
+            free(key);
+        } else if (id <= dict.count) {
+            write_string(dict.keys[id-1]);
+        } else {
+            return -1;
+        }
+        putchar(':');
+
+        uint64_t v;
+        switch (read_byte(r)) {
+            case S_LOG_BINARY_INT:
+                if (read_varint(r, &v) != 0) {
+                    return -1;
+                }
+                printf("%lld", (long long)((v >> 1) ^ -(v & 1)));
+                break;
+            case S_LOG_BINARY_UINT:
+                if (read_varint(r, &v) != 0) {
+                    return -1;
+                }
+                printf("%llu", (unsigned long long)v);
+                break;
+            case S_LOG_BINARY_DOUBLE: {
+                unsigned char le[8];
+                if (fread(le, 1, sizeof(le), r->in) != sizeof(le)) {
+                    return -1;
+                }
+                r->offset += sizeof(le);
+                uint64_t bits = 0;
+                for (int i = 0; i < 8; i++) {
+                    bits |= (uint64_t)le[i] << (8 * i);
+                }
+                double d;
+                memcpy(&d, &bits, sizeof(d));
+                write_double(d);
+                break;
+            }
+            case S_LOG_BINARY_STRING: {
+                char *s = read_bytes(r);
+                if (s == NULL) {
+                    return -1;
+                }
+                write_string(s);
+                free(s);
+                break;
+            }
+            case S_LOG_BINARY_NULL:
+                fputs("null", stdout);
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    fputs("}\n", stdout);
+
+    return r->offset == end ? 0 : -1;
+}
+
+static int
+decode(struct reader *r)
+{
+    for (;;) {
+        const long offset = r->offset;
+        int tag = read_byte(r);
+
+        int res;
+        switch (tag) {
+            case EOF:
+                return 0;
+            case S_LOG_BINARY_HEADER:
+                res = read_header(r);
+                break;
+            case S_LOG_BINARY_ENTRY:
+                res = dict.keys != NULL ? read_entry(r) : -1;
+                break;
+            default:
+                res = -1;
+        }
+
+        if (res != 0) {
+            fflush(stdout);
+            fprintf(stderr, "%s: invalid log record at offset %ld\n", r->name, offset);
+            return -1;
+        }
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 2) {
+        struct reader r = {"stdin", stdin, 0};
+        return decode(&r) == 0 ? 0 : 1;
+    }
+
+    int res = 0;
+    for (int i = 1; i < argc; i++) {
+        FILE *in = fopen(argv[i], "rb");
+        if (in == NULL) {
+            perror(argv[i]);
+            res = 1;
+            continue;
+        }
+
+        struct reader r = {argv[i], in, 0};
+        if (decode(&r) != 0) {
+            res = 1;
+        }
+        fclose(in);
+    }
+
+    return res;
+}
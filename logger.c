@@ -25,58 +25,125 @@
  * SUCH DAMAGE.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
+#include <unistd.h>
 
-#include <jansson.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "logger.h"
 
 
 /**
- * s_log_field_types is an enum of the supported log field types.
- */
-enum { 
-    S_LOG_INT, 
-    S_LOG_INT8,
-    S_LOG_INT16,
-    S_LOG_INT32,
-    S_LOG_INT64,
-    S_LOG_UINT, 
-    S_LOG_UINT8,
-    S_LOG_UINT16,
-    S_LOG_UINT32,
-    S_LOG_UINT64,
-    S_LOG_DOUBLE, 
-    S_LOG_STRING
-} s_log_field_types;
-
-/**
- * s_log_field_t represents a field in a log entry and it's
- * associated type.
- */
-struct s_log_field_t {
-    uint8_t type;
-    char *key;
-    union {
-        int int_value;
-        int8_t int8_value;
-        int16_t int16_value;
-        int32_t int32_value;
-        int64_t int64_value;
-        unsigned int uint_value;
-        uint8_t uint8_value;
-        uint16_t uint16_value;
-        uint32_t uint32_value;
-        uint64_t uint64_value;
-        double double_value;
-        char *char_value;
-    };
-} s_log_field_t;
+ * S_LOG_LINE_MAX is the size of a slot in the async buffer.
+ * Longer entries are copied to the heap and their slot points
+ * the writer thread at the copy, so they're still written
+ * whole and in order. They're dropped if the copy can't be
+ * made.
+ */
+#define S_LOG_LINE_MAX 2048
+
+/**
+ * S_LOG_WRITE_BATCH is the most entries the writer thread
+ * hands to a single writev call.
+ */
+#define S_LOG_WRITE_BATCH 256
+
+/**
+ * S_LOG_IDLE_WAIT_NS bounds how long the writer thread sleeps
+ * when the buffer is empty.
+ */
+#define S_LOG_IDLE_WAIT_NS 50000000
+
+/**
+ * s_log_slot holds a single serialized entry. seq says whose
+ * turn it is: equal to the slot's position it's free for the
+ * producer claiming that position and one past it the entry
+ * is ready for the writer. big holds entries that don't fit
+ * in line until the writer has written and freed them.
+ */
+struct s_log_slot {
+    uint64_t seq;
+    uint32_t len;
+    char *big;
+    char line[S_LOG_LINE_MAX];
+};
+
+/**
+ * log_ring is a bounded multi producer, single consumer queue
+ * of log entries drained by the writer thread.
+ */
+static struct {
+    struct s_log_slot *slots;
+    uint64_t capacity;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    uint64_t producers;
+    int policy;
+    int fd;
+    bool running;
+    bool stopping;
+    bool idle;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} log_ring = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * log_line is the buffer each thread serializes its entries
+ * into before they're queued.
+ */
+static __thread char log_line[S_LOG_LINE_MAX];
+
+#define LOG_LEVEL(n) {n, "{\"level\":\"" n "\",\"timestamp\":", sizeof("{\"level\":\"" n "\",\"timestamp\":")-1}
+
+/**
+ * log_levels holds the name of each level along with the
+ * start of the entries logged at it.
+ */
+static const struct {
+    const char *name;
+    const char *prefix;
+    size_t prefix_len;
+} log_levels[] = {
+    [LOG_TRACE] = LOG_LEVEL("trace"),
+    [LOG_DEBUG] = LOG_LEVEL("debug"),
+    [LOG_INFO]  = LOG_LEVEL("info"),
+    [LOG_WARN]  = LOG_LEVEL("warn"),
+    [LOG_ERROR] = LOG_LEVEL("error"),
+    [LOG_FATAL] = LOG_LEVEL("fatal"),
+};
+
+#define S_LOG_LEVEL_COUNT (int)(sizeof(log_levels) / sizeof(log_levels[0]))
+
+/**
+ * log_threshold holds the level until s_log_init maps the
+ * shared one, and for good if the mapping fails.
+ */
+static int log_threshold = LOG_INFO;
+int *s_log_threshold = &log_threshold;
 
 /**
  * log_output contains the location we're
@@ -84,222 +151,1016 @@ struct s_log_field_t {
  */
 static FILE *log_output;
 
+/**
+ * log_format is the format entries are written in.
+ */
+static int log_format = S_LOG_FORMAT_JSON;
+
+/**
+ * log_clock is the clock entries are timestamped with.
+ */
+static clockid_t log_clock = CLOCK_REALTIME;
+
+/**
+ * log_time holds the start of the thread's last formatted
+ * timestamp, up to and including the '.' before the
+ * nanoseconds, which only changes once a second.
+ */
+static __thread struct {
+    time_t sec;
+    char prefix[S_LOG_TIMESTAMP_SIZE];
+} log_time = {
+    .sec = -1,
+};
+
+#define S_LOG_TIMESTAMP_PREFIX_LEN (sizeof("2006-01-02T15:04:05.")-1)
+
+/**
+ * log_keys are the keys binary entries refer to by number. New
+ * keys can be added to the end, the header carries the list.
+ */
+static const char *log_keys[] = {
+    "msg",
+    "error",
+    "method",
+    "path",
+    "status",
+    "proto",
+    "duration_ns",
+    "request_id",
+    "spans",
+    "client_addr",
+    "sample_rate",
+    "pid",
+    "level",
+    "from",
+    "to",
+    "host",
+    "port",
+    "workers",
+    "signal",
+};
+
+#define S_LOG_KEY_COUNT (sizeof(log_keys) / sizeof(log_keys[0]))
+#define S_LOG_KEY_CACHE_SIZE 64
+
+/**
+ * log_key_cache remembers the number of the keys the thread
+ * has looked up by their address.
+ */
+static __thread struct {
+    const char *key;
+    unsigned int id;
+} log_key_cache[S_LOG_KEY_CACHE_SIZE];
+
+/**
+ * log_header is the header of binary log files.
+ */
+static char *log_header;
+static size_t log_header_len;
+
+/**
+ * log_file is the file sink, when logging to a file. The fd is
+ * kept the same across rotations so log_output and the writer
+ * thread keep working.
+ */
+static struct {
+    char *path;
+    int fd;
+    uint64_t max_bytes;
+    unsigned int rotate_secs;
+    unsigned int fsync_secs;
+    uint64_t size;
+    time_t opened;
+    time_t synced;
+    time_t checked;
+    bool dirty;
+} log_file = {
+    .fd = -1,
+};
+
+/**
+ * log_write_all writes the given entries to fd, picking up
+ * where short writes leave off. Entries are given up on if
+ * the write fails.
+ */
+static void
+log_write_all(const int fd, struct iovec *iov, int count)
+{
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+/**
+ * log_header_build encodes the binary header once so it can be
+ * written as is at the start of each file.
+ */
+static void
+log_header_build()
+{
+    size_t len = 1 + strlen(S_LOG_BINARY_MAGIC) + 1 + 1;
+    for (size_t i = 0; i < S_LOG_KEY_COUNT; i++) {
+        len += 1 + strlen(log_keys[i]);
+    }
+
+    log_header = malloc(len);
+    if (log_header == NULL) {
+        return;
+    }
+
+    char *p = log_header;
+    *p++ = S_LOG_BINARY_HEADER;
+    memcpy(p, S_LOG_BINARY_MAGIC, strlen(S_LOG_BINARY_MAGIC));
+    p += strlen(S_LOG_BINARY_MAGIC);
+    *p++ = S_LOG_BINARY_VERSION;
+    *p++ = S_LOG_KEY_COUNT;
+    for (size_t i = 0; i < S_LOG_KEY_COUNT; i++) {
+        size_t n = strlen(log_keys[i]);
+        *p++ = n;
+        memcpy(p, log_keys[i], n);
+        p += n;
+    }
+
+    log_header_len = p - log_header;
+}
+
+/**
+ * log_write_header starts a binary log on the given fd.
+ */
+static void
+log_write_header(const int fd)
+{
+    if (log_format != S_LOG_FORMAT_BINARY || log_header == NULL) {
+        return;
+    }
+
+    struct iovec iov = {log_header, log_header_len};
+    log_write_all(fd, &iov, 1);
+}
+
 /**
  * s_log_init initializes the logger and sets up
  * where the logger writes to.
  */
 void
-s_log_init(FILE *out)
+s_log_init(FILE *out, const int format)
 {
     log_output = out;
+    log_format = format;
+
+    // workers forked from here on share the level so setting it
+    // in one sets it in all of them.
+    if (s_log_threshold == &log_threshold) {
+        int *shared = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (shared != MAP_FAILED) {
+            *shared = log_threshold;
+            s_log_threshold = shared;
+        }
+    }
+
+    if (log_format == S_LOG_FORMAT_BINARY) {
+        if (log_header == NULL) {
+            log_header_build();
+        }
+        fwrite(log_header, 1, log_header_len, log_output);
+    }
 }
 
 /**
- * s_log_field_new allocates memory for a new log field,
- * sets the memory to 0, and returns a pointer to it.
+ * log_file_open opens the log file for appending.
  */
-static struct s_log_field_t*
-s_log_field_new(const char *key)
+static int
+log_file_open(const char *path)
+{
+    return open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+}
+
+int
+s_log_init_file(const char *path, const uint64_t max_bytes, const unsigned int rotate_secs, const unsigned int fsync_secs)
 {
-    struct s_log_field_t *field =
-        (struct s_log_field_t *)malloc(sizeof(s_log_field_t));
-    if (field == NULL) {
-        perror("unable to allocate memory for new field");
-        return NULL;
+    int fd = log_file_open(path);
+    if (fd < 0) {
+        return -1;
     }
-    memset(field, 0, sizeof(s_log_field_t));
-    field->key = (char *)malloc(strlen(key)+1);
-    strcpy(field->key, key);
-    return field;
+
+    FILE *out = fdopen(fd, "a");
+    if (out == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    // a forked worker opens the file again so it doesn't share
+    // its lock with the other processes.
+    if (log_file.fd >= 0) {
+        fclose(log_output);
+        free(log_file.path);
+    }
+
+    struct stat st;
+    log_file.size = fstat(fd, &st) == 0 ? (uint64_t)st.st_size : 0;
+    log_file.path = strdup(path);
+    log_file.fd = fd;
+    log_file.max_bytes = max_bytes;
+    log_file.rotate_secs = rotate_secs;
+    log_file.fsync_secs = fsync_secs;
+    log_file.opened = time(NULL);
+    log_file.synced = log_file.opened;
+    log_file.checked = log_file.opened;
+
+    log_output = out;
+
+    log_write_header(fd);
+
+    return 0;
 }
 
 /**
- * log_field_free frees the memory used by the log_field_t.
- * struct.
+ * log_file_rotate moves the log file aside and starts a new
+ * one. Workers share the file so the rotation is done under a
+ * lock and a worker finding it already rotated just reopens.
  */
 static void
-s_log_field_free(struct s_log_field_t *sf)
+log_file_rotate(const time_t now)
 {
-    if (sf != NULL) {
-        if (sf->key != NULL) {
-            free(sf->key);
+    flock(log_file.fd, LOCK_EX);
+
+    struct stat ours, current;
+    if (fstat(log_file.fd, &ours) == 0 && stat(log_file.path, &current) == 0 &&
+        ours.st_dev == current.st_dev && ours.st_ino == current.st_ino) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        struct tm tm;
+        gmtime_r(&ts.tv_sec, &tm);
+
+        char stamp[32];
+        strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%S", &tm);
+
+        size_t len = strlen(log_file.path) + sizeof(stamp) + 16;
+        char *rotated = malloc(len);
+        if (rotated != NULL) {
+            snprintf(rotated, len, "%s.%s.%09ld", log_file.path, stamp, ts.tv_nsec);
+            if (log_file.fsync_secs > 0) {
+                fdatasync(log_file.fd);
+            }
+            rename(log_file.path, rotated);
+            free(rotated);
         }
-        if ((sf->type == S_LOG_STRING) && (sf->char_value != NULL)) {
-            free(sf->char_value);
+    }
+
+    int fd = log_file_open(log_file.path);
+
+    flock(log_file.fd, LOCK_UN);
+
+    // try again next period rather than on every write if
+    // the new file can't be opened.
+    log_file.opened = now;
+    if (fd < 0) {
+        return;
+    }
+
+    dup2(fd, log_file.fd);
+    close(fd);
+
+    log_write_header(log_file.fd);
+
+    struct stat st;
+    log_file.size = fstat(log_file.fd, &st) == 0 ? (uint64_t)st.st_size : 0;
+    log_file.synced = now;
+    log_file.dirty = false;
+}
+
+/**
+ * log_file_maintain runs on the writer thread after each batch
+ * and while idle. It rotates the file when it's grown too big
+ * or old and syncs it on its timer.
+ */
+static void
+log_file_maintain(const size_t written)
+{
+    if (log_file.fd < 0) {
+        return;
+    }
+
+    log_file.size += written;
+    log_file.dirty = log_file.dirty || written > 0;
+
+    time_t now = time(NULL);
+
+    // other workers append to the same file so pick up the
+    // real size every so often.
+    if (now != log_file.checked) {
+        struct stat st;
+        if (fstat(log_file.fd, &st) == 0) {
+            log_file.size = st.st_size;
         }
-        free(sf);
+        log_file.checked = now;
+    }
+
+    if ((log_file.max_bytes > 0 && log_file.size >= log_file.max_bytes) ||
+        (log_file.rotate_secs > 0 && now - log_file.opened >= log_file.rotate_secs)) {
+        log_file_rotate(now);
+        return;
+    }
+
+    if (log_file.fsync_secs > 0 && log_file.dirty && now - log_file.synced >= log_file.fsync_secs) {
+        fdatasync(log_file.fd);
+        log_file.synced = now;
+        log_file.dirty = false;
     }
 }
 
 /**
- * s_log_int is used to add an integer value
- * to the log entry.
+ * log_writer_wait puts the writer thread to sleep until an
+ * entry is queued at pos or the logger is stopped.
  */
-struct s_log_field_t*
-s_log_int(const char *key, const int value)
+static void
+log_writer_wait(const uint64_t pos)
+{
+    struct s_log_slot *slot = &log_ring.slots[pos & (log_ring.capacity-1)];
+
+    pthread_mutex_lock(&log_ring.lock);
+    __atomic_store_n(&log_ring.idle, true, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != pos+1 &&
+        !__atomic_load_n(&log_ring.stopping, __ATOMIC_SEQ_CST)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += S_LOG_IDLE_WAIT_NS;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&log_ring.wake, &log_ring.lock, &deadline);
+    }
+
+    __atomic_store_n(&log_ring.idle, false, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&log_ring.lock);
+}
+
+/**
+ * log_writer_wake wakes the writer thread if it's sleeping.
+ */
+static void
+log_writer_wake()
+{
+    if (__atomic_load_n(&log_ring.idle, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&log_ring.lock);
+        pthread_cond_signal(&log_ring.wake);
+        pthread_mutex_unlock(&log_ring.lock);
+    }
+}
+
+/**
+ * log_writer drains the buffer in order, handing as many
+ * ready entries as it can to each writev, until the logger
+ * is stopped and everything queued has been written.
+ */
+static void*
+log_writer(void *arg)
+{
+    (void)arg;
+
+    struct iovec iov[S_LOG_WRITE_BATCH];
+    const uint64_t mask = log_ring.capacity - 1;
+
+    for (;;) {
+        uint64_t pos = log_ring.tail;
+
+        int count = 0;
+        size_t bytes = 0;
+        while (count < S_LOG_WRITE_BATCH) {
+            struct s_log_slot *slot = &log_ring.slots[(pos+count) & mask];
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos+count+1) {
+                break;
+            }
+            iov[count].iov_base = slot->big != NULL ? slot->big : slot->line;
+            iov[count].iov_len = slot->len;
+            bytes += slot->len;
+            count++;
+        }
+
+        if (count == 0) {
+            if (__atomic_load_n(&log_ring.stopping, __ATOMIC_SEQ_CST) &&
+                __atomic_load_n(&log_ring.head, __ATOMIC_SEQ_CST) == pos) {
+                break;
+            }
+            log_writer_wait(pos);
+            log_file_maintain(0);
+            continue;
+        }
+
+        log_write_all(log_ring.fd, iov, count);
+        log_file_maintain(bytes);
+
+        for (int i = 0; i < count; i++) {
+            struct s_log_slot *slot = &log_ring.slots[(pos+i) & mask];
+            if (slot->big != NULL) {
+                free(slot->big);
+                slot->big = NULL;
+            }
+            __atomic_store_n(&slot->seq, pos+i+log_ring.capacity, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&log_ring.tail, pos+count, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/**
+ * log_enqueue copies the entry into the next free slot of the
+ * buffer, or to the heap when it's too long for one. Returns -1
+ * if the entry was dropped.
+ */
+static int
+log_enqueue(const char *line, const size_t len)
+{
+    const uint64_t mask = log_ring.capacity - 1;
+    struct s_log_slot *slot;
+
+    char *big = NULL;
+    if (len > S_LOG_LINE_MAX) {
+        big = malloc(len);
+        if (big == NULL) {
+            __atomic_add_fetch(&log_ring.dropped, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        memcpy(big, line, len);
+    }
+
+    uint64_t pos = __atomic_load_n(&log_ring.head, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &log_ring.slots[pos & mask];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log_ring.head, &pos, pos+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+            continue;
+        }
+
+        if (diff < 0) {
+            if (log_ring.policy == S_LOG_FULL_DROP) {
+                __atomic_add_fetch(&log_ring.dropped, 1, __ATOMIC_RELAXED);
+                free(big);
+                return -1;
+            }
+            log_writer_wake();
+            sched_yield();
+        }
+
+        pos = __atomic_load_n(&log_ring.head, __ATOMIC_RELAXED);
+    }
+
+    if (big == NULL) {
+        memcpy(slot->line, line, len);
+    }
+    slot->big = big;
+    slot->len = len;
+    __atomic_store_n(&slot->seq, pos+1, __ATOMIC_SEQ_CST);
+
+    log_writer_wake();
+
+    return 0;
+}
+
+int
+s_log_async_start(size_t slots, int policy)
+{
+    if (log_ring.running || slots == 0) {
+        return -1;
+    }
+
+    uint64_t capacity = 1;
+    while (capacity < slots) {
+        capacity <<= 1;
+    }
+
+    log_ring.slots = malloc(capacity * sizeof(struct s_log_slot));
+    if (log_ring.slots == NULL) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < capacity; i++) {
+        log_ring.slots[i].seq = i;
+        log_ring.slots[i].big = NULL;
+    }
+
+    log_ring.capacity = capacity;
+    log_ring.head = 0;
+    log_ring.tail = 0;
+    log_ring.policy = policy;
+    log_ring.stopping = false;
+    log_ring.idle = false;
+
+    // anything written before now goes out ahead of the
+    // entries the writer thread writes straight to the fd.
+    fflush(log_output);
+    log_ring.fd = fileno(log_output);
+
+    if (pthread_create(&log_ring.writer, NULL, log_writer, NULL) != 0) {
+        free(log_ring.slots);
+        log_ring.slots = NULL;
+        return -1;
+    }
+
+    __atomic_store_n(&log_ring.running, true, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void
+s_log_flush(void)
+{
+    if (!__atomic_load_n(&log_ring.running, __ATOMIC_ACQUIRE)) {
+        fflush(log_output);
+        return;
+    }
+
+    const uint64_t target = __atomic_load_n(&log_ring.head, __ATOMIC_SEQ_CST);
+    const struct timespec pause = {0, 1000000};
+
+    while (__atomic_load_n(&log_ring.tail, __ATOMIC_ACQUIRE) < target) {
+        log_writer_wake();
+        nanosleep(&pause, NULL);
+    }
+}
+
+void
+s_log_shutdown(void)
 {
-    struct s_log_field_t *field = s_log_field_new(key);
-    field->type = S_LOG_INT;
-    field->int_value = value;
-    return field;
+    if (!__atomic_load_n(&log_ring.running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    // wait out anyone already queueing an entry before the
+    // writer is told to finish up.
+    __atomic_store_n(&log_ring.running, false, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&log_ring.producers, __ATOMIC_SEQ_CST) > 0) {
+        sched_yield();
+    }
+    __atomic_store_n(&log_ring.stopping, true, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&log_ring.lock);
+    pthread_cond_signal(&log_ring.wake);
+    pthread_mutex_unlock(&log_ring.lock);
+
+    pthread_join(log_ring.writer, NULL);
+
+    if (log_file.fd >= 0 && log_file.fsync_secs > 0) {
+        fdatasync(log_file.fd);
+    }
+
+    free(log_ring.slots);
+    log_ring.slots = NULL;
+}
+
+uint64_t
+s_log_dropped(void)
+{
+    return __atomic_load_n(&log_ring.dropped, __ATOMIC_RELAXED);
 }
 
 /**
- * s_log_int8 is used to add a 8 bit integer
- * value to the log entry.
+ * log_emit hands a serialized entry to the writer thread when
+ * the logger is async and writes it out directly otherwise.
  */
-struct s_log_field_t*
-s_log_int8(const char *key, const int8_t value)
+static void
+log_emit(const char *line, const size_t len)
 {
-    struct s_log_field_t *field = s_log_field_new(key);
-    field->type = S_LOG_INT8;
-    field->int8_value = value;
-    return field;
+    __atomic_add_fetch(&log_ring.producers, 1, __ATOMIC_SEQ_CST);
+
+    if (!__atomic_load_n(&log_ring.running, __ATOMIC_SEQ_CST)) {
+        __atomic_sub_fetch(&log_ring.producers, 1, __ATOMIC_SEQ_CST);
+        fwrite(line, 1, len, log_output);
+        return;
+    }
+
+    log_enqueue(line, len);
+
+    __atomic_sub_fetch(&log_ring.producers, 1, __ATOMIC_SEQ_CST);
 }
 
 /**
- * s_log_int16 is used to add a 16 bit integer
- * value to the log entry.
+ * log_buf is the line an entry is being encoded into. It
+ * starts out as the thread's log_line and moves to the heap
+ * if the entry outgrows it.
+ */
+struct log_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+/**
+ * log_buf_reserve makes room for n more bytes. Returns -1 if
+ * the line can't grow.
  */
-struct s_log_field_t*
-s_log_int16(const char *key, const int16_t value)
+static int
+log_buf_reserve(struct log_buf *b, const size_t n)
 {
-    struct s_log_field_t *field = s_log_field_new(key);
-    field->type = S_LOG_INT16;
-    field->int16_value = value;
-    return field;
+    if (b->len + n <= b->cap) {
+        return 0;
+    }
+
+    size_t cap = b->cap * 2;
+    while (cap < b->len + n) {
+        cap *= 2;
+    }
+
+    char *data;
+    if (b->data == log_line) {
+        data = malloc(cap);
+        if (data != NULL) {
+            memcpy(data, b->data, b->len);
+        }
+    } else {
+        data = realloc(b->data, cap);
+    }
+    if (data == NULL) {
+        return -1;
+    }
+
+    b->data = data;
+    b->cap = cap;
+
+    return 0;
 }
 
 /**
- * s_log_int32 is used to add a 32 bit integer
- * value to the log entry.
+ * log_buf_append appends n bytes to the line.
  */
-struct s_log_field_t*
-s_log_int32(const char *key, const int32_t value)
+static inline void
+log_buf_append(struct log_buf *b, const char *s, const size_t n)
 {
-    struct s_log_field_t *field = s_log_field_new(key);
-    field->type = S_LOG_INT32;
-    field->int32_value = value;
-    return field;
+    if (log_buf_reserve(b, n) == 0) {
+        memcpy(b->data + b->len, s, n);
+        b->len += n;
+    }
 }
 
+#define log_buf_literal(b, s) log_buf_append(b, s, sizeof(s)-1)
+
+/**
+ * digit_pairs holds "00" through "99" so integers can be
+ * formatted two digits at a time.
+ */
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
 /**
- * s_s_log_int64 is used to add a 64 bit integer
- * value to the log entry.
+ * log_buf_uint appends the decimal form of v.
  */
-struct s_log_field_t*
-s_log_int64(const char *key, const int64_t value)
+static void
+log_buf_uint(struct log_buf *b, uint64_t v)
 {
-    struct s_log_field_t *field = s_log_field_new(key);
-    field->type = S_LOG_INT64;
-    field->int64_value = value;
-    return field;
+    char tmp[20];
+    char *p = tmp + sizeof(tmp);
+
+    while (v >= 100) {
+        const unsigned i = (v % 100) * 2;
+        v /= 100;
+        *--p = digit_pairs[i+1];
+        *--p = digit_pairs[i];
+    }
+    if (v >= 10) {
+        const unsigned i = v * 2;
+        *--p = digit_pairs[i+1];
+        *--p = digit_pairs[i];
+    } else {
+        *--p = '0' + v;
+    }
+
+    log_buf_append(b, p, tmp + sizeof(tmp) - p);
 }
 
 /**
- * s_log_uint is used to add an unsigned integer value
- * to the log entry.
+ * log_buf_int appends the decimal form of v.
  */
-struct s_log_field_t*
-s_log_uint(const char *key, const unsigned int value)
+static void
+log_buf_int(struct log_buf *b, const int64_t v)
 {
-    struct s_log_field_t *field = s_log_field_new(key);
-    field->type = S_LOG_UINT;
-    field->int_value = value;
-    return field;
+    if (v < 0) {
+        log_buf_literal(b, "-");
+        log_buf_uint(b, -(uint64_t)v);
+        return;
+    }
+    log_buf_uint(b, v);
 }
 
 /**
- * s_log_uint8 is used to add a 8 bit integer
- * value to the log entry.
+ * log_buf_double appends v the way jansson would, or null
+ * since JSON has no way to write infinities and NaN.
  */
-struct s_log_field_t*
-s_log_uint8(const char *key, const uint8_t value)
+static void
+log_buf_double(struct log_buf *b, const double v)
 {
-    struct s_log_field_t *field = s_log_field_new(key);
-    field->type = S_LOG_UINT8;
-    field->int8_value = value;
-    return field;
+    if (!isfinite(v)) {
+        log_buf_literal(b, "null");
+        return;
+    }
+
+    char tmp[32];
+    int n = snprintf(tmp, sizeof(tmp), "%.17g", v);
+    log_buf_append(b, tmp, n);
+
+    // keep it a real when read back
+    if (strpbrk(tmp, ".eE") == NULL) {
+        log_buf_literal(b, ".0");
+    }
 }
 
 /**
- * s_log_uint16 is used to add a 16 bit integer
- * value to the log entry.
+ * log_clean_prefix returns how many bytes from the start of s
+ * can be copied into a JSON string as is. It stops at the
+ * first quote, backslash, control character or the end of the
+ * string. Blocks may be read past the end of the string but
+ * never past its page, which the address sanitizer can't tell
+ * apart from an overflow.
  */
-struct s_log_field_t*
-s_log_uint16(const char *key, const uint16_t value)
+__attribute__((no_sanitize_address))
+static size_t
+log_clean_prefix(const char *s)
 {
-    struct s_log_field_t *field = s_log_field_new(key);
-    field->type = S_LOG_UINT16;
-    field->int16_value = value;
-    return field;
+    const char *p = s;
+
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+#endif
+
+    for (;;) {
+#ifdef __SSE2__
+        // a block is only read when it can't cross into an
+        // unmapped page past the end of the string.
+        if (((uintptr_t)p & 4095) <= 4096 - 16) {
+            const __m128i v = _mm_loadu_si128((const __m128i *)p);
+            const __m128i special = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+                _mm_cmpeq_epi8(_mm_max_epu8(v, control), control));
+            const int mask = _mm_movemask_epi8(special);
+            if (mask != 0) {
+                return p - s + __builtin_ctz(mask);
+            }
+            p += 16;
+            continue;
+        }
+#endif
+        if (*p == '\0' || *p == '"' || *p == '\\' || (unsigned char)*p < 0x20) {
+            break;
+        }
+        p++;
+    }
+
+    return p - s;
 }
 
 /**
- * s_log_uint32 is used to add a 32 bit integer
- * value to the log entry.
+ * log_buf_string appends s as a quoted and escaped JSON
+ * string, or null if there's no string.
  */
-struct s_log_field_t*
-s_log_uint32(const char *key, const uint32_t value)
+static void
+log_buf_string(struct log_buf *b, const char *s)
 {
-    struct s_log_field_t *field = s_log_field_new(key);
-    field->type = S_LOG_UINT32;
-    field->int32_value = value;
-    return field;
+    static const char hex[] = "0123456789abcdef";
+
+    if (s == NULL) {
+        log_buf_literal(b, "null");
+        return;
+    }
+
+    log_buf_literal(b, "\"");
+
+    for (;;) {
+        const size_t n = log_clean_prefix(s);
+        log_buf_append(b, s, n);
+        s += n;
+
+        const unsigned char c = *s++;
+        switch (c) {
+            case '\0':
+                log_buf_literal(b, "\"");
+                return;
+            case '"':
+                log_buf_literal(b, "\\\"");
+                break;
+            case '\\':
+                log_buf_literal(b, "\\\\");
+                break;
+            case '\n':
+                log_buf_literal(b, "\\n");
+                break;
+            case '\r':
+                log_buf_literal(b, "\\r");
+                break;
+            case '\t':
+                log_buf_literal(b, "\\t");
+                break;
+            default: {
+                const char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+                log_buf_append(b, esc, sizeof(esc));
+            }
+        }
+    }
+}
+
+void
+s_log_set_clock(const clockid_t clock)
+{
+    log_clock = clock;
 }
 
 /**
- * s_log_uint64 is used to add a 64 bit integer
- * value to the log entry.
+ * log_format_seconds writes the part of the timestamp that
+ * changes once a second.
  */
-struct s_log_field_t*
-s_log_uint64(const char *key, const uint64_t value)
+static void
+log_format_seconds(const time_t sec, char *buf)
 {
-    struct s_log_field_t *field = s_log_field_new(key);
-    field->type = S_LOG_UINT64;
-    field->int64_value = value;
-    return field;
+    struct tm tm;
+    gmtime_r(&sec, &tm);
+    strftime(buf, S_LOG_TIMESTAMP_SIZE, "%Y-%m-%dT%H:%M:%S.", &tm);
 }
 
 /**
- * s_log_double is used to add a double to the
- * log entry.
+ * log_format_nanos writes the nanoseconds and zone of the
+ * timestamp.
  */
-struct s_log_field_t*
-s_log_double(const char *key, const double value)
+static void
+log_format_nanos(uint32_t nsec, char *buf)
 {
-    struct s_log_field_t *field = s_log_field_new(key);
-    field->type = S_LOG_DOUBLE;
-    field->double_value = value;
-    return field;
+    buf[9] = 'Z';
+    for (int i = 8; i > 0; i -= 2) {
+        const unsigned d = (nsec % 100) * 2;
+        nsec /= 100;
+        buf[i] = digit_pairs[d+1];
+        buf[i-1] = digit_pairs[d];
+    }
+    buf[0] = '0' + nsec;
+}
+
+void
+s_log_format_timestamp(const uint64_t ns, char *buf)
+{
+    log_format_seconds(ns / 1000000000, buf);
+    log_format_nanos(ns % 1000000000, buf + S_LOG_TIMESTAMP_PREFIX_LEN);
+    buf[S_LOG_TIMESTAMP_SIZE-1] = '\0';
 }
 
 /**
- * s_log_string is used to add a string to the
- * log entry.
+ * log_buf_timestamp appends ts as a quoted RFC 3339 timestamp,
+ * reusing the thread's formatted seconds when they match.
  */
-struct s_log_field_t*
-s_log_string(const char *key, const char *value)
+static void
+log_buf_timestamp(struct log_buf *b, const struct timespec *ts)
 {
-    struct s_log_field_t *field = s_log_field_new(key);
-    field->type = S_LOG_STRING;
-    field->char_value = (char *)malloc(strlen(value) + 1);
-    strcpy(field->char_value, value);
-    return field;
+    if (ts->tv_sec != log_time.sec) {
+        log_format_seconds(ts->tv_sec, log_time.prefix);
+        log_time.sec = ts->tv_sec;
+    }
+
+    char tmp[S_LOG_TIMESTAMP_SIZE + 2];
+    tmp[0] = '"';
+    memcpy(tmp + 1, log_time.prefix, S_LOG_TIMESTAMP_PREFIX_LEN);
+    log_format_nanos(ts->tv_nsec, tmp + 1 + S_LOG_TIMESTAMP_PREFIX_LEN);
+    tmp[S_LOG_TIMESTAMP_SIZE] = '"';
+
+    log_buf_append(b, tmp, sizeof(tmp) - 1);
+}
+
+int
+s_log_level_parse(const char *name)
+{
+    if (name == NULL) {
+        return -1;
+    }
+
+    for (int i = 0; i < S_LOG_LEVEL_COUNT; i++) {
+        if (strcasecmp(name, log_levels[i].name) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+const char*
+s_log_level_name(const int level)
+{
+    if (level < 0 || level >= S_LOG_LEVEL_COUNT) {
+        return "unknown";
+    }
+
+    return log_levels[level].name;
 }
 
 void
-reallog(char* l, ...)
+s_log_set_level(const int level)
 {
-    va_list ap;
+    if (level < 0 || level >= S_LOG_LEVEL_COUNT) {
+        return;
+    }
 
-    unsigned long now = (unsigned long)time(NULL); // UNIX timestamp format
+    __atomic_store_n(s_log_threshold, level, __ATOMIC_RELAXED);
+}
 
-    json_t *root = json_object();
-    json_object_set_new(root, "level", json_string(l));
-    json_object_set_new(root, "timestamp", json_integer(now));
+int
+s_log_get_level(void)
+{
+    return __atomic_load_n(s_log_threshold, __ATOMIC_RELAXED);
+}
 
-    va_start(ap, l);
+/**
+ * log_buf_varint appends v as a LEB128 varint.
+ */
+static inline void
+log_buf_varint(struct log_buf *b, uint64_t v)
+{
+    char tmp[10];
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        tmp[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    tmp[n++] = (char)v;
+
+    log_buf_append(b, tmp, n);
+}
+
+/**
+ * log_buf_bytes appends the length of s followed by s.
+ */
+static void
+log_buf_bytes(struct log_buf *b, const char *s)
+{
+    size_t len = strlen(s);
+    log_buf_varint(b, len);
+    log_buf_append(b, s, len);
+}
+
+/**
+ * log_key_id returns the number of the key in the header plus
+ * 1 or 0 if it isn't one of log_keys.
+ */
+static unsigned int
+log_key_id(const char *key)
+{
+    const size_t slot = ((uintptr_t)key >> 3) & (S_LOG_KEY_CACHE_SIZE-1);
+
+    // the key's memory may have been reused so check that
+    // a cached key still says the same thing.
+    unsigned int id = log_key_cache[slot].id;
+    if (log_key_cache[slot].key == key && strcmp(log_keys[id-1], key) == 0) {
+        return id;
+    }
+
+    for (size_t i = 0; i < S_LOG_KEY_COUNT; i++) {
+        if (strcmp(log_keys[i], key) == 0) {
+            log_key_cache[slot].key = key;
+            log_key_cache[slot].id = i + 1;
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * log_encode_json encodes an entry as a JSON line.
+ */
+static void
+log_encode_json(struct log_buf *line, const int level, const struct timespec *now, va_list ap)
+{
+    log_buf_append(line, log_levels[level].prefix, log_levels[level].prefix_len);
+    log_buf_timestamp(line, now);
 
     for (;;) {
         struct s_log_field_t *arg = va_arg(ap, struct s_log_field_t*);
@@ -307,33 +1168,137 @@ reallog(char* l, ...)
             break;
         }
 
+        log_buf_literal(line, ",");
+        log_buf_string(line, arg->key);
+        log_buf_literal(line, ":");
+
         switch (arg->type) {
-            case S_LOG_INT ... S_LOG_UINT64:
-                json_object_set_new(root, arg->key, json_integer(arg->int_value));
+            case S_LOG_INT ... S_LOG_INT64:
+                log_buf_int(line, arg->int64_value);
+                break;
+            case S_LOG_UINT ... S_LOG_UINT64:
+                log_buf_uint(line, arg->uint64_value);
                 break;
             case S_LOG_DOUBLE:
-                json_object_set_new(root, arg->key, json_real(arg->double_value));
+                log_buf_double(line, arg->double_value);
                 break;
             case S_LOG_STRING:
-                json_object_set_new(root, arg->key, json_string(arg->char_value));
+                log_buf_string(line, arg->char_value);
         }
+    }
 
-        s_log_field_free(arg);
+    log_buf_literal(line, "}\n");
+}
 
-        continue;
+/**
+ * log_encode_binary encodes the body of a binary entry.
+ */
+static void
+log_encode_binary(struct log_buf *line, const int level, const struct timespec *now, va_list ap)
+{
+    char head[2] = {(char)level, 0};
+    log_buf_append(line, head, 1);
+    log_buf_varint(line, (uint64_t)now->tv_sec * 1000000000 + now->tv_nsec);
+
+    for (;;) {
+        struct s_log_field_t *arg = va_arg(ap, struct s_log_field_t*);
+        if (arg == NULL) {
+            break;
+        }
+
+        unsigned int id = log_key_id(arg->key);
+        log_buf_varint(line, id);
+        if (id == 0) {
+            log_buf_bytes(line, arg->key);
+        }
+
+        switch (arg->type) {
+            case S_LOG_INT ... S_LOG_INT64:
+                head[0] = S_LOG_BINARY_INT;
+                log_buf_append(line, head, 1);
+                log_buf_varint(line, ((uint64_t)arg->int64_value << 1) ^ (uint64_t)(arg->int64_value >> 63));
+                break;
+            case S_LOG_UINT ... S_LOG_UINT64:
+                head[0] = S_LOG_BINARY_UINT;
+                log_buf_append(line, head, 1);
+                log_buf_varint(line, arg->uint64_value);
+                break;
+            case S_LOG_DOUBLE: {
+                uint64_t bits;
+                memcpy(&bits, &arg->double_value, sizeof(bits));
+                char le[9] = {S_LOG_BINARY_DOUBLE};
+                for (int i = 0; i < 8; i++) {
+                    le[i+1] = (char)(bits >> (8 * i));
+                }
+                log_buf_append(line, le, sizeof(le));
+                break;
+            }
+            case S_LOG_STRING:
+                if (arg->char_value == NULL) {
+                    head[0] = S_LOG_BINARY_NULL;
+                    log_buf_append(line, head, 1);
+                    break;
+                }
+                head[0] = S_LOG_BINARY_STRING;
+                log_buf_append(line, head, 1);
+                log_buf_bytes(line, arg->char_value);
+        }
     }
+}
+
+/**
+ * S_LOG_BINARY_PREFIX is the room left in front of a binary
+ * entry for its tag and length.
+ */
+#define S_LOG_BINARY_PREFIX 6
+
+void
+reallog(const int l, ...)
+{
+    va_list ap;
 
-    va_end(ap); 
+    struct timespec now;
+    clock_gettime(log_clock, &now);
 
-    int res = json_dumpf(root, log_output, JSON_INDENT(0));
-    if (res != 0) {
-        // error handler...
+    struct log_buf line = {
+        .data = log_line,
+        .cap = S_LOG_LINE_MAX,
+    };
+
+    const int level = l < 0 ? 0 : l >= S_LOG_LEVEL_COUNT ? LOG_FATAL : l;
+
+    va_start(ap, l);
+
+    size_t start = 0;
+    if (log_format == S_LOG_FORMAT_BINARY) {
+        line.len = S_LOG_BINARY_PREFIX;
+        log_encode_binary(&line, level, &now, ap);
+
+        // the tag and length go right in front of the body
+        uint64_t body = line.len - S_LOG_BINARY_PREFIX;
+        size_t n = 1;
+        while (body >> (7 * n)) {
+            n++;
+        }
+        start = S_LOG_BINARY_PREFIX - 1 - n;
+        line.data[start] = S_LOG_BINARY_ENTRY;
+        for (size_t i = 0; i < n; i++) {
+            line.data[start+1+i] = (char)((body >> (7 * i)) & 0x7f) | (i < n-1 ? 0x80 : 0);
+        }
+    } else {
+        log_encode_json(&line, level, &now, ap);
     }
-    fprintf(log_output, "\n");
 
-    json_decref(root);
+    va_end(ap);
+
+    log_emit(line.data + start, line.len - start);
+
+    if (line.data != log_line) {
+        free(line.data);
+    }
 
-    if (strcmp(l, LOG_FATAL) == 0) {
+    if (l == LOG_FATAL) {
+        s_log_flush();
         exit(1);
     }
 }
@@ -29,125 +29,332 @@
 #define _S_LOGGER_H
 
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
-#define LOG_TRACE "trace"
-#define LOG_DEBUG "debug"
-#define LOG_INFO  "info"
-#define LOG_WARN  "warn"
-#define LOG_ERROR "error"
-#define LOG_FATAL "fatal"
+#define LOG_TRACE 0
+#define LOG_DEBUG 1
+#define LOG_INFO  2
+#define LOG_WARN  3
+#define LOG_ERROR 4
+#define LOG_FATAL 5
 
+/**
+ * S_LOG_MIN_LEVEL is the lowest level compiled in. Entries
+ * below it are removed at compile time.
+ */
+#ifndef S_LOG_MIN_LEVEL
+#define S_LOG_MIN_LEVEL LOG_TRACE
+#endif
+
+/**
+ * s_log_threshold points at the lowest level currently logged.
+ * s_log_init moves it to memory shared with processes forked
+ * afterwards, so a change reaches every worker. Use
+ * s_log_set_level to change it.
+ */
+extern int *s_log_threshold;
+
+/**
+ * s_log_field_types is an enum of the supported log field types.
+ */
+enum s_log_field_types {
+    S_LOG_INT,
+    S_LOG_INT8,
+    S_LOG_INT16,
+    S_LOG_INT32,
+    S_LOG_INT64,
+    S_LOG_UINT,
+    S_LOG_UINT8,
+    S_LOG_UINT16,
+    S_LOG_UINT32,
+    S_LOG_UINT64,
+    S_LOG_DOUBLE,
+    S_LOG_STRING
+};
+
+/**
+ * s_log_field_t represents a field in a log entry and it's
+ * associated type. Fields borrow their key and value and
+ * only live until the end of the s_log call they're made
+ * in so they must not be kept around.
+ */
+struct s_log_field_t {
+    uint8_t type;
+    const char *key;
+    union {
+        int64_t int64_value;
+        uint64_t uint64_value;
+        double double_value;
+        const char *char_value;
+    };
+};
+
+/**
+ * S_LOG_FIELD builds a log field on the caller's stack.
+ */
+#define S_LOG_FIELD(t, k, member, v) \
+    (&(struct s_log_field_t){ .type = (t), .key = (k), .member = (v) })
 
 /**
  * s_log_int is used to add an integer value
  * to the log entry.
  */
-struct s_log_field_t*
-s_log_int(const char *key, const int value);
+#define s_log_int(key, value) \
+    S_LOG_FIELD(S_LOG_INT, key, int64_value, (int)(value))
 
 /**
  * s_log_int8 is used to add a 8 bit integer
  * value to the log entry.
  */
-struct s_log_field_t*
-s_log_int8(const char *key, const int8_t value);
+#define s_log_int8(key, value) \
+    S_LOG_FIELD(S_LOG_INT8, key, int64_value, (int8_t)(value))
 
 /**
  * s_log_int16 is used to add a 16 bit integer
  * value to the log entry.
  */
-struct s_log_field_t*
-s_log_int16(const char *key, const int16_t value);
+#define s_log_int16(key, value) \
+    S_LOG_FIELD(S_LOG_INT16, key, int64_value, (int16_t)(value))
 
 /**
  * s_log_int32 is used to add a 32 bit integer
  * value to the log entry.
  */
-struct s_log_field_t*
-s_log_int32(const char *key, const int32_t value);
+#define s_log_int32(key, value) \
+    S_LOG_FIELD(S_LOG_INT32, key, int64_value, (int32_t)(value))
 
 /**
- * s_s_log_int64 is used to add a 64 bit integer
+ * s_log_int64 is used to add a 64 bit integer
  * value to the log entry.
  */
-struct s_log_field_t*
-s_log_int64(const char *key, const int64_t value);
+#define s_log_int64(key, value) \
+    S_LOG_FIELD(S_LOG_INT64, key, int64_value, (int64_t)(value))
 
 /**
  * s_log_uint is used to add an unsigned integer value
  * to the log entry.
  */
-struct s_log_field_t*
-s_log_uint(const char *key, const unsigned int value);
+#define s_log_uint(key, value) \
+    S_LOG_FIELD(S_LOG_UINT, key, uint64_value, (unsigned int)(value))
 
 /**
  * s_log_uint8 is used to add a 8 bit integer
  * value to the log entry.
  */
-struct s_log_field_t*
-s_log_uint8(const char *key, const uint8_t value);
+#define s_log_uint8(key, value) \
+    S_LOG_FIELD(S_LOG_UINT8, key, uint64_value, (uint8_t)(value))
 
 /**
  * s_log_uint16 is used to add a 16 bit integer
  * value to the log entry.
  */
-struct s_log_field_t*
-s_log_uint16(const char *key, const uint16_t value);
+#define s_log_uint16(key, value) \
+    S_LOG_FIELD(S_LOG_UINT16, key, uint64_value, (uint16_t)(value))
 
 /**
  * s_log_uint32 is used to add a 32 bit integer
  * value to the log entry.
  */
-struct s_log_field_t*
-s_log_uint32(const char *key, const uint32_t value);
+#define s_log_uint32(key, value) \
+    S_LOG_FIELD(S_LOG_UINT32, key, uint64_value, (uint32_t)(value))
 
 /**
  * s_log_uint64 is used to add a 64 bit integer
  * value to the log entry.
  */
-struct s_log_field_t*
-s_log_uint64(const char *key, const uint64_t value);
+#define s_log_uint64(key, value) \
+    S_LOG_FIELD(S_LOG_UINT64, key, uint64_value, (uint64_t)(value))
 
 /**
  * s_log_double is used to add a double to the
  * log entry.
  */
-struct s_log_field_t*
-s_log_double(const char *key, const double value);
+#define s_log_double(key, value) \
+    S_LOG_FIELD(S_LOG_DOUBLE, key, double_value, (double)(value))
 
 /**
  * s_log_string is used to add a string to the
  * log entry.
  */
-struct s_log_field_t*
-s_log_string(const char *key, const char *value);
+#define s_log_string(key, value) \
+    S_LOG_FIELD(S_LOG_STRING, key, char_value, (value))
 
 enum {
     S_LOG_OUT_STDERR,
     S_LOG_OUT_STDOUT,
 };
 
+/**
+ * Formats log entries can be written in. Binary entries are
+ * read back with hush-logcat.
+ */
+enum {
+    S_LOG_FORMAT_JSON,
+    S_LOG_FORMAT_BINARY,
+};
+
+/**
+ * The binary format is a header followed by entries, each
+ * starting with its tag. The header lists the keys entries
+ * refer to by number and is repeated at the start of every
+ * file written to.
+ *
+ *   header: 'H' "HLOG" version count (len key)...
+ *   entry:  'E' len level timestamp (key type value)...
+ *
+ * The timestamp is nanoseconds since the epoch, seconds in
+ * version 1. Integers are LEB128 varints, signed ones zigzag
+ * encoded, and doubles 8 little endian bytes. A key of 0 is
+ * followed by the key itself as len bytes, otherwise it's the
+ * number of the key in the header plus 1.
+ */
+#define S_LOG_BINARY_MAGIC   "HLOG"
+#define S_LOG_BINARY_VERSION 2
+#define S_LOG_BINARY_HEADER  'H'
+#define S_LOG_BINARY_ENTRY   'E'
+
+enum {
+    S_LOG_BINARY_INT,
+    S_LOG_BINARY_UINT,
+    S_LOG_BINARY_DOUBLE,
+    S_LOG_BINARY_STRING,
+    S_LOG_BINARY_NULL,
+};
+
+/**
+ * Policies for what an async logger does with a log entry
+ * when its buffer is full.
+ */
+enum {
+    S_LOG_FULL_DROP,
+    S_LOG_FULL_BLOCK,
+};
+
 /**
  * s_log_init initializes the logger and sets up
- * where the logger writes to.
+ * where the logger writes to and in which format.
+ */
+void
+s_log_init(FILE *out, const int format);
+
+/**
+ * S_LOG_TIMESTAMP_SIZE is the size of a formatted timestamp
+ * including the terminating NUL.
+ */
+#define S_LOG_TIMESTAMP_SIZE sizeof("2006-01-02T15:04:05.999999999Z")
+
+/**
+ * s_log_set_clock sets the clock entries are timestamped with.
+ * CLOCK_REALTIME_COARSE is cheaper to read but only as precise
+ * as the kernel's tick. Defaults to CLOCK_REALTIME.
+ */
+void
+s_log_set_clock(const clockid_t clock);
+
+/**
+ * s_log_format_timestamp writes the given nanoseconds since the
+ * epoch as an RFC 3339 UTC timestamp with nanoseconds into buf,
+ * which must hold at least S_LOG_TIMESTAMP_SIZE bytes.
+ */
+void
+s_log_format_timestamp(const uint64_t ns, char *buf);
+
+/**
+ * s_log_init_file makes the logger append to the file at the
+ * given path. While the logger is async the file is rotated
+ * once it reaches max_bytes or is rotate_secs old and synced
+ * to disk every fsync_secs. Zero turns each of them off.
+ * Rotated files get the time of rotation appended to their
+ * name. Returns 0 on success.
+ */
+int
+s_log_init_file(const char *path, const uint64_t max_bytes, const unsigned int rotate_secs, const unsigned int fsync_secs);
+
+/**
+ * s_log_async_start moves writing log entries off of the
+ * calling threads. Entries are queued into a buffer of the
+ * given number of slots, rounded up to a power of 2, and
+ * written out by a writer thread. The policy decides if a
+ * full buffer drops entries or blocks until there's room.
+ * Returns 0 on success.
+ */
+int
+s_log_async_start(size_t slots, int policy);
+
+/**
+ * s_log_flush waits until every entry queued so far has
+ * been written.
+ */
+void
+s_log_flush(void);
+
+/**
+ * s_log_shutdown writes out any queued entries, stops the
+ * writer thread and goes back to writing entries directly.
  */
 void
-s_log_init(FILE *out);
+s_log_shutdown(void);
+
+/**
+ * s_log_dropped returns the number of entries dropped
+ * because the buffer was full.
+ */
+uint64_t
+s_log_dropped(void);
+
+/**
+ * s_log_level_parse returns the level with the given name or
+ * -1 if there's no such level.
+ */
+int
+s_log_level_parse(const char *name);
+
+/**
+ * s_log_level_name returns the name of the given level.
+ */
+const char*
+s_log_level_name(const int level);
+
+/**
+ * s_log_set_level sets the lowest level logged.
+ */
+void
+s_log_set_level(const int level);
+
+/**
+ * s_log_get_level returns the lowest level logged.
+ */
+int
+s_log_get_level(void);
+
+/**
+ * s_log_enabled reports if entries at the given level are
+ * logged.
+ */
+#define s_log_enabled(l) \
+    ((l) >= S_LOG_MIN_LEVEL && (l) >= __atomic_load_n(s_log_threshold, __ATOMIC_RELAXED))
 
 /**
  * reallog provides the functionality of the logger. Returns
  * the number os bytes written.
  */
 void
-reallog(char *l, ...);
+reallog(const int l, ...);
 
 /**
  * s_log is the main entry point for adding data
- * to the logger to create log entries
+ * to the logger to create log entries. The fields are
+ * only evaluated when the level is logged. Fatal entries
+ * are always logged.
  */
-#define s_log(l, ...) ({ reallog(l, __VA_ARGS__, NULL); })
+#define s_log(l, ...) ({ \
+    if ((l) == LOG_FATAL || s_log_enabled(l)) { \
+        reallog(l, __VA_ARGS__, NULL); \
+    } \
+})
 
 #endif /** end _S_LOGGER_H */
@@ -26,58 +26,398 @@
  */
 
 #include <inttypes.h>
-#ifdef __linux__
 #include <signal.h>
-#endif
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sodium.h>
 #include <ulfius.h>
 
 #include "api.h"
 #include "database.h"
 #include "logger.h"
+#include "pass.h"
+#include "policy.h"
+#include "trace.h"
 
 #define STR1(x) #x
 #define STR(x) STR1(x)
 
+/**
+ * WORKER_START_DELAY is how long a rolling restart waits for
+ * a replacement worker to start listening before the worker
+ * it replaces is told to drain.
+ */
+#define WORKER_START_DELAY 1
 
-int control = 0;
+/**
+ * WORKER_RESTART_MAX_DELAY caps how long a worker that keeps
+ * exiting waits before it's restarted. The delay starts at a
+ * second and doubles with each exit until the worker manages to
+ * stay up for WORKER_STABLE_SECS.
+ */
+#define WORKER_RESTART_MAX_DELAY 60
+#define WORKER_STABLE_SECS 30
+
+/**
+ * DEFAULT_DICT_INDEX is where `make dict` writes the dictionary
+ * index.
+ */
+#define DEFAULT_DICT_INDEX "words.idx"
 
 /**
- * sig_handler captures ctrl-c.
+ * DEFAULT_LOG_BUFFER_SIZE is how many log entries a worker
+ * can have queued for writing.
+ */
+#define DEFAULT_LOG_BUFFER_SIZE 1024
+
+
+/**
+ * log_to_file switches logging to the file named by LOG_FILE,
+ * if set, staying on stdout if it can't be opened.
  */
 static void
-sig_handler(int dummy)
+log_to_file()
 {
-    control = 1;
-    exit(EXIT_FAILURE);
+    const char *path = getenv("LOG_FILE");
+    if (path == NULL || path[0] == '\0') {
+        return;
+    }
+
+    const char *max_bytes = getenv("LOG_FILE_MAX_BYTES");
+    const char *rotate_secs = getenv("LOG_FILE_ROTATE_SECS");
+    const char *fsync_secs = getenv("LOG_FILE_FSYNC_SECS");
+
+    if (s_log_init_file(path,
+        max_bytes != NULL ? strtoull(max_bytes, NULL, 10) : 0,
+        rotate_secs != NULL ? strtoul(rotate_secs, NULL, 10) : 0,
+        fsync_secs != NULL ? strtoul(fsync_secs, NULL, 10) : 0) != 0) {
+        s_log(LOG_WARN, s_log_string("msg", "unable to open log file, logging to stdout"), s_log_string("path", path));
+    }
 }
 
-int
-main(int argc, char **argv)
+/**
+ * run_worker connects to the database and serves requests
+ * until told to stop. Each worker has its own connection pool.
+ */
+static int
+run_worker()
 {
-    signal(SIGINT, sig_handler);
-    srand(time(NULL));
+    const char *log_buffer_size = getenv("LOG_BUFFER_SIZE");
+    const char *log_full_policy = getenv("LOG_FULL_POLICY");
+    size_t log_slots = log_buffer_size != NULL ? strtoull(log_buffer_size, NULL, 10) : DEFAULT_LOG_BUFFER_SIZE;
+    int log_policy = (log_full_policy != NULL && strcmp(log_full_policy, "block") == 0) ?
+        S_LOG_FULL_BLOCK : S_LOG_FULL_DROP;
+    if (log_slots > 0 && s_log_async_start(log_slots, log_policy) != 0) {
+        s_log(LOG_WARN, s_log_string("msg", "unable to start async logger, logging synchronously"));
+    }
 
-    s_log_init(stdout);
+    if (trace_init(getenv("TRACE_EXPORT_FILE")) != 0) {
+        s_log(LOG_WARN, s_log_string("msg", "unable to open trace export file"));
+    }
 
     db_t *db = db_new();
 
-    s_log(LOG_INFO, s_log_string("msg", "initializing database"));
-    
     int res = db_init(db, getenv("DB_HOST"), getenv("DB_USER"), getenv("DB_PASS"), getenv("DB_NAME"));
     if (res != 0) {
         fprintf(stderr, "error: db init - %s\n", db_get_error(db));
+        s_log_shutdown();
         return 1;
     }
     
-    api_init(db);
+    if (api_init(db) != 0) {
+        db_cleanup(db);
+        trace_shutdown();
+        s_log_shutdown();
+        return 1;
+    }
     api_start();
 
     db_cleanup(db);
+    trace_shutdown();
+    s_log_shutdown();
+
+    return 0;
+}
+
+/**
+ * bootstrap_db migrates the database and adds the admin user
+ * once, before any workers start, so they don't race each other
+ * doing it. Its connections are closed before workers are forked.
+ */
+static int
+bootstrap_db()
+{
+    db_t *db = db_new();
+
+    s_log(LOG_INFO, s_log_string("msg", "initializing database"));
+
+    int res = db_init(db, getenv("DB_HOST"), getenv("DB_USER"), getenv("DB_PASS"), getenv("DB_NAME"));
+    if (res == 0) {
+        res = db_bootstrap(db);
+    }
+    if (res != 0) {
+        fprintf(stderr, "error: db init - %s\n", db_get_error(db));
+    }
+
+    db_cleanup(db);
+
+    return res;
+}
+
+/**
+ * spawn_worker forks a new worker process. Returns the pid
+ * of the worker to the supervisor.
+ */
+static pid_t
+spawn_worker()
+{
+    // don't leave buffered entries for the child to write again
+    s_log_flush();
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        log_to_file();
+        exit(run_worker());
+    }
+
+    if (pid < 0) {
+        s_log(LOG_ERROR, s_log_string("msg", "unable to fork worker"));
+    }
+
+    return pid;
+}
+
+/**
+ * run_supervisor starts the given number of workers sharing
+ * the listening port and keeps them running. SIGHUP replaces
+ * the workers one at a time without dropping connections and
+ * SIGINT or SIGTERM drains them all and exits. A worker that
+ * exits on its own is restarted straight away the first time and
+ * with a growing delay if it keeps exiting.
+ */
+static int
+run_supervisor(const int count)
+{
+    pid_t *workers = calloc(count, sizeof(pid_t));
+    time_t *started = calloc(count, sizeof(time_t));
+    time_t *restart_at = calloc(count, sizeof(time_t));
+    int *backoff = calloc(count, sizeof(int));
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+
+    for (int i = 0; i < count; i++) {
+        workers[i] = spawn_worker();
+        started[i] = time(NULL);
+    }
+
+    s_log(LOG_INFO, s_log_string("msg", "supervisor started"), s_log_int("workers", count));
+
+    bool stopping = false;
+    int running = count;
+    int waiting = 0;
+
+    while (running > 0 || waiting > 0) {
+        // wake up for the earliest delayed restart, if any
+        time_t now = time(NULL);
+        time_t next = 0;
+        for (int i = 0; i < count; i++) {
+            if (restart_at[i] > 0 && (next == 0 || restart_at[i] < next)) {
+                next = restart_at[i];
+            }
+        }
+
+        int sig;
+        if (next == 0) {
+            sigwait(&signals, &sig);
+        } else {
+            struct timespec timeout = { .tv_sec = next > now ? next - now : 0 };
+            sig = sigtimedwait(&signals, NULL, &timeout);
+        }
+
+        switch (sig) {
+            case SIGINT:
+            case SIGTERM:
+                stopping = true;
+                for (int i = 0; i < count; i++) {
+                    if (workers[i] > 0) {
+                        kill(workers[i], SIGTERM);
+                    }
+                    restart_at[i] = 0;
+                }
+                waiting = 0;
+                break;
+            case SIGHUP:
+                if (stopping) {
+                    break;
+                }
+                for (int i = 0; i < count; i++) {
+                    // the old worker keeps serving if its replacement
+                    // can't be started. an empty slot is retried.
+                    pid_t pid = spawn_worker();
+                    if (pid <= 0) {
+                        if (workers[i] <= 0 && restart_at[i] == 0) {
+                            restart_at[i] = time(NULL) + WORKER_START_DELAY;
+                            waiting++;
+                        }
+                        continue;
+                    }
+
+                    pid_t old = workers[i];
+                    workers[i] = pid;
+                    started[i] = time(NULL);
+                    running++;
+                    if (restart_at[i] > 0) {
+                        restart_at[i] = 0;
+                        waiting--;
+                    }
+                    sleep(WORKER_START_DELAY);
+                    if (old > 0) {
+                        kill(old, SIGTERM);
+                    }
+                }
+                break;
+            case SIGCHLD: {
+                pid_t pid;
+                int status;
+                while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                    running--;
+
+                    for (int i = 0; i < count; i++) {
+                        if (workers[i] != pid) {
+                            continue;
+                        }
+
+                        // a worker that exits on its own is replaced
+                        // unless we're shutting down. one that didn't
+                        // stay up long waits longer each time.
+                        workers[i] = 0;
+                        if (stopping) {
+                            continue;
+                        }
+
+                        if (time(NULL) - started[i] >= WORKER_STABLE_SECS) {
+                            backoff[i] = 0;
+                        }
+
+                        s_log(LOG_WARN, s_log_string("msg", "worker exited, restarting"), s_log_int("pid", pid),
+                            s_log_int("delay", backoff[i]));
+                        restart_at[i] = time(NULL) + backoff[i];
+                        waiting++;
+                        backoff[i] = backoff[i] == 0 ? 1 : backoff[i] * 2;
+                        if (backoff[i] > WORKER_RESTART_MAX_DELAY) {
+                            backoff[i] = WORKER_RESTART_MAX_DELAY;
+                        }
+                    }
+                }
+                break;
+            }
+        }
+
+        now = time(NULL);
+        for (int i = 0; i < count; i++) {
+            if (restart_at[i] == 0 || restart_at[i] > now) {
+                continue;
+            }
+
+            workers[i] = spawn_worker();
+            started[i] = now;
+            if (workers[i] > 0) {
+                restart_at[i] = 0;
+                waiting--;
+                running++;
+            } else {
+                restart_at[i] = now + (backoff[i] > 0 ? backoff[i] : 1);
+            }
+        }
+    }
+
+    free(workers);
+    free(started);
+    free(restart_at);
+    free(backoff);
 
     return 0;
 }
+
+int
+main(int argc, char **argv)
+{
+    srand(time(NULL));
+
+    const char *log_format = getenv("LOG_FORMAT");
+    s_log_init(stdout, (log_format != NULL && strcmp(log_format, "binary") == 0) ?
+        S_LOG_FORMAT_BINARY : S_LOG_FORMAT_JSON);
+    log_to_file();
+
+    const char *log_clock = getenv("LOG_CLOCK");
+    if (log_clock != NULL && strcmp(log_clock, "coarse") == 0) {
+        s_log_set_clock(CLOCK_REALTIME_COARSE);
+    }
+
+    const char *log_level = getenv("LOG_LEVEL");
+    if (log_level != NULL) {
+        int level = s_log_level_parse(log_level);
+        if (level < 0) {
+            s_log(LOG_WARN, s_log_string("msg", "unknown log level, using default"), s_log_string("level", log_level));
+        } else {
+            s_log_set_level(level);
+        }
+    }
+
+    if (sodium_init() < 0) {
+        s_log(LOG_FATAL, s_log_string("msg", "unable to initialize libsodium"));
+    }
+
+    const char *opslimit = getenv("HASH_OPSLIMIT");
+    const char *memlimit = getenv("HASH_MEMLIMIT");
+    password_hash_init(opslimit != NULL ? strtoull(opslimit, NULL, 10) : 0,
+        memlimit != NULL ? strtoull(memlimit, NULL, 10) : 0);
+
+    const char *dict_index = getenv("DICT_INDEX");
+    if (password_dict_init(dict_index != NULL ? dict_index : DEFAULT_DICT_INDEX) != 0) {
+        s_log(LOG_WARN, s_log_string("msg", "unable to load dictionary index, run make dict"));
+    }
+
+    // policies are compiled once here so every worker shares
+    // them, and a bad file stops the server rather than leaving
+    // labels generating with the wrong policy.
+    const char *password_policies = getenv("PASSWORD_POLICIES");
+    if (password_policies != NULL && password_policies[0] != '\0') {
+        const char *error;
+        if (policy_load(password_policies, password_dict(), &error) != 0) {
+            s_log(LOG_FATAL, s_log_string("msg", "unable to load password policies"), s_log_string("error", error));
+        }
+    }
+
+    // the stop signals are waited for explicitly so block them
+    // before any threads are started.
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &stop_signals, NULL);
+
+    if (bootstrap_db() != 0) {
+        return 1;
+    }
+
+    const char *workers = getenv("HTTP_WORKERS");
+    if (workers != NULL && atoi(workers) > 0) {
+        return run_supervisor(atoi(workers));
+    }
+
+    return run_worker();
+}
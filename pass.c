@@ -1,20 +1,17 @@
+#include <fcntl.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <sodium.h>
 
+#include "dict.h"
 #include "pass.h"
-
-#define SPECIAL_CHARS "!@#$%^&*()-_=+,.?/:;{}[]~"
-#define NUMBER_CHARS "0123456789"
-#define UPPER_CHARS "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-#define LOWER_CHARS "abcdefghijklmnopqrstuvwxyz"
-#define ALL_CHARS UPPER_CHARS LOWER_CHARS NUMBER_CHARS SPECIAL_CHARS
-
-#define WORD_LOCATION "/usr/share/dict/words"
+#include "stream.h"
 
 #define KEY_OVERWRITE_MESSAGE !!!! WARNING !!!!           \
 This is a destructive action that will prevent previously \
@@ -24,76 +21,31 @@ what you want to do.
 int
 encrypt_password(const char *target_file, const char *password, const unsigned char key[crypto_secretstream_xchacha20poly1305_KEYBYTES])
 {
-    unsigned char buf_in[MAX_PASS_SIZE];
-    unsigned char buf_out[MAX_PASS_SIZE + crypto_secretstream_xchacha20poly1305_ABYTES];
-    unsigned char header[crypto_secretstream_xchacha20poly1305_HEADERBYTES];
-
-    crypto_secretstream_xchacha20poly1305_state st;
-
-    unsigned long long out_len;
-    unsigned char tag;
-    
-    FILE *fp_t = fopen(target_file, "wb");
-
-    crypto_secretstream_xchacha20poly1305_init_push(&st, header, key);
-    
-    fwrite(header, 1, sizeof header, fp_t);
-
-    size_t pass_len = strlen(password);
-    do {
-        tag = EOF ? crypto_secretstream_xchacha20poly1305_TAG_FINAL : 0;
-        crypto_secretstream_xchacha20poly1305_push(&st, buf_out, &out_len, password, pass_len, NULL, 0, tag);
-        fwrite(buf_out, 1, (size_t)out_len, fp_t);
-    } while (!EOF);
+    int fd = open(target_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return -1;
+    }
 
-    fclose(fp_t);
+    int res = stream_encrypt_buf((const unsigned char *)password, strlen(password), fd, key);
+    if (close(fd) != 0) {
+        res = -1;
+    }
 
-    return 0;
+    return res;
 }
 
 int
-decrypt_password(const char *source_file, const unsigned char key[crypto_secretstream_xchacha20poly1305_KEYBYTES])
+decrypt_password(const char *source_file, const int out_fd, const unsigned char key[crypto_secretstream_xchacha20poly1305_KEYBYTES])
 {
-    unsigned char buf_in[MAX_PASS_SIZE + crypto_secretstream_xchacha20poly1305_ABYTES];
-    unsigned char buf_out[MAX_PASS_SIZE];
-    unsigned char header[crypto_secretstream_xchacha20poly1305_HEADERBYTES];
-
-    crypto_secretstream_xchacha20poly1305_state st;
-
-    unsigned long long out_len;
-    int eof;
-    int ret = -1;
-    unsigned char tag;
-
-    FILE *fp_s = fopen(source_file, "rb");
-    size_t res = fread(header, 1, sizeof(header), fp_s);
-    
-    if (crypto_secretstream_xchacha20poly1305_init_pull(&st, header, key) != 0) {
-        goto ret;
+    int fd = open(source_file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
     }
 
-    do {
-        size_t rlen = fread(buf_in, 1, sizeof buf_in, fp_s);
-        
-        eof = feof(fp_s);
-        
-        if (crypto_secretstream_xchacha20poly1305_pull(&st, buf_out, &out_len, &tag, buf_in, rlen, NULL, 0) != 0) {
-            goto ret;
-        }
-
-        if (tag == crypto_secretstream_xchacha20poly1305_TAG_FINAL && ! eof) {
-            goto ret;
-        }
-
-        fwrite(buf_out, 1, (size_t)out_len, stdout);
-        fwrite("\n", 1, (size_t)1, stdout);
-    } while (!eof);
+    int res = stream_decrypt_fd(fd, out_fd, key);
+    close(fd);
 
-    ret = 0;
-ret:
-    fclose(fp_s);
-    
-    return ret;
+    return res;
 }
 
 /**
@@ -116,158 +68,295 @@ create_key(const char *key_file)
     return 0;
 }
 
-char*
-generate_password(const int size)
+/**
+ * GENERATE_POOL_SIZE is the most random bytes drawn at once
+ * when generating passwords.
+ */
+#define GENERATE_POOL_SIZE 4096
+
+void
+generate_passwords(char *out, const size_t size, const size_t count)
 {
-    char *password = malloc(MAX_PASS_SIZE);
+    // bytes at or above limit are thrown away so every
+    // character of the alphabet is equally likely.
+    const size_t alphabet_size = sizeof(ALL_CHARS) - 1;
+    const unsigned int limit = 256 - (256 % alphabet_size);
+
+    unsigned char pool[GENERATE_POOL_SIZE];
+    size_t avail = 0;
+    size_t pos = 0;
+
+    size_t remaining = size * count;
+    for (size_t p = 0; p < count; p++) {
+        char *password = out + p * (size + 1);
+
+        for (size_t i = 0; i < size; ) {
+            if (pos == avail) {
+                // enough for what's left with some to spare
+                // for the rejected bytes.
+                avail = remaining + remaining / 2 + 16;
+                if (avail > sizeof(pool)) {
+                    avail = sizeof(pool);
+                }
+                randombytes_buf(pool, avail);
+                pos = 0;
+            }
+
+            const unsigned char b = pool[pos++];
+            if (b < limit) {
+                password[i++] = ALL_CHARS[b % alphabet_size];
+                remaining--;
+            }
+        }
 
-    for(int i = 0; i < size; i++) {
-        password[i] = ALL_CHARS[randombytes_random() % (sizeof(ALL_CHARS) - 1)];
+        password[size] = '\0';
     }
 
-    return password;
+    sodium_memzero(pool, sizeof(pool));
 }
 
-/**
- * in_dict checks to see if the given password is in the 
- * system dictionary.
- */
-static bool
-in_dict(const char *pass)
+void
+generate_password_into(char *out, const size_t size)
 {
-    char line[26];
+    generate_passwords(out, size, 1);
+}
 
-    FILE *fp = fopen(WORD_LOCATION, "r");
-    if (!fp) {
-        perror("could not find the file");
-        exit(0);
+char*
+generate_password(const int size)
+{
+    char *password = malloc(size + 1);
+    if (password == NULL) {
+        return NULL;
     }
 
-    while (fgets(line, 26, fp) != NULL ) {
-        line[strcspn(line, "\r\n")] = 0;
+    generate_password_into(password, size);
 
-        if (!strcmp(line, pass)) {
-            return true;   
-        }
+    return password;
+}
+
+static unsigned long long hash_opslimit = crypto_pwhash_OPSLIMIT_INTERACTIVE;
+static size_t hash_memlimit = crypto_pwhash_MEMLIMIT_INTERACTIVE;
+
+void
+password_hash_init(const unsigned long long opslimit, const size_t memlimit)
+{
+    if (opslimit >= crypto_pwhash_OPSLIMIT_MIN) {
+        hash_opslimit = opslimit;
     }
 
-    fclose(fp);
+    if (memlimit >= crypto_pwhash_MEMLIMIT_MIN) {
+        hash_memlimit = memlimit;
+    }
+}
 
-    return false;
+int
+password_hash(const char *password, char hash[crypto_pwhash_STRBYTES])
+{
+    return crypto_pwhash_str_alg(hash, password, strlen(password), hash_opslimit, hash_memlimit, crypto_pwhash_ALG_ARGON2ID13);
 }
 
-/** 
- * has_special_char chceks the given password
- * for any special characters.
- */
-static bool
-has_special_char(const char *pass)
+int
+password_verify(const char *hash, const char *password)
 {
-    for (int i = 0; i < strlen(pass); i++) {
-        if (strchr(SPECIAL_CHARS, pass[i]) ) {
-            return true;
-        }
+    if (strncmp(hash, crypto_pwhash_argon2id_STRPREFIX, strlen(crypto_pwhash_argon2id_STRPREFIX)) != 0) {
+        return 0;
     }
 
-    return false;
+    return crypto_pwhash_str_verify(hash, password, strlen(password)) == 0;
 }
 
-/**
- * has_number_char chceks the given password
- * for any number characters.
- */
-static bool
-has_number_char(const char *pass)
+int
+password_needs_rehash(const char *hash)
 {
-    for (int i = 0; i < strlen(pass); i++) {
-        if (strchr(NUMBER_CHARS, pass[i]) ) {
-            return true;
-        }
+    if (strncmp(hash, crypto_pwhash_argon2id_STRPREFIX, strlen(crypto_pwhash_argon2id_STRPREFIX)) != 0) {
+        return 1;
     }
 
-    return false;
+    return crypto_pwhash_str_needs_rehash(hash, hash_opslimit, hash_memlimit) != 0;
 }
 
 /**
- * has_upper_char chceks the given password
- * for any upper characters.
+ * words is the dictionary index passwords are checked against.
  */
-static bool
-has_upper_char(const char *pass)
+static dict_t *words;
+
+int
+password_dict_init(const char *index_path)
 {
-    for (int i = 0; i < strlen(pass); i++) {
-        if (strchr(UPPER_CHARS, pass[i]) ) {
-            return true;
-        }
+    dict_t *dict = dict_open(index_path);
+    if (dict == NULL) {
+        return -1;
     }
 
-    return false;
+    dict_close(words);
+    words = dict;
+
+    return 0;
+}
+
+const dict_t*
+password_dict(void)
+{
+    return words;
 }
 
 /**
- * has_lower_char chceks the given password
- * for any lower characters.
+ * in_dict checks to see if the given password is in the 
+ * dictionary, ignoring case and leetspeak substitutions.
+ * Nothing is in the dictionary if no index was loaded.
  */
 static bool
-has_lower_char(const char *pass)
+in_dict(const char *pass)
 {
-    for (int i = 0; i < strlen(pass); i++) {
-        if (strchr(LOWER_CHARS, pass[i]) ) {
-            return true;
-        }
-    }
-
-    return false;
+    return dict_contains(words, pass, DICT_LEET);
 }
 
-void
-check(const char *pass)
-{
-    printf("report:\n");
+/**
+ * Character classes used to score passwords.
+ */
+enum {
+    CHAR_OTHER   = 0x0,
+    CHAR_LOWER   = 0x1,
+    CHAR_UPPER   = 0x2,
+    CHAR_NUMBER  = 0x4,
+    CHAR_SPECIAL = 0x8,
+};
 
-    int score = 0;
+/**
+ * char_class maps every byte to its class so a password is
+ * classified in a single pass.
+ */
+static const unsigned char char_class[256] = {
+    ['a' ... 'z'] = CHAR_LOWER,
+    ['A' ... 'Z'] = CHAR_UPPER,
+    ['0' ... '9'] = CHAR_NUMBER,
+    ['!'] = CHAR_SPECIAL, ['@'] = CHAR_SPECIAL, ['#'] = CHAR_SPECIAL,
+    ['$'] = CHAR_SPECIAL, ['%'] = CHAR_SPECIAL, ['^'] = CHAR_SPECIAL,
+    ['&'] = CHAR_SPECIAL, ['*'] = CHAR_SPECIAL, ['('] = CHAR_SPECIAL,
+    [')'] = CHAR_SPECIAL, ['-'] = CHAR_SPECIAL, ['_'] = CHAR_SPECIAL,
+    ['='] = CHAR_SPECIAL, ['+'] = CHAR_SPECIAL, [','] = CHAR_SPECIAL,
+    ['.'] = CHAR_SPECIAL, ['?'] = CHAR_SPECIAL, ['/'] = CHAR_SPECIAL,
+    [':'] = CHAR_SPECIAL, [';'] = CHAR_SPECIAL, ['{'] = CHAR_SPECIAL,
+    ['}'] = CHAR_SPECIAL, ['['] = CHAR_SPECIAL, [']'] = CHAR_SPECIAL,
+    ['~'] = CHAR_SPECIAL,
+};
 
-    size_t pass_size = strlen(pass);
+/**
+ * The number of characters in each class, used to size the
+ * pool a password's characters are drawn from. Other covers
+ * the rest of printable ASCII.
+ */
+#define LOWER_POOL   26
+#define UPPER_POOL   26
+#define NUMBER_POOL  10
+#define SPECIAL_POOL (sizeof(SPECIAL_CHARS) - 1)
+#define OTHER_POOL   (95 - LOWER_POOL - UPPER_POOL - NUMBER_POOL - SPECIAL_POOL)
 
-    printf("  greater than 8:");
-    if (pass_size > 8) {
-        score++;
-        printf(" y\n");
-    } else {
-        printf(" n\n");
-    }
+/**
+ * Minimum entropy in bits for each score above 0.
+ */
+static const double score_entropy[] = {28, 36, 60, 128};
 
-    printf("  has lower:");
-    if (has_lower_char(pass)) {
-        score++;
-        printf("      y\n");
-    } else {
-        printf("      n\n");
+void
+password_strength(const char *pass, password_strength_t *strength)
+{
+    memset(strength, 0, sizeof(password_strength_t));
+
+    unsigned char classes = 0;
+    bool other = false;
+    size_t run = 0;
+    int prev = -1;
+    int step = 0;
+    size_t len = 0;
+
+    for (const unsigned char *p = (const unsigned char *)pass; *p != '\0'; p++, len++) {
+        const unsigned char c = char_class[*p];
+        classes |= c;
+        other = other || c == CHAR_OTHER;
+
+        // a character repeating the one before it or carrying
+        // on a run like abc or 321 adds next to nothing.
+        if (prev == *p) {
+            strength->repeats++;
+        } else if (prev >= 0 && c != CHAR_OTHER && c == char_class[prev] && (*p - prev == 1 || *p - prev == -1)) {
+            if (run > 0 && *p - prev == step) {
+                strength->sequences++;
+            }
+            step = *p - prev;
+            run++;
+        } else {
+            run = 0;
+        }
+        prev = *p;
     }
 
-    printf("  has upper:");
-    if (has_upper_char(pass)) {
-        score++;
-        printf("      y\n");
-    } else {
-        printf("      n\n");
+    strength->length = len;
+    strength->has_lower = classes & CHAR_LOWER;
+    strength->has_upper = classes & CHAR_UPPER;
+    strength->has_number = classes & CHAR_NUMBER;
+    strength->has_special = classes & CHAR_SPECIAL;
+
+    // words dressed up with digits or symbols around them, like
+    // password123!, are checked without them too.
+    size_t affix = 0;
+    strength->in_dictionary = len > 0 && in_dict(pass);
+    if (!strength->in_dictionary && len <= DICT_MAX_WORD) {
+        size_t start = 0;
+        size_t end = len;
+        while (start < end && (char_class[(unsigned char)pass[start]] & (CHAR_NUMBER | CHAR_SPECIAL))) {
+            start++;
+        }
+        while (end > start && (char_class[(unsigned char)pass[end-1]] & (CHAR_NUMBER | CHAR_SPECIAL))) {
+            end--;
+        }
+
+        if (end > start && end - start < len) {
+            char word[DICT_MAX_WORD + 1];
+            memcpy(word, pass + start, end - start);
+            word[end - start] = '\0';
+            strength->in_dictionary = in_dict(word);
+            affix = len - (end - start);
+        }
     }
 
-    printf("  has special:");
-    if (has_special_char(pass)) {
-        score++;
-        printf("    y\n");
-    } else {
-        printf("    n\n");
+    size_t pool = (strength->has_lower ? LOWER_POOL : 0) +
+        (strength->has_upper ? UPPER_POOL : 0) +
+        (strength->has_number ? NUMBER_POOL : 0) +
+        (strength->has_special ? SPECIAL_POOL : 0) +
+        (other ? OTHER_POOL : 0);
+
+    size_t effective = len - strength->repeats - strength->sequences;
+    strength->entropy = pool > 1 ? effective * log2(pool) : 0;
+
+    // a dictionary word is only as strong as the number of
+    // words it could have been, plus whatever surrounds it.
+    if (strength->in_dictionary) {
+        double word_entropy = log2(dict_size(words)) + affix * log2(NUMBER_POOL + SPECIAL_POOL);
+        if (strength->entropy > word_entropy) {
+            strength->entropy = word_entropy;
+        }
     }
 
-    printf("  in dictionary:");
-    if (in_dict(pass)) {
-        score--;
-        printf("  y\n");
-    } else {
-        printf("  n\n");
+    for (size_t i = 0; i < sizeof(score_entropy) / sizeof(score_entropy[0]); i++) {
+        if (strength->entropy >= score_entropy[i]) {
+            strength->score = i + 1;
+        }
     }
+}
 
-    return;
+void
+check(const char *pass)
+{
+    password_strength_t strength;
+    password_strength(pass, &strength);
+
+    printf("report:\n");
+    printf("  greater than 8: %s\n", strength.length > 8 ? "y" : "n");
+    printf("  has lower:      %s\n", strength.has_lower ? "y" : "n");
+    printf("  has upper:      %s\n", strength.has_upper ? "y" : "n");
+    printf("  has number:     %s\n", strength.has_number ? "y" : "n");
+    printf("  has special:    %s\n", strength.has_special ? "y" : "n");
+    printf("  in dictionary:  %s\n", strength.in_dictionary ? "y" : "n");
+    printf("  entropy:        %.1f bits\n", strength.entropy);
+    printf("  score:          %d/%d\n", strength.score, PASSWORD_MAX_SCORE);
 }
@@ -1,12 +1,22 @@
 #ifndef __PASS_H
 #define __PASS_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
 
 #include <sodium.h>
 
+#include "dict.h"
+
 #define MAX_PASS_SIZE 4096
 
+#define SPECIAL_CHARS "!@#$%^&*()-_=+,.?/:;{}[]~"
+#define NUMBER_CHARS "0123456789"
+#define UPPER_CHARS "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+#define LOWER_CHARS "abcdefghijklmnopqrstuvwxyz"
+#define ALL_CHARS UPPER_CHARS LOWER_CHARS NUMBER_CHARS SPECIAL_CHARS
+
 /**
  * BASE_DIRECTORY returns the pass base directory.
  */
@@ -27,17 +37,19 @@ strcat(fp, argv[i+1]);
 
 /**
  * encrypt_password encrypts the given password and saves the
- * encrypted cipher to a file in the user's pass directory.
+ * encrypted stream to target_file. Returns 0 on success and -1
+ * if the file can't be written.
  */
 int
 encrypt_password(const char *target_file, const char *password, const unsigned char key[crypto_secretstream_xchacha20poly1305_KEYBYTES]);
 
 /**
- * decrypt_password decrypts the given file and prints out the 
- * contents to stdout.
+ * decrypt_password decrypts the given file and writes the
+ * password to out_fd. Returns -1 if the file can't be read or
+ * authenticated.
  */
 int
-decrypt_password(const char *source_file, const unsigned char key[crypto_secretstream_xchacha20poly1305_KEYBYTES]);
+decrypt_password(const char *source_file, const int out_fd, const unsigned char key[crypto_secretstream_xchacha20poly1305_KEYBYTES]);
 
 int
 create_key(const char *key_file);
@@ -49,6 +61,93 @@ create_key(const char *key_file);
 char*
 generate_password(const int size);
 
+/**
+ * generate_password_into writes a password of the given size
+ * followed by a NUL into out, which must hold size + 1 bytes.
+ */
+void
+generate_password_into(char *out, const size_t size);
+
+/**
+ * generate_passwords writes count passwords of the given size
+ * into out, each followed by a NUL, so the i'th one starts at
+ * out + i * (size + 1). Characters are drawn uniformly from
+ * letters, numbers and symbols.
+ */
+void
+generate_passwords(char *out, const size_t size, const size_t count);
+
+/**
+ * password_hash_init sets the argon2id cost parameters used
+ * for new password hashes.
+ */
+void
+password_hash_init(const unsigned long long opslimit, const size_t memlimit);
+
+/**
+ * password_hash hashes the given password with argon2id using
+ * the configured parameters. Returns 0 on success.
+ */
+int
+password_hash(const char *password, char hash[crypto_pwhash_STRBYTES]);
+
+/**
+ * password_verify checks the password against an argon2id hash.
+ * Returns 1 when they match.
+ */
+int
+password_verify(const char *hash, const char *password);
+
+/**
+ * password_needs_rehash checks if the hash was created with
+ * parameters other than the configured ones, or with something
+ * other than argon2id.
+ */
+int
+password_needs_rehash(const char *hash);
+
+/**
+ * password_dict_init loads the dictionary index built by
+ * `make dict` that passwords are checked against. Returns 0
+ * on success.
+ */
+int
+password_dict_init(const char *index_path);
+
+/**
+ * password_dict returns the loaded dictionary index or NULL.
+ */
+const dict_t*
+password_dict(void);
+
+#define PASSWORD_MAX_SCORE 4
+
+/**
+ * password_strength_t describes how strong a password is. The
+ * score goes from 0 to PASSWORD_MAX_SCORE and is derived from
+ * the entropy, an estimate of how many bits of guessing the
+ * password takes. Repeated characters, runs like abc or 321
+ * and dictionary words lower it.
+ */
+typedef struct {
+    int score;
+    double entropy;
+    size_t length;
+    bool has_lower;
+    bool has_upper;
+    bool has_number;
+    bool has_special;
+    bool in_dictionary;
+    size_t repeats;
+    size_t sequences;
+} password_strength_t;
+
+/**
+ * password_strength scores the given password.
+ */
+void
+password_strength(const char *pass, password_strength_t *strength);
+
 /**
  * check checks to see if the given password meets 
  * complexity requirements for upper, lower, numbers,
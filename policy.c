@@ -0,0 +1,702 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jansson.h>
+#include <sodium.h>
+
+#include "dict.h"
+#include "pass.h"
+#include "policy.h"
+
+#define STR1(x) #x
+#define STR(x) STR1(x)
+
+#define POLICY_DEFAULT_WORDS 6
+#define POLICY_DEFAULT_MIN_WORD 3
+#define POLICY_DEFAULT_MAX_WORD 8
+#define POLICY_DEFAULT_SEPARATOR "-"
+
+/**
+ * POLICY_POOL_SIZE is how many random bytes are drawn at once
+ * when generating.
+ */
+#define POLICY_POOL_SIZE 512
+
+enum policy_classes {
+    POLICY_LOWER,
+    POLICY_UPPER,
+    POLICY_NUMBER,
+    POLICY_SPECIAL,
+    POLICY_CLASSES
+};
+
+static const char *policy_class_names[POLICY_CLASSES] = {
+    [POLICY_LOWER]   = "lower",
+    [POLICY_UPPER]   = "upper",
+    [POLICY_NUMBER]  = "number",
+    [POLICY_SPECIAL] = "special",
+};
+
+/**
+ * policy_table draws characters uniformly from an alphabet
+ * with one lookup per random byte. map holds the character for
+ * each byte value, or 0 for the values at and above the last
+ * whole multiple of the alphabet size, which are thrown away.
+ * count is how many characters a password takes from it.
+ */
+struct policy_table {
+    char map[256];
+    size_t count;
+};
+
+struct policy {
+    char name[POLICY_MAX_NAME];
+    bool passphrase;
+
+    // characters
+    size_t min_length;
+    size_t max_length;
+    struct policy_table required[POLICY_CLASSES];
+    size_t required_tables;
+    size_t required_total;
+    struct policy_table fill;
+
+    // passphrases
+    size_t words;
+    char separator[POLICY_MAX_SEPARATOR+1];
+    size_t separator_len;
+    bool capitalize;
+    size_t max_word;
+    const char **word_list;
+    uint8_t *word_lengths;
+    size_t word_count;
+};
+
+/**
+ * policy_label assigns a policy to a label. They're kept sorted
+ * by label so lookups can binary search.
+ */
+struct policy_label {
+    char *label;
+    const struct policy *policy;
+};
+
+/**
+ * policy_set is everything loaded from one policy file.
+ */
+struct policy_set {
+    struct policy *policies;
+    size_t policy_count;
+    struct policy_label *labels;
+    size_t label_count;
+};
+
+/**
+ * policies is the loaded set. It's replaced whole by
+ * policy_load, which is meant to run before requests are
+ * served.
+ */
+static struct policy_set policies;
+
+static char policy_error[256];
+
+/**
+ * policy_rng hands out random bytes from a pool filled a block
+ * at a time.
+ */
+struct policy_rng {
+    unsigned char pool[POLICY_POOL_SIZE];
+    size_t pos;
+};
+
+static inline void
+policy_rng_fill(struct policy_rng *rng)
+{
+    randombytes_buf(rng->pool, sizeof(rng->pool));
+    rng->pos = 0;
+}
+
+/**
+ * policy_rng_uniform returns a uniform random number below n.
+ */
+static uint32_t
+policy_rng_uniform(struct policy_rng *rng, const uint32_t n)
+{
+    if (n > 256) {
+        return randombytes_uniform(n);
+    }
+
+    const unsigned int limit = 256 - (256 % n);
+    for (;;) {
+        if (rng->pos == sizeof(rng->pool)) {
+            policy_rng_fill(rng);
+        }
+        const unsigned char b = rng->pool[rng->pos++];
+        if (b < limit) {
+            return b % n;
+        }
+    }
+}
+
+/**
+ * policy_table_draw writes n characters from the table to out.
+ * Every byte is written and the position only moves past the
+ * ones that weren't thrown away, so the loop doesn't branch on
+ * the character drawn.
+ */
+static void
+policy_table_draw(const struct policy_table *table, struct policy_rng *rng, char *out, const size_t n)
+{
+    size_t i = 0;
+    while (i < n) {
+        if (rng->pos == sizeof(rng->pool)) {
+            policy_rng_fill(rng);
+        }
+
+        size_t pos = rng->pos;
+        for (; pos < sizeof(rng->pool) && i < n; pos++) {
+            const char c = table->map[rng->pool[pos]];
+            out[i] = c;
+            i += c != 0;
+        }
+        rng->pos = pos;
+    }
+}
+
+/**
+ * policy_table_init compiles the alphabet, which must have 1
+ * to 255 characters, into the table.
+ */
+static void
+policy_table_init(struct policy_table *table, const char *alphabet, const size_t size, const size_t count)
+{
+    const size_t limit = 256 - (256 % size);
+    for (size_t b = 0; b < 256; b++) {
+        table->map[b] = b < limit ? alphabet[b % size] : 0;
+    }
+    table->count = count;
+}
+
+/**
+ * policy_fail formats the reason loading failed.
+ */
+static int __attribute__((format(printf, 1, 2)))
+policy_fail(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(policy_error, sizeof(policy_error), fmt, ap);
+    va_end(ap);
+
+    return -1;
+}
+
+/**
+ * policy_size reads an optional positive number from the
+ * policy into value. Returns -1 if it's there but isn't one
+ * between 1 and max.
+ */
+static int
+policy_size(const json_t *json_policy, const char *key, const size_t max, size_t *value)
+{
+    json_t *json_value = json_object_get(json_policy, key);
+    if (json_value == NULL) {
+        return 0;
+    }
+
+    if (!json_is_integer(json_value) || json_integer_value(json_value) < 1 ||
+        (size_t)json_integer_value(json_value) > max) {
+        return -1;
+    }
+    *value = json_integer_value(json_value);
+
+    return 0;
+}
+
+/**
+ * policy_compile_characters compiles a policy that generates
+ * strings of characters.
+ */
+static int
+policy_compile_characters(struct policy *policy, const json_t *json_policy)
+{
+    bool excluded[128] = {0};
+
+    json_t *json_exclude = json_object_get(json_policy, "exclude");
+    if (json_exclude != NULL) {
+        if (!json_is_string(json_exclude)) {
+            return policy_fail("policy %s: exclude must be a string", policy->name);
+        }
+        for (const char *c = json_string_value(json_exclude); *c != '\0'; c++) {
+            if ((unsigned char)*c < 128) {
+                excluded[(unsigned char)*c] = true;
+            }
+        }
+    }
+
+    if (json_is_true(json_object_get(json_policy, "exclude_ambiguous"))) {
+        for (const char *c = POLICY_AMBIGUOUS_CHARS; *c != '\0'; c++) {
+            excluded[(unsigned char)*c] = true;
+        }
+    }
+
+    const char *symbols = SPECIAL_CHARS;
+    json_t *json_symbols = json_object_get(json_policy, "symbols");
+    if (json_symbols != NULL) {
+        if (!json_is_string(json_symbols)) {
+            return policy_fail("policy %s: symbols must be a string", policy->name);
+        }
+        symbols = json_string_value(json_symbols);
+        for (const char *c = symbols; *c != '\0'; c++) {
+            if (!ispunct((unsigned char)*c)) {
+                return policy_fail("policy %s: symbols must be punctuation", policy->name);
+            }
+        }
+    }
+
+    const char *class_chars[POLICY_CLASSES] = {
+        [POLICY_LOWER]   = LOWER_CHARS,
+        [POLICY_UPPER]   = UPPER_CHARS,
+        [POLICY_NUMBER]  = NUMBER_CHARS,
+        [POLICY_SPECIAL] = symbols,
+    };
+
+    // each character goes in at most once, so symbols repeating
+    // a character or one of another class don't skew the odds.
+    bool used[128] = {0};
+    char fill[128];
+    size_t fill_size = 0;
+
+    policy->required_tables = 0;
+    policy->required_total = 0;
+
+    for (int class = 0; class < POLICY_CLASSES; class++) {
+        size_t min = 0;
+        json_t *json_class = json_object_get(json_policy, policy_class_names[class]);
+        if (json_class != NULL && json_is_false(json_class)) {
+            continue;
+        }
+        if (json_class != NULL && json_is_true(json_class)) {
+            min = 1;
+        } else if (json_class != NULL) {
+            if (!json_is_integer(json_class) || json_integer_value(json_class) < 0 ||
+                json_integer_value(json_class) > POLICY_MAX_LENGTH) {
+                return policy_fail("policy %s: %s must be false or a count", policy->name, policy_class_names[class]);
+            }
+            min = json_integer_value(json_class);
+        }
+
+        char alphabet[128];
+        size_t size = 0;
+        for (const char *c = class_chars[class]; *c != '\0'; c++) {
+            if (!excluded[(unsigned char)*c] && !used[(unsigned char)*c]) {
+                used[(unsigned char)*c] = true;
+                alphabet[size++] = *c;
+            }
+        }
+
+        if (size == 0) {
+            if (min > 0) {
+                return policy_fail("policy %s: every %s character is excluded", policy->name, policy_class_names[class]);
+            }
+            continue;
+        }
+
+        memcpy(fill + fill_size, alphabet, size);
+        fill_size += size;
+
+        if (min > 0) {
+            policy_table_init(&policy->required[policy->required_tables++], alphabet, size, min);
+            policy->required_total += min;
+        }
+    }
+
+    if (fill_size == 0) {
+        return policy_fail("policy %s: no characters left to use", policy->name);
+    }
+    policy_table_init(&policy->fill, fill, fill_size, 0);
+
+    size_t length = 0;
+    policy->min_length = POLICY_DEFAULT_LENGTH;
+    policy->max_length = POLICY_DEFAULT_LENGTH;
+    if (policy_size(json_policy, "length", POLICY_MAX_LENGTH, &length) != 0 ||
+        policy_size(json_policy, "min_length", POLICY_MAX_LENGTH, &policy->min_length) != 0 ||
+        policy_size(json_policy, "max_length", POLICY_MAX_LENGTH, &policy->max_length) != 0) {
+        return policy_fail("policy %s: lengths must be 1 to " STR(POLICY_MAX_LENGTH), policy->name);
+    }
+    if (length > 0) {
+        policy->min_length = length;
+        policy->max_length = length;
+    }
+
+    if (policy->min_length > policy->max_length) {
+        return policy_fail("policy %s: min_length is above max_length", policy->name);
+    }
+    if (policy->required_total > policy->min_length) {
+        return policy_fail("policy %s: class minimums add up to more than min_length", policy->name);
+    }
+
+    return 0;
+}
+
+/**
+ * policy_compile_passphrase compiles a policy that generates
+ * passphrases, collecting the words it picks from up front.
+ */
+static int
+policy_compile_passphrase(struct policy *policy, const json_t *json_policy, const dict_t *dict)
+{
+    if (dict == NULL) {
+        return policy_fail("policy %s: passphrases need the dictionary index, run make dict", policy->name);
+    }
+
+    size_t min_word = POLICY_DEFAULT_MIN_WORD;
+    policy->words = POLICY_DEFAULT_WORDS;
+    policy->max_word = POLICY_DEFAULT_MAX_WORD;
+    if (policy_size(json_policy, "words", POLICY_MAX_WORDS, &policy->words) != 0 ||
+        policy_size(json_policy, "min_word", DICT_MAX_WORD, &min_word) != 0 ||
+        policy_size(json_policy, "max_word", DICT_MAX_WORD, &policy->max_word) != 0) {
+        return policy_fail("policy %s: words must be 1 to " STR(POLICY_MAX_WORDS) " and word lengths 1 to " STR(DICT_MAX_WORD), policy->name);
+    }
+    if (min_word > policy->max_word) {
+        return policy_fail("policy %s: min_word is above max_word", policy->name);
+    }
+
+    const char *separator = POLICY_DEFAULT_SEPARATOR;
+    json_t *json_separator = json_object_get(json_policy, "separator");
+    if (json_separator != NULL) {
+        if (!json_is_string(json_separator) || json_string_length(json_separator) > POLICY_MAX_SEPARATOR) {
+            return policy_fail("policy %s: separator must be a string of up to " STR(POLICY_MAX_SEPARATOR) " bytes", policy->name);
+        }
+        separator = json_string_value(json_separator);
+    }
+    policy->separator_len = strlen(separator);
+    memcpy(policy->separator, separator, policy->separator_len + 1);
+    policy->capitalize = json_is_true(json_object_get(json_policy, "capitalize"));
+
+    // only words made of letters are used so a passphrase can
+    // be split back into its words by the separator.
+    size_t cap = 0;
+    for (size_t len = min_word; len <= policy->max_word; len++) {
+        size_t count;
+        dict_words(dict, len, &count);
+        cap += count;
+    }
+
+    policy->word_list = malloc(cap * sizeof(const char*));
+    policy->word_lengths = malloc(cap);
+    policy->word_count = 0;
+
+    for (size_t len = min_word; len <= policy->max_word; len++) {
+        size_t count;
+        const char *word = dict_words(dict, len, &count);
+        for (size_t i = 0; i < count; i++, word += len) {
+            size_t j = 0;
+            while (j < len && word[j] >= 'a' && word[j] <= 'z') {
+                j++;
+            }
+            if (j == len) {
+                policy->word_list[policy->word_count] = word;
+                policy->word_lengths[policy->word_count] = len;
+                policy->word_count++;
+            }
+        }
+    }
+
+    if (policy->word_count < 2) {
+        return policy_fail("policy %s: not enough dictionary words of %zu to %zu letters", policy->name, min_word, policy->max_word);
+    }
+
+    return 0;
+}
+
+static void
+policy_set_free(struct policy_set *set)
+{
+    for (size_t i = 0; i < set->policy_count; i++) {
+        free(set->policies[i].word_list);
+        free(set->policies[i].word_lengths);
+    }
+    for (size_t i = 0; i < set->label_count; i++) {
+        free(set->labels[i].label);
+    }
+    free(set->policies);
+    free(set->labels);
+    memset(set, 0, sizeof(struct policy_set));
+}
+
+static int
+policy_label_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct policy_label *)a)->label, ((const struct policy_label *)b)->label);
+}
+
+/**
+ * policy_set_find returns the policy with the given name from
+ * the set or NULL.
+ */
+static const struct policy*
+policy_set_find(const struct policy_set *set, const char *name)
+{
+    for (size_t i = 0; i < set->policy_count; i++) {
+        if (strcmp(set->policies[i].name, name) == 0) {
+            return &set->policies[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * policy_set_load compiles the policies and labels of the
+ * parsed file into the set.
+ */
+static int
+policy_set_load(struct policy_set *set, const json_t *json_root, const dict_t *dict)
+{
+    json_t *json_policies = json_object_get(json_root, "policies");
+    if (!json_is_object(json_policies)) {
+        return policy_fail("policies must be an object");
+    }
+    if (json_object_size(json_policies) > POLICY_MAX_POLICIES) {
+        return policy_fail("more than " STR(POLICY_MAX_POLICIES) " policies");
+    }
+
+    set->policies = calloc(json_object_size(json_policies), sizeof(struct policy));
+
+    const char *name;
+    json_t *json_policy;
+    json_object_foreach(json_policies, name, json_policy) {
+        struct policy *policy = &set->policies[set->policy_count++];
+
+        if (name[0] == '\0' || strlen(name) >= POLICY_MAX_NAME) {
+            return policy_fail("policy names must be 1 to %d bytes", POLICY_MAX_NAME - 1);
+        }
+        strcpy(policy->name, name);
+
+        if (!json_is_object(json_policy)) {
+            return policy_fail("policy %s: must be an object", name);
+        }
+
+        json_t *json_mode = json_object_get(json_policy, "mode");
+        const char *mode = json_mode != NULL ? json_string_value(json_mode) : "characters";
+        if (mode != NULL && strcmp(mode, "characters") == 0) {
+            if (policy_compile_characters(policy, json_policy) != 0) {
+                return -1;
+            }
+        } else if (mode != NULL && strcmp(mode, "passphrase") == 0) {
+            policy->passphrase = true;
+            if (policy_compile_passphrase(policy, json_policy, dict) != 0) {
+                return -1;
+            }
+        } else {
+            return policy_fail("policy %s: mode must be characters or passphrase", name);
+        }
+    }
+
+    json_t *json_labels = json_object_get(json_root, "labels");
+    if (json_labels == NULL) {
+        return 0;
+    }
+    if (!json_is_object(json_labels)) {
+        return policy_fail("labels must be an object");
+    }
+    if (json_object_size(json_labels) > POLICY_MAX_LABELS) {
+        return policy_fail("more than " STR(POLICY_MAX_LABELS) " labels");
+    }
+
+    set->labels = calloc(json_object_size(json_labels), sizeof(struct policy_label));
+
+    const char *label;
+    json_t *json_name;
+    json_object_foreach(json_labels, label, json_name) {
+        const struct policy *policy = json_is_string(json_name) ?
+            policy_set_find(set, json_string_value(json_name)) : NULL;
+        if (policy == NULL) {
+            return policy_fail("label %s: no such policy", label);
+        }
+
+        set->labels[set->label_count].label = strdup(label);
+        set->labels[set->label_count].policy = policy;
+        set->label_count++;
+    }
+
+    qsort(set->labels, set->label_count, sizeof(struct policy_label), policy_label_cmp);
+
+    return 0;
+}
+
+int
+policy_load(const char *path, const dict_t *dict, const char **error)
+{
+    json_error_t json_error;
+    json_t *json_root = json_load_file(path, 0, &json_error);
+    if (json_root == NULL) {
+        policy_fail("%s:%d: %s", path, json_error.line, json_error.text);
+        *error = policy_error;
+        return -1;
+    }
+
+    struct policy_set set = {0};
+    int res = policy_set_load(&set, json_root, dict);
+    json_decref(json_root);
+
+    if (res != 0) {
+        policy_set_free(&set);
+        *error = policy_error;
+        return -1;
+    }
+
+    policy_set_free(&policies);
+    policies = set;
+
+    return 0;
+}
+
+const policy_t*
+policy_get(const char *name)
+{
+    return policy_set_find(&policies, name);
+}
+
+const policy_t*
+policy_for_label(const char *label)
+{
+    const struct policy_label key = {.label = (char *)label};
+    const struct policy_label *found = bsearch(&key, policies.labels, policies.label_count,
+        sizeof(struct policy_label), policy_label_cmp);
+
+    return found != NULL ? found->policy : NULL;
+}
+
+const char*
+policy_name(const policy_t *policy)
+{
+    return policy->name;
+}
+
+bool
+policy_allows_length(const policy_t *policy, const size_t length)
+{
+    return !policy->passphrase && length >= policy->min_length && length <= policy->max_length;
+}
+
+size_t
+policy_max_length(const policy_t *policy)
+{
+    if (policy->passphrase) {
+        return policy->words * policy->max_word + (policy->words - 1) * policy->separator_len;
+    }
+
+    return policy->max_length;
+}
+
+/**
+ * policy_generate_characters writes a password of the given
+ * length. The characters each class requires are drawn first,
+ * the rest from every allowed character, and then they're
+ * shuffled so the required ones can end up anywhere.
+ */
+static void
+policy_generate_characters(const struct policy *policy, struct policy_rng *rng, char *out, const size_t length)
+{
+    size_t pos = 0;
+    for (size_t t = 0; t < policy->required_tables; t++) {
+        policy_table_draw(&policy->required[t], rng, out + pos, policy->required[t].count);
+        pos += policy->required[t].count;
+    }
+    policy_table_draw(&policy->fill, rng, out + pos, length - pos);
+
+    if (policy->required_tables > 0) {
+        for (size_t i = length - 1; i > 0; i--) {
+            const size_t j = policy_rng_uniform(rng, i + 1);
+            const char c = out[i];
+            out[i] = out[j];
+            out[j] = c;
+        }
+    }
+}
+
+/**
+ * policy_generate_passphrase writes a passphrase and returns
+ * its length.
+ */
+static size_t
+policy_generate_passphrase(const struct policy *policy, struct policy_rng *rng, char *out)
+{
+    size_t pos = 0;
+    for (size_t w = 0; w < policy->words; w++) {
+        if (w > 0) {
+            memcpy(out + pos, policy->separator, policy->separator_len);
+            pos += policy->separator_len;
+        }
+
+        const uint32_t i = policy_rng_uniform(rng, policy->word_count);
+        memcpy(out + pos, policy->word_list[i], policy->word_lengths[i]);
+        if (policy->capitalize) {
+            out[pos] = (char)toupper((unsigned char)out[pos]);
+        }
+        pos += policy->word_lengths[i];
+    }
+
+    return pos;
+}
+
+void
+policy_generate(const policy_t *policy, const size_t length, char *out, size_t *lengths, const size_t count)
+{
+    const size_t stride = policy_max_length(policy) + 1;
+
+    struct policy_rng rng;
+    policy_rng_fill(&rng);
+
+    for (size_t p = 0; p < count; p++) {
+        char *password = out + p * stride;
+
+        size_t n;
+        if (policy->passphrase) {
+            n = policy_generate_passphrase(policy, &rng, password);
+        } else {
+            n = length > 0 ? length : policy->min_length +
+                policy_rng_uniform(&rng, policy->max_length - policy->min_length + 1);
+            policy_generate_characters(policy, &rng, password, n);
+        }
+
+        password[n] = '\0';
+        lengths[p] = n;
+    }
+
+    sodium_memzero(&rng, sizeof(rng));
+}
@@ -0,0 +1,133 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _POLICY_H
+#define _POLICY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "dict.h"
+
+#define POLICY_MAX_POLICIES 64
+#define POLICY_MAX_LABELS 256
+#define POLICY_MAX_NAME 64
+#define POLICY_MAX_LENGTH 1024
+#define POLICY_MAX_WORDS 32
+#define POLICY_MAX_SEPARATOR 8
+#define POLICY_DEFAULT_LENGTH 32
+
+/**
+ * POLICY_DEFAULT is the name of the policy used when a request
+ * names no policy and its label has none.
+ */
+#define POLICY_DEFAULT "default"
+
+/**
+ * POLICY_AMBIGUOUS_CHARS are left out of policies that set
+ * exclude_ambiguous since they're easily mistaken for each
+ * other when read or typed.
+ */
+#define POLICY_AMBIGUOUS_CHARS "0Oo1lI|`'\""
+
+/**
+ * policy_t is a compiled password policy.
+ */
+typedef struct policy policy_t;
+
+/**
+ * policy_load reads the password policies in the JSON file at
+ * path and compiles them. The file looks like
+ *
+ *   {
+ *     "policies": {
+ *       "db": {"min_length": 16, "max_length": 24, "upper": 1,
+ *              "number": 2, "special": false, "exclude_ambiguous": true},
+ *       "wifi": {"mode": "passphrase", "words": 5, "separator": "-"}
+ *     },
+ *     "labels": {"prod-db": "db"}
+ *   }
+ *
+ * Character policies take a fixed length or a min_length and
+ * max_length, and for each of lower, upper, number and special
+ * either the fewest characters of that class a password has or
+ * false to leave the class out. symbols replaces the special
+ * characters and exclude lists characters to never use.
+ * Passphrase policies draw words of min_word to max_word
+ * letters from dict, optionally capitalized. On error -1 is
+ * returned, error points to the reason and the policies
+ * already loaded are kept.
+ */
+int
+policy_load(const char *path, const dict_t *dict, const char **error);
+
+/**
+ * policy_get returns the policy with the given name or NULL.
+ */
+const policy_t*
+policy_get(const char *name);
+
+/**
+ * policy_for_label returns the policy assigned to the label or
+ * NULL if it has none.
+ */
+const policy_t*
+policy_for_label(const char *label);
+
+/**
+ * policy_name returns the name of the policy.
+ */
+const char*
+policy_name(const policy_t *policy);
+
+/**
+ * policy_allows_length checks if the policy can generate
+ * passwords of the given length. Passphrases allow none since
+ * their length follows from the words picked.
+ */
+bool
+policy_allows_length(const policy_t *policy, const size_t length);
+
+/**
+ * policy_max_length returns the longest password the policy
+ * generates, not counting the NUL.
+ */
+size_t
+policy_max_length(const policy_t *policy);
+
+/**
+ * policy_generate writes count passwords into out, each
+ * followed by a NUL, so the i'th one starts at
+ * out + i * (policy_max_length(policy) + 1). A length of 0
+ * lets the policy pick one from its range for each password,
+ * otherwise it must be one policy_allows_length accepts.
+ * lengths receives the length of each password.
+ */
+void
+policy_generate(const policy_t *policy, const size_t length, char *out, size_t *lengths, const size_t count);
+
+#endif /** end _POLICY_H */
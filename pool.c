@@ -0,0 +1,227 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+/**
+ * pool_task is an entry in the pool's queue.
+ */
+struct pool_task {
+    pool_task_fn fn;
+    void *arg;
+    pool_group_t *group;
+};
+
+struct pool {
+    pthread_t *threads;
+    size_t thread_count;
+    struct pool_task *queue;
+    size_t queue_size;
+    size_t head;
+    size_t count;
+    size_t active;
+    uint64_t completed;
+    uint64_t rejected;
+    bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+};
+
+static void*
+pool_worker(void *arg)
+{
+    pool_t *pool = (pool_t *)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+
+        if (pool->count == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+
+        struct pool_task task = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->queue_size;
+        pool->count--;
+        pool->active++;
+        pthread_mutex_unlock(&pool->lock);
+
+        task.fn(task.arg);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->active--;
+        pool->completed++;
+        pthread_mutex_unlock(&pool->lock);
+
+        pthread_mutex_lock(&task.group->lock);
+        if (--task.group->pending == 0) {
+            pthread_cond_broadcast(&task.group->done);
+        }
+        pthread_mutex_unlock(&task.group->lock);
+    }
+}
+
+pool_t*
+pool_new(const size_t threads, const size_t queue_size)
+{
+    pool_t *pool = calloc(1, sizeof(pool_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->queue_size = queue_size > 0 ? queue_size : 1;
+    pool->queue = calloc(pool->queue_size, sizeof(struct pool_task));
+    pool->threads = calloc(threads > 0 ? threads : 1, sizeof(pthread_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+
+    for (size_t i = 0; pool->queue != NULL && pool->threads != NULL && i < threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0) {
+            break;
+        }
+        pool->thread_count++;
+    }
+
+    // tasks would wait forever in a pool without threads
+    if (pool->thread_count == 0) {
+        pool_free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+void
+pool_free(pool_t *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->ready);
+    free(pool->threads);
+    free(pool->queue);
+    free(pool);
+}
+
+void
+pool_group_init(pool_group_t *group)
+{
+    pthread_mutex_init(&group->lock, NULL);
+    pthread_cond_init(&group->done, NULL);
+    group->pending = 0;
+}
+
+void
+pool_group_destroy(pool_group_t *group)
+{
+    pthread_mutex_destroy(&group->lock);
+    pthread_cond_destroy(&group->done);
+}
+
+int
+pool_submit(pool_t *pool, pool_group_t *group, pool_task_fn fn, void *arg)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count == pool->queue_size || pool->stopping) {
+        pool->rejected++;
+        pthread_mutex_unlock(&pool->lock);
+        return 1;
+    }
+
+    pthread_mutex_lock(&group->lock);
+    group->pending++;
+    pthread_mutex_unlock(&group->lock);
+
+    pool->queue[(pool->head + pool->count) % pool->queue_size] = (struct pool_task){
+        .fn = fn,
+        .arg = arg,
+        .group = group,
+    };
+    pool->count++;
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+void
+pool_group_wait(pool_group_t *group)
+{
+    pthread_mutex_lock(&group->lock);
+    while (group->pending > 0) {
+        pthread_cond_wait(&group->done, &group->lock);
+    }
+    pthread_mutex_unlock(&group->lock);
+}
+
+int
+pool_run(pool_t *pool, pool_task_fn fn, void *arg)
+{
+    pool_group_t group;
+    pool_group_init(&group);
+
+    int ret = pool_submit(pool, &group, fn, arg);
+    if (ret == 0) {
+        pool_group_wait(&group);
+    }
+
+    pool_group_destroy(&group);
+
+    return ret;
+}
+
+void
+pool_get_stats(pool_t *pool, pool_stats_t *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+    stats->threads = pool->thread_count;
+    stats->queue_size = pool->queue_size;
+    stats->queued = pool->count;
+    stats->active = pool->active;
+    stats->completed = pool->completed;
+    stats->rejected = pool->rejected;
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,107 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct pool pool_t;
+
+typedef void (*pool_task_fn)(void *arg);
+
+/**
+ * pool_group_t tracks a set of tasks submitted together
+ * so the submitter can wait for all of them to finish.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    size_t pending;
+} pool_group_t;
+
+/**
+ * pool_stats_t is a snapshot of a pool's counters.
+ */
+typedef struct {
+    size_t threads;
+    size_t queue_size;
+    size_t queued;
+    size_t active;
+    uint64_t completed;
+    uint64_t rejected;
+} pool_stats_t;
+
+/**
+ * pool_new starts a pool with the given number of threads
+ * and room for queue_size waiting tasks. Fewer threads may be
+ * started if the system won't create them all. Returns NULL if
+ * none could be started, including when threads is 0.
+ */
+pool_t*
+pool_new(const size_t threads, const size_t queue_size);
+
+/**
+ * pool_free stops the pool's threads once the queued tasks
+ * have run and frees the memory used by it.
+ */
+void
+pool_free(pool_t *pool);
+
+void
+pool_group_init(pool_group_t *group);
+
+void
+pool_group_destroy(pool_group_t *group);
+
+/**
+ * pool_submit queues the task as part of the given group.
+ * Returns 1 without queueing the task if the queue is full.
+ */
+int
+pool_submit(pool_t *pool, pool_group_t *group, pool_task_fn fn, void *arg);
+
+/**
+ * pool_group_wait blocks until every task submitted with
+ * the group has finished.
+ */
+void
+pool_group_wait(pool_group_t *group);
+
+/**
+ * pool_run runs a single task on the pool and waits for it
+ * to finish. Returns 1 if the queue is full.
+ */
+int
+pool_run(pool_t *pool, pool_task_fn fn, void *arg);
+
+void
+pool_get_stats(pool_t *pool, pool_stats_t *stats);
+
+#endif /* _POOL_H */
@@ -0,0 +1,145 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sample.h"
+#include "trace.h"
+
+/**
+ * sample_rule logs 1 in rate requests whose path starts
+ * with prefix.
+ */
+struct sample_rule {
+    char *prefix;
+    size_t prefix_len;
+    uint32_t rate;
+};
+
+static struct {
+    struct sample_rule rules[SAMPLE_MAX_RULES];
+    size_t count;
+    uint64_t slow_ns;
+} sampling;
+
+/**
+ * sample_state is the thread's random number generator
+ * state. Zero means it hasn't been seeded yet.
+ */
+static __thread uint64_t sample_state;
+
+int
+sample_init(const char *rules, const uint64_t slow_ns)
+{
+    sampling.slow_ns = slow_ns;
+
+    if (rules == NULL) {
+        return 0;
+    }
+
+    char *copy = strdup(rules);
+    char *save = NULL;
+    int res = 0;
+
+    for (char *rule = strtok_r(copy, ",", &save); rule != NULL; rule = strtok_r(NULL, ",", &save)) {
+        char *eq = strrchr(rule, '=');
+        if (eq == NULL || eq == rule || sampling.count == SAMPLE_MAX_RULES) {
+            res = -1;
+            continue;
+        }
+        *eq = '\0';
+
+        char *end;
+        unsigned long rate = strtoul(eq+1, &end, 10);
+        if (*end != '\0' || rate == 0 || rate > UINT32_MAX) {
+            res = -1;
+            continue;
+        }
+
+        struct sample_rule *r = &sampling.rules[sampling.count++];
+        r->prefix = strdup(rule);
+        r->prefix_len = strlen(rule);
+        r->rate = rate;
+    }
+
+    free(copy);
+
+    return res;
+}
+
+/**
+ * sample_next returns the next number from the thread's
+ * xorshift64* generator.
+ */
+static uint64_t
+sample_next()
+{
+    if (sample_state == 0) {
+        sample_state = trace_now_ns() ^ (uintptr_t)&sample_state;
+        if (sample_state == 0) {
+            sample_state = 1;
+        }
+    }
+
+    sample_state ^= sample_state >> 12;
+    sample_state ^= sample_state << 25;
+    sample_state ^= sample_state >> 27;
+
+    return sample_state * 0x2545F4914F6CDD1DULL;
+}
+
+uint32_t
+sample_request(const char *path, const unsigned int status, const uint64_t duration_ns)
+{
+    if (status >= 400 || (sampling.slow_ns > 0 && duration_ns >= sampling.slow_ns)) {
+        return 1;
+    }
+
+    uint32_t rate = 1;
+    size_t best = 0;
+    for (size_t i = 0; path != NULL && i < sampling.count; i++) {
+        const struct sample_rule *r = &sampling.rules[i];
+        if (r->prefix_len >= best && strncmp(path, r->prefix, r->prefix_len) == 0) {
+            rate = r->rate;
+            best = r->prefix_len;
+        }
+    }
+
+    if (rate == 1) {
+        return 1;
+    }
+
+    // scale the top 32 bits into [0, rate)
+    if (((sample_next() >> 32) * rate) >> 32 != 0) {
+        return 0;
+    }
+
+    return rate;
+}
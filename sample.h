@@ -0,0 +1,55 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SAMPLE_H
+#define _SAMPLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SAMPLE_MAX_RULES 32
+
+/**
+ * sample_init sets the sampling rules for request logs. Rules
+ * are a comma separated list of path=rate pairs where 1 in
+ * rate requests whose path starts with path are logged. The
+ * longest matching path wins and paths matching no rule are
+ * all logged. Requests taking at least slow_ns are always
+ * logged. Returns -1 if a rule can't be parsed.
+ */
+int
+sample_init(const char *rules, const uint64_t slow_ns);
+
+/**
+ * sample_request decides if a request is logged. Errors and
+ * slow requests always are. Returns the rate the request was
+ * sampled at or 0 if it's skipped.
+ */
+uint32_t
+sample_request(const char *path, const unsigned int status, const uint64_t duration_ns);
+
+#endif /** end _SAMPLE_H */
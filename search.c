@@ -0,0 +1,573 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "arena.h"
+#include "search.h"
+
+#define SEARCH_INITIAL_ENTRIES 64
+#define SEARCH_INITIAL_GRAMS 256
+
+/**
+ * entry is an indexed name along with its lower cased copy
+ * that all matching is done against.
+ */
+struct entry {
+    char *name;
+    char *lower;
+    size_t len;
+};
+
+/**
+ * posting lists the entries containing a trigram, in the
+ * order they were added. A trigram of 0 marks an empty slot
+ * since names can't contain NUL bytes.
+ */
+struct posting {
+    uint32_t trigram;
+    uint32_t *entries;
+    uint32_t count;
+    uint32_t cap;
+};
+
+/**
+ * user_index is the index of one user's password names. The
+ * entries are referenced by position from the sorted array,
+ * used for prefix lookups, and from the trigram postings, used
+ * for substring lookups.
+ */
+struct user_index {
+    long user_id;
+    time_t loaded_at;
+    time_t last_used;
+    size_t refs;
+    pthread_rwlock_t lock;
+
+    struct entry *entries;
+    size_t count;
+    size_t cap;
+    uint32_t *sorted;
+
+    struct posting *grams;
+    size_t gram_count;
+    size_t gram_cap;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct user_index **users;
+    size_t count;
+    size_t max;
+    unsigned int ttl;
+} indexes = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+void
+search_init(const size_t max_users, const unsigned int ttl)
+{
+    indexes.max = max_users > 0 ? max_users : 1;
+    indexes.ttl = ttl;
+    indexes.users = calloc(indexes.max, sizeof(struct user_index*));
+}
+
+static void
+lower_copy(char *dst, const char *src, const size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        dst[i] = (char)tolower((unsigned char)src[i]);
+    }
+    dst[len] = '\0';
+}
+
+static uint32_t
+trigram_at(const char *s)
+{
+    return (uint32_t)(unsigned char)s[0] << 16 | (uint32_t)(unsigned char)s[1] << 8 | (unsigned char)s[2];
+}
+
+static size_t
+trigram_slot(const uint32_t trigram, const size_t cap)
+{
+    return (trigram * 2654435761u) & (cap - 1);
+}
+
+/**
+ * grams_find returns the posting for the trigram or NULL if
+ * no name contains it.
+ */
+static struct posting*
+grams_find(const struct user_index *index, const uint32_t trigram)
+{
+    size_t slot = trigram_slot(trigram, index->gram_cap);
+    while (index->grams[slot].trigram != 0) {
+        if (index->grams[slot].trigram == trigram) {
+            return &index->grams[slot];
+        }
+        slot = (slot + 1) & (index->gram_cap - 1);
+    }
+
+    return NULL;
+}
+
+static void
+grams_grow(struct user_index *index)
+{
+    struct posting *old = index->grams;
+    size_t old_cap = index->gram_cap;
+
+    index->gram_cap *= 2;
+    index->grams = calloc(index->gram_cap, sizeof(struct posting));
+
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].trigram == 0) {
+            continue;
+        }
+        size_t slot = trigram_slot(old[i].trigram, index->gram_cap);
+        while (index->grams[slot].trigram != 0) {
+            slot = (slot + 1) & (index->gram_cap - 1);
+        }
+        index->grams[slot] = old[i];
+    }
+
+    free(old);
+}
+
+/**
+ * grams_add records that the entry contains the trigram.
+ */
+static void
+grams_add(struct user_index *index, const uint32_t trigram, const uint32_t entry)
+{
+    struct posting *posting = grams_find(index, trigram);
+    if (posting == NULL) {
+        if ((index->gram_count + 1) * 2 > index->gram_cap) {
+            grams_grow(index);
+        }
+
+        size_t slot = trigram_slot(trigram, index->gram_cap);
+        while (index->grams[slot].trigram != 0) {
+            slot = (slot + 1) & (index->gram_cap - 1);
+        }
+        posting = &index->grams[slot];
+        posting->trigram = trigram;
+        index->gram_count++;
+    }
+
+    // a name repeating a trigram only needs to be listed once
+    if (posting->count > 0 && posting->entries[posting->count-1] == entry) {
+        return;
+    }
+
+    if (posting->count == posting->cap) {
+        posting->cap = posting->cap > 0 ? posting->cap * 2 : 4;
+        posting->entries = realloc(posting->entries, sizeof(uint32_t)*posting->cap);
+    }
+    posting->entries[posting->count++] = entry;
+}
+
+/**
+ * sorted_position returns where lower belongs in the sorted
+ * array, the first entry not less than it.
+ */
+static size_t
+sorted_position(const struct user_index *index, const char *lower)
+{
+    size_t lo = 0;
+    size_t hi = index->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(index->entries[index->sorted[mid]].lower, lower) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/**
+ * index_add adds a name to the index unless it's already in it.
+ */
+static void
+index_add(struct user_index *index, const char *name)
+{
+    size_t len = strlen(name);
+    char *lower = malloc(len + 1);
+    lower_copy(lower, name, len);
+
+    size_t pos = sorted_position(index, lower);
+    for (size_t i = pos; i < index->count; i++) {
+        const struct entry *next = &index->entries[index->sorted[i]];
+        if (strcmp(next->lower, lower) != 0) {
+            break;
+        }
+        if (strcmp(next->name, name) == 0) {
+            free(lower);
+            return;
+        }
+    }
+
+    if (index->count == index->cap) {
+        index->cap *= 2;
+        index->entries = realloc(index->entries, sizeof(struct entry)*index->cap);
+        index->sorted = realloc(index->sorted, sizeof(uint32_t)*index->cap);
+    }
+
+    uint32_t entry = (uint32_t)index->count;
+    index->entries[entry] = (struct entry){
+        .name = strdup(name),
+        .lower = lower,
+        .len = len,
+    };
+
+    memmove(&index->sorted[pos+1], &index->sorted[pos], sizeof(uint32_t)*(index->count - pos));
+    index->sorted[pos] = entry;
+    index->count++;
+
+    for (size_t i = 0; i + 3 <= len; i++) {
+        grams_add(index, trigram_at(lower + i), entry);
+    }
+}
+
+static struct user_index*
+index_new(const long user_id, const size_t count)
+{
+    struct user_index *index = calloc(1, sizeof(struct user_index));
+    index->user_id = user_id;
+    index->loaded_at = time(NULL);
+    index->last_used = index->loaded_at;
+    index->refs = 1;
+    pthread_rwlock_init(&index->lock, NULL);
+
+    index->cap = count > SEARCH_INITIAL_ENTRIES ? count : SEARCH_INITIAL_ENTRIES;
+    index->entries = malloc(sizeof(struct entry)*index->cap);
+    index->sorted = malloc(sizeof(uint32_t)*index->cap);
+
+    index->gram_cap = SEARCH_INITIAL_GRAMS;
+    index->grams = calloc(index->gram_cap, sizeof(struct posting));
+
+    return index;
+}
+
+static void
+index_free(struct user_index *index)
+{
+    for (size_t i = 0; i < index->count; i++) {
+        free(index->entries[i].name);
+        free(index->entries[i].lower);
+    }
+    for (size_t i = 0; i < index->gram_cap; i++) {
+        free(index->grams[i].entries);
+    }
+    free(index->grams);
+    free(index->sorted);
+    free(index->entries);
+    pthread_rwlock_destroy(&index->lock);
+    free(index);
+}
+
+/**
+ * index_release drops a reference to the index, freeing it once
+ * it's been replaced or evicted and nobody is using it anymore.
+ */
+static void
+index_release(struct user_index *index)
+{
+    pthread_mutex_lock(&indexes.lock);
+    bool last = --index->refs == 0;
+    pthread_mutex_unlock(&indexes.lock);
+
+    if (last) {
+        index_free(index);
+    }
+}
+
+/**
+ * index_acquire returns a reference to the user's current index
+ * or NULL if there isn't one.
+ */
+static struct user_index*
+index_acquire(const long user_id)
+{
+    struct user_index *index = NULL;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&indexes.lock);
+    for (size_t i = 0; i < indexes.count; i++) {
+        struct user_index *candidate = indexes.users[i];
+        if (candidate->user_id != user_id) {
+            continue;
+        }
+        if (indexes.ttl == 0 || now - candidate->loaded_at < (time_t)indexes.ttl) {
+            candidate->refs++;
+            candidate->last_used = now;
+            index = candidate;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&indexes.lock);
+
+    return index;
+}
+
+bool
+search_is_loaded(const long user_id)
+{
+    struct user_index *index = index_acquire(user_id);
+    if (index == NULL) {
+        return false;
+    }
+    index_release(index);
+
+    return true;
+}
+
+void
+search_load(const long user_id, char *const *names, const size_t count)
+{
+    struct user_index *index = index_new(user_id, count);
+    for (size_t i = 0; i < count; i++) {
+        index_add(index, names[i]);
+    }
+
+    struct user_index *old = NULL;
+
+    pthread_mutex_lock(&indexes.lock);
+    size_t slot = indexes.count;
+    for (size_t i = 0; i < indexes.count; i++) {
+        if (indexes.users[i]->user_id == user_id) {
+            slot = i;
+            break;
+        }
+    }
+
+    // evict the least recently used index to make room
+    if (slot == indexes.count && indexes.count == indexes.max) {
+        slot = 0;
+        for (size_t i = 1; i < indexes.count; i++) {
+            if (indexes.users[i]->last_used < indexes.users[slot]->last_used) {
+                slot = i;
+            }
+        }
+    }
+
+    if (slot < indexes.count) {
+        old = indexes.users[slot];
+    } else {
+        indexes.count++;
+    }
+    indexes.users[slot] = index;
+    pthread_mutex_unlock(&indexes.lock);
+
+    if (old != NULL) {
+        index_release(old);
+    }
+}
+
+void
+search_add(const long user_id, const char *name)
+{
+    struct user_index *index = index_acquire(user_id);
+    if (index == NULL) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&index->lock);
+    index_add(index, name);
+    pthread_rwlock_unlock(&index->lock);
+
+    index_release(index);
+}
+
+/**
+ * score ranks a match of q at hit within the entry's name.
+ */
+static int
+score(const struct entry *entry, const size_t qlen, const char *hit)
+{
+    if (entry->len == qlen) {
+        return 0;
+    }
+    if (hit == entry->lower) {
+        return 1;
+    }
+    if (!isalnum((unsigned char)hit[-1])) {
+        return 2;
+    }
+
+    return 3;
+}
+
+static bool
+ranks_before(const search_result_t *a, const struct entry *ea, const search_result_t *b, const struct entry *eb)
+{
+    if (a->score != b->score) {
+        return a->score < b->score;
+    }
+    if (ea->len != eb->len) {
+        return ea->len < eb->len;
+    }
+
+    return strcmp(ea->lower, eb->lower) < 0;
+}
+
+/**
+ * top_k keeps the best limit matches seen so far, in rank
+ * order, along with the entries they came from.
+ */
+struct top_k {
+    search_result_t *results;
+    const struct entry **entries;
+    size_t count;
+    size_t limit;
+};
+
+static void
+top_k_offer(struct top_k *top, const struct entry *entry, const int match_score)
+{
+    search_result_t candidate = {.name = entry->name, .score = match_score};
+
+    if (top->count == top->limit &&
+        !ranks_before(&candidate, entry, &top->results[top->count-1], top->entries[top->count-1])) {
+        return;
+    }
+
+    size_t pos = top->count < top->limit ? top->count : top->limit - 1;
+    while (pos > 0 && ranks_before(&candidate, entry, &top->results[pos-1], top->entries[pos-1])) {
+        top->results[pos] = top->results[pos-1];
+        top->entries[pos] = top->entries[pos-1];
+        pos--;
+    }
+    top->results[pos] = candidate;
+    top->entries[pos] = entry;
+
+    if (top->count < top->limit) {
+        top->count++;
+    }
+}
+
+int
+search_query(const long user_id, const char *q, size_t limit, arena_t *arena, search_result_t **results)
+{
+    *results = NULL;
+
+    struct user_index *index = index_acquire(user_id);
+    if (index == NULL) {
+        return -1;
+    }
+
+    if (limit > SEARCH_MAX_LIMIT) {
+        limit = SEARCH_MAX_LIMIT;
+    }
+
+    size_t qlen = strlen(q);
+    if (qlen == 0 || limit == 0) {
+        index_release(index);
+        return 0;
+    }
+
+    char *lower = arena_alloc(arena, qlen + 1);
+    lower_copy(lower, q, qlen);
+
+    struct top_k top = {
+        .results = arena_alloc(arena, sizeof(search_result_t)*limit),
+        .entries = arena_alloc(arena, sizeof(struct entry*)*limit),
+        .limit = limit,
+    };
+
+    pthread_rwlock_rdlock(&index->lock);
+
+    // walk the names starting with q first. They outrank any
+    // other match so when there are enough of them nothing else
+    // needs to be looked at.
+    size_t prefixed = 0;
+    for (size_t i = sorted_position(index, lower); i < index->count; i++) {
+        const struct entry *entry = &index->entries[index->sorted[i]];
+        if (strncmp(entry->lower, lower, qlen) != 0) {
+            break;
+        }
+        top_k_offer(&top, entry, score(entry, qlen, entry->lower));
+        prefixed++;
+    }
+
+    if (prefixed < limit) {
+        if (qlen >= 3) {
+            // every trigram of q has to be in the name so only the
+            // entries of the rarest one need to be checked.
+            const struct posting *rarest = NULL;
+            for (size_t i = 0; i + 3 <= qlen; i++) {
+                const struct posting *posting = grams_find(index, trigram_at(lower + i));
+                if (posting == NULL) {
+                    rarest = NULL;
+                    break;
+                }
+                if (rarest == NULL || posting->count < rarest->count) {
+                    rarest = posting;
+                }
+            }
+
+            for (uint32_t i = 0; rarest != NULL && i < rarest->count; i++) {
+                const struct entry *entry = &index->entries[rarest->entries[i]];
+                const char *hit = strstr(entry->lower, lower);
+                if (hit != NULL && hit != entry->lower) {
+                    top_k_offer(&top, entry, score(entry, qlen, hit));
+                }
+            }
+        } else {
+            for (size_t i = 0; i < index->count; i++) {
+                const struct entry *entry = &index->entries[i];
+                const char *hit = strstr(entry->lower, lower);
+                if (hit != NULL && hit != entry->lower) {
+                    top_k_offer(&top, entry, score(entry, qlen, hit));
+                }
+            }
+        }
+    }
+
+    // copy the names out so the index can change once it's
+    // unlocked
+    for (size_t i = 0; i < top.count; i++) {
+        top.results[i].name = arena_strdup(arena, top.results[i].name);
+    }
+
+    pthread_rwlock_unlock(&index->lock);
+    index_release(index);
+
+    *results = top.results;
+
+    return (int)top.count;
+}
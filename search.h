@@ -0,0 +1,87 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SEARCH_H
+#define _SEARCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arena.h"
+
+#define SEARCH_MAX_LIMIT 100
+
+/**
+ * search_result_t is a single match. Lower scores rank higher:
+ * 0 is an exact match, 1 a prefix, 2 the start of a word and 3
+ * anywhere else in the name.
+ */
+typedef struct {
+    char *name;
+    int score;
+} search_result_t;
+
+/**
+ * search_init sets how many users' indexes are kept in memory
+ * and how many seconds an index is used before it's reloaded.
+ * The reload picks up writes made by other worker processes.
+ */
+void
+search_init(const size_t max_users, const unsigned int ttl);
+
+/**
+ * search_is_loaded checks whether there's a current index for
+ * the given user.
+ */
+bool
+search_is_loaded(const long user_id);
+
+/**
+ * search_load builds the index of the user's password names,
+ * replacing any existing one.
+ */
+void
+search_load(const long user_id, char *const *names, const size_t count);
+
+/**
+ * search_add adds a name to the user's index if it's loaded.
+ * Names already in the index are ignored.
+ */
+void
+search_add(const long user_id, const char *name);
+
+/**
+ * search_query finds the user's password names containing q,
+ * ignoring ASCII case. At most limit results are returned, best
+ * ranked first, in an array allocated from the given arena.
+ * Returns the number of results or -1 if the user's index isn't
+ * loaded.
+ */
+int
+search_query(const long user_id, const char *q, size_t limit, arena_t *arena, search_result_t **results);
+
+#endif /* _SEARCH_H */
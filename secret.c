@@ -0,0 +1,184 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sodium.h>
+
+#include "base64.h"
+#include "pool.h"
+#include "secret.h"
+
+/**
+ * SECRET_PARALLEL_MIN is the smallest batch worth splitting
+ * across the pool. Below it the hand off costs more than
+ * opening the values on the calling thread.
+ */
+#define SECRET_PARALLEL_MIN 512
+
+bool
+secret_is_sealed(const char *value)
+{
+    return value != NULL && strncmp(value, SECRET_PREFIX, strlen(SECRET_PREFIX)) == 0;
+}
+
+char*
+secret_seal(const unsigned char *key, const char *plain)
+{
+    size_t plain_len = strlen(plain);
+    size_t sealed_len = crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES + plain_len;
+    unsigned char *sealed = malloc(sealed_len);
+    if (sealed == NULL) {
+        return NULL;
+    }
+
+    randombytes_buf(sealed, crypto_secretbox_NONCEBYTES);
+    crypto_secretbox_easy(sealed + crypto_secretbox_NONCEBYTES, (const unsigned char *)plain, plain_len, sealed, key);
+
+    char *encoded = base64_encode(sealed, sealed_len);
+    free(sealed);
+    if (encoded == NULL) {
+        return NULL;
+    }
+
+    char *value = malloc(strlen(SECRET_PREFIX) + strlen(encoded) + 1);
+    if (value == NULL) {
+        free(encoded);
+        return NULL;
+    }
+    strcpy(value, SECRET_PREFIX);
+    strcat(value, encoded);
+    free(encoded);
+
+    return value;
+}
+
+int
+secret_open(const unsigned char *key, char *value)
+{
+    if (!secret_is_sealed(value)) {
+        return 0;
+    }
+
+    // decode over the value itself. The decoder writes behind
+    // where it reads so the encoded text is consumed before it's
+    // overwritten.
+    const char *encoded = value + strlen(SECRET_PREFIX);
+    size_t sealed_len = base64_decoded_size(encoded);
+    if (sealed_len < crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES ||
+        !base64_decode(encoded, (unsigned char *)value, sealed_len)) {
+        return -1;
+    }
+
+    unsigned char nonce[crypto_secretbox_NONCEBYTES];
+    memcpy(nonce, value, sizeof(nonce));
+
+    unsigned char *cipher = (unsigned char *)value + crypto_secretbox_NONCEBYTES;
+    size_t cipher_len = sealed_len - crypto_secretbox_NONCEBYTES;
+    if (crypto_secretbox_open_easy((unsigned char *)value, cipher, cipher_len, nonce, key) != 0) {
+        sodium_memzero(value, sealed_len);
+        return -1;
+    }
+    value[cipher_len - crypto_secretbox_MACBYTES] = '\0';
+
+    return 0;
+}
+
+/**
+ * open_job is a slice of a batch opened by one pool thread.
+ */
+struct open_job {
+    const unsigned char *key;
+    char **values;
+    size_t count;
+    size_t failed;
+};
+
+static void
+open_task(void *arg)
+{
+    struct open_job *job = (struct open_job *)arg;
+
+    for (size_t i = 0; i < job->count; i++) {
+        if (secret_open(job->key, job->values[i]) != 0) {
+            job->failed++;
+        }
+    }
+}
+
+size_t
+secret_open_all(const unsigned char *key, char **values, const size_t count, pool_t *pool)
+{
+    pool_stats_t stats = {0};
+    if (pool != NULL) {
+        pool_get_stats(pool, &stats);
+    }
+
+    if (count < SECRET_PARALLEL_MIN || stats.threads < 2) {
+        struct open_job job = {.key = key, .values = values, .count = count};
+        open_task(&job);
+        return job.failed;
+    }
+
+    size_t slices = stats.threads;
+    size_t per_slice = (count + slices - 1) / slices;
+    struct open_job *jobs = calloc(slices, sizeof(struct open_job));
+    if (jobs == NULL) {
+        struct open_job job = {.key = key, .values = values, .count = count};
+        open_task(&job);
+        return job.failed;
+    }
+
+    pool_group_t group;
+    pool_group_init(&group);
+
+    for (size_t i = 0; i < slices; i++) {
+        size_t offset = i * per_slice;
+        jobs[i].key = key;
+        jobs[i].values = values + offset;
+        jobs[i].count = offset < count ? (count - offset < per_slice ? count - offset : per_slice) : 0;
+
+        // a full queue just means this slice runs here instead
+        if (jobs[i].count > 0 && pool_submit(pool, &group, open_task, &jobs[i]) != 0) {
+            open_task(&jobs[i]);
+        }
+    }
+
+    pool_group_wait(&group);
+    pool_group_destroy(&group);
+
+    size_t failed = 0;
+    for (size_t i = 0; i < slices; i++) {
+        failed += jobs[i].failed;
+    }
+    free(jobs);
+
+    return failed;
+}
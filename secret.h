@@ -0,0 +1,77 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SECRET_H
+#define _SECRET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "pool.h"
+
+/**
+ * SECRET_PREFIX marks a value sealed with secret_seal. Values
+ * without it were written before secrets were encrypted.
+ */
+#define SECRET_PREFIX "$sb1$"
+
+/**
+ * secret_is_sealed checks whether the value was written by
+ * secret_seal.
+ */
+bool
+secret_is_sealed(const char *value);
+
+/**
+ * secret_seal encrypts plain with the given secretbox key and
+ * returns it as SECRET_PREFIX followed by the base64 encoded
+ * nonce and ciphertext. The result needs to be freed. Returns
+ * NULL if memory can't be allocated.
+ */
+char*
+secret_seal(const unsigned char *key, const char *plain);
+
+/**
+ * secret_open decrypts a sealed value in place. The plaintext
+ * is always shorter than the sealed value so no memory is
+ * allocated. Values that aren't sealed are left as they are.
+ * Returns 0 on success and -1 if the value can't be opened.
+ */
+int
+secret_open(const unsigned char *key, char *value);
+
+/**
+ * secret_open_all opens every value with the same key. Large
+ * batches are split across the given pool's threads when one
+ * is given, or all on the calling thread if the slices can't
+ * be allocated. Returns the number of values that couldn't be
+ * opened.
+ */
+size_t
+secret_open_all(const unsigned char *key, char **values, const size_t count, pool_t *pool);
+
+#endif /* _SECRET_H */
@@ -0,0 +1,145 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * hush-secretbench times sealing values and opening them in a
+ * batch, on the calling thread and split across a pool, the
+ * way reads of a user's passwords do. No database is needed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sodium.h>
+
+#include "pool.h"
+#include "secret.h"
+
+#define DEFAULT_BENCH_COUNT 100000
+#define DEFAULT_BENCH_THREADS 4
+#define BENCH_PLAIN "correct horse battery staple"
+
+static double
+now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void
+report(const char *name, const size_t count, const double ms)
+{
+    printf("%-24s %8zu values %10.2f ms %12.0f values/s\n", name, count, ms, count / (ms / 1000.0));
+}
+
+/**
+ * bench_open copies the sealed values, since they're opened in
+ * place, and times opening the copies with the given pool.
+ */
+static int
+bench_open(const char *name, const unsigned char *key, char **sealed, const size_t count, pool_t *pool)
+{
+    char **values = malloc(sizeof(char*)*count);
+    if (values == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        values[i] = strdup(sealed[i]);
+    }
+
+    double start = now_ms();
+    size_t failed = secret_open_all(key, values, count, pool);
+    report(name, count, now_ms() - start);
+
+    for (size_t i = 0; i < count; i++) {
+        free(values[i]);
+    }
+    free(values);
+
+    return failed == 0 ? 0 : -1;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_BENCH_COUNT;
+    size_t threads = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_BENCH_THREADS;
+    if (count == 0 || threads == 0) {
+        fprintf(stderr, "usage: %s [count] [threads]\n", argv[0]);
+        return 1;
+    }
+
+    if (sodium_init() < 0) {
+        fprintf(stderr, "unable to initialize libsodium\n");
+        return 1;
+    }
+
+    unsigned char key[crypto_secretbox_KEYBYTES];
+    crypto_secretbox_keygen(key);
+
+    char **sealed = malloc(sizeof(char*)*count);
+    if (sealed == NULL) {
+        perror("unable to allocate values");
+        return 1;
+    }
+
+    double start = now_ms();
+    for (size_t i = 0; i < count; i++) {
+        sealed[i] = secret_seal(key, BENCH_PLAIN);
+        if (sealed[i] == NULL) {
+            perror("unable to seal value");
+            return 1;
+        }
+    }
+    report("seal", count, now_ms() - start);
+
+    pool_t *pool = pool_new(threads, threads);
+    if (pool == NULL) {
+        fprintf(stderr, "unable to start %zu threads\n", threads);
+        return 1;
+    }
+
+    int ret = 0;
+    if (bench_open("open_all (serial)", key, sealed, count, NULL) != 0 ||
+        bench_open("open_all (pool)", key, sealed, count, pool) != 0) {
+        fprintf(stderr, "values failed to open\n");
+        ret = 1;
+    }
+
+    pool_free(pool);
+    for (size_t i = 0; i < count; i++) {
+        free(sealed[i]);
+    }
+    free(sealed);
+    sodium_memzero(key, sizeof(key));
+
+    return ret;
+}
@@ -0,0 +1,442 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sodium.h>
+
+#include "stream.h"
+
+#define STREAM_ABYTES crypto_secretstream_xchacha20poly1305_ABYTES
+#define STREAM_TAG_FINAL crypto_secretstream_xchacha20poly1305_TAG_FINAL
+#define STREAM_TAG_MESSAGE crypto_secretstream_xchacha20poly1305_TAG_MESSAGE
+
+/**
+ * read_full reads until buf is full or the end of the file.
+ * Returns the number of bytes read or -1 on error.
+ */
+static ssize_t
+read_full(const int fd, unsigned char *buf, const size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, buf + done, size - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+
+    return done;
+}
+
+/**
+ * write_full writes all of buf. Returns -1 on error.
+ */
+static int
+write_full(const int fd, const unsigned char *buf, const size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = write(fd, buf + done, size - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += n;
+    }
+
+    return 0;
+}
+
+/**
+ * stream_reader reads a file ahead into two buffers on its own
+ * thread. While one buffer is being worked on the other is
+ * filled, and the reader stops after a short read since that's
+ * the end of the file or an error.
+ */
+struct stream_reader {
+    int fd;
+    size_t size;
+    unsigned char *buf[2];
+    ssize_t len[2];
+    int ready;
+    bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+};
+
+static void*
+stream_reader_run(void *arg)
+{
+    struct stream_reader *reader = arg;
+
+    for (int i = 0;; i ^= 1) {
+        pthread_mutex_lock(&reader->lock);
+        while (reader->ready == 2 && !reader->stop) {
+            pthread_cond_wait(&reader->cond, &reader->lock);
+        }
+        const bool stop = reader->stop;
+        pthread_mutex_unlock(&reader->lock);
+        if (stop) {
+            break;
+        }
+
+        ssize_t n = read_full(reader->fd, reader->buf[i], reader->size);
+
+        pthread_mutex_lock(&reader->lock);
+        reader->len[i] = n;
+        reader->ready++;
+        pthread_cond_signal(&reader->cond);
+        pthread_mutex_unlock(&reader->lock);
+
+        if (n < (ssize_t)reader->size) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static int
+stream_reader_start(struct stream_reader *reader, const int fd, const size_t size)
+{
+    memset(reader, 0, sizeof(struct stream_reader));
+    reader->fd = fd;
+    reader->size = size;
+    reader->buf[0] = malloc(size * 2);
+    if (reader->buf[0] == NULL) {
+        return -1;
+    }
+    reader->buf[1] = reader->buf[0] + size;
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->cond, NULL);
+
+    if (pthread_create(&reader->thread, NULL, stream_reader_run, reader) != 0) {
+        pthread_cond_destroy(&reader->cond);
+        pthread_mutex_destroy(&reader->lock);
+        free(reader->buf[0]);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * stream_reader_wait waits for the i'th buffer to be filled and
+ * returns how much was read into it.
+ */
+static ssize_t
+stream_reader_wait(struct stream_reader *reader, const int i)
+{
+    pthread_mutex_lock(&reader->lock);
+    while (reader->ready == 0) {
+        pthread_cond_wait(&reader->cond, &reader->lock);
+    }
+    const ssize_t n = reader->len[i];
+    pthread_mutex_unlock(&reader->lock);
+
+    return n;
+}
+
+/**
+ * stream_reader_release hands the oldest filled buffer back to
+ * the reader.
+ */
+static void
+stream_reader_release(struct stream_reader *reader)
+{
+    pthread_mutex_lock(&reader->lock);
+    reader->ready--;
+    pthread_cond_signal(&reader->cond);
+    pthread_mutex_unlock(&reader->lock);
+}
+
+/**
+ * stream_reader_stop stops the reader, waiting for a read in
+ * progress, and wipes its buffers.
+ */
+static void
+stream_reader_stop(struct stream_reader *reader)
+{
+    pthread_mutex_lock(&reader->lock);
+    reader->stop = true;
+    pthread_cond_signal(&reader->cond);
+    pthread_mutex_unlock(&reader->lock);
+
+    pthread_join(reader->thread, NULL);
+    pthread_cond_destroy(&reader->cond);
+    pthread_mutex_destroy(&reader->lock);
+
+    sodium_memzero(reader->buf[0], reader->size * 2);
+    free(reader->buf[0]);
+}
+
+size_t
+stream_encrypted_size(const size_t plain_len)
+{
+    return STREAM_HEADER_BYTES + plain_len + (plain_len / STREAM_CHUNK_SIZE + 1) * STREAM_ABYTES;
+}
+
+ssize_t
+stream_decrypted_size(const size_t cipher_len)
+{
+    if (cipher_len < STREAM_HEADER_BYTES + STREAM_ABYTES) {
+        return -1;
+    }
+
+    // every chunk but the last is full and the last is never,
+    // so the size alone says how many chunks there are.
+    const size_t body = cipher_len - STREAM_HEADER_BYTES;
+    if (body % STREAM_CIPHER_CHUNK_SIZE < STREAM_ABYTES) {
+        return -1;
+    }
+
+    return body - (body / STREAM_CIPHER_CHUNK_SIZE + 1) * STREAM_ABYTES;
+}
+
+int
+stream_encrypt_fd(const int in_fd, const int out_fd, const unsigned char key[STREAM_KEY_BYTES])
+{
+    crypto_secretstream_xchacha20poly1305_state state;
+    unsigned char header[STREAM_HEADER_BYTES];
+
+    crypto_secretstream_xchacha20poly1305_init_push(&state, header, key);
+    if (write_full(out_fd, header, sizeof(header)) != 0) {
+        return -1;
+    }
+
+    unsigned char *out = malloc(STREAM_CIPHER_CHUNK_SIZE);
+    if (out == NULL) {
+        sodium_memzero(&state, sizeof(state));
+        return -1;
+    }
+
+    struct stream_reader reader;
+    if (stream_reader_start(&reader, in_fd, STREAM_CHUNK_SIZE) != 0) {
+        sodium_memzero(&state, sizeof(state));
+        free(out);
+        return -1;
+    }
+
+    int res = -1;
+
+    for (int i = 0;; i ^= 1) {
+        const ssize_t n = stream_reader_wait(&reader, i);
+        if (n < 0) {
+            break;
+        }
+
+        const bool final = n < STREAM_CHUNK_SIZE;
+        crypto_secretstream_xchacha20poly1305_push(&state, out, NULL, reader.buf[i], n, NULL, 0,
+            final ? STREAM_TAG_FINAL : STREAM_TAG_MESSAGE);
+        stream_reader_release(&reader);
+
+        if (write_full(out_fd, out, n + STREAM_ABYTES) != 0) {
+            break;
+        }
+        if (final) {
+            res = 0;
+            break;
+        }
+    }
+
+    stream_reader_stop(&reader);
+    sodium_memzero(&state, sizeof(state));
+    free(out);
+
+    return res;
+}
+
+int
+stream_decrypt_fd(const int in_fd, const int out_fd, const unsigned char key[STREAM_KEY_BYTES])
+{
+    crypto_secretstream_xchacha20poly1305_state state;
+    unsigned char header[STREAM_HEADER_BYTES];
+
+    if (read_full(in_fd, header, sizeof(header)) != sizeof(header) ||
+        crypto_secretstream_xchacha20poly1305_init_pull(&state, header, key) != 0) {
+        return -1;
+    }
+
+    unsigned char *out = malloc(STREAM_CHUNK_SIZE);
+    if (out == NULL) {
+        sodium_memzero(&state, sizeof(state));
+        return -1;
+    }
+
+    struct stream_reader reader;
+    if (stream_reader_start(&reader, in_fd, STREAM_CIPHER_CHUNK_SIZE) != 0) {
+        sodium_memzero(&state, sizeof(state));
+        free(out);
+        return -1;
+    }
+
+    int res = -1;
+
+    for (int i = 0;; i ^= 1) {
+        const ssize_t n = stream_reader_wait(&reader, i);
+        if (n < STREAM_ABYTES) {
+            break;
+        }
+
+        // the final chunk has to be the short one at the end,
+        // anything else means the stream was cut or spliced.
+        unsigned long long out_len;
+        unsigned char tag;
+        const bool last = n < STREAM_CIPHER_CHUNK_SIZE;
+        const int ok = crypto_secretstream_xchacha20poly1305_pull(&state, out, &out_len, &tag,
+            reader.buf[i], n, NULL, 0) == 0 && (tag == STREAM_TAG_FINAL) == last;
+        stream_reader_release(&reader);
+
+        if (!ok || write_full(out_fd, out, out_len) != 0) {
+            break;
+        }
+        if (last) {
+            res = 0;
+            break;
+        }
+    }
+
+    stream_reader_stop(&reader);
+    sodium_memzero(&state, sizeof(state));
+    sodium_memzero(out, STREAM_CHUNK_SIZE);
+    free(out);
+
+    return res;
+}
+
+int
+stream_encrypt_buf(const unsigned char *in, const size_t len, const int out_fd, const unsigned char key[STREAM_KEY_BYTES])
+{
+    crypto_secretstream_xchacha20poly1305_state state;
+    unsigned char header[STREAM_HEADER_BYTES];
+
+    crypto_secretstream_xchacha20poly1305_init_push(&state, header, key);
+    if (write_full(out_fd, header, sizeof(header)) != 0) {
+        return -1;
+    }
+
+    unsigned char *out = malloc(STREAM_CIPHER_CHUNK_SIZE);
+    if (out == NULL) {
+        sodium_memzero(&state, sizeof(state));
+        return -1;
+    }
+
+    int res = 0;
+
+    for (size_t pos = 0;; pos += STREAM_CHUNK_SIZE) {
+        const size_t n = len - pos < STREAM_CHUNK_SIZE ? len - pos : STREAM_CHUNK_SIZE;
+        const bool final = n < STREAM_CHUNK_SIZE;
+        crypto_secretstream_xchacha20poly1305_push(&state, out, NULL, in + pos, n, NULL, 0,
+            final ? STREAM_TAG_FINAL : STREAM_TAG_MESSAGE);
+
+        if (write_full(out_fd, out, n + STREAM_ABYTES) != 0) {
+            res = -1;
+            break;
+        }
+        if (final) {
+            break;
+        }
+    }
+
+    sodium_memzero(&state, sizeof(state));
+    free(out);
+
+    return res;
+}
+
+int
+stream_decrypt_buf(const unsigned char *in, const size_t len, unsigned char *out, const unsigned char key[STREAM_KEY_BYTES])
+{
+    stream_pull_t pull;
+    if (stream_pull_init(&pull, in, len, key) != 0) {
+        return -1;
+    }
+
+    ssize_t n;
+    while ((n = stream_pull_next(&pull, out)) > 0) {
+        out += n;
+    }
+    sodium_memzero(&pull.state, sizeof(pull.state));
+
+    return n < 0 || !pull.done ? -1 : 0;
+}
+
+int
+stream_pull_init(stream_pull_t *pull, const unsigned char *in, const size_t len, const unsigned char key[STREAM_KEY_BYTES])
+{
+    if (stream_decrypted_size(len) < 0 ||
+        crypto_secretstream_xchacha20poly1305_init_pull(&pull->state, in, key) != 0) {
+        return -1;
+    }
+
+    pull->in = in;
+    pull->len = len;
+    pull->pos = STREAM_HEADER_BYTES;
+    pull->done = false;
+
+    return 0;
+}
+
+ssize_t
+stream_pull_next(stream_pull_t *pull, unsigned char *out)
+{
+    if (pull->done) {
+        return 0;
+    }
+
+    const size_t remaining = pull->len - pull->pos;
+    const size_t n = remaining < STREAM_CIPHER_CHUNK_SIZE ? remaining : STREAM_CIPHER_CHUNK_SIZE;
+    const bool last = n == remaining;
+
+    unsigned long long out_len;
+    unsigned char tag;
+    if (crypto_secretstream_xchacha20poly1305_pull(&pull->state, out, &out_len, &tag,
+            pull->in + pull->pos, n, NULL, 0) != 0 || (tag == STREAM_TAG_FINAL) != last) {
+        return -1;
+    }
+
+    pull->pos += n;
+    pull->done = last;
+
+    return out_len;
+}
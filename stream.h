@@ -0,0 +1,129 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _STREAM_H
+#define _STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <sodium.h>
+
+/**
+ * STREAM_CHUNK_SIZE is how much plaintext goes in each message
+ * of an encrypted stream. Every message but the last is full
+ * and the last, tagged final, is shorter, possibly empty.
+ */
+#define STREAM_CHUNK_SIZE (64 * 1024)
+
+#define STREAM_KEY_BYTES crypto_secretstream_xchacha20poly1305_KEYBYTES
+#define STREAM_HEADER_BYTES crypto_secretstream_xchacha20poly1305_HEADERBYTES
+#define STREAM_CIPHER_CHUNK_SIZE (STREAM_CHUNK_SIZE + crypto_secretstream_xchacha20poly1305_ABYTES)
+
+/**
+ * stream_pull_t decrypts a stream held in memory, such as a
+ * mapped file, one chunk at a time.
+ */
+typedef struct {
+    crypto_secretstream_xchacha20poly1305_state state;
+    const unsigned char *in;
+    size_t len;
+    size_t pos;
+    bool done;
+} stream_pull_t;
+
+/**
+ * stream_encrypted_size returns the size of the stream that
+ * plain_len bytes encrypt to.
+ */
+size_t
+stream_encrypted_size(const size_t plain_len);
+
+/**
+ * stream_decrypted_size returns the size of the plaintext of a
+ * stream of cipher_len bytes or -1 if no stream has that size.
+ */
+ssize_t
+stream_decrypted_size(const size_t cipher_len);
+
+/**
+ * stream_encrypt_fd encrypts everything read from in_fd up to
+ * the end of file and writes the stream to out_fd. The next
+ * chunk is read on another thread while the current one is
+ * encrypted and written, and memory use doesn't depend on the
+ * size of the input. Returns 0 on success and -1 if reading or
+ * writing fails.
+ */
+int
+stream_encrypt_fd(const int in_fd, const int out_fd, const unsigned char key[STREAM_KEY_BYTES]);
+
+/**
+ * stream_decrypt_fd decrypts the stream read from in_fd and
+ * writes the plaintext to out_fd, reading ahead the same way
+ * as stream_encrypt_fd. Returns -1 if the stream is truncated,
+ * has been tampered with or can't be read or written. Chunks
+ * are written as they're authenticated so on failure what was
+ * written must be thrown away.
+ */
+int
+stream_decrypt_fd(const int in_fd, const int out_fd, const unsigned char key[STREAM_KEY_BYTES]);
+
+/**
+ * stream_encrypt_buf encrypts len bytes of in and writes the
+ * stream to out_fd. Returns 0 on success and -1 if writing
+ * fails.
+ */
+int
+stream_encrypt_buf(const unsigned char *in, const size_t len, const int out_fd, const unsigned char key[STREAM_KEY_BYTES]);
+
+/**
+ * stream_decrypt_buf decrypts the stream of len bytes at in
+ * into out, which must hold stream_decrypted_size(len) bytes.
+ * Returns -1 if the stream can't be authenticated.
+ */
+int
+stream_decrypt_buf(const unsigned char *in, const size_t len, unsigned char *out, const unsigned char key[STREAM_KEY_BYTES]);
+
+/**
+ * stream_pull_init starts decrypting the stream of len bytes
+ * at in, which has to stay around until it's done. Returns -1
+ * if it isn't a stream or the header doesn't match the key.
+ */
+int
+stream_pull_init(stream_pull_t *pull, const unsigned char *in, const size_t len, const unsigned char key[STREAM_KEY_BYTES]);
+
+/**
+ * stream_pull_next decrypts the next chunk into out, which must
+ * hold STREAM_CHUNK_SIZE bytes. Returns the number of bytes
+ * decrypted, 0 once the final chunk has been read and -1 if
+ * the chunk can't be authenticated.
+ */
+ssize_t
+stream_pull_next(stream_pull_t *pull, unsigned char *out);
+
+#endif /** end _STREAM_H */
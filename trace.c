@@ -0,0 +1,338 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <jansson.h>
+#include <sodium.h>
+
+#include "trace.h"
+
+#define SPAN_ID_SIZE 16
+
+#define OTLP_SPAN_KIND_INTERNAL 1
+#define OTLP_SPAN_KIND_SERVER 2
+#define OTLP_STATUS_CODE_ERROR 2
+
+/**
+ * trace_span is a timed stage of a request. Times are
+ * monotonic nanoseconds and end is 0 while it's running.
+ */
+struct trace_span {
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+};
+
+struct trace {
+    char id[TRACE_ID_SIZE+1];
+    char span_id[SPAN_ID_SIZE+1];
+    uint64_t start;
+    uint64_t start_unix;
+    uint64_t end;
+    struct trace_span spans[TRACE_MAX_SPANS];
+    size_t span_count;
+    size_t dropped;
+};
+
+/**
+ * current is the trace of the request the thread is
+ * handling, so spans can be recorded without passing it
+ * through every call.
+ */
+static __thread trace_t *current = NULL;
+
+static FILE *export_file = NULL;
+static pthread_mutex_t export_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int
+trace_init(const char *export_path)
+{
+    if (export_path == NULL || export_path[0] == '\0') {
+        return 0;
+    }
+
+    export_file = fopen(export_path, "a");
+    if (export_file == NULL) {
+        return 1;
+    }
+
+    return 0;
+}
+
+void
+trace_shutdown(void)
+{
+    pthread_mutex_lock(&export_lock);
+    if (export_file != NULL) {
+        fclose(export_file);
+        export_file = NULL;
+    }
+    pthread_mutex_unlock(&export_lock);
+}
+
+static uint64_t
+clock_ns(const clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t
+trace_now_ns(void)
+{
+    return clock_ns(CLOCK_MONOTONIC);
+}
+
+/**
+ * random_hex fills out with size random hex characters
+ * followed by a NUL.
+ */
+static void
+random_hex(char *out, const size_t size)
+{
+    unsigned char bytes[TRACE_ID_SIZE/2];
+
+    randombytes_buf(bytes, size/2);
+    sodium_bin2hex(out, size+1, bytes, size/2);
+}
+
+trace_t*
+trace_new(void)
+{
+    trace_t *trace = calloc(1, sizeof(trace_t));
+
+    random_hex(trace->id, TRACE_ID_SIZE);
+    random_hex(trace->span_id, SPAN_ID_SIZE);
+    trace->start_unix = clock_ns(CLOCK_REALTIME);
+    trace->start = trace_now_ns();
+
+    current = trace;
+
+    return trace;
+}
+
+void
+trace_free(trace_t *trace)
+{
+    if (current == trace) {
+        current = NULL;
+    }
+    free(trace);
+}
+
+const char*
+trace_id(const trace_t *trace)
+{
+    return trace->id;
+}
+
+uint64_t
+trace_duration_ns(const trace_t *trace)
+{
+    return (trace->end != 0 ? trace->end : trace_now_ns()) - trace->start;
+}
+
+int
+trace_span_begin(const char *name)
+{
+    trace_t *trace = current;
+    if (trace == NULL) {
+        return -1;
+    }
+
+    if (trace->span_count == TRACE_MAX_SPANS) {
+        trace->dropped++;
+        return -1;
+    }
+
+    struct trace_span *span = &trace->spans[trace->span_count];
+    span->name = name;
+    span->start = trace_now_ns();
+    span->end = 0;
+
+    return trace->span_count++;
+}
+
+void
+trace_span_end(const int span)
+{
+    trace_t *trace = current;
+    if (trace == NULL || span < 0 || (size_t)span >= trace->span_count) {
+        return;
+    }
+
+    trace->spans[span].end = trace_now_ns();
+}
+
+/**
+ * span_end returns when the span ended. Spans still running
+ * when the trace finished end with it.
+ */
+static uint64_t
+span_end(const trace_t *trace, const struct trace_span *span)
+{
+    if (span->end != 0) {
+        return span->end;
+    }
+
+    return trace->end != 0 ? trace->end : trace_now_ns();
+}
+
+size_t
+trace_format_spans(const trace_t *trace, char *buf, const size_t len)
+{
+    size_t written = 0;
+
+    if (len > 0) {
+        buf[0] = '\0';
+    }
+
+    for (size_t i = 0; i < trace->span_count && written < len; i++) {
+        const struct trace_span *span = &trace->spans[i];
+        int n = snprintf(buf + written, len - written, "%s%s=%" PRIu64,
+            i > 0 ? " " : "", span->name, span_end(trace, span) - span->start);
+        if (n < 0) {
+            break;
+        }
+        written += (size_t)n;
+    }
+
+    return written < len ? written : len - 1;
+}
+
+/**
+ * otlp_time converts a monotonic timestamp of the trace into
+ * the decimal unix nanoseconds OTLP/JSON expects.
+ */
+static json_t*
+otlp_time(const trace_t *trace, const uint64_t ns)
+{
+    char buf[24];
+    snprintf(buf, sizeof(buf), "%" PRIu64, trace->start_unix + (ns - trace->start));
+
+    return json_string(buf);
+}
+
+/**
+ * otlp_span builds an OTLP/JSON span.
+ */
+static json_t*
+otlp_span(const trace_t *trace, const char *span_id, const char *parent_id, const char *name,
+          const int kind, const uint64_t start, const uint64_t end)
+{
+    json_t *span = json_pack("{s:s, s:s, s:s, s:i, s:o, s:o}",
+        "traceId", trace->id,
+        "spanId", span_id,
+        "name", name,
+        "kind", kind,
+        "startTimeUnixNano", otlp_time(trace, start),
+        "endTimeUnixNano", otlp_time(trace, end));
+    if (parent_id != NULL) {
+        json_object_set_new(span, "parentSpanId", json_string(parent_id));
+    }
+
+    return span;
+}
+
+/**
+ * trace_export appends the trace to the export file as an
+ * OTLP/JSON ExportTraceServiceRequest on a single line.
+ */
+static void
+trace_export(const trace_t *trace, const char *name, const unsigned int status)
+{
+    json_t *spans = json_array();
+
+    json_t *root = otlp_span(trace, trace->span_id, NULL, name, OTLP_SPAN_KIND_SERVER, trace->start, trace->end);
+    json_object_set_new(root, "attributes", json_pack("[{s:s, s:{s:I}}]",
+        "key", "http.response.status_code",
+        "value", "intValue", (json_int_t)status));
+    if (status >= 500) {
+        json_object_set_new(root, "status", json_pack("{s:i}", "code", OTLP_STATUS_CODE_ERROR));
+    }
+    json_array_append_new(spans, root);
+
+    for (size_t i = 0; i < trace->span_count; i++) {
+        const struct trace_span *span = &trace->spans[i];
+        char span_id[SPAN_ID_SIZE+1];
+        random_hex(span_id, SPAN_ID_SIZE);
+
+        json_array_append_new(spans, otlp_span(trace, span_id, trace->span_id, span->name,
+            OTLP_SPAN_KIND_INTERNAL, span->start, span_end(trace, span)));
+    }
+
+    json_t *request = json_pack("{s:[{s:{s:[{s:s, s:{s:s}}]}, s:[{s:{s:s}, s:o}]}]}",
+        "resourceSpans",
+            "resource",
+                "attributes",
+                    "key", "service.name",
+                    "value", "stringValue", "hush",
+            "scopeSpans",
+                "scope", "name", "hush",
+                "spans", spans);
+
+    char *line = json_dumps(request, JSON_COMPACT);
+    json_decref(request);
+    if (line == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&export_lock);
+    if (export_file != NULL) {
+        fprintf(export_file, "%s\n", line);
+        fflush(export_file);
+    }
+    pthread_mutex_unlock(&export_lock);
+
+    free(line);
+}
+
+void
+trace_finish(trace_t *trace, const char *name, const unsigned int status)
+{
+    if (trace->end == 0) {
+        trace->end = trace_now_ns();
+    }
+
+    if (export_file != NULL) {
+        trace_export(trace, name, status);
+    }
+
+    if (current == trace) {
+        current = NULL;
+    }
+}
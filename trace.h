@@ -0,0 +1,123 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Brian J. Downs
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_ID_SIZE 32
+#define TRACE_MAX_SPANS 32
+
+typedef struct trace trace_t;
+
+/**
+ * TRACED evaluates expr inside a span with the given name on
+ * the current trace and yields its value.
+ */
+#define TRACED(name, expr) ({                  \
+    int _trace_span = trace_span_begin(name);  \
+    __typeof__(expr) _trace_res = (expr);      \
+    trace_span_end(_trace_span);               \
+    _trace_res;                                \
+})
+
+/**
+ * trace_init sets up the tracer. When export_path is given
+ * every finished trace is appended to it as a line of
+ * OTLP/JSON. Returns 0 on success.
+ */
+int
+trace_init(const char *export_path);
+
+/**
+ * trace_shutdown closes the export file.
+ */
+void
+trace_shutdown(void);
+
+/**
+ * trace_now_ns returns a monotonic timestamp in nanoseconds.
+ */
+uint64_t
+trace_now_ns(void);
+
+/**
+ * trace_new starts a new trace with a random ID and makes
+ * it the current trace of the calling thread.
+ */
+trace_t*
+trace_new(void);
+
+void
+trace_free(trace_t *trace);
+
+/**
+ * trace_id returns the trace's ID as TRACE_ID_SIZE hex
+ * characters.
+ */
+const char*
+trace_id(const trace_t *trace);
+
+/**
+ * trace_duration_ns returns how long the trace ran for, or
+ * has been running for if it isn't finished yet.
+ */
+uint64_t
+trace_duration_ns(const trace_t *trace);
+
+/**
+ * trace_span_begin starts a span on the calling thread's
+ * current trace. Returns the span's handle or -1 when there's
+ * no current trace or it's out of room for spans.
+ */
+int
+trace_span_begin(const char *name);
+
+/**
+ * trace_span_end ends the span with the given handle.
+ */
+void
+trace_span_end(const int span);
+
+/**
+ * trace_format_spans writes the trace's spans into buf as
+ * space separated name=nanoseconds pairs.
+ */
+size_t
+trace_format_spans(const trace_t *trace, char *buf, const size_t len);
+
+/**
+ * trace_finish ends the trace, exports it when exporting is
+ * enabled and detaches it from the calling thread. name and
+ * status describe the request the trace belongs to.
+ */
+void
+trace_finish(trace_t *trace, const char *name, const unsigned int status);
+
+#endif /* _TRACE_H */